@@ -83,16 +83,24 @@ LOCAL_MODULE := vlcjni
 LOCAL_SRC_FILES := ../../contrib/vlclibs/libvlcjni.so
 include $(PREBUILT_SHARED_LIBRARY)
 ###################################
+# NEON startcode scanner is picked at runtime, only its own file gets -mfpu=neon
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+XMEDIA_SIMD_SRC := xutil/xmedia_simd.cpp.neon
+XMEDIA_SIMD_CFLAGS := -DHAVE_NEON
+else
+XMEDIA_SIMD_SRC := xutil/xmedia_simd.cpp
+XMEDIA_SIMD_CFLAGS :=
+endif
+###################################
 include $(CLEAR_VARS)
 
 CONTRIB_INSTALL := $(LOCAL_PATH)/../../contrib/install
 PRIVATE_INCDIR := $(CONTRIB_INSTALL)/include
 
-LOCAL_MODULE := libfqrtmpjni
+# JNI-free core, also built for Linux by CMakeLists.txt
+LOCAL_MODULE := fqrtmp
 
-LOCAL_SRC_FILES := libfqrtmpjni.cpp \
-    native_crash_handler.cpp \
-    libfqrtmp_events.cpp \
+LOCAL_SRC_FILES := fqrtmp_session.cpp \
     audio_encoder.cpp \
     video_encoder.cpp \
     rtmp_handler.cpp \
@@ -100,15 +108,138 @@ LOCAL_SRC_FILES := libfqrtmpjni.cpp \
     common.cpp \
     jitter_buffer.cpp \
     flv_muxer.cpp \
+    dvr_ring.cpp \
+    latency_tracker.cpp \
+    mem_budget.cpp \
+    metrics.cpp \
+    trace.cpp \
+    flight_recorder.cpp \
+    thread_ctl.cpp \
+    rtmp_server.cpp \
+    net_impair.cpp \
     xutil/xfile.cpp \
     xutil/xutil.cpp \
-    xutil/xmedia.cpp
+    xutil/xlog.cpp \
+    xutil/xmedia.cpp \
+    xutil/xpool.cpp \
+    xutil/xring.cpp \
+    xutil/xexecutor.cpp \
+    $(XMEDIA_SIMD_SRC)
 
 LOCAL_C_INCLUDES := $(PRIVATE_INCDIR) $(LOCAL_PATH)/xutil $(LOCAL_PATH)/libyuv/include
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_C_INCLUDES)
+LOCAL_CFLAGS := -Wall $(XMEDIA_SIMD_CFLAGS)
+LOCAL_EXPORT_LDLIBS := -llog
+include $(BUILD_STATIC_LIBRARY)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libfqrtmpjni
+
+LOCAL_SRC_FILES := libfqrtmpjni.cpp \
+    native_crash_handler.cpp \
+    jni_util.cpp
+
 LOCAL_CFLAGS := -Wall
 LOCAL_LDLIBS := -llog
 LOCAL_SHARED_LIBRARIES := rtmp
-LOCAL_STATIC_LIBRARIES := fdk-aac x264 libyuv_static
+LOCAL_STATIC_LIBRARIES := fqrtmp fdk-aac x264 libyuv_static
 include $(BUILD_SHARED_LIBRARY)
 ####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := startcode_bench
+
+LOCAL_SRC_FILES := tools/startcode_bench.cpp \
+    xutil/xfile.cpp \
+    xutil/xutil.cpp \
+    xutil/xlog.cpp \
+    xutil/xmedia.cpp \
+    xutil/xpool.cpp \
+    $(XMEDIA_SIMD_SRC)
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/xutil $(LOCAL_PATH)/libyuv/include
+LOCAL_CFLAGS := -Wall $(XMEDIA_SIMD_CFLAGS)
+LOCAL_LDLIBS := -llog
+LOCAL_STATIC_LIBRARIES := libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := iobuf_bench
+
+LOCAL_SRC_FILES := tools/iobuf_bench.cpp \
+    xutil/xfile.cpp \
+    xutil/xutil.cpp \
+    xutil/xlog.cpp \
+    xutil/xring.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/xutil
+LOCAL_CFLAGS := -Wall
+LOCAL_LDLIBS := -llog
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := latency_report
+
+LOCAL_SRC_FILES := tools/latency_report.cpp \
+    latency_tracker.cpp \
+    xutil/xfile.cpp \
+    xutil/xutil.cpp \
+    xutil/xlog.cpp \
+    xutil/xmedia.cpp \
+    xutil/xpool.cpp \
+    $(XMEDIA_SIMD_SRC)
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/xutil $(LOCAL_PATH)/libyuv/include
+LOCAL_CFLAGS := -Wall $(XMEDIA_SIMD_CFLAGS)
+LOCAL_LDLIBS := -llog
+LOCAL_STATIC_LIBRARIES := libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := fqrtmp_push
+
+LOCAL_SRC_FILES := tools/fqrtmp_push.cpp
+
+LOCAL_CFLAGS := -Wall
+LOCAL_SHARED_LIBRARIES := rtmp
+LOCAL_STATIC_LIBRARIES := fqrtmp fdk-aac x264 libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := rtmp_serve
+
+LOCAL_SRC_FILES := tools/rtmp_serve.cpp
+
+LOCAL_CFLAGS := -Wall
+LOCAL_SHARED_LIBRARIES := rtmp
+LOCAL_STATIC_LIBRARIES := fqrtmp fdk-aac x264 libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := net_impair
+
+LOCAL_SRC_FILES := tools/net_impair.cpp
+
+LOCAL_CFLAGS := -Wall
+LOCAL_SHARED_LIBRARIES := rtmp
+LOCAL_STATIC_LIBRARIES := fqrtmp fdk-aac x264 libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := pipeline_bench
+
+LOCAL_SRC_FILES := tools/pipeline_bench.cpp
+
+LOCAL_CFLAGS := -Wall
+LOCAL_SHARED_LIBRARIES := rtmp
+LOCAL_STATIC_LIBRARIES := fqrtmp fdk-aac x264 libyuv_static
+include $(BUILD_EXECUTABLE)
+####################################
 include $(call all-makefiles-under,$(LOCAL_PATH))
@@ -2,6 +2,11 @@
 
 #include "audio_encoder.h"
 #include "rtmp_handler.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "thread_ctl.h"
+#include "fqrtmp_session.h"
 #include "common.h"
 
 #define DUMP_AAC    0
@@ -40,11 +45,17 @@ static const char *aac_get_error(AACENC_ERROR err)
     }
 }
 
-AudioEncoder::AudioEncoder() :
-    m_hdlr(NULL), m_aot(0), m_samplerate(0), m_channels(0), m_bits_per_sample(0),
+AudioConfig::AudioConfig() :
+    channels(2), aot(AOT_AAC_LC), samplerate(44100), bits_per_sample(16),
+    bitrate(-1), frame_length(-1), encoder_delay(-1)
+{
+}
+
+AudioEncoder::AudioEncoder(FQRtmpSession *session) :
+    m_session(session), m_hdlr(NULL), m_aot(0), m_samplerate(0), m_channels(0), m_bits_per_sample(0),
     m_cond(m_mutex), m_thrd(NULL), m_quit(false), m_file(NULL)
 {
-    m_iobuf = new IOBuffer;
+    m_iobuf = new RingBuffer;
 
 #if defined(DUMP_AAC) && (DUMP_AAC != 0)
     m_file = new xfile::File;
@@ -58,54 +69,43 @@ AudioEncoder::~AudioEncoder()
         m_quit = true;
         m_cond.signal();
         JOIN_DELETE_THREAD(m_thrd);
+        m_session->mem_budget()->add(MEM_AUDIO_BUFFER,
+                                     -(int64_t) GETAVAILABLEBYTESCOUNT(*m_iobuf));
         SAFE_DELETE(m_iobuf);
         SAFE_DELETE(m_file);
         aacEncClose(&m_hdlr);
     }
 }
 
-int AudioEncoder::init(jobject audio_config)
+int AudioEncoder::init(AudioConfig &audio_config)
 {
-    jvalue jval;
     CHANNEL_MODE mode;
     int sce = 0, cpe = 0;
     int bitrate;
     AACENC_ERROR err;
-    
-#define CALL_METHOD(obj, name, signature) do { \
-    jboolean has_exception = JNI_FALSE; \
-    jval = jnu_call_method_by_name(&has_exception, obj, name, signature); \
-    if (has_exception) { \
-        E("Exception with %s()", name); \
-        goto error; \
-    } \
-} while (0)
-
-    CALL_METHOD(audio_config, "getChannelCount", "()I");
-    if ((err = aacEncOpen(&m_hdlr, 0, jval.i)) != AACENC_OK) {
+
+    if ((err = aacEncOpen(&m_hdlr, 0, audio_config.channels)) != AACENC_OK) {
         E("Unable to open the encoder: %s",
           aac_get_error(err));
         goto error;
     }
-    m_channels = jval.i;
+    m_channels = audio_config.channels;
 
-    CALL_METHOD(audio_config, "getAudioObjectType", "()I");
     if ((err = aacEncoder_SetParam(m_hdlr, AACENC_AOT,
-                                   jval.i)) != AACENC_OK) {
+                                   audio_config.aot)) != AACENC_OK) {
         E("Unable to set the AOT %d: %s",
-          jval.i, aac_get_error(err));
+          audio_config.aot, aac_get_error(err));
         goto error;
     }
-    m_aot = jval.i;
+    m_aot = audio_config.aot;
 
-    CALL_METHOD(audio_config, "getSamplerate", "()I");
     if ((err = aacEncoder_SetParam(m_hdlr, AACENC_SAMPLERATE,
-                                   jval.i)) != AACENC_OK) {
+                                   audio_config.samplerate)) != AACENC_OK) {
         E("Unable to set the sample rate %d: %s\n",
-          jval.i, aac_get_error(err));
+          audio_config.samplerate, aac_get_error(err));
         goto error;
     }
-    m_samplerate = jval.i;
+    m_samplerate = audio_config.samplerate;
 
     switch (m_channels) {
     case 1: mode = MODE_1;       sce = 1; cpe = 0; break;
@@ -131,20 +131,9 @@ int AudioEncoder::init(jobject audio_config)
         goto error;
     }
 
-    CALL_METHOD(audio_config, "getBitsPerSample", "()I");
-    m_bits_per_sample = jval.i;
+    m_bits_per_sample = audio_config.bits_per_sample;
 
-#define SET_FIELD(obj, name, signature, val) do { \
-    jboolean has_exception = JNI_FALSE; \
-    jnu_set_field_by_name(&has_exception, obj, name, signature, val); \
-    if (has_exception) { \
-        E("Exception occurred when set field \"%s\"", name); \
-        goto error; \
-    } \
-} while (0)
-
-    CALL_METHOD(audio_config, "getBitrate", "()I");
-    if (jval.i <= 0) {
+    if (audio_config.bitrate <= 0) {
         if (m_aot == AOT_PS) {
             sce = 1;
             cpe = 0;
@@ -154,7 +143,7 @@ int AudioEncoder::init(jobject audio_config)
             bitrate /= 2;
         }
     } else {
-        bitrate = jval.i;
+        bitrate = audio_config.bitrate;
     }
     if ((err = aacEncoder_SetParam(m_hdlr, AACENC_BITRATE,
                                    bitrate)) != AACENC_OK) {
@@ -162,7 +151,7 @@ int AudioEncoder::init(jobject audio_config)
           bitrate, aac_get_error(err));
         goto error;
     }
-    SET_FIELD(audio_config, "mBitrate", "I", bitrate);
+    audio_config.bitrate = bitrate;
 
     if ((err = aacEncoder_SetParam(m_hdlr, AACENC_TRANSMUX,
                                    2 /* ADTS bitstream format */)) != AACENC_OK) {
@@ -197,8 +186,8 @@ int AudioEncoder::init(jobject audio_config)
         goto error;
     }
 
-    SET_FIELD(audio_config, "mFrameLength", "I", m_info.frameLength);
-    SET_FIELD(audio_config, "mEncoderDelay", "I", m_info.encoderDelay);
+    audio_config.frame_length = m_info.frameLength;
+    audio_config.encoder_delay = m_info.encoderDelay;
 
     frac_init(&m_pts, 0, 0, m_samplerate);
 
@@ -211,15 +200,14 @@ int AudioEncoder::init(jobject audio_config)
 error:
     E("Init audio encoder failed");
     return -1;
-
-#undef CALL_METHOD
-#undef SET_FIELD
 }
 
 int AudioEncoder::feed(uint8_t *buffer, int len)
 {
     AutoLock l(m_mutex);
     m_iobuf->read_from_buffer(buffer, len);
+    m_session->mem_budget()->add(MEM_AUDIO_BUFFER, len);
+    metric_set(METRIC_AUDIO_QUEUE_BYTES, GETAVAILABLEBYTESCOUNT(*m_iobuf));
     m_cond.signal();
     return 0;
 }
@@ -241,6 +229,8 @@ unsigned int AudioEncoder::encode_routine(void *arg)
         goto done;
     }
 
+    TRACE_THREAD_NAME("audio_encoder");
+    thread_ctl_register("audio_encoder");
     D("aac encode_routine started ..");
 
     while (!m_quit) {
@@ -256,6 +246,7 @@ unsigned int AudioEncoder::encode_routine(void *arg)
         AACENC_ERROR err;
 
         BEGIN
+        TRACE_SCOPE("wait pcm");
         AutoLock l(m_mutex);
 
         while (!m_quit &&
@@ -268,6 +259,8 @@ unsigned int AudioEncoder::encode_routine(void *arg)
 
         memcpy(input_buf, GETIBPOINTER(*m_iobuf), input_size);
         m_iobuf->ignore(input_size);
+        m_session->mem_budget()->add(MEM_AUDIO_BUFFER, -input_size);
+        metric_set(METRIC_AUDIO_QUEUE_BYTES, GETAVAILABLEBYTESCOUNT(*m_iobuf));
         END
 
         for (i = 0; i < input_size/2; ++i) {
@@ -295,8 +288,11 @@ unsigned int AudioEncoder::encode_routine(void *arg)
         out_buf.bufSizes = &out_size;
         out_buf.bufElSizes = &out_elem_size;
 
-        if ((err = aacEncEncode(m_hdlr, &in_buf, &out_buf,
-                                &in_args, &out_args)) != AACENC_OK) {
+        uint64_t encode_start_us = get_time_now_us();
+        TRACE_BEGIN("aacEncEncode");
+        err = aacEncEncode(m_hdlr, &in_buf, &out_buf, &in_args, &out_args);
+        TRACE_END("aacEncEncode");
+        if (err != AACENC_OK) {
             if (err == AACENC_ENCODE_EOF) {
                 W("libfdk-aac eof?");
                 goto done;
@@ -307,7 +303,13 @@ unsigned int AudioEncoder::encode_routine(void *arg)
             goto done;
         }
 
+        metric_observe_since(METRIC_AUDIO_ENCODE_US, encode_start_us);
+
         if (out_args.numOutBytes != 0) {
+            metric_add(METRIC_AUDIO_FRAMES_ENCODED);
+            metric_add(METRIC_AUDIO_BYTES_ENCODED, out_args.numOutBytes);
+            flight_record(FLIGHT_AUDIO_ENCODED, out_args.numOutBytes, m_pts.val);
+
             std::auto_ptr<Packet> pkt_out(
                     new Packet(outbuf, out_args.numOutBytes, m_pts.val, m_pts.val));
 
@@ -315,8 +317,10 @@ unsigned int AudioEncoder::encode_routine(void *arg)
                 m_file->write_buffer(outbuf, out_args.numOutBytes);
             }
 
-            if (gfq.rtmp_hdlr) {
-                gfq.rtmp_hdlr->send_audio(pkt_out->pts, pkt_out->data, pkt_out->size);
+            if (!pkt_out->buf) {
+                W("Audio frame of %d bytes not sent (cont)", out_args.numOutBytes);
+            } else if (RtmpHandler *rtmp_hdlr = m_session->rtmp_handler()) {
+                rtmp_hdlr->send_audio(pkt_out->pts, pkt_out->data, pkt_out->size);
             }
 
             frac_add(&m_pts, m_info.frameLength * 1000);
@@ -326,46 +330,7 @@ unsigned int AudioEncoder::encode_routine(void *arg)
 done:
     SAFE_FREE(input_buf);
     SAFE_FREE(convert_buf);
+    thread_ctl_unregister();
     D("aac encode_routine ended");
     return 0;
 }
-
-jint openAudioEncoder(JNIEnv *env, jobject thiz, jobject audio_config)
-{
-    gfq.audio_enc = new AudioEncoder;
-
-    if (gfq.audio_enc->init(audio_config) < 0) {
-        closeAudioEncoder(env, thiz);
-        return -1;
-    }
-
-    return 0;
-}
-
-jint closeAudioEncoder(JNIEnv *env, jobject thiz)
-{
-    SAFE_DELETE(gfq.audio_enc);
-    return 0;
-}
-
-jint sendRawAudio(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len)
-{
-    int ret = 0;
-
-    if (gfq.audio_enc && !gfq.audio_enc->quit()) {
-        uint8_t *buffer;
-        jboolean is_copy;
-
-        buffer = (uint8_t *) env->GetByteArrayElements(byte_arr, &is_copy);
-        if (!buffer) {
-            E("Get audio buffer failed");
-            return -1;
-        }
-
-        ret = gfq.audio_enc->feed(buffer, len);
-
-        env->ReleaseByteArrayElements(byte_arr, (jbyte *) buffer, 0);
-    }
-
-    return ret;
-}
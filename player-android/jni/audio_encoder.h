@@ -1,27 +1,46 @@
 #ifndef _AUDIO_ENCODER_H_
 #define _AUDIO_ENCODER_H_
 
-#include <jni.h>
 #include <fdk-aac/aacenc_lib.h>
 
 #include "xutil.h"
 #include "xfile.h"
+#include "xring.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+class FQRtmpSession;
+
+// Mirrors LibFQRtmp.AudioConfig
+struct AudioConfig {
+    int channels;
+    int aot;                // Audio object type
+    int samplerate;
+    int bits_per_sample;
+    int bitrate;            // <= 0 for a default, the one in use on return
+    // Filled in by the encoder
+    int frame_length;       // Samples per channel
+    int encoder_delay;
+
+    AudioConfig();
+};
+
 class AudioEncoder {
 public:
-    AudioEncoder();
+    AudioEncoder(FQRtmpSession *session);
     ~AudioEncoder();
 
-    int init(jobject audio_config);
+    int init(AudioConfig &audio_config);
     int feed(uint8_t *buffer, int len);
     volatile bool quit() const;
+    // Pcm the encoder takes at a time
+    int frame_bytes() const { return m_channels * 2 * m_info.frameLength; }
 
 private:
     DISALLOW_COPY_AND_ASSIGN(AudioEncoder);
+    FQRtmpSession *m_session;
     xutil::Frac m_pts;
     HANDLE_AACENCODER m_hdlr;
     AACENC_InfoStruct m_info;
@@ -33,15 +52,11 @@ private:
     xutil::Condition m_cond;
     DECL_THREAD_ROUTINE(AudioEncoder, encode_routine);
     xutil::Thread *m_thrd;
-    xutil::IOBuffer *m_iobuf;
+    xutil::RingBuffer *m_iobuf;    // Pcm, written and consumed continuously
     volatile bool m_quit;
     xfile::File *m_file;
 };
 
-jint openAudioEncoder(JNIEnv *env, jobject, jobject);
-jint closeAudioEncoder(JNIEnv *env, jobject);
-jint sendRawAudio(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len);
-
 #ifdef __cplusplus
 }
 #endif
@@ -1,252 +1,96 @@
 #include "common.h"
+#include "thread_ctl.h"
+#include "xexecutor.h"
 #include "xutil.h"
 
-#define THREAD_NAME "common"
-extern JNIEnv *jni_get_env(const char *name);
-
-Packet::Packet() :
-    data(NULL), size(0), pts(0), dts(0)
+MediaBuffer *media_buffer_alloc(int size, int headroom, int tailroom)
 {
+    MediaBuffer *buf = (MediaBuffer *) xpool_alloc(
+            sizeof(MediaBuffer) + headroom + 63 + size + tailroom);
+    if (!buf) {
+        E("xpool_alloc for media buffer (%d bytes) failed: %s",
+          size, ERRNOMSG);
+        return NULL;
+    }
+
+    // Payload follows the header in the same allocation, aligned for
+    // the simd converters; the alignment slack adds to the headroom
+    uint8_t *start = (uint8_t *) (buf + 1);
+    buf->data = (uint8_t *) (((uintptr_t) (start + headroom) + 63) & ~(uintptr_t) 63);
+    buf->size = size;
+    buf->headroom = buf->data - start;
+    buf->tailroom = tailroom;
+    buf->refcnt = 1;
+    return buf;
 }
 
-Packet::Packet(uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_) :
-    data(NULL), size(size_), pts(pts_), dts(dts_)
+MediaBuffer *media_buffer_ref(MediaBuffer *buf)
 {
-    if (size > 0) {
-        data = (uint8_t *) malloc(size * sizeof(uint8_t));
-        assert(data);
-        memcpy(data, data_, size);
+    if (buf) {
+        __sync_add_and_fetch(&buf->refcnt, 1);
     }
+    return buf;
 }
 
-Packet::~Packet()
+void media_buffer_unref(MediaBuffer **buf)
 {
-    SAFE_FREE(data);
+    if (*buf) {
+        if (!__sync_sub_and_fetch(&(*buf)->refcnt, 1)) {
+            xpool_free(*buf);
+        }
+        *buf = NULL;
+    }
 }
 
-jvalue jnu_get_field_by_name(jboolean *has_exception, jobject obj,
-                             const char *name, const char *signature)
+int media_buffer_room_before(const MediaBuffer *buf, const uint8_t *p)
 {
-    JNIEnv *env = jni_get_env(THREAD_NAME);
-    jclass cls;
-    jfieldID fid;
-    jvalue result;
-
-    result.i = 0;
-
-    if (env->EnsureLocalCapacity(3) < 0)
-        goto done2;
-
-    cls = env->GetObjectClass(obj);
-    fid = env->GetFieldID(cls, name, signature);
-    if (fid == NULL)
-        goto done1;
-
-    switch (*signature) {
-    case '[':
-    case 'L':
-        result.l = env->GetObjectField(obj, fid);
-        break;
-    case 'Z':
-        result.z = env->GetBooleanField(obj, fid);
-        break;
-    case 'B':
-        result.b = env->GetByteField(obj, fid);
-        break;
-    case 'C':
-        result.c = env->GetCharField(obj, fid);
-        break;
-    case 'S':
-        result.s = env->GetShortField(obj, fid);
-        break;
-    case 'I':
-        result.i = env->GetIntField(obj, fid);
-        break;
-    case 'J':
-        result.j = env->GetLongField(obj, fid);
-        break;
-    case 'F':
-        result.f = env->GetFloatField(obj, fid);
-        break;
-    case 'D':
-        result.d = env->GetDoubleField(obj, fid);
-        break;
-
-    default:
-        env->FatalError("jnu_get_field_by_name: illegal signature");
-    }
-
-done1:
-    env->DeleteLocalRef(cls);
-done2:
-    if (has_exception) {
-        *has_exception = env->ExceptionCheck();
-    }
-    return result;
+    return p - (buf->data - buf->headroom);
 }
 
-jvalue jnu_call_method_by_name_v(jboolean *has_exception, jobject obj,
-                                 const char *name, const char *signature, va_list args)
+Packet::Packet() :
+    data(NULL), size(0), pts(0), dts(0), buf(NULL), latency_seq(0)
 {
-    JNIEnv *env = jni_get_env(THREAD_NAME);
-    jclass clazz;
-    jmethodID mid;
-    jvalue result;
-    const char *p = signature;
-
-    while (*p && *p != ')')
-        p++;
-    p++;
-
-    result.i = 0;
-
-    if (env->EnsureLocalCapacity(3) < 0)
-        goto done2;
-
-    clazz = env->GetObjectClass(obj);
-    mid = env->GetMethodID(clazz, name, signature);
-    if (mid == NULL)
-        goto done1;
+}
 
-    switch (*p) {
-        case 'V':
-            env->CallVoidMethodV(obj, mid, args);
-            break;
-        case '[':
-        case 'L':
-            result.l = env->CallObjectMethodV(obj, mid, args);
-            break;
-        case 'Z':
-            result.z = env->CallBooleanMethodV(obj, mid, args);
-            break;
-        case 'B':
-            result.b = env->CallByteMethodV(obj, mid, args);
-            break;
-        case 'C':
-            result.c = env->CallCharMethodV(obj, mid, args);
-            break;
-        case 'S':
-            result.s = env->CallShortMethodV(obj, mid, args);
-            break;
-        case 'I':
-            result.i = env->CallIntMethodV(obj, mid, args);
-            break;
-        case 'J':
-            result.j = env->CallLongMethodV(obj, mid, args);
-            break;
-        case 'F':
-            result.f = env->CallFloatMethodV(obj, mid, args);
-            break;
-        case 'D':
-            result.d = env->CallDoubleMethodV(obj, mid, args);
-            break;
-        default:
-            env->FatalError("jnu_call_method_by_name_v: illegal signature");
-    }
-done1:
-    env->DeleteLocalRef(clazz);
-done2:
-    if (has_exception) {
-        *has_exception = env->ExceptionCheck();
+Packet::Packet(uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_) :
+    data(NULL), size(0), pts(pts_), dts(dts_), buf(NULL), latency_seq(0)
+{
+    // Left empty if out of memory, callers check buf
+    if (size_ > 0) {
+        buf = media_buffer_alloc(size_);
+        if (!buf) {
+            E("Packet of %d bytes not copied", size_);
+            return;
+        }
+        data = buf->data;
+        size = size_;
+        memcpy(data, data_, size);
     }
-    return result;
 }
 
-jvalue jnu_call_method_by_name(jboolean *has_exception, jobject obj,
-                               const char *name, const char *signature, ...)
+Packet::Packet(MediaBuffer *buf_, uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_) :
+    data(data_), size(size_), pts(pts_), dts(dts_), buf(buf_), latency_seq(0)
 {
-    jvalue result;
-    va_list args;
-
-    va_start(args, signature);
-    result = jnu_call_method_by_name_v(has_exception, obj, name, signature, args);
-    va_end(args);
-
-    return result;
+    assert(!buf || (media_buffer_room_before(buf, data) >= 0 &&
+                    data + size <= buf->data + buf->size + buf->tailroom));
 }
 
-void jnu_set_field_by_name(jboolean *hasException, jobject obj,
-                           const char *name, const char *signature, ...)
+Packet::~Packet()
 {
-    JNIEnv *env = jni_get_env(THREAD_NAME);
-    jclass cls;
-    jfieldID fid;
-    va_list args;
-
-    if (env->EnsureLocalCapacity(3) < 0)
-        goto done2;
-
-    cls = env->GetObjectClass(obj);
-    fid = env->GetFieldID(cls, name, signature);
-    if (fid == 0)
-        goto done1;
-
-    va_start(args, signature);
-    switch (*signature) {
-    case '[':
-    case 'L':
-        env->SetObjectField(obj, fid, va_arg(args, jobject));
-    break;      
-    case 'Z':
-        env->SetBooleanField(obj, fid, (jboolean)va_arg(args, int));
-    break;
-    case 'B':
-        env->SetByteField(obj, fid, (jbyte)va_arg(args, int));
-    break;
-    case 'C':
-        env->SetCharField(obj, fid, (jchar)va_arg(args, int));
-    break;
-    case 'S':
-        env->SetShortField(obj, fid, (jshort)va_arg(args, int));
-    break;
-    case 'I':
-        env->SetIntField(obj, fid, va_arg(args, jint));
-    break;
-    case 'J':
-        env->SetLongField(obj, fid, va_arg(args, jlong));
-    break;
-    case 'F':
-        env->SetFloatField(obj, fid, (jfloat)va_arg(args, jdouble));
-    break;
-    case 'D':
-        env->SetDoubleField(obj, fid, va_arg(args, jdouble));
-    break;
-
-    default:
-        env->FatalError("jnu_set_field_by_name: illegal signature");
-    }
-    va_end(args);
-
- done1:
-    env->DeleteLocalRef(cls);
- done2:
-    if (hasException) {
-        *hasException = env->ExceptionCheck();
+    if (buf) {
+        media_buffer_unref(&buf);
+        data = NULL;
+    } else {
+        SAFE_FREE(data);
     }
 }
 
-jstring jnu_new_string(const char *str)
+AVCFrame::AVCFrame() :
+    key_frame(false),
+    sps(NULL), sps_length(0),
+    pps(NULL), pps_length(0),
+    sps_pps_changed(false)
 {
-    JNIEnv *env = jni_get_env(THREAD_NAME);
-    jmethodID cid;
-    jbyteArray arr;
-    jsize len;
-    jstring result;
-
-    cid = env->GetMethodID(gfq.String.clazz, "<init>", "([B)V");
-    if (!cid)
-        return NULL;
-
-    len = strlen(str);
-    arr = env->NewByteArray(len);
-    if (!arr)
-        return NULL;
-    env->SetByteArrayRegion(arr, 0, len, (const jbyte *) str);
-
-    result = (jstring) env->NewObject(gfq.String.clazz, cid, arr);
-
-    env->DeleteLocalRef(arr);
-    return result;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -256,9 +100,6 @@ void rtmp_log(int level, const char *fmt, va_list args)
     if (level == RTMP_LOGDEBUG2)
         return;
 
-    char buf[4096];
-    vsnprintf(buf, sizeof(buf)-1, fmt, args);
-
     android_LogPriority prio;
 
     switch (level) {
@@ -270,5 +111,50 @@ void rtmp_log(int level, const char *fmt, va_list args)
         case RTMP_LOGDEBUG:     prio = ANDROID_LOG_DEBUG; break;
     }
 
-    libfqrtmp_log_print("rtmp_module", -1, prio, LOG_TAG, buf);
+    if (prio < XLOG_MIN_LEVEL)
+        return;
+
+    // Formatted later by the logger thread, librtmp's fmt copied along
+    xlog_vprint("rtmp_module", -1, prio, LOG_TAG, true, fmt, args);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+static pthread_once_t executor_once = PTHREAD_ONCE_INIT;
+// Never destroyed, like the threads it serves
+static xutil::Executor *executor;
+
+// A worker per three cores beyond the first, which is left to the audio
+// encoder; x264 gets the rest
+static int executor_threads()
+{
+    return (xutil::cpu_num() - 1) / 3;
+}
+
+static void executor_init()
+{
+    executor = new xutil::Executor(executor_threads(), "executor",
+                                   thread_ctl_register, thread_ctl_unregister);
+}
+
+xutil::Executor *pipeline_executor()
+{
+    pthread_once(&executor_once, executor_init);
+    return executor;
+}
+
+int pipeline_encoder_threads()
+{
+    return MAX(xutil::cpu_num() - executor_threads() - 1, 1);
+}
+
+std::string pipeline_executor_report()
+{
+    if (!executor)
+        return "";
+
+    return xutil::sprintf_("executor: %d threads, %llu tasks run, %llu stolen\n",
+                    executor->threads(),
+                    (long long unsigned) executor->executed(),
+                    (long long unsigned) executor->stolen());
 }
@@ -1,17 +1,22 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <string>
 #include <vector>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
 #include <libgen.h>
 #include <errno.h>
-#include <jni.h>
 #include <librtmp/log.h>
-#include <android/log.h>
 
 #include "xtype.h"
+#include "xpool.h"
+
+namespace xutil {
+class Executor;
+}
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,20 +27,67 @@ struct Rational {
     int den;
 };
 
+// Ref-counted payload, shared (read-only) by every consumer of a packet.
+// headroom/tailroom are spare bytes around data, for the holder of the
+// only reference to put headers (flv tag, rtmp chunk) in front in place
+struct MediaBuffer {
+    uint8_t *data;      // 64-byte aligned
+    int size;
+    int headroom;
+    int tailroom;
+    volatile int refcnt;
+};
+
+// Kept in front of encoded frames: an rtmp chunk header (18 bytes at most)
+// and the 5-byte flv video tag header
+#define MEDIA_BUFFER_HEADROOM   32
+
+MediaBuffer *media_buffer_alloc(int size, int headroom = 0, int tailroom = 0);
+MediaBuffer *media_buffer_ref(MediaBuffer *buf);
+void media_buffer_unref(MediaBuffer **buf);
+// Spare bytes in front of p, which points into buf's payload
+int media_buffer_room_before(const MediaBuffer *buf, const uint8_t *p);
+
 struct Packet {
     uint8_t *data;
     int size;
     uint64_t pts, dts;
+    MediaBuffer *buf;   // Owner of data if not NULL, else data is malloc'ed
+    uint32_t latency_seq; // Sampled by LatencyTracker if not 0
 
     Packet();
+    // Copy of data_, empty (buf NULL) if that can't be allocated
     Packet(uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_);
+    // View of [data_, data_+size_) in buf_, takes over the caller's reference
+    Packet(MediaBuffer *buf_, uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_);
     virtual ~Packet();
+
+    // Packets of every kind come and go per frame, keep them off malloc
+    static void *operator new(size_t size) { return xpool_alloc(size); }
+    static void operator delete(void *ptr) { xpool_free(ptr); }
 };
 
-typedef std::pair<uint32_t, byte *> NaluItem;
-typedef struct Nalu {
-    std::vector<NaluItem *> *dat;
-} Nalu;
+// Location of a nalu inside its buffer, startcode or length prefix excluded
+struct NaluInfo {
+    uint32_t offset;    // Of the nalu header
+    uint32_t length;
+    byte type;
+};
+
+// Encoded h264 access unit in AVCC form: every nalu is preceded by
+// its 4-byte big-endian length, as flv/rtmp want it
+struct AVCFrame : public Packet {
+    std::vector<NaluInfo> nalus;
+    bool key_frame;
+    // Parameter sets in effect (no length prefix), owned by the producer
+    const byte *sps;
+    uint32_t sps_length;
+    const byte *pps;
+    uint32_t pps_length;
+    bool sps_pps_changed;
+
+    AVCFrame();
+};
 
 enum RTMPChannel {
     RTMP_NETWORK_CHANNEL = 2,
@@ -45,46 +97,18 @@ enum RTMPChannel {
     RTMP_SOURCE_CHANNEL  = 8,
 };
 
-class AudioEncoder;
-class VideoEncoder;
-class RtmpHandler;
-
-struct LibFQRtmp {
-    jclass clazz;
-    jobject weak_thiz;
-    struct {
-        jclass clazz;
-    } IllegalArgumentException;
-    struct {
-        jclass clazz;
-    } String;
-    jmethodID onNativeCrashID;
-    jmethodID dispatchEventFromNativeID;
-    AudioEncoder *audio_enc;
-    VideoEncoder *video_enc;
-    RtmpHandler *rtmp_hdlr;
-};
-
-extern struct LibFQRtmp gfq;
-
-jstring jnu_new_string(const char *str);
-
-static inline void throw_IllegalArgumentException(JNIEnv *env, const char *error)
-{
-    env->ThrowNew(gfq.IllegalArgumentException.clazz, error);
-}
-
-jvalue jnu_get_field_by_name(jboolean *has_exception, jobject obj,
-                             const char *name, const char *signature);
-void jnu_set_field_by_name(jboolean *hasException, jobject obj,
-                           const char *name, const char *signature, ...);
-jvalue jnu_call_method_by_name(jboolean *has_exception, jobject obj,
-                               const char *name, const char *signature, ...);
-jvalue jnu_call_method_by_name_v(jboolean *has_exception, jobject obj,
-                                 const char *name, const char *signature, va_list args);
-
 void rtmp_log(int level, const char *fmt, va_list args);
 
+// Workers shared by the stages for the work they split up (colour
+// conversion bands), created on first use. Sized so x264's own threads,
+// the audio encoder and these stay within the cores, see
+// pipeline_encoder_threads(); no workers at all on one or two cores
+xutil::Executor *pipeline_executor();
+// x264 threads that fit next to the executor and the audio encoder
+int pipeline_encoder_threads();
+// A line on what the executor ran, empty if never created
+std::string pipeline_executor_report();
+
 #ifdef __cplusplus
 }
 #endif
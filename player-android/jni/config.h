@@ -7,7 +7,15 @@
 #define RTMP_LOGLEVEL           RTMP_LOGDEBUG
 #define RTMP_DEF_BUFTIME        (10*60*60*1000) // 10 hours default
 #define RTMP_MAX_PLAY_BUFSIZE   (10*1024*1024) // 10M
+#define RTMP_OUT_CHUNK_SIZE     (64*1024) // Messages up to it are sent zero-copy
 
 #define NEW_STREAM_TIMESTAMP_THESHO 300
 
+#define DVR_DEF_MAX_BYTES       (32*1024*1024) // 32M
+#define DVR_DEF_MAX_DURATION    (60*1000) // 60 seconds
+
+#define MEM_DEF_CAP             (96*1024*1024) // Of all the session buffers
+
+#define ENABLE_TRACE            1 // 0 compiles the trace points out
+
 #endif /* end of _CONFIG_H_ */
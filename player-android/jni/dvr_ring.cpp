@@ -0,0 +1,322 @@
+#include <memory>
+#include <librtmp/rtmp.h>
+
+#include "dvr_ring.h"
+#include "flv_muxer.h"
+#include "fqrtmp_session.h"
+#include "thread_ctl.h"
+
+using namespace xutil;
+
+DVRRing::ExportJob::~ExportJob()
+{
+    foreach(pkts, it) {
+        SAFE_DELETE(*it);
+    }
+}
+
+DVRRing::DVRRing(FQRtmpSession *session, uint32_t max_bytes, uint32_t max_duration) :
+    m_session(session),
+    m_max_bytes(max_bytes),
+    m_max_duration(max_duration),
+    m_bytes(0),
+    m_key_frames(0),
+    m_wait_key_frame(false),
+    m_thrd(NULL)
+{
+    memset(m_seq_hdr, 0, sizeof(m_seq_hdr));
+
+    m_thrd = CREATE_THREAD_ROUTINE(export_routine, NULL, false);
+}
+
+DVRRing::~DVRRing()
+{
+    // Pending exports are still written before the thread quits
+    m_queue.cancel_wait();
+    JOIN_DELETE_THREAD(m_thrd);
+
+    while (!m_pkts.empty()) {
+        pop_front();
+    }
+    for (int i = 0; i < SEQ_HDR_NUM; ++i) {
+        SAFE_DELETE(m_seq_hdr[i]);
+    }
+}
+
+bool DVRRing::is_key_frame(const RtmpPacket *pkt)
+{
+    return pkt->pkttype == RTMP_PACKET_TYPE_VIDEO &&
+           pkt->size >= 2 &&
+           (pkt->data[0]>>4) == 1 &&    // Key frame
+           pkt->data[1] == 0x01;        // AVC NALU
+}
+
+int DVRRing::seq_header_index(const RtmpPacket *pkt)
+{
+    if (pkt->size < 2 || pkt->data[1] != 0x00)
+        return -1;
+
+    if (pkt->pkttype == RTMP_PACKET_TYPE_VIDEO &&
+        (pkt->data[0]&0x0F) == 7 /*AVC*/)
+        return VIDEO_SEQ_HDR;
+    if (pkt->pkttype == RTMP_PACKET_TYPE_AUDIO &&
+        (pkt->data[0]>>4) == 10 /*AAC*/)
+        return AUDIO_SEQ_HDR;
+    return -1;
+}
+
+bool DVRRing::over_budget() const
+{
+    if (m_max_bytes && m_bytes > m_max_bytes)
+        return true;
+    if (m_max_duration && get_duration() > m_max_duration)
+        return true;
+    return false;
+}
+
+void DVRRing::pop_front()
+{
+    RtmpPacket *pkt = m_pkts.front();
+    m_pkts.pop_front();
+
+    m_bytes -= pkt->size;
+    m_session->mem_budget()->add(MEM_DVR, -pkt->size);
+    if (is_key_frame(pkt)) {
+        --m_key_frames;
+    }
+
+    int idx = seq_header_index(pkt);
+    if (idx >= 0) {
+        // Keep it, it still describes the packets behind
+        SAFE_DELETE(m_seq_hdr[idx]);
+        m_seq_hdr[idx] = pkt;
+    } else {
+        SAFE_DELETE(pkt);
+    }
+}
+
+void DVRRing::pop_back()
+{
+    RtmpPacket *pkt = m_pkts.back();
+    m_pkts.pop_back();
+
+    m_bytes -= pkt->size;
+    m_session->mem_budget()->add(MEM_DVR, -pkt->size);
+    if (is_key_frame(pkt)) {
+        --m_key_frames;
+    }
+    SAFE_DELETE(pkt);
+}
+
+int DVRRing::add_packet(RtmpPacket *pkt)
+{
+    bool key_frame = is_key_frame(pkt);
+    bool seq_hdr = seq_header_index(pkt) >= 0;
+
+    BEGIN
+    AutoLock _l(m_mutex);
+    // The frames up to the next key frame would refer to what was cut
+    if (m_wait_key_frame && !key_frame && !seq_hdr)
+        return 0;
+    END
+
+    std::auto_ptr<RtmpPacket> pkt_ref(new RtmpPacket);
+    if (pkt_ref->clone(pkt) < 0) {
+        E("Clone packet for dvr ring failed");
+        return -1;
+    }
+
+    AutoLock _l(m_mutex);
+
+    if (key_frame && m_wait_key_frame) {
+        m_wait_key_frame = false;
+    }
+
+    m_bytes += pkt_ref->size;
+    m_session->mem_budget()->add(MEM_DVR, pkt_ref->size);
+    if (key_frame) {
+        ++m_key_frames;
+    }
+    m_pkts.push_back(pkt_ref.release());
+
+    while (!m_pkts.empty() && over_budget()) {
+        if (m_key_frames == 1 && is_key_frame(m_pkts.front())) {
+            // The ring is the newest GOP alone and that doesn't fit: cut
+            // it short here, rather than lose its key frame
+            if (!key_frame && !seq_hdr) {
+                pop_back();
+            }
+            if (!m_wait_key_frame) {
+                W("A GOP over the dvr budget, cut short up to the next key frame (cont)");
+                m_wait_key_frame = true;
+            }
+            break;
+        }
+
+        pop_front();
+
+        // Drop the rest of the GOP so that the ring starts at a key frame
+        while (m_key_frames && !is_key_frame(m_pkts.front())) {
+            pop_front();
+        }
+    }
+
+    // Gives way to the live path under memory pressure, down to the last GOP
+    while (m_key_frames > 1 && m_session->mem_budget()->pressure()) {
+        pop_front();
+        while (!is_key_frame(m_pkts.front())) {
+            pop_front();
+        }
+    }
+    return 0;
+}
+
+uint32_t DVRRing::get_bytes() const
+{
+    AutoLock _l(m_mutex);
+    return m_bytes;
+}
+
+uint32_t DVRRing::get_duration() const
+{
+    AutoLock _l(m_mutex);
+
+    if (m_pkts.size() < 2)
+        return 0;
+    return m_pkts.back()->pts - m_pkts.front()->pts;
+}
+
+int DVRRing::export_clip(uint64_t start_ts, uint64_t end_ts, const std::string &path)
+{
+    if (start_ts > end_ts || path.empty()) {
+        E("Invalid clip range [%llu, %llu] or path \"%s\"",
+          (long long unsigned) start_ts, (long long unsigned) end_ts,
+          path.c_str());
+        return -1;
+    }
+
+    std::auto_ptr<ExportJob> job(new ExportJob);
+    job->path = path;
+
+    BEGIN
+    AutoLock _l(m_mutex);
+
+    // Start from the last key frame not after start_ts, so the clip
+    // is decodable; audio-only ring starts at start_ts directly
+    uint32_t start = m_pkts.size();
+    for (uint32_t i = 0; i < m_pkts.size(); ++i) {
+        const RtmpPacket *pkt = m_pkts[i];
+        if (m_key_frames ? is_key_frame(pkt) : true) {
+            if (pkt->pts <= start_ts || start == m_pkts.size()) {
+                start = i;
+            }
+            if (pkt->pts >= start_ts)
+                break;
+        }
+    }
+    if (start == m_pkts.size() || m_pkts[start]->pts > end_ts) {
+        E("No dvr data in range [%llu, %llu]",
+          (long long unsigned) start_ts, (long long unsigned) end_ts);
+        return -1;
+    }
+
+    // Find out the sequence headers in effect at the clip start
+    const RtmpPacket *seq_hdr[SEQ_HDR_NUM];
+    memcpy(seq_hdr, m_seq_hdr, sizeof(seq_hdr));
+    for (uint32_t i = 0; i < start; ++i) {
+        int idx = seq_header_index(m_pkts[i]);
+        if (idx >= 0) {
+            seq_hdr[idx] = m_pkts[i];
+        }
+    }
+
+    for (int i = 0; i < SEQ_HDR_NUM; ++i) {
+        if (!seq_hdr[i])
+            continue;
+
+        RtmpPacket *pkt = new RtmpPacket;
+        if (pkt->clone(const_cast<RtmpPacket *>(seq_hdr[i])) < 0) {
+            SAFE_DELETE(pkt);
+            E("Clone sequence header for clip export failed");
+            return -1;
+        }
+        pkt->pts = pkt->dts = m_pkts[start]->pts;
+        job->pkts.push_back(pkt);
+    }
+
+    for (uint32_t i = start;
+         i < m_pkts.size() && m_pkts[i]->pts <= end_ts; ++i) {
+        RtmpPacket *pkt = new RtmpPacket;
+        if (pkt->clone(m_pkts[i]) < 0) {
+            SAFE_DELETE(pkt);
+            E("Clone packet for clip export failed");
+            return -1;
+        }
+        job->pkts.push_back(pkt);
+    }
+    END
+
+    I("Export dvr clip [%llu, %llu] (%u tags) to \"%s\"",
+      (long long unsigned) start_ts, (long long unsigned) end_ts,
+      (unsigned) job->pkts.size(), path.c_str());
+
+    return m_queue.push(job.release());
+}
+
+int DVRRing::export_last(uint32_t duration, const std::string &path)
+{
+    uint64_t start_ts, end_ts;
+
+    BEGIN
+    AutoLock _l(m_mutex);
+
+    if (m_pkts.empty()) {
+        E("DVR ring is empty, nothing to export");
+        return -1;
+    }
+
+    end_ts = m_pkts.back()->pts;
+    start_ts = end_ts > duration ? end_ts - duration : 0;
+    END
+
+    return export_clip(start_ts, end_ts, path);
+}
+
+unsigned int DVRRing::export_routine(void *arg)
+{
+    ExportJob *job;
+
+    thread_ctl_register("dvr_export");
+    D("dvr export_routine started ..");
+
+    while (m_queue.pop(job) == 0) {
+        if (write_clip(job) < 0) {
+            E("Write dvr clip to \"%s\" failed", job->path.c_str());
+            m_session->send_event(ENCOUNTERED_ERROR,
+                                  -1002, "dvr clip export failed");
+        } else {
+            m_session->send_event(CLIP_EXPORTED,
+                                  job->pkts.size(), job->path.c_str());
+        }
+        SAFE_DELETE(job);
+    }
+
+    thread_ctl_unregister();
+    D("dvr export_routine ended");
+    return 0;
+}
+
+int DVRRing::write_clip(const ExportJob *job)
+{
+    FLVMuxer flvmuxer;
+
+    if (flvmuxer.set_file(job->path) < 0)
+        return -1;
+
+    foreach(job->pkts, it) {
+        const RtmpPacket *pkt = *it;
+        if (flvmuxer.write_tag(pkt->pkttype, pkt->pts, pkt->data, pkt->size) < 0)
+            return -1;
+    }
+    return 0;
+}
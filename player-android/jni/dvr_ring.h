@@ -0,0 +1,78 @@
+#ifndef _DVR_RING_H_
+#define _DVR_RING_H_
+
+#include <deque>
+
+#include "jitter_buffer.h"
+#include "xqueue.h"
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+class FQRtmpSession;
+
+/* In-memory ring of the interleaved flv tags (the ones going to the
+ * rtmp server), bounded by bytes and duration. Eviction is done
+ * GOP by GOP so the ring always starts at a video key frame; the newest
+ * key frame is never evicted, a GOP the budget can't hold is cut short
+ * and nothing but sequence headers is taken until the next key frame.
+ * Packets share their payload with the send path (no copy). */
+class DVRRing {
+public:
+    // 0 for either budget means no limit on it
+    DVRRing(FQRtmpSession *session, uint32_t max_bytes, uint32_t max_duration /*ms*/);
+    ~DVRRing();
+
+    int add_packet(RtmpPacket *pkt);
+
+    // Export [start_ts, end_ts] (stream timestamps in ms) to an flv file,
+    // the file is written in background
+    int export_clip(uint64_t start_ts, uint64_t end_ts, const std::string &path);
+    // Export the latest duration (ms) of the ring
+    int export_last(uint32_t duration, const std::string &path);
+
+    uint32_t get_bytes() const;
+    uint32_t get_duration() const;
+
+private:
+    struct ExportJob {
+        std::string path;
+        std::vector<RtmpPacket *> pkts;
+
+        ~ExportJob();
+    };
+
+    enum { VIDEO_SEQ_HDR, AUDIO_SEQ_HDR, SEQ_HDR_NUM };
+
+    static bool is_key_frame(const RtmpPacket *pkt);
+    static int seq_header_index(const RtmpPacket *pkt);
+
+    bool over_budget() const;
+    void pop_front();
+    // The packet just added, never a sequence header
+    void pop_back();
+    int write_clip(const ExportJob *job);
+
+private:
+    FQRtmpSession *m_session;
+    uint32_t m_max_bytes;
+    uint32_t m_max_duration;
+    std::deque<RtmpPacket *> m_pkts;
+    uint32_t m_bytes;
+    uint32_t m_key_frames;
+    // The newest GOP went over budget, refusing packets up to a key frame
+    bool m_wait_key_frame;
+    // Sequence headers in effect at the head of the ring
+    RtmpPacket *m_seq_hdr[SEQ_HDR_NUM];
+    mutable xutil::RecursiveMutex m_mutex;
+    DECL_THREAD_ROUTINE(DVRRing, export_routine);
+    xutil::Thread *m_thrd;
+    Queue<ExportJob *> m_queue;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _DVR_RING_H_ */
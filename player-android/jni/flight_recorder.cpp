@@ -0,0 +1,221 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "flight_recorder.h"
+
+using namespace xutil;
+
+struct FlightEvent {
+    volatile uint32_t seq;  // Set last, a slot being written never matches
+    pid_t tid;
+    uint64_t ts;            // Monotonic, in us
+    int64_t a, b;
+    const char *s, *s2;
+    int type;
+};
+
+static const char *flight_event_names[FLIGHT_EVENT_NUM] = {
+    "session_start",
+    "connected",
+    "video_fed",
+    "video_dropped",
+    "video_encoded",
+    "keyframe_forced",
+    "audio_encoded",
+    "interleave_forced",
+    "packet_sent",
+    "send_failed",
+    "mem_pressure",
+    "warn",
+    "error",
+};
+
+static FlightEvent flight_ring[FLIGHT_RING_SIZE];
+static volatile uint32_t flight_seq;
+static volatile int flight_fd = -1;
+
+static pthread_key_t tid_key;
+static pthread_once_t tid_once = PTHREAD_ONCE_INIT;
+
+static void tid_init_key()
+{
+    pthread_key_create(&tid_key, NULL);
+}
+
+// gettid() is a syscall, keep it per thread
+static pid_t cached_tid()
+{
+    pthread_once(&tid_once, tid_init_key);
+
+    pid_t tid = (pid_t) (intptr_t) pthread_getspecific(tid_key);
+    if (!tid) {
+        tid = syscall(__NR_gettid);
+        pthread_setspecific(tid_key, (void *) (intptr_t) tid);
+    }
+    return tid;
+}
+
+static uint64_t mono_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void flight_record(FlightEventType type, int64_t a, int64_t b,
+                   const char *s, const char *s2)
+{
+    uint32_t seq = __sync_add_and_fetch(&flight_seq, 1);
+    FlightEvent &ev = flight_ring[seq & (FLIGHT_RING_SIZE - 1)];
+
+    ev.seq = 0;
+    __sync_synchronize();
+    ev.tid = cached_tid();
+    ev.ts = mono_us();
+    ev.a = a;
+    ev.b = b;
+    ev.s = s;
+    ev.s2 = s2;
+    ev.type = type;
+    __sync_synchronize();
+    ev.seq = seq;
+}
+
+static void flight_log_hook(int prio, const char *file, int line, const char *fmt)
+{
+    flight_record(prio >= ANDROID_LOG_ERROR ? FLIGHT_LOG_ERROR : FLIGHT_LOG_WARN,
+                  line, 0, file, fmt);
+}
+
+void flight_recorder_init()
+{
+    xlog_set_hook(flight_log_hook);
+}
+
+int flight_recorder_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        E("Open flight recorder file \"%s\" failed: %s", path, ERRNOMSG);
+        return -1;
+    }
+    set_close_on_exec(fd);
+
+    int old = flight_fd;
+    flight_fd = fd;
+    if (old >= 0) {
+        close(old);
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////
+// Nothing below may allocate, lock or call stdio
+
+struct SafeLine {
+    char buf[512];
+    size_t len;
+
+    SafeLine() : len(0) { }
+
+    SafeLine &str(const char *s) {
+        while (s && *s && len < sizeof(buf) - 1) buf[len++] = *s++;
+        return *this;
+    }
+    SafeLine &dec(int64_t val) {
+        char tmp[24];
+        int n = 0;
+        uint64_t u = val < 0 ? -(uint64_t) val : val;
+        do {
+            tmp[n++] = '0' + u % 10;
+            u /= 10;
+        } while (u);
+        if (val < 0) tmp[n++] = '-';
+        while (n && len < sizeof(buf) - 1) buf[len++] = tmp[--n];
+        return *this;
+    }
+    SafeLine &hex(uint64_t val) {
+        static const char digits[] = "0123456789abcdef";
+        char tmp[16];
+        int n = 0;
+        do {
+            tmp[n++] = digits[val & 0xF];
+            val >>= 4;
+        } while (val);
+        str("0x");
+        while (n && len < sizeof(buf) - 1) buf[len++] = tmp[--n];
+        return *this;
+    }
+    // Microseconds as milliseconds with 3 decimals
+    SafeLine &ms(int64_t us) {
+        if (us < 0) {
+            str("-");
+            us = -us;
+        }
+        dec(us / 1000).str(".");
+        int frac = us % 1000;
+        if (frac < 100) str("0");
+        if (frac < 10) str("0");
+        return dec(frac);
+    }
+    void flush(int fd) {
+        buf[len++] = '\n';
+        const char *p = buf;
+        while (len > 0) {
+            ssize_t n = write(fd, p, len);
+            if (n <= 0)
+                break;
+            p += n;
+            len -= n;
+        }
+        len = 0;
+    }
+};
+
+void flight_recorder_dump(int sig, const siginfo_t *info)
+{
+    int fd = flight_fd;
+    if (fd < 0)
+        return;
+
+    uint64_t now = mono_us();
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+
+    SafeLine line;
+    line.str("*** fqrtmp flight recorder: signal ").dec(sig);
+    if (info) {
+        line.str(" code ").dec(info->si_code).str(" addr ").hex((uintptr_t) info->si_addr);
+    }
+    line.str(" tid ").dec(syscall(__NR_gettid))
+        .str(" time ").dec(wall.tv_sec).str(" ***");
+    line.flush(fd);
+
+    // Oldest first; slots in the middle of a write are skipped
+    uint32_t last = flight_seq;
+    uint32_t first = last >= FLIGHT_RING_SIZE ? last - FLIGHT_RING_SIZE + 1 : 1;
+    for (uint32_t seq = first; seq && seq <= last; ++seq) {
+        const FlightEvent &ev = flight_ring[seq & (FLIGHT_RING_SIZE - 1)];
+        if (ev.seq != seq)
+            continue;
+
+        line.str("[").ms((int64_t) (ev.ts - now)).str("ms] tid ").dec(ev.tid).str(" ");
+        line.str(ev.type >= 0 && ev.type < FLIGHT_EVENT_NUM ?
+                 flight_event_names[ev.type] : "?");
+        line.str(" ").dec(ev.a).str(" ").dec(ev.b);
+        if (ev.s) {
+            line.str(" ").str(ev.s);
+        }
+        if (ev.s2) {
+            line.str(" \"").str(ev.s2).str("\"");
+        }
+        line.flush(fd);
+    }
+
+    line.str("*** end ***");
+    line.flush(fd);
+    fsync(fd);
+}
@@ -0,0 +1,52 @@
+#ifndef _FLIGHT_RECORDER_H_
+#define _FLIGHT_RECORDER_H_
+
+#include <signal.h>
+
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Always-on ring of the latest pipeline events, written out by the
+ * native crash handler with async-signal-safe calls only. Recording is
+ * a few stores and an atomic add, cheap enough for every frame. */
+
+#define FLIGHT_RING_SIZE    2048    // Power of 2
+
+enum FlightEventType {
+    FLIGHT_SESSION_START,   // a: 0
+    FLIGHT_CONNECTED,       // a: 0 ok, -1 failed
+    FLIGHT_VIDEO_FED,       // a: bytes, b: encoder queue depth
+    FLIGHT_VIDEO_DROPPED,   // a: dropped so far
+    FLIGHT_VIDEO_ENCODED,   // a: bytes, b: pts
+    FLIGHT_KEYFRAME_FORCED, // a: frame number
+    FLIGHT_AUDIO_ENCODED,   // a: bytes, b: pts
+    FLIGHT_INTERLEAVE_FORCED, // a: pts delta
+    FLIGHT_PACKET_SENT,     // a: pkttype, b: bytes
+    FLIGHT_SEND_FAILED,     // a: pkttype, b: bytes
+    FLIGHT_MEM_PRESSURE,    // a: 1 on, 0 off, b: bytes held
+    FLIGHT_LOG_WARN,        // a: line, s: file, s2: fmt
+    FLIGHT_LOG_ERROR,       // Ditto
+    FLIGHT_EVENT_NUM
+};
+
+// Strings must outlive the process (literals)
+void flight_record(FlightEventType type, int64_t a = 0, int64_t b = 0,
+                   const char *s = NULL, const char *s2 = NULL);
+
+// Records warnings and errors logged from now on
+void flight_recorder_init();
+
+// Where the crash handler writes to, opened now since open() is no
+// option then; appended, so earlier crashes are kept
+int flight_recorder_open(const char *path);
+
+// Async-signal-safe
+void flight_recorder_dump(int sig, const siginfo_t *info);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _FLIGHT_RECORDER_H_ */
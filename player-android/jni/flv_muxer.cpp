@@ -1,6 +1,10 @@
 #include <librtmp/rtmp.h>
 
 #include "flv_muxer.h"
+#include "trace.h"
+
+#define FLV_TAG_HEADER_SIZE     11
+#define FLV_PREV_TAG_SIZE       4
 
 using namespace xutil;
 
@@ -43,6 +47,8 @@ const char *FLVMuxer::get_path() const
 
 int FLVMuxer::write_tag(int typ, int ts, const uint8_t *buf, int buf_size)
 {
+    TRACE_SCOPE("FLVMuxer::write_tag");
+
     if (typ != RTMP_PACKET_TYPE_VIDEO &&
         typ != RTMP_PACKET_TYPE_AUDIO &&
         typ != RTMP_PACKET_TYPE_INFO)
@@ -53,12 +59,20 @@ int FLVMuxer::write_tag(int typ, int ts, const uint8_t *buf, int buf_size)
     }
     ts += m_tm_offset;
 
-    m_file->writeui8(typ);
-    m_file->writeui24(buf_size, true);
-    m_file->writeui24(ts&0xFFFFFF, true);
-    m_file->writeui8(ts&0xFF000000);
-    m_file->writeui24(0, true);
-    m_file->write_buffer(buf, buf_size);
-    m_file->writeui32(buf_size+11, true);
+    // Header and trailer around the payload as it is, the file's stdio
+    // buffer gathers them; the payload may be shared and is not copied
+    byte hdr[FLV_TAG_HEADER_SIZE], trailer[FLV_PREV_TAG_SIZE];
+    byte *p = hdr;
+    *p++ = typ;
+    p = put_be24(p, buf_size);
+    p = put_be24(p, ts&0xFFFFFF);
+    *p++ = (ts>>24)&0xFF;   // Timestamp extended
+    p = put_be24(p, 0);     // StreamID
+    put_be32(trailer, buf_size + FLV_TAG_HEADER_SIZE);
+
+    if (!m_file->write_buffer(hdr, sizeof(hdr)) ||
+        !m_file->write_buffer(buf, buf_size) ||
+        !m_file->write_buffer(trailer, sizeof(trailer)))
+        return -1;
     return 0;
 }
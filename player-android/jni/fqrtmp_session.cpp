@@ -0,0 +1,411 @@
+#include <getopt.h>
+
+#include "fqrtmp_session.h"
+#include "rtmp_handler.h"
+#include "latency_tracker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "config.h"
+
+using namespace xutil;
+
+SessionConfig::SessionConfig() :
+    dvr_size(0), dvr_time(0), latency_sei(0), metrics_interval(5000),
+    mem_cap(MEM_DEF_CAP), thread_stats(0)
+{
+}
+
+int SessionConfig::parse(int argc, char *const argv[])
+{
+    struct option longopts[] = {
+        {"live",    required_argument, NULL, 'L'},
+        {"flvpath", required_argument, NULL, 'f'},
+        {"dvrsize", required_argument, NULL, 's'},
+        {"dvrtime", required_argument, NULL, 't'},
+        {"latencysei", required_argument, NULL, 'l'},
+        {"metricsdump", required_argument, NULL, 'm'},
+        {"metricsinterval", required_argument, NULL, 'M'},
+        {"trace", required_argument, NULL, 'T'},
+        {"logfile", required_argument, NULL, 'g'},
+        {"crashdump", required_argument, NULL, 'c'},
+        {"memcap", required_argument, NULL, 'C'},
+        {"thread", required_argument, NULL, 'P'},
+        {"threadstats", required_argument, NULL, 'S'},
+        {0, 0, 0, 0}
+    };
+    int ch;
+
+    optind = 0;
+    while ((ch = getopt_long(argc, argv,
+                             ":L:f:s:t:l:m:M:T:g:c:C:P:S:W;", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'L':
+            liveurl = optarg;
+            break;
+
+        case 'f':
+            flvpath = optarg;
+            break;
+
+        case 's':
+            dvr_size = strtoul(optarg, NULL, 10);
+            break;
+
+        case 't':
+            dvr_time = strtoul(optarg, NULL, 10) * 1000;
+            break;
+
+        case 'l':
+            // 0 to disable
+            latency_sei = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'm':
+            metrics_path = optarg;
+            break;
+
+        case 'M':
+            metrics_interval = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'T':
+            // Whole session traced, written out in close()
+            trace_path = optarg;
+            break;
+
+        case 'g':
+            // Besides logcat
+            log_path = optarg;
+            break;
+
+        case 'c':
+            // Flight recorder appended here on native crash
+            crashdump_path = optarg;
+            break;
+
+        case 'C':
+            // In bytes, 0 to disable
+            mem_cap = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'P': {
+            // Once per thread, e.g. "video_encoder:nice=-8:cpus=4-7"
+            ThreadConfig thread;
+            if (thread.parse(optarg) < 0)
+                return -1;
+            threads.push_back(thread);
+            break;
+        }
+
+        case 'S':
+            // Where the threads ran goes to metrics_report()
+            thread_stats = strtoul(optarg, NULL, 10);
+            break;
+
+        case 0:
+            break;
+
+        case '?':
+        default:
+            E("Unknown option: %c", optopt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int SessionConfig::parse(const char *str)
+{
+    std::vector<char *> argv;
+    char *cmdline = strdup(str);
+    const char *delim = " ";
+    char *saveptr = NULL;
+
+    argv.push_back(const_cast<char *>("libfqrtmp"));
+    for (char *p = strtok_r(cmdline, delim, &saveptr);
+         p; p = strtok_r(NULL, delim, &saveptr)) {
+        argv.push_back(p);
+    }
+    argv.push_back(NULL);
+
+    int retval = parse(argv.size() - 1, &argv[0]);
+    SAFE_FREE(cmdline);
+    return retval;
+}
+
+/////////////////////////////////////////////////////////////
+
+FQRtmpSession::FQRtmpSession() :
+    m_event_cb(NULL), m_event_opaque(NULL),
+    m_video_enc(NULL), m_audio_enc(NULL),
+    m_rtmp_hdlr(NULL), m_latency(NULL), m_metrics_dumper(NULL),
+    m_mem_pressure_changed(0), m_mem_pressure_reporting(0),
+    m_mem_pressure_reported(false)
+{
+    m_mem_budget.set_pressure_callback(on_mem_pressure, this);
+}
+
+FQRtmpSession::~FQRtmpSession()
+{
+    // Encoders first, they still send to the handler
+    close_video_encoder();
+    close_audio_encoder();
+    close();
+    SAFE_DELETE(m_latency);
+}
+
+void FQRtmpSession::set_event_callback(libfqrtmp_event_cb cb, void *opaque)
+{
+    m_event_cb = cb;
+    m_event_opaque = opaque;
+}
+
+void FQRtmpSession::send_event(libfqrtmp_event type, int64_t arg1, const char *arg2)
+{
+    if (m_event_cb) {
+        m_event_cb(m_event_opaque, type, arg1, arg2 ? arg2 : "");
+    }
+}
+
+// On the thread whose add() crossed a watermark, which may hold a lock
+// of the pipeline (the interleaver's is), so nothing goes to java here
+void FQRtmpSession::on_mem_pressure(void *opaque, bool pressure, int64_t used)
+{
+    FQRtmpSession *session = (FQRtmpSession *) opaque;
+
+    __sync_lock_test_and_set(&session->m_mem_pressure_changed, 1);
+}
+
+void FQRtmpSession::report_mem_pressure()
+{
+    // Another thread at it (or this one, called back into from the
+    // listener) leaves it to the next call
+    if (!m_mem_pressure_changed ||
+        !__sync_bool_compare_and_swap(&m_mem_pressure_reporting, 0, 1))
+        return;
+
+    // Edges that came and went meanwhile end up as where it stands now
+    while (__sync_bool_compare_and_swap(&m_mem_pressure_changed, 1, 0)) {
+        bool pressure = m_mem_budget.pressure();
+        if (pressure == m_mem_pressure_reported)
+            continue;
+        m_mem_pressure_reported = pressure;
+        send_event(MEMORY_PRESSURE, pressure,
+                   sprintf_("used %lld of %llu bytes", (long long) m_mem_budget.used(),
+                            (long long unsigned) m_mem_budget.cap()).c_str());
+    }
+    __sync_lock_release(&m_mem_pressure_reporting);
+}
+
+int FQRtmpSession::open(const SessionConfig &config)
+{
+    if (m_rtmp_hdlr) {
+        E("Session already opened");
+        return -1;
+    }
+
+    m_config = config;
+
+    if (!m_config.log_path.empty() &&
+        xlog_set_file(m_config.log_path.c_str()) < 0) {
+        W("Open log file \"%s\" failed (cont)", m_config.log_path.c_str());
+    }
+
+    if (!m_config.crashdump_path.empty() &&
+        flight_recorder_open(m_config.crashdump_path.c_str()) < 0) {
+        W("Open crash dump file failed (cont)");
+    }
+    flight_record(FLIGHT_SESSION_START);
+
+    send_event(OPENING, 0, "");
+
+    if (!m_config.trace_path.empty()) {
+        trace_start();
+    }
+
+    m_mem_budget.set_cap(m_config.mem_cap);
+
+    // Encoders may be running already
+    thread_ctl_configure(m_config.threads);
+    if (m_config.thread_stats &&
+        thread_ctl_sample_start(m_config.thread_stats) < 0) {
+        W("Start thread sampler failed (cont)");
+    }
+
+    // Counted per session
+    metrics_reset();
+    if (!m_config.metrics_path.empty()) {
+        m_metrics_dumper = new MetricsDumper;
+        if (m_metrics_dumper->start(m_config.metrics_path,
+                                    m_config.metrics_interval) < 0) {
+            W("Start metrics dumper failed (cont)");
+            SAFE_DELETE(m_metrics_dumper);
+        }
+    }
+
+    if (m_config.latency_sei) {
+        if (!m_latency) {
+            m_latency = new LatencyTracker(m_config.latency_sei);
+        } else {
+            m_latency->set_interval(m_config.latency_sei);
+        }
+    }
+
+    RtmpHandler *rtmp_hdlr = new RtmpHandler(this, m_config.flvpath);
+    if (m_config.dvr_size || m_config.dvr_time) {
+        rtmp_hdlr->enable_dvr(m_config.dvr_size ? m_config.dvr_size : DVR_DEF_MAX_BYTES,
+                              m_config.dvr_time ? m_config.dvr_time : DVR_DEF_MAX_DURATION);
+    }
+    // Published to the encoders once set up
+    m_rtmp_hdlr = rtmp_hdlr;
+
+    if (!m_config.liveurl.empty() &&
+        m_rtmp_hdlr->connect(m_config.liveurl) < 0) {
+        flight_record(FLIGHT_CONNECTED, -1);
+        send_event(ENCOUNTERED_ERROR, -1001, "rtmp_connect failed");
+        return -1;
+    }
+
+    flight_record(FLIGHT_CONNECTED);
+    send_event(CONNECTED, 0, "");
+    return 0;
+}
+
+void FQRtmpSession::close()
+{
+    RtmpHandler *rtmp_hdlr = m_rtmp_hdlr;
+    m_rtmp_hdlr = NULL;
+    SAFE_DELETE(rtmp_hdlr);
+    SAFE_DELETE(m_metrics_dumper);
+
+    if (m_config.thread_stats) {
+        thread_ctl_sample_stop();
+        I("Thread residency:\n%s", STR(thread_ctl_report()));
+    }
+
+    if (!m_config.trace_path.empty() && gtrace_on) {
+        trace_stop(m_config.trace_path);
+    }
+}
+
+int FQRtmpSession::open_video_encoder(const VideoConfig &video_config)
+{
+    close_video_encoder();
+
+    VideoEncoder *video_enc = new VideoEncoder(this);
+    if (video_enc->init(video_config) < 0) {
+        SAFE_DELETE(video_enc);
+        return -1;
+    }
+
+    AutoLock _l(m_video_mutex);
+    m_video_enc = video_enc;
+    return 0;
+}
+
+void FQRtmpSession::close_video_encoder()
+{
+    VideoEncoder *video_enc;
+    {
+        AutoLock _l(m_video_mutex);
+        video_enc = m_video_enc;
+        m_video_enc = NULL;
+    }
+    // Not under the lock, its thread may be asking for a keyframe
+    SAFE_DELETE(video_enc);
+}
+
+int FQRtmpSession::request_keyframe()
+{
+    AutoLock _l(m_video_mutex);
+    if (!m_video_enc)
+        return -1;
+    m_video_enc->request_keyframe();
+    return 0;
+}
+
+int FQRtmpSession::send_video(uint8_t *buffer, int len, int rotation, int64_t pts)
+{
+    TRACE_SCOPE("sendRawVideo");
+
+    if (!m_video_enc || m_video_enc->quit())
+        return 0;
+
+    report_mem_pressure();
+
+    // Only while a frame is queued for x264, the queue drains from there on
+    // even if other buffers hold on to their memory. Not counted as input,
+    // may well come again
+    if (m_mem_budget.full() && m_mem_budget.used(MEM_VIDEO_QUEUE) > 0) {
+        metric_add(METRIC_INPUT_REFUSED);
+        return SEND_DROPPED;
+    }
+
+    metric_add(METRIC_VIDEO_FRAMES_IN);
+    metric_add(METRIC_VIDEO_BYTES_IN, len);
+
+    if (m_video_enc->feed(buffer, len, rotation, pts) < 0)
+        return -1;
+    return m_mem_budget.pressure() ? SEND_SLOW_DOWN : SEND_OK;
+}
+
+int FQRtmpSession::open_audio_encoder(AudioConfig &audio_config)
+{
+    close_audio_encoder();
+
+    m_audio_enc = new AudioEncoder(this);
+    if (m_audio_enc->init(audio_config) < 0) {
+        close_audio_encoder();
+        return -1;
+    }
+    return 0;
+}
+
+void FQRtmpSession::close_audio_encoder()
+{
+    SAFE_DELETE(m_audio_enc);
+}
+
+int FQRtmpSession::send_audio(uint8_t *buffer, int len)
+{
+    TRACE_SCOPE("sendRawAudio");
+
+    if (!m_audio_enc || m_audio_enc->quit())
+        return 0;
+
+    report_mem_pressure();
+
+    // Likewise, while a whole aac frame is waiting
+    if (m_mem_budget.full() &&
+        m_mem_budget.used(MEM_AUDIO_BUFFER) >= m_audio_enc->frame_bytes()) {
+        metric_add(METRIC_INPUT_REFUSED);
+        return SEND_DROPPED;
+    }
+
+    metric_add(METRIC_AUDIO_BYTES_IN, len);
+
+    if (m_audio_enc->feed(buffer, len) < 0)
+        return -1;
+    return m_mem_budget.pressure() ? SEND_SLOW_DOWN : SEND_OK;
+}
+
+int FQRtmpSession::export_clip(uint64_t start_ms, uint64_t end_ms, const std::string &path)
+{
+    if (!m_rtmp_hdlr) {
+        E("Rtmp handler not created");
+        return -1;
+    }
+
+    return m_rtmp_hdlr->export_clip(start_ms, end_ms, path);
+}
+
+int FQRtmpSession::export_last_clip(uint32_t duration_ms, const std::string &path)
+{
+    if (!m_rtmp_hdlr) {
+        E("Rtmp handler not created");
+        return -1;
+    }
+
+    return m_rtmp_hdlr->export_last(duration_ms, path);
+}
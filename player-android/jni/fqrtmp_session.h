@@ -0,0 +1,118 @@
+#ifndef _FQRTMP_SESSION_H_
+#define _FQRTMP_SESSION_H_
+
+#include "audio_encoder.h"
+#include "video_encoder.h"
+#include "libfqrtmp_events.h"
+#include "mem_budget.h"
+#include "thread_ctl.h"
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+class RtmpHandler;
+class LatencyTracker;
+class MetricsDumper;
+
+// What the cmdline of nativeNew() controls
+struct SessionConfig {
+    std::string liveurl;        // Empty to write flvpath only
+    std::string flvpath;
+    uint32_t dvr_size;
+    uint32_t dvr_time;          // In ms
+    uint32_t latency_sei;       // Every latency_sei video frame gets sampled
+    std::string metrics_path;
+    uint32_t metrics_interval;  // In ms
+    std::string trace_path;
+    std::string log_path;
+    std::string crashdump_path;
+    uint64_t mem_cap;           // 0 for no cap
+    std::vector<ThreadConfig> threads;
+    uint32_t thread_stats;      // Sampling interval in ms, 0 for none
+
+    SessionConfig();
+
+    // "--live <url> --flvpath <path> ..."; argv[0] is skipped
+    int parse(int argc, char *const argv[]);
+    int parse(const char *cmdline);
+};
+
+// What send_video() and send_audio() return besides -1
+enum {
+    SEND_OK,
+    SEND_SLOW_DOWN,             // Taken, but buffers are near the memory cap
+    SEND_DROPPED,               // Refused, buffers are at the memory cap
+};
+
+/* The whole push pipeline: encoders, the rtmp/flv output and the dvr
+ * ring, without any JNI. Raw frames go in through send_video() and
+ * send_audio(), encoders may be opened before or after open(), frames
+ * encoded while no session is open are dropped. Logging, metrics and
+ * tracing are process wide, so is one session at a time. */
+class FQRtmpSession {
+public:
+    FQRtmpSession();
+    ~FQRtmpSession();
+
+    // Called from whichever thread the event happens on
+    void set_event_callback(libfqrtmp_event_cb cb, void *opaque);
+
+    int open(const SessionConfig &config);
+    void close();
+
+    int open_video_encoder(const VideoConfig &video_config);
+    void close_video_encoder();
+    // NV21 of the configured size, pts (in ms) as VideoEncoder::feed();
+    // SEND_* or -1
+    int send_video(uint8_t *buffer, int len, int rotation, int64_t pts = -1);
+    // Any thread, see VideoEncoder::request_keyframe(); -1 without one
+    int request_keyframe();
+
+    // Bitrate (when defaulted), frame length and encoder delay are set
+    int open_audio_encoder(AudioConfig &audio_config);
+    void close_audio_encoder();
+    // Interleaved s16le, SEND_* or -1
+    int send_audio(uint8_t *buffer, int len);
+
+    int export_clip(uint64_t start_ms, uint64_t end_ms, const std::string &path);
+    int export_last_clip(uint32_t duration_ms, const std::string &path);
+
+    void send_event(libfqrtmp_event type, int64_t arg1, const char *arg2);
+
+    RtmpHandler *rtmp_handler() const { return m_rtmp_hdlr; }
+    LatencyTracker *latency() const { return m_latency; }
+    MemBudget *mem_budget() { return &m_mem_budget; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FQRtmpSession);
+    static void on_mem_pressure(void *opaque, bool pressure, int64_t used);
+    // Sends MEMORY_PRESSURE if it changed since last sent, from send_video
+    // and send_audio, where the caller holds no lock of ours
+    void report_mem_pressure();
+
+    SessionConfig m_config;
+    libfqrtmp_event_cb m_event_cb;
+    void *m_event_opaque;
+    VideoEncoder *m_video_enc;
+    // Held by request_keyframe(), which comes from other threads too,
+    // while m_video_enc is set or taken
+    xutil::Mutex m_video_mutex;
+    AudioEncoder *m_audio_enc;
+    RtmpHandler *volatile m_rtmp_hdlr;
+    LatencyTracker *m_latency;
+    MetricsDumper *m_metrics_dumper;
+    MemBudget m_mem_budget;
+    // Set by on_mem_pressure(), taken by report_mem_pressure()
+    volatile int m_mem_pressure_changed;
+    // Held by the one thread reporting
+    volatile int m_mem_pressure_reporting;
+    // What was sent last
+    bool m_mem_pressure_reported;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _FQRTMP_SESSION_H_ */
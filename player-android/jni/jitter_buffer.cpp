@@ -2,6 +2,9 @@
 #include <librtmp/rtmp.h>
 
 #include "jitter_buffer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
 #include "xutil.h"
 
 RtmpPacket::RtmpPacket() :
@@ -14,6 +17,12 @@ RtmpPacket::RtmpPacket(int pkttype_, uint8_t *data_, int size_, uint64_t pts_, u
 {
 }
 
+RtmpPacket::RtmpPacket(int pkttype_, MediaBuffer *buf_, uint8_t *data_, int size_,
+                       uint64_t pts_, uint64_t dts_) :
+    Packet(buf_, data_, size_, pts_, dts_), pkttype(pkttype_)
+{
+}
+
 RtmpPacket::~RtmpPacket()
 {
 }
@@ -26,12 +35,18 @@ int RtmpPacket::clone(RtmpPacket *pkt, bool reuse_buffer)
     *this = *pkt;
 
     if (!reuse_buffer) {
-        data = (uint8_t *) malloc(sizeof(uint8_t) * pkt->size);
-        if (!data)
-            return -1;
-        memcpy(data, pkt->data, pkt->size);
+        if (buf) {
+            // Payload is immutable once shared, just take a reference
+            media_buffer_ref(buf);
+        } else {
+            data = (uint8_t *) malloc(sizeof(uint8_t) * pkt->size);
+            if (!data)
+                return -1;
+            memcpy(data, pkt->data, pkt->size);
+        }
     } else {
         pkt->data = NULL;
+        pkt->buf = NULL;
     }
     return 0;
 }
@@ -39,6 +54,8 @@ int RtmpPacket::clone(RtmpPacket *pkt, bool reuse_buffer)
 JitterBuffer::JitterBuffer(int max_interleave_delta) :
     m_packet_buffer(NULL), m_packet_buffer_end(NULL),
     m_max_interleave_delta(max_interleave_delta),
+    m_depth(0),
+    m_mem_budget(NULL),
     m_quit(false)
 {
     memset(m_last_pktl, 0, sizeof(m_last_pktl));
@@ -50,6 +67,7 @@ JitterBuffer::~JitterBuffer()
     PacketList *p = m_packet_buffer, *q;
     while (p) {
         q = p->next;
+        account(p, -1);
         SAFE_DELETE(p);
         p = q;
     }
@@ -65,7 +83,7 @@ int JitterBuffer::add_packet(RtmpPacket *pkt)
             return ret;
         }
         if (m_pc.cb &&
-            !m_pc.cb(m_pc.opaque, opkt->pkttype, opkt->pts, opkt->data, opkt->size)) {
+            !m_pc.cb(m_pc.opaque, opkt.get())) {
             break;
         }
     }
@@ -86,6 +104,8 @@ int JitterBuffer::interleave_packet_per_pts(RtmpPacket *out, RtmpPacket *pkt)
     unsigned i;
     int flush = 0;
 
+    TRACE_SCOPE("JitterBuffer::interleave");
+
     if (pkt &&
         (ret = interleave_add_packet(pkt, interleave_compare_pts)) < 0) {
         return ret;
@@ -121,12 +141,15 @@ int JitterBuffer::interleave_packet_per_pts(RtmpPacket *out, RtmpPacket *pkt)
             W("Delay between the first packet and last packet in the "
               "muxing queue is %llu > %llu: forcing output",
               (long long unsigned) delta_pts, (long long unsigned) m_max_interleave_delta);
+            metric_add(METRIC_INTERLEAVE_FORCED);
+            flight_record(FLIGHT_INTERLEAVE_FORCED, delta_pts);
             flush = 1;
         }
     }
 
     if (stream_count && flush) {
         pktl = m_packet_buffer;
+        account(pktl, -1);
         out->clone(&pktl->pkt, true);
 
         m_packet_buffer = pktl->next;
@@ -135,6 +158,8 @@ int JitterBuffer::interleave_packet_per_pts(RtmpPacket *out, RtmpPacket *pkt)
 
         if (locate_last(out->pkttype) == pktl)
             locate_last(out->pkttype) = NULL;
+        metric_observe_since(METRIC_INTERLEAVE_WAIT_US, pktl->enqueue_us);
+        metric_set(METRIC_JITTER_DEPTH, --m_depth);
         SAFE_DELETE(pktl);
         return 1;
     }
@@ -162,6 +187,9 @@ int JitterBuffer::interleave_add_packet(RtmpPacket *pkt,
         return -1;
     }
     this_pktl->pkt.clone(pkt, true);
+    this_pktl->enqueue_us = xutil::get_time_now_us();
+    account(this_pktl, 1);
+    metric_set(METRIC_JITTER_DEPTH, ++m_depth);
 
     if (locate_last(pkt->pkttype)) {
         next_point = &(locate_last(pkt->pkttype)->next);
@@ -195,9 +223,20 @@ next_non_null:
 PacketList *&JitterBuffer::locate_last(int pkttype)
 {
     assert(pkttype == RTMP_PACKET_TYPE_VIDEO ||
-           pkttype == RTMP_PACKET_TYPE_AUDIO);
+           pkttype == RTMP_PACKET_TYPE_AUDIO ||
+           pkttype == RTMP_PACKET_TYPE_INFO);
 
-    if (pkttype == RTMP_PACKET_TYPE_VIDEO)
+    // onMetaData is queued in line with the video it describes
+    if (pkttype == RTMP_PACKET_TYPE_VIDEO ||
+        pkttype == RTMP_PACKET_TYPE_INFO)
         return m_last_pktl[0];
     return m_last_pktl[1];
 }
+
+void JitterBuffer::account(const PacketList *pktl, int sign)
+{
+    if (m_mem_budget) {
+        m_mem_budget->add(MEM_JITTER,
+                          sign * (int64_t) (sizeof(PacketList) + pktl->pkt.size));
+    }
+}
@@ -2,6 +2,7 @@
 #define _JITTER_BUFFER_H_
 
 #include "common.h"
+#include "mem_budget.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,6 +13,8 @@ struct RtmpPacket : public Packet {
 
     RtmpPacket();
     RtmpPacket(int pkttype, uint8_t *data_, int size_, uint64_t pts_, uint64_t dts_);
+    RtmpPacket(int pkttype, MediaBuffer *buf_, uint8_t *data_, int size_,
+               uint64_t pts_, uint64_t dts_);
     virtual ~RtmpPacket();
 
     int clone(RtmpPacket *pkt, bool reuse_buffer = false);
@@ -20,12 +23,15 @@ struct RtmpPacket : public Packet {
 struct PacketList {
     RtmpPacket pkt;
     PacketList *next;
+    uint64_t enqueue_us;
+
+    static void *operator new(size_t size) { return xpool_alloc(size); }
+    static void operator delete(void *ptr) { xpool_free(ptr); }
 };
 
 struct PacketCallback {
     void *opaque;
-    bool (*cb) (void *opaque, int pkttype,
-                uint32_t pts, const byte *buf, uint32_t pktsize);
+    bool (*cb) (void *opaque, RtmpPacket *pkt);
 };
 
 class JitterBuffer {
@@ -36,6 +42,8 @@ public:
     int add_packet(RtmpPacket *pkt);
 
     int set_packet_callback(PacketCallback pc);
+    // Where the held packets are accounted, none by default
+    void set_mem_budget(MemBudget *mem_budget) { m_mem_budget = mem_budget; }
 
 private:
     int interleave_packet_per_pts(RtmpPacket *out, RtmpPacket *pkt);
@@ -44,6 +52,7 @@ private:
     static int interleave_compare_pts(JitterBuffer *s,
                                       RtmpPacket *next, RtmpPacket *pkt);
     PacketList *&locate_last(int pkttype);
+    void account(const PacketList *pktl, int sign);
 
 private:
     PacketList *m_packet_buffer;
@@ -51,7 +60,9 @@ private:
     uint64_t m_max_interleave_delta;
     enum { STREAM_NUM = 2 };
     PacketList *m_last_pktl[STREAM_NUM];
+    int m_depth;
     PacketCallback m_pc;
+    MemBudget *m_mem_budget;
     volatile bool m_quit;
 };
 
@@ -0,0 +1,52 @@
+#ifndef _JNI_UTIL_H_
+#define _JNI_UTIL_H_
+
+#include <jni.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+class FQRtmpSession;
+
+struct LibFQRtmp {
+    jclass clazz;
+    jobject weak_thiz;
+    struct {
+        jclass clazz;
+    } IllegalArgumentException;
+    struct {
+        jclass clazz;
+    } String;
+    jmethodID onNativeCrashID;
+    jmethodID dispatchEventFromNativeID;
+    // Whole pipeline, lives as long as the library is loaded
+    FQRtmpSession *session;
+};
+
+extern struct LibFQRtmp gfq;
+
+// Attached (and detached at exit) on demand
+JNIEnv *jni_get_env(const char *name);
+
+jstring jnu_new_string(const char *str);
+
+static inline void throw_IllegalArgumentException(JNIEnv *env, const char *error)
+{
+    env->ThrowNew(gfq.IllegalArgumentException.clazz, error);
+}
+
+jvalue jnu_get_field_by_name(jboolean *has_exception, jobject obj,
+                             const char *name, const char *signature);
+void jnu_set_field_by_name(jboolean *hasException, jobject obj,
+                           const char *name, const char *signature, ...);
+jvalue jnu_call_method_by_name(jboolean *has_exception, jobject obj,
+                               const char *name, const char *signature, ...);
+jvalue jnu_call_method_by_name_v(jboolean *has_exception, jobject obj,
+                                 const char *name, const char *signature, va_list args);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _JNI_UTIL_H_ */
@@ -0,0 +1,203 @@
+#include "latency_tracker.h"
+#include "xmedia.h"
+
+//#define XDEBUG
+
+using namespace xutil;
+
+// Random, only has to differ from other encoders' (e.g. x264's own)
+const byte latency_sei_uuid[16] = {
+    0x66, 0x71, 0x72, 0x74, 0x6d, 0x70, 0x4c, 0x41,
+    0x8e, 0x3b, 0x0f, 0x52, 0xd1, 0x9a, 0x27, 0xc4
+};
+
+static uint32_t get_be32(const byte *p)
+{
+    return ((uint32_t) p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+int latency_sei_write(const LatencySEI &sei, byte *buf, uint32_t len)
+{
+    if (len < LATENCY_SEI_PAYLOAD_SIZE)
+        return -1;
+
+    byte *p = buf;
+    memcpy(p, latency_sei_uuid, sizeof(latency_sei_uuid));
+    p += sizeof(latency_sei_uuid);
+    *p++ = LATENCY_SEI_VERSION;
+    p = put_be16(p, sei.interval);
+    p = put_be32(p, sei.seq);
+    p = put_be64(p, sei.capture_us);
+    p = put_be32(p, sei.report_seq);
+    for (int i = 0; i < STAGE_NUM - 1; ++i) {
+        p = put_be32(p, sei.report[i]);
+    }
+    return p - buf;
+}
+
+int latency_sei_read(const byte *buf, uint32_t len, LatencySEI &sei)
+{
+    if (len < LATENCY_SEI_PAYLOAD_SIZE ||
+        memcmp(buf, latency_sei_uuid, sizeof(latency_sei_uuid)))
+        return -1;
+
+    const byte *p = buf + sizeof(latency_sei_uuid);
+    if (*p++ != LATENCY_SEI_VERSION)
+        return -1;
+
+    sei.interval = (p[0]<<8) | p[1];
+    p += 2;
+    sei.seq = get_be32(p);
+    p += 4;
+    sei.capture_us = ((uint64_t) get_be32(p)<<32) | get_be32(p + 4);
+    p += 8;
+    sei.report_seq = get_be32(p);
+    p += 4;
+    for (int i = 0; i < STAGE_NUM - 1; ++i, p += 4) {
+        sei.report[i] = get_be32(p);
+    }
+    return 0;
+}
+
+// Walk the sei messages of one sei rbsp
+static void parse_sei(const byte *rbsp, uint32_t len, std::vector<LatencySEI> &seis)
+{
+    const byte *p = rbsp, *end = rbsp + len;
+
+    while (end - p > 2) {
+        uint32_t typ = 0, size = 0;
+
+        while (p < end && *p == 0xFF) typ += *p++;
+        if (p < end) typ += *p++;
+        while (p < end && *p == 0xFF) size += *p++;
+        if (p < end) size += *p++;
+
+        if (size > (uint32_t) (end - p))
+            break;
+
+        LatencySEI sei;
+        if (typ == 5 /*user_data_unregistered*/ &&
+            !latency_sei_read(p, size, sei)) {
+            seis.push_back(sei);
+        }
+        p += size;
+    }
+}
+
+int latency_sei_parse_video_tag(const byte *dat, uint32_t len, int &length_size,
+                                std::vector<LatencySEI> &seis)
+{
+    if (len < 5 || (dat[0]&0x0F) != 7 /*AVC*/)
+        return 0;
+
+    if (dat[1] == 0x00) {
+        // avc_dcr, lengthSizeMinusOne lies in its fifth byte
+        if (len >= 5 + 5) {
+            length_size = (dat[5 + 4]&0x03) + 1;
+        }
+        return 0;
+    }
+    if (dat[1] != 0x01)
+        return 0;
+
+    size_t found = seis.size();
+    const byte *p = dat + 5, *end = dat + len;
+    while (end - p > length_size) {
+        uint32_t nalu_len = 0;
+        for (int i = 0; i < length_size; ++i) {
+            nalu_len = (nalu_len<<8) | *p++;
+        }
+        if (nalu_len > (uint32_t) (end - p))
+            break;
+
+        if (nalu_len > 1 && (p[0]&0x1F) == 6 /*SEI*/) {
+            std::vector<byte> rbsp(nalu_len);
+            uint32_t rbsp_len = xmedia::h264_nal_to_rbsp(p + 1, nalu_len - 1, &rbsp[0]);
+            parse_sei(&rbsp[0], rbsp_len, seis);
+        }
+        p += nalu_len;
+    }
+    return seis.size() - found;
+}
+
+/////////////////////////////////////////////////////////////
+
+LatencyTracker::LatencyTracker(uint32_t interval) :
+    m_interval(MAX(interval, 1u)),
+    m_frame_count(0),
+    m_last_sent(0)
+{
+    memset(m_ring, 0, sizeof(m_ring));
+}
+
+void LatencyTracker::set_interval(uint32_t interval)
+{
+    m_interval = MAX(interval, 1u);
+}
+
+uint32_t LatencyTracker::begin_frame(uint64_t capture_us)
+{
+    AutoLock _l(m_mutex);
+
+    // Sequence counts every frame so gaps show dropped ones
+    uint32_t seq = ++m_frame_count;
+    if ((seq - 1) % m_interval)
+        return 0;
+
+    FrameTiming &ft = m_ring[seq % RING_SIZE];
+    memset(&ft, 0, sizeof(ft));
+    ft.seq = seq;
+    ft.ts[STAGE_CAPTURE] = capture_us;
+    return seq;
+}
+
+void LatencyTracker::mark(uint32_t seq, LatencyStage stage, uint64_t us)
+{
+    if (!seq)
+        return;
+
+    AutoLock _l(m_mutex);
+
+    FrameTiming &ft = m_ring[seq % RING_SIZE];
+    if (ft.seq != seq)
+        return; // Overwritten, too late
+
+    ft.ts[stage] = us ? us : get_time_now_us();
+    if (stage == STAGE_SENT) {
+        m_last_sent = seq;
+
+#ifdef XDEBUG
+        D("Frame #%u latency: convert %lluus, encode %lluus, interleave %lluus, send %lluus",
+          seq,
+          (long long unsigned) (ft.ts[STAGE_CONVERTED] - ft.ts[STAGE_CAPTURE]),
+          (long long unsigned) (ft.ts[STAGE_ENCODED] - ft.ts[STAGE_CONVERTED]),
+          (long long unsigned) (ft.ts[STAGE_INTERLEAVED] - ft.ts[STAGE_ENCODED]),
+          (long long unsigned) (ft.ts[STAGE_SENT] - ft.ts[STAGE_INTERLEAVED]));
+#endif
+    }
+}
+
+void LatencyTracker::make_sei(uint32_t seq, LatencySEI &sei) const
+{
+    AutoLock _l(m_mutex);
+
+    const FrameTiming &ft = m_ring[seq % RING_SIZE];
+    sei.seq = seq;
+    sei.interval = m_interval;
+    sei.capture_us = ft.seq == seq ? ft.ts[STAGE_CAPTURE] : 0;
+
+    const FrameTiming &sent = m_ring[m_last_sent % RING_SIZE];
+    if (m_last_sent && sent.seq == m_last_sent) {
+        sei.report_seq = m_last_sent;
+        for (int i = 0; i < STAGE_NUM - 1; ++i) {
+            uint64_t ts = sent.ts[i + 1];
+            sei.report[i] = ts >= sent.ts[STAGE_CAPTURE] ?
+                (uint32_t) (ts - sent.ts[STAGE_CAPTURE]) : LATENCY_SEI_NO_REPORT;
+        }
+    } else {
+        sei.report_seq = 0;
+        for (int i = 0; i < STAGE_NUM - 1; ++i) {
+            sei.report[i] = LATENCY_SEI_NO_REPORT;
+        }
+    }
+}
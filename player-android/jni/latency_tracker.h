@@ -0,0 +1,79 @@
+#ifndef _LATENCY_TRACKER_H_
+#define _LATENCY_TRACKER_H_
+
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum LatencyStage {
+    STAGE_CAPTURE,      // Frame handed in by java
+    STAGE_CONVERTED,    // Color converted / rotated
+    STAGE_ENCODED,      // Out of x264
+    STAGE_INTERLEAVED,  // Out of the jitter buffer
+    STAGE_SENT,         // RTMP_SendPacket returned
+    STAGE_NUM
+};
+
+struct FrameTiming {
+    uint32_t seq;
+    uint64_t ts[STAGE_NUM]; // Wall clock in us, 0 if not reached yet
+};
+
+// What a latency sei carries: the sequence and capture time of its own
+// frame, plus the stage timings of the latest frame fully sent by then
+struct LatencySEI {
+    uint32_t seq;
+    uint16_t interval;
+    uint64_t capture_us;
+    uint32_t report_seq;    // 0 if no report
+    // Delay of each stage after capture in us, ~0 if not reached
+    uint32_t report[STAGE_NUM - 1];
+};
+
+// user_data_unregistered payload: uuid(16) version(1) interval(2) seq(4)
+// capture_us(8) report_seq(4) report(4*4), all big-endian
+#define LATENCY_SEI_VERSION         1
+#define LATENCY_SEI_PAYLOAD_SIZE    (16 + 1 + 2 + 4 + 8 + 4 + 4*(STAGE_NUM - 1))
+#define LATENCY_SEI_NO_REPORT       0xFFFFFFFF
+
+extern const byte latency_sei_uuid[16];
+
+int latency_sei_write(const LatencySEI &sei, byte *buf, uint32_t len);
+int latency_sei_read(const byte *buf, uint32_t len, LatencySEI &sei);
+// Appends the latency seis of an flv video tag (or rtmp video message
+// body), returns how many; length_size is updated by the avc_dcr
+int latency_sei_parse_video_tag(const byte *dat, uint32_t len, int &length_size,
+                                std::vector<LatencySEI> &seis);
+
+/* Keeps the per-stage timestamps of the sampled frames (every interval
+ * frame), so that the encoder can embed them in later frames' sei. */
+class LatencyTracker {
+public:
+    LatencyTracker(uint32_t interval);
+
+    void set_interval(uint32_t interval);
+    uint32_t get_interval() const { return m_interval; }
+
+    // Returns the sequence number of the frame if it's sampled, else 0
+    uint32_t begin_frame(uint64_t capture_us);
+    void mark(uint32_t seq, LatencyStage stage, uint64_t us = 0 /*now*/);
+
+    // Fill the sei of frame seq
+    void make_sei(uint32_t seq, LatencySEI &sei) const;
+
+private:
+    enum { RING_SIZE = 256 };
+
+    FrameTiming m_ring[RING_SIZE];
+    volatile uint32_t m_interval;
+    uint32_t m_frame_count;
+    uint32_t m_last_sent;
+    mutable xutil::Mutex m_mutex;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _LATENCY_TRACKER_H_ */
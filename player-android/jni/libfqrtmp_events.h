@@ -1,7 +1,7 @@
 #ifndef _LIBFQRTMP_EVENTS_H_
 #define _LIBFQRTMP_EVENTS_H_
 
-#include <jni.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,9 +11,13 @@ typedef enum {
     OPENING,
     CONNECTED,
     ENCOUNTERED_ERROR,
+    CLIP_EXPORTED,
+    MEMORY_PRESSURE,        // arg1: 1 on, 0 off; from within a send_*()
 } libfqrtmp_event;
 
-void libfqrtmp_event_send(libfqrtmp_event type, jlong arg0, jstring arg2);
+// How a session reports them, see FQRtmpSession::set_event_callback()
+typedef void (*libfqrtmp_event_cb)(void *opaque, libfqrtmp_event type,
+                                   int64_t arg1, const char *arg2);
 
 #ifdef __cplusplus
 }
@@ -3,11 +3,10 @@
 #include <pthread.h>
 
 #include "native_crash_handler.h"
-#include "libfqrtmp_events.h"
-#include "rtmp_handler.h"
-#include "audio_encoder.h"
-#include "video_encoder.h"
-#include "common.h"
+#include "fqrtmp_session.h"
+#include "metrics.h"
+#include "trace.h"
+#include "jni_util.h"
 #include "config.h"
 #include "xutil.h"
 
@@ -24,6 +23,18 @@ static pthread_key_t jni_env_key;
 static jstring version(JNIEnv *, jobject);
 static void nativeNew(JNIEnv *, jobject, jstring cmdline);
 static void nativeRelease(JNIEnv *, jobject);
+static jint sendRawAudio(JNIEnv *, jobject, jbyteArray byte_arr, jint len);
+static jint sendRawVideo(JNIEnv *, jobject, jbyteArray byte_arr, jint len, jint rotation);
+static jint openAudioEncoder(JNIEnv *, jobject, jobject audio_config);
+static jint closeAudioEncoder(JNIEnv *, jobject);
+static jint openVideoEncoder(JNIEnv *, jobject, jobject video_config);
+static jint closeVideoEncoder(JNIEnv *, jobject);
+static jint requestKeyframe(JNIEnv *, jobject);
+static jint exportClip(JNIEnv *, jobject, jlong start_ms, jlong end_ms, jstring path);
+static jint exportLastClip(JNIEnv *, jobject, jint duration_ms, jstring path);
+static jstring getMetrics(JNIEnv *, jobject);
+static jint startTrace(JNIEnv *, jobject);
+static jint stopTrace(JNIEnv *, jobject, jstring path);
 
 static JNINativeMethod method[] = {
     {"version", "()Ljava/lang/String;", (void *) version},
@@ -35,6 +46,12 @@ static JNINativeMethod method[] = {
     {"closeAudioEncoder", "()I", (void *) closeAudioEncoder},
     {"openVideoEncoder", "(Lcom/dxyh/libfqrtmp/LibFQRtmp$VideoConfig;)I", (void *) openVideoEncoder},
     {"closeVideoEncoder", "()I", (void *) closeVideoEncoder},
+    {"requestKeyframe", "()I", (void *) requestKeyframe},
+    {"exportClip", "(JJLjava/lang/String;)I", (void *) exportClip},
+    {"exportLastClip", "(ILjava/lang/String;)I", (void *) exportLastClip},
+    {"getMetrics", "()Ljava/lang/String;", (void *) getMetrics},
+    {"startTrace", "()I", (void *) startTrace},
+    {"stopTrace", "(Ljava/lang/String;)I", (void *) stopTrace},
 };
 
 static void jni_detach_thread(void *data)
@@ -42,6 +59,23 @@ static void jni_detach_thread(void *data)
     cached_jvm->DetachCurrentThread();
 }
 
+// Session events, up to LibFQRtmp.dispatchEventFromNative()
+static void dispatch_event(void *opaque, libfqrtmp_event type,
+                           int64_t arg1, const char *arg2)
+{
+    JNIEnv *env = NULL;
+
+    if (!(env = jni_get_env(THREAD_NAME)))
+       return;
+
+    if (!env->IsSameObject(gfq.weak_thiz, NULL)) {
+        jstring jarg2 = jnu_new_string(arg2);
+        env->CallVoidMethod(gfq.weak_thiz,
+                            gfq.dispatchEventFromNativeID, (jint) type, (jlong) arg1, jarg2);
+        env->DeleteLocalRef(jarg2);
+    }
+}
+
 JNIEnv *jni_get_env(const char *name)
 {
     JNIEnv *env;
@@ -124,6 +158,9 @@ JNI_OnLoad(JavaVM *jvm, void *reserved)
 
     env->RegisterNatives(gfq.clazz, method, NELEM(method));
 
+    gfq.session = new FQRtmpSession;
+    gfq.session->set_event_callback(dispatch_event, NULL);
+
     init_native_crash_handler();
 
     I("JNI interface loaded.");
@@ -144,6 +181,10 @@ JNI_OnUnload(JavaVM *jvm, void *reserved)
     env->DeleteGlobalRef(gfq.String.clazz);
     env->DeleteGlobalRef(gfq.IllegalArgumentException.clazz);
 
+    SAFE_DELETE(gfq.session);
+
+    xlog_flush();
+
     pthread_key_delete(jni_env_key);
 }
 
@@ -152,68 +193,10 @@ static jstring version(JNIEnv *env, jobject thiz)
     return jnu_new_string(VERSION_MESSAGE);
 }
 
-static std::string liveurl;
-static std::string flvpath;
-
-static int parse_arg(const char *str)
-{
-    int n = 3, argc = 0;
-    const char **argv =
-        (const char **) malloc(n * sizeof(const char *));
-    char *cmdline = strdup(str);
-    const char *delim = " ";
-    const char *p = strtok(cmdline, delim);
-    int retval = 0;
-
-    argv[argc++] = "libfqrtmp";
-    while (p) {
-        if (argc == n)
-           argv = (const char **) realloc(argv, (n+=2)*sizeof(const char *));
-        argv[argc++] = p;
-        p = strtok(NULL, delim);
-    }
-
-    BEGIN
-    struct option longopts[] = {
-        {"live",    required_argument, NULL, 'L'},
-        {"flvpath", required_argument, NULL, 'f'},
-        {0, 0, 0, 0}
-    };
-    int ch;
-
-    optind = 0;
-    while ((ch = getopt_long(argc, (char * const *) argv,
-                             ":L:f:W;", longopts, NULL)) != -1) {
-        switch (ch) {
-        case 'L':
-            liveurl = optarg;
-            break;
-
-        case 'f':
-            flvpath = optarg;
-            break;
-
-        case 0:
-            break;
-
-        case '?':
-        default:
-            E("Unknown option: %c", optopt);
-            retval = -1;
-            goto out;
-        }
-    }
-    END
-
-out:
-    SAFE_FREE(argv);
-    SAFE_FREE(cmdline);
-    return retval;
-}
-
 static void nativeNew(JNIEnv *env, jobject thiz, jstring cmdline)
 {
     const char *str;
+    SessionConfig config;
 
     str = env->GetStringUTFChars(cmdline, NULL);
     if (!str) {
@@ -221,7 +204,7 @@ static void nativeNew(JNIEnv *env, jobject thiz, jstring cmdline)
         return;
     }
 
-    if (parse_arg(str) < 0) {
+    if (config.parse(str) < 0) {
         E("parse_arg failed");
         goto out;
     }
@@ -232,16 +215,7 @@ static void nativeNew(JNIEnv *env, jobject thiz, jstring cmdline)
         goto out;
     }
 
-    libfqrtmp_event_send(OPENING, 0, jnu_new_string(""));
-
-    gfq.rtmp_hdlr = new RtmpHandler(flvpath);
-    if (gfq.rtmp_hdlr->connect(liveurl) < 0) {
-        libfqrtmp_event_send(ENCOUNTERED_ERROR,
-                             -1001, jnu_new_string("rtmp_connect failed"));
-        goto out;
-    }
-
-    libfqrtmp_event_send(CONNECTED, 0, jnu_new_string(""));
+    gfq.session->open(config);
 
 out:
     env->ReleaseStringUTFChars(cmdline, str);
@@ -249,9 +223,282 @@ out:
 
 static void nativeRelease(JNIEnv *env, jobject thiz)
 {
-    SAFE_DELETE(gfq.rtmp_hdlr);
+    gfq.session->close();
 
     if (!env->IsSameObject(gfq.weak_thiz, NULL)) {
         env->DeleteWeakGlobalRef(gfq.weak_thiz);
     }
 }
+
+static jint exportClip(JNIEnv *env, jobject thiz, jlong start_ms, jlong end_ms, jstring path)
+{
+    const char *str;
+    int ret;
+
+    str = env->GetStringUTFChars(path, NULL);
+    if (!str) {
+        throw_IllegalArgumentException(env, "path invalid");
+        return -1;
+    }
+
+    ret = gfq.session->export_clip(start_ms, end_ms, str);
+
+    env->ReleaseStringUTFChars(path, str);
+    return ret;
+}
+
+static jint exportLastClip(JNIEnv *env, jobject thiz, jint duration_ms, jstring path)
+{
+    const char *str;
+    int ret;
+
+    str = env->GetStringUTFChars(path, NULL);
+    if (!str) {
+        throw_IllegalArgumentException(env, "path invalid");
+        return -1;
+    }
+
+    ret = gfq.session->export_last_clip(duration_ms, str);
+
+    env->ReleaseStringUTFChars(path, str);
+    return ret;
+}
+
+static jstring getMetrics(JNIEnv *env, jobject thiz)
+{
+    return jnu_new_string(metrics_snapshot().c_str());
+}
+
+static jint startTrace(JNIEnv *env, jobject thiz)
+{
+    return trace_start();
+}
+
+static jint stopTrace(JNIEnv *env, jobject thiz, jstring path)
+{
+    const char *str;
+    int ret;
+
+    str = env->GetStringUTFChars(path, NULL);
+    if (!str) {
+        throw_IllegalArgumentException(env, "path invalid");
+        return -1;
+    }
+
+    ret = trace_stop(str);
+
+    env->ReleaseStringUTFChars(path, str);
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////
+
+// LibFQRtmp.VideoConfig, through its getters
+static int load_video_config(JNIEnv *env, jobject video_config, VideoConfig &config)
+{
+    jvalue jval;
+
+#define CALL_METHOD(obj, name, signature) do { \
+    jboolean has_exception = JNI_FALSE; \
+    jval = jnu_call_method_by_name(&has_exception, obj, name, signature); \
+    if (has_exception) { \
+        E("Exception with %s()", name); \
+        return -1; \
+    } \
+} while (0)
+
+#define INIT_STRING_MEMBER(member, jstr) do { \
+    const char *str = env->GetStringUTFChars((jstring) jstr, NULL); \
+    member = str ? str : ""; \
+    env->ReleaseStringUTFChars((jstring) jstr, str); \
+} while (0)
+
+    CALL_METHOD(video_config, "getPreset", "()Ljava/lang/String;");
+    INIT_STRING_MEMBER(config.preset, jval.l);
+
+    CALL_METHOD(video_config, "getTune", "()Ljava/lang/String;");
+    INIT_STRING_MEMBER(config.tune, jval.l);
+
+    CALL_METHOD(video_config, "getProfile", "()Ljava/lang/String;");
+    INIT_STRING_MEMBER(config.profile, jval.l);
+
+    CALL_METHOD(video_config, "getLevelIDC", "()I");
+    config.level_idc = jval.i;
+
+    CALL_METHOD(video_config, "getInputCSP", "()I");
+    config.input_csp = jval.i;
+
+    CALL_METHOD(video_config, "getBitrate", "()I");
+    config.bitrate = jval.i;
+
+    CALL_METHOD(video_config, "getWidth", "()I");
+    config.width = jval.i;
+
+    CALL_METHOD(video_config, "getHeight", "()I");
+    config.height = jval.i;
+
+#define INIT_RATIONAL_MEMBER(rational, obj) do { \
+    jboolean has_exception = JNI_FALSE; \
+    jvalue tmpval = jnu_get_field_by_name(&has_exception, obj, "num", "I"); \
+    if (has_exception) { \
+        E("Exception with Rational"); \
+        return -1; \
+    } \
+    rational.num = tmpval.i; \
+    tmpval = jnu_get_field_by_name(&has_exception, obj, "den", "I"); \
+    if (has_exception) { \
+        E("Exception with Rational"); \
+        return -1; \
+    } \
+    rational.den = tmpval.i; \
+} while (0)
+
+    CALL_METHOD(video_config, "getFPS", "()Lcom/dxyh/libfqrtmp/LibFQRtmp$Rational;");
+    INIT_RATIONAL_MEMBER(config.fps, jval.l);
+
+    CALL_METHOD(video_config, "getOrigFPS", "()Lcom/dxyh/libfqrtmp/LibFQRtmp$Rational;");
+    INIT_RATIONAL_MEMBER(config.orig_fps, jval.l);
+
+    CALL_METHOD(video_config, "getIFrameInterval", "()I");
+    config.i_frame_interval = jval.i;
+
+    CALL_METHOD(video_config, "getRepeatHeaders", "()Z");
+    config.repeat_headers = jval.z;
+
+    CALL_METHOD(video_config, "getBFrames", "()I");
+    config.b_frames = jval.i;
+
+    CALL_METHOD(video_config, "getDeblockingFilter", "()Z");
+    config.deblocking_filter = jval.z;
+
+    CALL_METHOD(video_config, "getSliceMaxSize", "()I");
+    config.slice_max_size = jval.i;
+
+    CALL_METHOD(video_config, "getIntraRefresh", "()Z");
+    config.intra_refresh = jval.z;
+
+    CALL_METHOD(video_config, "getAdaptiveEffort", "()Z");
+    config.adaptive_effort = jval.z;
+
+    return 0;
+
+#undef CALL_METHOD
+#undef INIT_STRING_MEMBER
+#undef INIT_RATIONAL_MEMBER
+}
+
+static jint openVideoEncoder(JNIEnv *env, jobject thiz, jobject video_config)
+{
+    VideoConfig config;
+
+    if (load_video_config(env, video_config, config) < 0) {
+        E("Video encoder load_config failed");
+        return -1;
+    }
+
+    return gfq.session->open_video_encoder(config);
+}
+
+static jint closeVideoEncoder(JNIEnv *env, jobject thiz)
+{
+    gfq.session->close_video_encoder();
+    return 0;
+}
+
+static jint requestKeyframe(JNIEnv *env, jobject thiz)
+{
+    return gfq.session->request_keyframe();
+}
+
+static jint sendRawVideo(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len, jint rotation)
+{
+    uint8_t *buffer;
+    jboolean is_copy;
+    int ret;
+
+    buffer = (uint8_t *) env->GetByteArrayElements(byte_arr, &is_copy);
+    if (!buffer) {
+        E("Get video buffer failed");
+        return -1;
+    }
+
+    ret = gfq.session->send_video(buffer, len, rotation);
+
+    env->ReleaseByteArrayElements(byte_arr, (jbyte *) buffer, JNI_ABORT);
+    return ret;
+}
+
+// LibFQRtmp.AudioConfig, what the encoder settled on is written back
+static jint openAudioEncoder(JNIEnv *env, jobject thiz, jobject audio_config)
+{
+    AudioConfig config;
+    jvalue jval;
+
+#define CALL_METHOD(obj, name, signature) do { \
+    jboolean has_exception = JNI_FALSE; \
+    jval = jnu_call_method_by_name(&has_exception, obj, name, signature); \
+    if (has_exception) { \
+        E("Exception with %s()", name); \
+        return -1; \
+    } \
+} while (0)
+
+#define SET_FIELD(obj, name, signature, val) do { \
+    jboolean has_exception = JNI_FALSE; \
+    jnu_set_field_by_name(&has_exception, obj, name, signature, val); \
+    if (has_exception) { \
+        E("Exception occurred when set field \"%s\"", name); \
+        return -1; \
+    } \
+} while (0)
+
+    CALL_METHOD(audio_config, "getChannelCount", "()I");
+    config.channels = jval.i;
+
+    CALL_METHOD(audio_config, "getAudioObjectType", "()I");
+    config.aot = jval.i;
+
+    CALL_METHOD(audio_config, "getSamplerate", "()I");
+    config.samplerate = jval.i;
+
+    CALL_METHOD(audio_config, "getBitsPerSample", "()I");
+    config.bits_per_sample = jval.i;
+
+    CALL_METHOD(audio_config, "getBitrate", "()I");
+    config.bitrate = jval.i;
+
+    if (gfq.session->open_audio_encoder(config) < 0)
+        return -1;
+
+    SET_FIELD(audio_config, "mBitrate", "I", config.bitrate);
+    SET_FIELD(audio_config, "mFrameLength", "I", config.frame_length);
+    SET_FIELD(audio_config, "mEncoderDelay", "I", config.encoder_delay);
+    return 0;
+
+#undef CALL_METHOD
+#undef SET_FIELD
+}
+
+static jint closeAudioEncoder(JNIEnv *env, jobject thiz)
+{
+    gfq.session->close_audio_encoder();
+    return 0;
+}
+
+static jint sendRawAudio(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len)
+{
+    uint8_t *buffer;
+    jboolean is_copy;
+    int ret;
+
+    buffer = (uint8_t *) env->GetByteArrayElements(byte_arr, &is_copy);
+    if (!buffer) {
+        E("Get audio buffer failed");
+        return -1;
+    }
+
+    ret = gfq.session->send_audio(buffer, len);
+
+    env->ReleaseByteArrayElements(byte_arr, (jbyte *) buffer, JNI_ABORT);
+    return ret;
+}
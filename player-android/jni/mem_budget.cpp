@@ -0,0 +1,46 @@
+#include "mem_budget.h"
+#include "metrics.h"
+#include "flight_recorder.h"
+
+MemBudget::MemBudget() :
+    m_used(0), m_cap(0), m_pressure(0), m_cb(NULL), m_opaque(NULL)
+{
+    memset((void *) m_users, 0, sizeof(m_users));
+}
+
+void MemBudget::set_pressure_callback(MemPressureCallback cb, void *opaque)
+{
+    m_cb = cb;
+    m_opaque = opaque;
+}
+
+void MemBudget::add(MemUser user, int64_t bytes)
+{
+    __sync_add_and_fetch(&m_users[user], bytes);
+    int64_t used = __sync_add_and_fetch(&m_used, bytes);
+    metric_set(METRIC_MEM_USED, (int32_t) MIN(used, (int64_t) 0x7FFFFFFF));
+
+    if (!m_cap)
+        return;
+
+    // Only the thread that flips the state reports it
+    if (used >= (int64_t) (m_cap / 100 * MEM_HIGH_PERCENT)) {
+        if (__sync_bool_compare_and_swap(&m_pressure, 0, 1)) {
+            W("Memory pressure: %lld of %llu bytes held",
+              (long long) used, (long long unsigned) m_cap);
+            flight_record(FLIGHT_MEM_PRESSURE, 1, used);
+            if (m_cb) {
+                m_cb(m_opaque, true, used);
+            }
+        }
+    } else if (used <= (int64_t) (m_cap / 100 * MEM_LOW_PERCENT)) {
+        if (__sync_bool_compare_and_swap(&m_pressure, 1, 0)) {
+            I("Memory pressure over: %lld of %llu bytes held",
+              (long long) used, (long long unsigned) m_cap);
+            flight_record(FLIGHT_MEM_PRESSURE, 0, used);
+            if (m_cb) {
+                m_cb(m_opaque, false, used);
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _MEM_BUDGET_H_
+#define _MEM_BUDGET_H_
+
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum MemUser {
+    MEM_VIDEO_QUEUE,        // Raw frames waiting for x264
+    MEM_AUDIO_BUFFER,       // Pcm waiting for the aac encoder
+    MEM_JITTER,             // Encoded packets held by the interleaver
+    MEM_DVR,                // Encoded packets kept for clip export
+    MEM_USER_NUM
+};
+
+// Pressure starts at MEM_HIGH_PERCENT of the cap, ends at MEM_LOW_PERCENT
+#define MEM_HIGH_PERCENT        80
+#define MEM_LOW_PERCENT         60
+
+// Called on the thread whose add() crossed a watermark
+typedef void (*MemPressureCallback)(void *opaque, bool pressure, int64_t used);
+
+/* What the buffers of a session hold, against a cap. Every queue reports
+ * its growth and shrinkage as it happens, so the total is current at any
+ * time; a payload kept by both the interleaver and the dvr ring counts
+ * twice while it is. Lock-free, any thread. */
+class MemBudget {
+public:
+    MemBudget();
+
+    // 0 for no cap, only accounting then
+    void set_cap(uint64_t cap) { m_cap = cap; }
+    uint64_t cap() const { return m_cap; }
+
+    void set_pressure_callback(MemPressureCallback cb, void *opaque);
+
+    // bytes < 0 when released
+    void add(MemUser user, int64_t bytes);
+
+    int64_t used() const { return m_used; }
+    int64_t used(MemUser user) const { return m_users[user]; }
+
+    // Between crossing the high and then the low watermark
+    bool pressure() const { return m_pressure; }
+    // At the cap, new input is to be refused
+    bool full() const { return m_cap && m_used >= (int64_t) m_cap; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MemBudget);
+
+    volatile int64_t m_used;
+    volatile int64_t m_users[MEM_USER_NUM];
+    uint64_t m_cap;
+    volatile int m_pressure;
+    MemPressureCallback m_cb;
+    void *m_opaque;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _MEM_BUDGET_H_ */
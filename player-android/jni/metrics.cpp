@@ -0,0 +1,216 @@
+#include "metrics.h"
+#include "common.h"
+#include "xpool.h"
+#include "thread_ctl.h"
+
+using namespace xutil;
+
+struct Metrics gmetrics;
+
+static const char *counter_names[METRIC_COUNTER_NUM] = {
+    "video_frames_in",
+    "video_bytes_in",
+    "video_frames_dropped",
+    "video_frames_encoded",
+    "video_bytes_encoded",
+    "audio_bytes_in",
+    "audio_frames_encoded",
+    "audio_bytes_encoded",
+    "interleave_forced",
+    "rtmp_packets_sent",
+    "rtmp_bytes_sent",
+    "rtmp_send_failed",
+    "rtmp_body_copies",
+    "input_refused",
+    "video_slices",
+    "video_effort_steps",
+    "video_keyframe_requests",
+    "video_keyframes_forced",
+};
+
+static const char *gauge_names[METRIC_GAUGE_NUM] = {
+    "video_queue_depth",
+    "audio_queue_bytes",
+    "jitter_depth",
+    "mem_used_bytes",
+    "video_effort",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_NUM] = {
+    "convert_us",
+    "video_encode_us",
+    "audio_encode_us",
+    "interleave_wait_us",
+    "rtmp_send_us",
+    "slice_lead_us",
+};
+
+void metrics_reset()
+{
+    memset((void *) &gmetrics, 0, sizeof(gmetrics));
+    gmetrics.start_us = get_time_now_us();
+}
+
+uint32_t metric_percentile(const uint32_t buckets[], uint32_t count,
+                           uint32_t max, int pct)
+{
+    uint64_t target = ((uint64_t) count * pct + 99) / 100;
+    uint64_t acc = 0;
+
+    if (!count)
+        return 0;
+
+    for (int i = 0; i < METRIC_BUCKET_NUM; ++i) {
+        if (!buckets[i])
+            continue;
+        if (acc + buckets[i] >= target) {
+            // The values taken as spread evenly over the bucket, the last
+            // one ends at the max
+            uint64_t lo = i ? 1ULL << (i + METRIC_BUCKET_SHIFT - 1) : 0;
+            uint64_t hi = i == METRIC_BUCKET_NUM - 1 ?
+                MAX((uint64_t) max, lo) : 1ULL << (i + METRIC_BUCKET_SHIFT);
+            uint64_t val = lo + (hi - lo) * (target - acc) / buckets[i];
+            return (uint32_t) MIN(val, (uint64_t) max);
+        }
+        acc += buckets[i];
+    }
+    return max;
+}
+
+std::string metrics_snapshot()
+{
+    std::string json;
+    int i;
+
+    json.reserve(2048);
+    json += sprintf_("{\"uptime_ms\":%llu",
+                     (long long unsigned) (get_time_now_us() - gmetrics.start_us) / 1000);
+
+    json += ",\"counters\":{";
+    for (i = 0; i < METRIC_COUNTER_NUM; ++i) {
+        json += sprintf_("%s\"%s\":%llu", i ? "," : "", counter_names[i],
+                         (long long unsigned) gmetrics.counters[i]);
+    }
+
+    json += "},\"gauges\":{";
+    for (i = 0; i < METRIC_GAUGE_NUM; ++i) {
+        json += sprintf_("%s\"%s\":%d", i ? "," : "", gauge_names[i],
+                         gmetrics.gauges[i]);
+    }
+
+    json += "},\"histograms\":{";
+    for (i = 0; i < METRIC_HISTOGRAM_NUM; ++i) {
+        const MetricHistogramData &hist = gmetrics.histograms[i];
+        uint32_t buckets[METRIC_BUCKET_NUM];
+        uint32_t count = 0;
+
+        // Writers go on meanwhile, take the count from the copied buckets
+        for (int j = 0; j < METRIC_BUCKET_NUM; ++j) {
+            buckets[j] = hist.buckets[j];
+            count += buckets[j];
+        }
+
+        json += sprintf_("%s\"%s\":{\"count\":%u,\"avg\":%llu,\"max\":%u,"
+                         "\"p50\":%u,\"p90\":%u,\"p99\":%u,\"buckets\":[",
+                         i ? "," : "", histogram_names[i], count,
+                         (long long unsigned) (hist.count ? hist.sum / hist.count : 0),
+                         hist.max,
+                         metric_percentile(buckets, count, hist.max, 50),
+                         metric_percentile(buckets, count, hist.max, 90),
+                         metric_percentile(buckets, count, hist.max, 99));
+        for (int j = 0; j < METRIC_BUCKET_NUM; ++j) {
+            json += sprintf_("%s%u", j ? "," : "", buckets[j]);
+        }
+        json += "]}";
+    }
+    json += "}}";
+    return json;
+}
+
+std::string metrics_report()
+{
+    std::string text;
+    int i;
+
+    text += sprintf_("%-24s %llu\n", "uptime_ms",
+                     (long long unsigned) (get_time_now_us() - gmetrics.start_us) / 1000);
+    for (i = 0; i < METRIC_COUNTER_NUM; ++i) {
+        text += sprintf_("%-24s %llu\n", counter_names[i],
+                         (long long unsigned) gmetrics.counters[i]);
+    }
+
+    text += sprintf_("%-24s %8s %8s %8s %8s %8s %8s\n",
+                     "", "count", "avg", "p50", "p90", "p99", "max");
+    for (i = 0; i < METRIC_HISTOGRAM_NUM; ++i) {
+        const MetricHistogramData &hist = gmetrics.histograms[i];
+        uint32_t buckets[METRIC_BUCKET_NUM];
+        uint32_t count = 0;
+
+        for (int j = 0; j < METRIC_BUCKET_NUM; ++j) {
+            buckets[j] = hist.buckets[j];
+            count += buckets[j];
+        }
+
+        text += sprintf_("%-24s %8u %8llu %8u %8u %8u %8u\n",
+                         histogram_names[i], count,
+                         (long long unsigned) (hist.count ? hist.sum / hist.count : 0),
+                         metric_percentile(buckets, count, hist.max, 50),
+                         metric_percentile(buckets, count, hist.max, 90),
+                         metric_percentile(buckets, count, hist.max, 99),
+                         hist.max);
+    }
+
+    text += xpool_report();
+    text += thread_ctl_report();
+    text += pipeline_executor_report();
+    return text;
+}
+
+/////////////////////////////////////////////////////////////
+
+MetricsDumper::MetricsDumper() :
+    m_thrd(NULL), m_interval(0), m_quit(false)
+{
+}
+
+MetricsDumper::~MetricsDumper()
+{
+    m_quit = true;
+    JOIN_DELETE_THREAD(m_thrd);
+}
+
+int MetricsDumper::start(const std::string &path, uint32_t interval_ms)
+{
+    if (m_thrd) {
+        E("Metrics dumper already started");
+        return -1;
+    }
+
+    if (!m_file.open(path, "a")) {
+        E("Open metrics file \"%s\" failed", STR(path));
+        return -1;
+    }
+
+    m_interval = MAX(interval_ms, 100u);
+    m_thrd = CREATE_THREAD_ROUTINE(dump_routine, NULL, false);
+
+    I("Dump metrics to \"%s\" every %ums", STR(path), m_interval);
+    return 0;
+}
+
+unsigned int MetricsDumper::dump_routine(void *arg)
+{
+    while (!m_quit) {
+        short_snap(m_interval, &m_quit);
+
+        // One last snapshot on quit too
+        std::string json = metrics_snapshot();
+        json += "\n";
+        if (!m_file.write_buffer((const uint8_t *) json.data(), json.length()) ||
+            !m_file.flush()) {
+            E("Write metrics to \"%s\" failed", m_file.get_path());
+            break;
+        }
+    }
+    return 0;
+}
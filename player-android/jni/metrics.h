@@ -0,0 +1,139 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <string>
+
+#include "xfile.h"
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum MetricCounter {
+    METRIC_VIDEO_FRAMES_IN,         // Handed in by java
+    METRIC_VIDEO_BYTES_IN,
+    METRIC_VIDEO_FRAMES_DROPPED,    // By the fps control
+    METRIC_VIDEO_FRAMES_ENCODED,
+    METRIC_VIDEO_BYTES_ENCODED,
+    METRIC_AUDIO_BYTES_IN,
+    METRIC_AUDIO_FRAMES_ENCODED,
+    METRIC_AUDIO_BYTES_ENCODED,
+    METRIC_INTERLEAVE_FORCED,       // Flushed for max_interleave_delta
+    METRIC_RTMP_PACKETS_SENT,
+    METRIC_RTMP_BYTES_SENT,
+    METRIC_RTMP_SEND_FAILED,
+    METRIC_RTMP_BODY_COPIES,        // Messages too long to send in place
+    METRIC_INPUT_REFUSED,           // Frames turned away at the memory cap
+    METRIC_VIDEO_SLICES,            // Handed over by x264 one by one, slice mode
+    METRIC_VIDEO_EFFORT_STEPS,      // Adaptive effort level changes
+    METRIC_VIDEO_KEYFRAME_REQUESTS, // Through VideoEncoder::request_keyframe()
+    METRIC_VIDEO_KEYFRAMES_FORCED,  // Of which (pending ones together) made one
+    METRIC_COUNTER_NUM
+};
+
+enum MetricGauge {
+    METRIC_VIDEO_QUEUE_DEPTH,       // Frames waiting for x264
+    METRIC_AUDIO_QUEUE_BYTES,       // Pcm waiting for fdk-aac
+    METRIC_JITTER_DEPTH,            // Packets held by the interleaver
+    METRIC_MEM_USED,                // Bytes held by the session buffers
+    METRIC_VIDEO_EFFORT,            // Adaptive effort level x264 is at
+    METRIC_GAUGE_NUM
+};
+
+enum MetricHistogram {
+    METRIC_CONVERT_US,
+    METRIC_VIDEO_ENCODE_US,
+    METRIC_AUDIO_ENCODE_US,
+    METRIC_INTERLEAVE_WAIT_US,
+    METRIC_RTMP_SEND_US,
+    METRIC_SLICE_LEAD_US,           // Frame sent that early, before x264 returned
+    METRIC_HISTOGRAM_NUM
+};
+
+// Bucket 0 counts values below 2^METRIC_BUCKET_SHIFT us, bucket i (i > 0)
+// those in [2^(i+SHIFT-1), 2^(i+SHIFT)), the last one takes the rest (>1s)
+#define METRIC_BUCKET_SHIFT     6
+#define METRIC_BUCKET_NUM       16
+
+struct MetricHistogramData {
+    volatile uint32_t buckets[METRIC_BUCKET_NUM];
+    volatile uint32_t count;
+    volatile uint32_t max;
+    volatile uint64_t sum;
+};
+
+// Process-wide, updated lock-free from any thread
+struct Metrics {
+    volatile uint64_t counters[METRIC_COUNTER_NUM];
+    volatile int32_t gauges[METRIC_GAUGE_NUM];
+    MetricHistogramData histograms[METRIC_HISTOGRAM_NUM];
+    volatile uint64_t start_us;
+};
+
+extern struct Metrics gmetrics;
+
+static inline void metric_add(MetricCounter c, uint64_t n = 1)
+{
+    __sync_add_and_fetch(&gmetrics.counters[c], n);
+}
+
+static inline void metric_set(MetricGauge g, int32_t val)
+{
+    gmetrics.gauges[g] = val;
+}
+
+static inline void metric_observe(MetricHistogram h, uint32_t us)
+{
+    MetricHistogramData &hist = gmetrics.histograms[h];
+    uint32_t v = us >> METRIC_BUCKET_SHIFT;
+    uint32_t idx = v ? 32 - __builtin_clz(v) : 0;
+
+    __sync_add_and_fetch(&hist.buckets[MIN(idx, METRIC_BUCKET_NUM - 1u)], 1);
+    __sync_add_and_fetch(&hist.count, 1);
+    __sync_add_and_fetch(&hist.sum, us);
+
+    uint32_t old;
+    while (us > (old = hist.max) &&
+           !__sync_bool_compare_and_swap(&hist.max, old, us))
+        ;
+}
+
+// Time spent since begin_us, in us
+static inline void metric_observe_since(MetricHistogram h, uint64_t begin_us)
+{
+    metric_observe(h, (uint32_t) (xutil::get_time_now_us() - begin_us));
+}
+
+// pct-th percentile of count values in buckets, interpolated within the
+// bucket it falls in and never above max, the largest value seen
+uint32_t metric_percentile(const uint32_t buckets[], uint32_t count,
+                           uint32_t max, int pct);
+
+void metrics_reset();
+// Json object of every metric, percentiles as metric_percentile()
+std::string metrics_snapshot();
+// Same as a table for humans, one metric per line (gauges left out)
+std::string metrics_report();
+
+// Appends a snapshot per interval to a file (one json per line)
+class MetricsDumper {
+public:
+    MetricsDumper();
+    ~MetricsDumper();
+
+    int start(const std::string &path, uint32_t interval_ms);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MetricsDumper);
+    DECL_THREAD_ROUTINE(MetricsDumper, dump_routine);
+    xutil::Thread *m_thrd;
+    xfile::File m_file;
+    uint32_t m_interval;
+    volatile bool m_quit;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _METRICS_H_ */
@@ -1,11 +1,18 @@
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include "native_crash_handler.h"
-#include "common.h"
+#include "flight_recorder.h"
+#include "jni_util.h"
 #include "xutil.h"
 
 static struct sigaction old_actions[NSIG];
 
 #define THREAD_NAME "native_crash_handler"
-extern JNIEnv *jni_get_env(const char *name);
+
+// How long the crashed thread waits for onNativeCrash() to return
+#define CRASH_ACK_TIMEOUT_MS    1000
 
 static const int monitored_signals[] = {
     SIGILL,
@@ -17,15 +24,61 @@ static const int monitored_signals[] = {
     SIGPIPE
 };
 
-void sigaction_callback(int signal, siginfo_t *info, void *reserved)
+// Signal handler -> watchdog, and back
+static int crash_pipe[2] = { -1, -1 };
+static int ack_pipe[2] = { -1, -1 };
+static pthread_t watchdog_tid;
+static bool watchdog_running;
+
+// JNI is not async-signal-safe, calling up to java is done here instead
+static void *watchdog_routine(void *arg)
 {
-    JNIEnv *env;
-    if (!(env = jni_get_env(THREAD_NAME)))
-        return;
+    for ( ; ; ) {
+        int sig;
+        ssize_t n = read(crash_pipe[0], &sig, sizeof(sig));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(sig))
+            break;  // Write end closed
 
-    env->CallStaticVoidMethod(gfq.clazz, gfq.onNativeCrashID);
+        JNIEnv *env = jni_get_env(THREAD_NAME);
+        if (env) {
+            env->CallStaticVoidMethod(gfq.clazz, gfq.onNativeCrashID);
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+            }
+        }
 
-    old_actions[signal].sa_handler(signal);
+        if (write(ack_pipe[1], &sig, sizeof(sig)) < 0) {
+            // Crashed thread times out
+        }
+    }
+    return NULL;
+}
+
+static void sigaction_callback(int sig, siginfo_t *info, void *reserved)
+{
+    int saved_errno = errno;
+
+    flight_recorder_dump(sig, info);
+
+    if (watchdog_running &&
+        write(crash_pipe[1], &sig, sizeof(sig)) == sizeof(sig)) {
+        struct pollfd pfd;
+        pfd.fd = ack_pipe[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, CRASH_ACK_TIMEOUT_MS);
+    }
+
+    // Chain to the previous handler (debuggerd): a fault happens again
+    // once we return, anything sent by kill()/abort() is sent again
+    sigaction(sig, &old_actions[sig], NULL);
+    if (info->si_code <= 0 || sig == SIGABRT || sig == SIGPIPE) {
+        raise(sig);
+    }
+
+    errno = saved_errno;
 }
 
 void init_native_crash_handler()
@@ -34,8 +87,18 @@ void init_native_crash_handler()
     struct sigaction handler;
     memset(&handler, 0, sizeof(struct sigaction));
 
+    flight_recorder_init();
+
+    if (pipe(crash_pipe) < 0 || pipe(ack_pipe) < 0) {
+        E("Create crash pipes failed: %s", ERRNOMSG);
+    } else if (pthread_create(&watchdog_tid, NULL, watchdog_routine, NULL) != 0) {
+        E("Create crash watchdog thread failed");
+    } else {
+        watchdog_running = true;
+    }
+
     handler.sa_sigaction = sigaction_callback;
-    handler.sa_flags = SA_RESETHAND;
+    handler.sa_flags = SA_SIGINFO | SA_RESETHAND;
 
     for (i = 0; i < NELEM(monitored_signals); ++i) {
         const int s = monitored_signals[i];
@@ -50,4 +113,15 @@ void destroy_native_crash_handler()
         const int s = monitored_signals[i];
         sigaction(s, &old_actions[s], NULL);
     }
+
+    if (watchdog_running) {
+        watchdog_running = false;
+        close(crash_pipe[1]);
+        crash_pipe[1] = -1;
+        pthread_join(watchdog_tid, NULL);
+    }
+    for (i = 0; i < 2; ++i) {
+        SAFE_CLOSE(crash_pipe[i]);
+        SAFE_CLOSE(ack_pipe[i]);
+    }
 }
@@ -0,0 +1,437 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <deque>
+
+#include "net_impair.h"
+#include "trace.h"
+
+#define THREAD_NAME "net_impair"
+
+// What's read at once, about a packet on the wire
+#define PUMP_CHUNK_SIZE         1400
+#define PUMP_POLL_MS            20
+#define DEF_QUEUE_BYTES         (64*1024)
+
+using namespace xutil;
+
+NetPhase::NetPhase() :
+    duration_ms(0), rate_bps(0), rtt_ms(0), jitter_ms(0),
+    queue_bytes(DEF_QUEUE_BYTES), stall(false), drop(false)
+{
+}
+
+// "1.5M", "300k", "800000"
+static int parse_amount(const std::string &val, uint32_t &out)
+{
+    char *end;
+    double d = strtod(val.c_str(), &end);
+
+    if (end == val.c_str() || d < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K') {
+        d *= 1000;
+        ++end;
+    } else if (*end == 'M') {
+        d *= 1000000;
+        ++end;
+    }
+    if (*end)
+        return -1;
+    out = (uint32_t) d;
+    return 0;
+}
+
+// "200ms", "1.5s", "30" (ms)
+static int parse_duration(const std::string &val, uint32_t &out_ms)
+{
+    char *end;
+    double d = strtod(val.c_str(), &end);
+
+    if (end == val.c_str() || d < 0)
+        return -1;
+    if (!strcmp(end, "s")) {
+        d *= 1000;
+    } else if (*end && strcmp(end, "ms")) {
+        return -1;
+    }
+    out_ms = (uint32_t) d;
+    return 0;
+}
+
+int net_schedule_parse(const char *str, std::vector<NetPhase> &phases)
+{
+    std::vector<std::string> steps = split(str, ";");
+    NetPhase prev;
+
+    phases.clear();
+    foreach(steps, it) {
+        std::vector<std::string> items = split(*it, " \t,");
+        NetPhase phase = prev;
+        phase.duration_ms = 0;
+        phase.stall = phase.drop = false;
+
+        if (items.empty())
+            continue;
+
+        foreach(items, item) {
+            size_t eq = item->find('=');
+            std::string key = item->substr(0, eq);
+            std::string val = eq == std::string::npos ? "" : item->substr(eq + 1);
+            int ret = 0;
+
+            if (key == "stall") {
+                phase.stall = true;
+            } else if (key == "drop") {
+                phase.drop = true;
+            } else if (key == "rate") {
+                ret = parse_amount(val, phase.rate_bps);
+            } else if (key == "queue") {
+                ret = parse_amount(val, phase.queue_bytes);
+            } else if (key == "dur") {
+                ret = parse_duration(val, phase.duration_ms);
+            } else if (key == "rtt") {
+                ret = parse_duration(val, phase.rtt_ms);
+            } else if (key == "jitter") {
+                ret = parse_duration(val, phase.jitter_ms);
+            } else {
+                ret = -1;
+            }
+            if (ret < 0) {
+                E("Invalid impairment \"%s\"", STR(*item));
+                return -1;
+            }
+        }
+
+        if (phase.drop) {
+            phase.duration_ms = 0;
+        } else if (!phase.duration_ms && &*it != &steps.back()) {
+            E("Phase \"%s\" needs a dur, it's not the last one", STR(*it));
+            return -1;
+        }
+        phases.push_back(phase);
+        prev = phase;
+    }
+
+    if (phases.empty()) {
+        phases.push_back(NetPhase());
+    }
+    return 0;
+}
+
+static int send_all(int fd, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+NetImpairProxy::NetImpairProxy() :
+    m_target_port(0), m_listen_fd(-1), m_port(0),
+    m_client_fd(-1), m_server_fd(-1), m_start_us(0),
+    m_accept_thrd(NULL), m_up_thrd(NULL), m_down_thrd(NULL),
+    m_pumps(0), m_quit(false)
+{
+}
+
+NetImpairProxy::~NetImpairProxy()
+{
+    stop();
+}
+
+int NetImpairProxy::start(int listen_port, const std::string &target_addr, int target_port,
+                          const std::vector<NetPhase> &phases)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int on = 1;
+
+    if (m_accept_thrd) {
+        E("Impairment proxy already started");
+        return -1;
+    }
+
+    m_phases = phases;
+    if (m_phases.empty()) {
+        m_phases.push_back(NetPhase());
+    }
+    m_target_addr = target_addr;
+    m_target_port = target_port;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(listen_port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+        E("socket() failed: %s", ERRNOMSG);
+        return -1;
+    }
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(m_listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        listen(m_listen_fd, 4) < 0 ||
+        getsockname(m_listen_fd, (struct sockaddr *) &sin, &len) < 0) {
+        E("Listen on port %d failed: %s", listen_port, ERRNOMSG);
+        SAFE_CLOSE(m_listen_fd);
+        return -1;
+    }
+    m_port = ntohs(sin.sin_port);
+
+    m_quit = false;
+    m_start_us = 0;
+    m_accept_thrd = CREATE_THREAD_ROUTINE(accept_routine, NULL, false);
+
+    I("Impairment proxy on 127.0.0.1:%d -> %s:%d, %d phases",
+      m_port, STR(m_target_addr), m_target_port, (int) m_phases.size());
+    return 0;
+}
+
+void NetImpairProxy::stop()
+{
+    if (!m_accept_thrd)
+        return;
+
+    m_quit = true;
+    JOIN_DELETE_THREAD(m_accept_thrd);
+    close_connection();
+    SAFE_CLOSE(m_listen_fd);
+}
+
+int NetImpairProxy::phase_index(uint64_t now_us) const
+{
+    if (!m_start_us)
+        return -1;
+
+    uint64_t elapsed_ms = (now_us - m_start_us) / 1000;
+    uint64_t end_ms = 0;
+    int i;
+
+    for (i = 0; i < (int) m_phases.size() - 1; ++i) {
+        end_ms += m_phases[i].duration_ms;
+        if (elapsed_ms < end_ms)
+            break;
+    }
+    return i;
+}
+
+const NetPhase &NetImpairProxy::phase_at(uint64_t now_us) const
+{
+    return m_phases[MAX(phase_index(now_us), 0)];
+}
+
+int NetImpairProxy::connect_target()
+{
+    struct sockaddr_in sin;
+    int on = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(m_target_port);
+    if (inet_pton(AF_INET, m_target_addr.c_str(), &sin.sin_addr) != 1) {
+        E("Invalid address \"%s\"", STR(m_target_addr));
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        E("socket() failed: %s", ERRNOMSG);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        E("Connect to %s:%d failed: %s",
+          STR(m_target_addr), m_target_port, ERRNOMSG);
+        SAFE_CLOSE(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+void NetImpairProxy::close_connection()
+{
+    if (m_client_fd >= 0) {
+        shutdown(m_client_fd, SHUT_RDWR);
+    }
+    if (m_server_fd >= 0) {
+        shutdown(m_server_fd, SHUT_RDWR);
+    }
+    JOIN_DELETE_THREAD(m_up_thrd);
+    JOIN_DELETE_THREAD(m_down_thrd);
+    SAFE_CLOSE(m_client_fd);
+    SAFE_CLOSE(m_server_fd);
+}
+
+unsigned int NetImpairProxy::accept_routine(void *arg)
+{
+    struct pollfd pfd;
+    int last_phase = -1;
+
+    pfd.fd = m_listen_fd;
+    pfd.events = POLLIN;
+
+    TRACE_THREAD_NAME(THREAD_NAME);
+
+    while (!m_quit) {
+        int ret = poll(&pfd, 1, PUMP_POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            E("poll() failed: %s", ERRNOMSG);
+            break;
+        }
+
+        // Walk through every phase passed, a drop takes no time
+        int idx = phase_index(get_time_now_us());
+        while (last_phase < idx) {
+            ++last_phase;
+            const NetPhase &phase = m_phases[last_phase];
+            I("Impairment phase #%d: rate=%ubps rtt=%ums jitter=%ums queue=%u%s%s",
+              last_phase, phase.rate_bps, phase.rtt_ms, phase.jitter_ms,
+              phase.queue_bytes, phase.stall ? " stall" : "", phase.drop ? " drop" : "");
+            if (phase.drop) {
+                close_connection();
+            }
+        }
+
+        // Both ways gone by themselves
+        if (m_client_fd >= 0 && !m_pumps) {
+            close_connection();
+        }
+
+        if (ret <= 0 || !(pfd.revents & POLLIN))
+            continue;
+
+        int fd = accept(m_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            W("accept() failed: %s (cont)", ERRNOMSG);
+            continue;
+        }
+
+        // A reconnect replaces whatever is left of the previous one
+        close_connection();
+
+        int server_fd = connect_target();
+        if (server_fd < 0) {
+            SAFE_CLOSE(fd);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        m_client_fd = fd;
+        m_server_fd = server_fd;
+        if (!m_start_us) {
+            m_start_us = get_time_now_us();
+        }
+
+        m_pumps = 2;
+        m_up_thrd = CREATE_THREAD_ROUTINE(up_routine, NULL, false);
+        m_down_thrd = CREATE_THREAD_ROUTINE(down_routine, NULL, false);
+    }
+    return 0;
+}
+
+unsigned int NetImpairProxy::up_routine(void *arg)
+{
+    pump(m_client_fd, m_server_fd, true);
+    __sync_sub_and_fetch(&m_pumps, 1);
+    return 0;
+}
+
+unsigned int NetImpairProxy::down_routine(void *arg)
+{
+    pump(m_server_fd, m_client_fd, false);
+    __sync_sub_and_fetch(&m_pumps, 1);
+    return 0;
+}
+
+struct Chunk {
+    uint64_t release_us;
+    std::vector<uint8_t> data;
+};
+
+/* Data is read into a queue as long as the phase's bottleneck buffer has
+ * room, each chunk leaving once the bottleneck has serialized it (rate,
+ * upstream only) plus the one way delay. */
+void NetImpairProxy::pump(int src, int dst, bool upstream)
+{
+    std::deque<Chunk> queue;
+    uint32_t queued_bytes = 0;
+    uint64_t link_free_us = 0, last_release_us = 0;
+    unsigned int seed = upstream ? 1 : 2;
+    bool eof = false;
+
+    TRACE_THREAD_NAME(upstream ? "impair_up" : "impair_down");
+
+    while (!m_quit && (!eof || !queue.empty())) {
+        uint64_t now = get_time_now_us();
+        const NetPhase &phase = phase_at(now);
+
+        if (!phase.stall) {
+            while (!queue.empty() && queue.front().release_us <= now) {
+                Chunk &chunk = queue.front();
+                if (send_all(dst, &chunk.data[0], chunk.data.size()) < 0)
+                    goto out;
+                queued_bytes -= chunk.data.size();
+                queue.pop_front();
+            }
+        }
+
+        // Not reading (eof, or the bottleneck buffer full), poll() only
+        // sleeps till the next release: a hung up src would wake it at once
+        struct pollfd pfd;
+        pfd.fd = !eof && queued_bytes < phase.queue_bytes ? src : -1;
+        pfd.events = POLLIN;
+        int timeout = PUMP_POLL_MS;
+        if (!queue.empty() && !phase.stall) {
+            int64_t wait = ((int64_t) queue.front().release_us - (int64_t) now) / 1000;
+            timeout = MAX(0, MIN(timeout, (int) wait + 1));
+        }
+
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno != EINTR)
+            break;
+        if (ret <= 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        Chunk chunk;
+        chunk.data.resize(PUMP_CHUNK_SIZE);
+        ssize_t n = recv(src, &chunk.data[0], chunk.data.size(), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            eof = true;
+            continue;
+        }
+        chunk.data.resize(n);
+
+        now = get_time_now_us();
+        uint64_t serialize_us = upstream && phase.rate_bps ?
+            (uint64_t) n * 8 * 1000000 / phase.rate_bps : 0;
+        link_free_us = MAX(link_free_us, now) + serialize_us;
+        uint64_t delay_us = phase.rtt_ms * 1000 / 2;
+        if (phase.jitter_ms) {
+            delay_us += (uint64_t) (rand_r(&seed) % (phase.jitter_ms * 1000 + 1));
+        }
+        // Tcp keeps the order whatever the jitter
+        chunk.release_us = MAX(link_free_us + delay_us, last_release_us);
+        last_release_us = chunk.release_us;
+
+        queued_bytes += n;
+        queue.push_back(chunk);
+    }
+
+out:
+    // Pass the close on
+    shutdown(dst, SHUT_WR);
+}
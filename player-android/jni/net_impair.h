@@ -0,0 +1,78 @@
+#ifndef _NET_IMPAIR_H_
+#define _NET_IMPAIR_H_
+
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One step of an impairment schedule
+struct NetPhase {
+    uint32_t duration_ms;   // 0 for the rest of the run (last phase)
+    uint32_t rate_bps;      // Upstream bottleneck, 0 for unlimited
+    uint32_t rtt_ms;        // Half of it added each way
+    uint32_t jitter_ms;     // Up to this much more, each way
+    uint32_t queue_bytes;   // Bottleneck buffer, the publisher blocks beyond
+    bool stall;             // Nothing goes through either way
+    bool drop;              // Close the connection, takes no time
+
+    NetPhase();
+};
+
+/* Phases separated by ';', each a list of key=value:
+ *   rate=1.5M dur=30s; rate=300k dur=20s rtt=200ms jitter=50ms; drop
+ * keys: rate (bps, k/M), dur, rtt, jitter (ms, or s), queue (bytes, k/M),
+ * and the flags stall, drop. Unset keys carry over from the previous
+ * phase, a phase without dur lasts till the end. */
+int net_schedule_parse(const char *str, std::vector<NetPhase> &phases);
+
+/* Loopback tcp proxy applying a NetPhase schedule to the connection
+ * going through it, e.g. between RtmpHandler and RtmpServer. The
+ * schedule starts with the first connection; one connection at a time,
+ * a new one replaces the old. Jitter is pseudo random with a fixed seed,
+ * so a run replays the same way. */
+class NetImpairProxy {
+public:
+    NetImpairProxy();
+    ~NetImpairProxy();
+
+    // listen_port 0 to pick a free one, see port()
+    int start(int listen_port, const std::string &target_addr, int target_port,
+              const std::vector<NetPhase> &phases);
+    void stop();
+
+    int port() const { return m_port; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(NetImpairProxy);
+    DECL_THREAD_ROUTINE(NetImpairProxy, accept_routine);
+    DECL_THREAD_ROUTINE(NetImpairProxy, up_routine);
+    DECL_THREAD_ROUTINE(NetImpairProxy, down_routine);
+
+    int connect_target();
+    void close_connection();
+    // Index of the phase at now, -1 before the first connection
+    int phase_index(uint64_t now_us) const;
+    const NetPhase &phase_at(uint64_t now_us) const;
+    void pump(int src, int dst, bool upstream);
+
+    std::vector<NetPhase> m_phases;
+    std::string m_target_addr;
+    int m_target_port;
+    int m_listen_fd;
+    int m_port;
+    int m_client_fd;
+    int m_server_fd;
+    uint64_t m_start_us;
+    xutil::Thread *m_accept_thrd;
+    xutil::Thread *m_up_thrd;
+    xutil::Thread *m_down_thrd;
+    volatile int m_pumps;
+    volatile bool m_quit;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _NET_IMPAIR_H_ */
@@ -17,6 +17,7 @@ RawParserBase::~RawParserBase()
 /////////////////////////////////////////////////////////////
 
 VideoRawParser::VideoRawParser() :
+    m_dat(NULL),
     m_sps_len(0),
     m_pps_len(0),
     m_key_frame(false),
@@ -31,9 +32,7 @@ VideoRawParser::~VideoRawParser()
 
 void VideoRawParser::reset()
 {
-    foreach(m_nalus, it) {
-        SAFE_DELETE(*it);
-    }
+    m_dat = NULL;
     m_nalus.clear();
 
     m_key_frame = false;
@@ -43,93 +42,74 @@ void VideoRawParser::reset()
 int VideoRawParser::process(byte *dat, uint32_t len)
 {
     reset();
+    m_dat = dat;
 
-    /* Split nalus into vector m_nalus
-     * TODO: Find a better way */
-
-    byte *end = dat + len;
+    // Split nalus into vector m_nalus
+    const byte *end = dat + len;
+    const byte *startcode = find_startcode(dat, end);
     uint32_t nalu_ignored = 0;
 
-    for ( ; ; ) {
-        bool startcoede_found = false;
+    while (startcode != end) {
+        // Flush the startcode found, the nalu runs up to the next one
+        byte *nalu_start = const_cast<byte *>(startcode) + 3;
+        const byte *nalu_end = startcode = find_startcode(nalu_start, end);
 
-        while (dat != end) {
-            if (STARTCODE3(dat)) {  // If next 24 bits are 0x000001
-                startcoede_found = true;
-                break;
-            } else {
-                ++dat;              // Flush 8 bits
-            }
+        // Trailing zero bytes (e.g. head of a 4 bytes startcode) are not in the nalu
+        while (nalu_end > nalu_start && !nalu_end[-1]) {
+            --nalu_end;
         }
 
-        if (startcoede_found) {     // If startcoede found
-            dat += 3;               // Flush the startcode found
-
-            // Record this nalu_start addr
-            byte *nalu_start = dat;
-
-            // Now navigate up to next startcode and store the in between stuff
-            while (dat != end) {
-                // Get next 24 bits & check if it equals to 0x000001
-                if (!STARTCODE3(dat)) {
-                    // Search for pattern 0x000000
-                    if (!(dat[0]==0 && dat[1]==0 && dat[2]==0)) {
-                        // Copy one byte to the nal (just backward)
-                        ++dat;
-                    } else {
-                        break;
-                    }
-                } else {
-                    break;
+        // We got a nalu item
+        if (nalu_end - nalu_start > 0) { // If extra startcode founded, ignore it
+            uint32_t nalu_len = nalu_end - nalu_start;
+
+            // Update the sps & pps if there is
+            byte nalu_typ = (*nalu_start)&0x1F;
+            if (nalu_typ == 7 /*SPS*/) {
+                // Check whether sps has changed
+                if (m_sps_len != 0 &&
+                    (m_sps_len != nalu_len ||
+                     memcmp(m_sps, nalu_start, m_sps_len))) {
+                    m_sps_pps_changed = true;
                 }
-            }
 
-            // We got a nalu item
-            if (dat - nalu_start > 0) { // If extra startcode founded, ignore it
-                // Update the sps & pps if there is
-                byte nalu_typ = (*nalu_start)&0x1F;
-                if (nalu_typ == 7 /*SPS*/) {
-                    // Check whether sps has changed
-                    if (m_sps_len != 0 &&
-                        (m_sps_len != (uint32_t) (dat-nalu_start) ||
-                         memcmp(m_sps, nalu_start, m_sps_len))) {
-                        m_sps_pps_changed = true;
-                    }
-                    
-                    m_sps_len = dat-nalu_start;
-                    memcpy(m_sps, nalu_start, m_sps_len);
-
-                    // Indicate this a key frame
-                    m_key_frame = true;
-                } else if (nalu_typ == 8 /*PPS*/) {
-                    // Check whether sps has changed
-                    if (m_pps_len != 0 &&
-                        (m_pps_len != (uint32_t) (dat-nalu_start) ||
-                         memcmp(m_pps, nalu_start, m_pps_len))) {
-                        m_sps_pps_changed = true;
-                    }
-                    
-                    m_pps_len = dat-nalu_start;
-                    memcpy(m_pps, nalu_start, m_pps_len);
-
-                    m_key_frame = true; // ditto
-                } else if (nalu_typ == 6) {
-                    m_key_frame = true; // ditto
+                m_sps_len = nalu_len;
+                memcpy(m_sps, nalu_start, m_sps_len);
+
+                // Indicate this a key frame
+                m_key_frame = true;
+            } else if (nalu_typ == 8 /*PPS*/) {
+                // Check whether sps has changed
+                if (m_pps_len != 0 &&
+                    (m_pps_len != nalu_len ||
+                     memcmp(m_pps, nalu_start, m_pps_len))) {
+                    m_sps_pps_changed = true;
                 }
 
-                m_nalus.push_back(
-                        new NaluItem(dat-nalu_start, nalu_start));
-            } else {
-                ++nalu_ignored;
+                m_pps_len = nalu_len;
+                memcpy(m_pps, nalu_start, m_pps_len);
+
+                m_key_frame = true; // ditto
+            } else if (nalu_typ == 5 /*IDR*/ ||
+                       (nalu_typ == 6 &&
+                        xmedia::h264_sei_has_recovery_point(nalu_start, nalu_len))) {
+                // The start of an intra refresh is as good for joining
+                m_key_frame = true;
             }
+
+            NaluInfo ni;
+            ni.offset = nalu_start - dat;
+            ni.length = nalu_len;
+            ni.type = nalu_typ;
+            m_nalus.push_back(ni);
         } else {
-            break;
+            ++nalu_ignored;
         }
     }
 
 #ifdef XDEBUG
-    D("Video nalus#: %u, ignored#: %u, addr: ",
-      m_nalus.size(), nalu_ignored, dat);
+    D("Video nalus#: %u, ignored#: %u",
+      m_nalus.size(), nalu_ignored);
     if (m_key_frame) {
         D("m_sps_len=%u, first 4 bytes is: %02x %02x %02x %02x",
           m_sps_len, m_sps[0], m_sps[1], m_sps[2], m_sps[3]);
@@ -137,16 +117,19 @@ int VideoRawParser::process(byte *dat, uint32_t len)
           m_pps_len, m_pps[0], m_pps[1], m_pps[2], m_pps[3]);
     }
     foreach(m_nalus, it) {
+        const byte *nalu = m_dat + it->offset;
         D("%p, length=%u, first 4 bytes is: %02x %02x %02x %02x",
-          (*it)->second,
-          (*it)->first,
-          (*it)->second[0], (*it)->second[1],
-          (*it)->second[2], (*it)->second[3]);
+          nalu, it->length, nalu[0], nalu[1], nalu[2], nalu[3]);
     }
 #endif
     return 0;
 }
 
+xutil::Span<NaluInfo> VideoRawParser::get_nalus() const
+{
+    return xutil::Span<NaluInfo>(m_nalus.empty() ? NULL : &m_nalus[0], m_nalus.size());
+}
+
 const byte *VideoRawParser::get_nalu_data(uint32_t idx) const
 {
     if (idx >= m_nalus.size()) {
@@ -154,7 +137,7 @@ const byte *VideoRawParser::get_nalu_data(uint32_t idx) const
         return NULL;
     }
 
-    return m_nalus[idx]->second;
+    return m_dat + m_nalus[idx].offset;
 }
 
 uint32_t VideoRawParser::get_nalu_length(uint32_t idx) const
@@ -164,7 +147,7 @@ uint32_t VideoRawParser::get_nalu_length(uint32_t idx) const
         return 0;
     }
 
-    return m_nalus[idx]->first;
+    return m_nalus[idx].length;
 }
 
 /////////////////////////////////////////////////////////////
@@ -186,8 +169,6 @@ int AudioRawParser::process(byte *dat, uint32_t len)
     adts_header2asc(dat, m_asc);
 
     m_raw_len = len - 7;
-    byte *buf = (byte *) m_mem_pool.alloc(m_raw_len);
-    memcpy(buf, dat+7, m_raw_len);
     return 0;
 }
 
@@ -12,7 +12,6 @@ public:
     virtual int process(byte *dat, uint32_t len) = 0;
 
 protected:
-    xutil::MemHolder m_mem_pool;
     uint32_t m_raw_len;
 };
 
@@ -25,6 +24,9 @@ public:
 
     virtual int process(byte *dat, uint32_t len);
 
+    // Offsets are relative to the buffer given to process(), valid
+    // until the next call
+    xutil::Span<NaluInfo> get_nalus() const;
     uint32_t get_nalu_num() const { return m_nalus.size(); }
     const byte *get_nalu_data(uint32_t idx) const;
     uint32_t get_nalu_length(uint32_t idx) const;
@@ -42,7 +44,9 @@ private:
     void reset();
 
 private:
-    std::vector<NaluItem *> m_nalus;
+    const byte *m_dat;
+    // Capacity is kept across frames, no allocation once warmed up
+    std::vector<NaluInfo> m_nalus;
 
     byte m_sps[128];
     uint32_t m_sps_len;
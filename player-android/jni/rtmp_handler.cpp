@@ -3,6 +3,12 @@
 #include "rtmp_handler.h"
 #include "raw_parser.h"
 #include "jitter_buffer.h"
+#include "dvr_ring.h"
+#include "latency_tracker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "fqrtmp_session.h"
 #include "xmedia.h"
 #include "config.h"
 
@@ -11,16 +17,29 @@
 #define VIDEO_BODY_HEADER_LENGTH    16
 #define VIDEO_PAYLOAD_OFFSET        5
 
+// "@setDataFrame" amf string heading the rtmp metadata, not kept in flv
+#define SET_DATA_FRAME_LENGTH       (1 + 2 + 13)
+
+// An AVal of a writable copy of str, what librtmp's SAVC is in C
+#define SAVAL(name, str) \
+    static char name##_str[] = str; \
+    static const AVal name = { name##_str, (int) sizeof(name##_str) - 1 }
+
 using namespace xutil;
 
-RtmpHandler::RtmpHandler(const std::string &flvpath) :
+RtmpHandler::RtmpHandler(FQRtmpSession *session, const std::string &flvpath) :
+    m_session(session),
     m_rtmp(NULL),
     m_vparser(new VideoRawParser),
     m_aparser(new AudioRawParser),
-    m_jitter(new JitterBuffer)
+    m_keyframe_asked(false),
+    m_send_failed(false),
+    m_jitter(new JitterBuffer),
+    m_dvr(NULL)
 {
     struct PacketCallback pc = { this, packet_cb };
     m_jitter->set_packet_callback(pc);
+    m_jitter->set_mem_budget(m_session->mem_budget());
 
     if (!flvpath.empty()) {
         if (m_flvmuxer.set_file(flvpath) < 0) {
@@ -36,6 +55,7 @@ RtmpHandler::~RtmpHandler()
     SAFE_DELETE(m_vparser);
     SAFE_DELETE(m_aparser);
     SAFE_DELETE(m_jitter);
+    SAFE_DELETE(m_dvr);
 }
 
 int RtmpHandler::connect(const std::string &liveurl)
@@ -69,6 +89,12 @@ int RtmpHandler::connect(const std::string &liveurl)
         goto bail;
     }
 
+    if (set_chunk_size(RTMP_OUT_CHUNK_SIZE) < 0) {
+        E("Set chunk size to %d failed for liveurl: \"%s\"",
+          RTMP_OUT_CHUNK_SIZE, liveurl.c_str());
+        goto bail;
+    }
+
     if (!RTMP_ConnectStream(m_rtmp, 0)) {
         E("RTMP_ConnectStream failed for liveurl: \"%s\"",
           liveurl.c_str());
@@ -76,9 +102,13 @@ int RtmpHandler::connect(const std::string &liveurl)
     }
 
     m_url = liveurl;
+    m_send_failed = false;
 
     I("Connect to rtmp server with url \"%s\" ok",
       m_url.c_str());
+
+    // Frames encoded before are gone, the server starts at a keyframe
+    m_session->request_keyframe();
     return 0;
 
 bail:
@@ -101,6 +131,27 @@ int RtmpHandler::disconnect()
     return 0;
 }
 
+// Larger chunks let most messages go out without copying, see packet_cb()
+int RtmpHandler::set_chunk_size(int size)
+{
+    char pbuf[RTMP_MAX_HEADER_SIZE + 4];
+    RTMPPacket pkt;
+
+    RTMPPacket_Reset(&pkt);
+    pkt.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+    pkt.m_nChannel = RTMP_NETWORK_CHANNEL;
+    pkt.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    pkt.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+    pkt.m_nBodySize = 4;
+    AMF_EncodeInt32(pkt.m_body, pbuf + sizeof(pbuf), size);
+
+    if (!RTMP_SendPacket(m_rtmp, &pkt, FALSE))
+        return -1;
+
+    m_rtmp->m_outChunkSize = size;
+    return 0;
+}
+
 int RtmpHandler::send_video(int32_t timestamp, byte *dat, uint32_t length)
 {
     if (m_vparser->process(dat, length) < 0) {
@@ -108,30 +159,23 @@ int RtmpHandler::send_video(int32_t timestamp, byte *dat, uint32_t length)
         return -1;
     }
 
-    byte *buf = (byte *) m_mem_pool.alloc(
-            length + VIDEO_BODY_HEADER_LENGTH + 128 /*Just in case*/);
+    MediaBuffer *mb = media_buffer_alloc(
+            length + VIDEO_BODY_HEADER_LENGTH + 128 /*Just in case*/, RTMP_MAX_HEADER_SIZE);
+    if (!mb)
+        return -1;
+    byte *buf = mb->data;
     byte *cur = buf + VIDEO_PAYLOAD_OFFSET;
 
-    for (uint32_t idx=0; idx<m_vparser->get_nalu_num(); ++idx) {
-        const byte *nalu_dat =
-            m_vparser->get_nalu_data(idx);
-        uint32_t nalu_length =
-            m_vparser->get_nalu_length(idx);
-
-        // Check whether startcode is there, remove it
-        if (STARTCODE4(nalu_dat)) {
-            nalu_dat += 4;
-            nalu_length -= 4;
-        } else if (STARTCODE3(nalu_dat)) {
-            nalu_dat += 3;
-            nalu_length -= 3;
-        }
+    Span<NaluInfo> nalus = m_vparser->get_nalus();
+    for (const NaluInfo *ni = nalus.begin(); ni != nalus.end(); ++ni) {
+        // Startcode is not included
+        const byte *nalu_dat = dat + ni->offset;
+        uint32_t nalu_length = ni->length;
 
         // (X) Ignore sps & pps for it will send in avc_dcr-pkt (Marked)
         // Add sps & pps in I-frame
 #if 0
-        byte nalu_typ = (*nalu_dat)&0x1F;
-        if (nalu_typ == 7 || nalu_typ == 8) {
+        if (ni->type == 7 || ni->type == 8) {
             // Skip sps&pps in I-frame
             continue;
         }
@@ -143,6 +187,53 @@ int RtmpHandler::send_video(int32_t timestamp, byte *dat, uint32_t length)
         cur += (4 + nalu_length);
     }
 
+    return send_avc(timestamp, mb, buf, cur-buf, m_vparser->is_key_frame(),
+                    m_vparser->get_sps(), m_vparser->get_sps_length(),
+                    m_vparser->get_pps(), m_vparser->get_pps_length(),
+                    m_vparser->sps_pps_changed());
+}
+
+int RtmpHandler::send_video(int32_t timestamp, const AVCFrame *frame)
+{
+    MediaBuffer *mb;
+    byte *buf;
+
+    // Nalus are length-prefixed already, take the payload as it is: the
+    // tag header goes into the frame's headroom, so the body sent, kept
+    // by the dvr ring and written to flv is the encoder's very buffer
+    if (frame->buf && frame->buf->refcnt == 1 &&
+        media_buffer_room_before(frame->buf, frame->data) >=
+            RTMP_MAX_HEADER_SIZE + VIDEO_PAYLOAD_OFFSET) {
+        mb = media_buffer_ref(frame->buf);
+        buf = frame->data - VIDEO_PAYLOAD_OFFSET;
+    } else {
+        mb = media_buffer_alloc(frame->size + VIDEO_PAYLOAD_OFFSET, RTMP_MAX_HEADER_SIZE);
+        if (!mb)
+            return -1;
+        buf = mb->data;
+        memcpy(buf + VIDEO_PAYLOAD_OFFSET, frame->data, frame->size);
+    }
+
+    return send_avc(timestamp, mb, buf, VIDEO_PAYLOAD_OFFSET + frame->size, frame->key_frame,
+                    frame->sps, frame->sps_length,
+                    frame->pps, frame->pps_length,
+                    frame->sps_pps_changed, frame->latency_seq);
+}
+
+// buf (inside mb, whose reference is taken over) holds the avcc payload
+// at VIDEO_PAYLOAD_OFFSET, length counts the offset in
+int RtmpHandler::send_avc(int32_t timestamp, MediaBuffer *mb, byte *buf, uint32_t length,
+                          bool key_frame,
+                          const byte *sps, uint32_t sps_len,
+                          const byte *pps, uint32_t pps_len, bool sps_pps_changed,
+                          uint32_t latency_seq)
+{
+    // The sequence header and onMetaData too: one thread at a time in the
+    // interleaver and on the connection, and m_ainfo is looked at
+    TRACE_BEGIN("lock RtmpHandler");
+    AutoLock _l(m_mutex);
+    TRACE_END("lock RtmpHandler");
+
     if (timestamp - m_vinfo.lts < -NEW_STREAM_TIMESTAMP_THESHO) {
         // Take this as a new video stream
         int32_t lvabs_ts = m_vinfo.lts + m_vinfo.tm_offset;
@@ -173,29 +264,38 @@ int RtmpHandler::send_video(int32_t timestamp, byte *dat, uint32_t length)
     }
     
     // Check whether need to send avc_dcr-pkt
-    if (m_vinfo.need_cfg || m_vparser->sps_pps_changed()) {
-        if (m_vparser->is_key_frame()) {
+    if (m_vinfo.need_cfg || sps_pps_changed) {
+        if (key_frame) {
+            if (update_video_info(timestamp+m_vinfo.tm_offset,
+                                  sps, sps_len, pps, pps_len) < 0) {
+                W("Update video info from sps/pps failed (cont)");
+            }
+
             byte avc_dcr_body[2048];
             int body_len = make_avc_dcr_body(avc_dcr_body,
-                                             m_vparser->get_sps(), m_vparser->get_sps_length(),
-                                             m_vparser->get_pps(), m_vparser->get_pps_length());
+                                             sps, sps_len,
+                                             pps, pps_len);
             if (!send_rtmp_pkt(RTMP_PACKET_TYPE_VIDEO, timestamp+m_vinfo.tm_offset,
                                avc_dcr_body, body_len)) {
                 E("Send video avc_dcr to rtmpserver failed");
+                media_buffer_unref(&mb);
                 return -1;
             }
 
             m_vinfo.need_cfg = false;
+            m_keyframe_asked = false;
+        } else if (!m_keyframe_asked) {
+            // Nothing can be decoded until then, don't wait for the gop
+            m_session->request_keyframe();
+            m_keyframe_asked = true;
         }
     }
 
     m_vinfo.lts = timestamp;
 
-    AutoLock _l(m_mutex);
-
-    int body_len = make_video_body(buf, cur-buf, m_vparser->is_key_frame());
+    int body_len = make_video_body(buf, length, key_frame);
     if (!send_rtmp_pkt(RTMP_PACKET_TYPE_VIDEO, timestamp+m_vinfo.tm_offset,
-                       buf, body_len)) {
+                       mb, buf, body_len, latency_seq)) {
         E("Send video data to rtmpserver failed");
         return -1;
     }
@@ -206,6 +306,73 @@ int RtmpHandler::send_video(int32_t timestamp, byte *dat, uint32_t length)
     return 0;
 }
 
+int RtmpHandler::update_video_info(int32_t timestamp,
+                                   const byte *sps, uint32_t sps_len,
+                                   const byte *pps, uint32_t pps_len)
+{
+    xmedia::SPS sps_dec;
+    xmedia::PPS pps_dec;
+    xmedia::AVCVideoInfo info;
+
+    if (xmedia::h264_parse_sps(sps, sps_len, &sps_dec) < 0 ||
+        xmedia::h264_parse_pps(pps, pps_len, &pps_dec) < 0 ||
+        xmedia::h264_video_info(sps_dec, &pps_dec, info) < 0)
+        return -1;
+
+    xmedia::print_video_info(info);
+
+    byte metadata_body[512];
+    int body_len = make_metadata_body(metadata_body, sizeof(metadata_body), info);
+    if (body_len < 0 ||
+        !send_rtmp_pkt(RTMP_PACKET_TYPE_INFO, timestamp,
+                       metadata_body, body_len)) {
+        E("Send onMetaData to rtmpserver failed");
+        return -1;
+    }
+    return 0;
+}
+
+int RtmpHandler::make_metadata_body(byte *buf, uint32_t len,
+                                    const xmedia::AVCVideoInfo &info)
+{
+    SAVAL(av_setDataFrame, "@setDataFrame");
+    SAVAL(av_onMetaData, "onMetaData");
+    SAVAL(av_width, "width");
+    SAVAL(av_height, "height");
+    SAVAL(av_framerate, "framerate");
+    SAVAL(av_videocodecid, "videocodecid");
+    SAVAL(av_avcprofile, "avcprofile");
+    SAVAL(av_avclevel, "avclevel");
+
+    char *enc = (char *) buf;
+    char *end = enc + len;
+    bool has_fps = info.fps_num > 0 && info.fps_den > 0;
+
+    enc = AMF_EncodeString(enc, end, &av_setDataFrame);
+    enc = AMF_EncodeString(enc, end, &av_onMetaData);
+
+    *enc++ = AMF_ECMA_ARRAY;
+    enc = AMF_EncodeInt32(enc, end, has_fps ? 6 : 5);
+    enc = AMF_EncodeNamedNumber(enc, end, &av_width, info.width);
+    enc = AMF_EncodeNamedNumber(enc, end, &av_height, info.height);
+    if (has_fps) {
+        enc = AMF_EncodeNamedNumber(enc, end, &av_framerate,
+                                    (double) info.fps_num / info.fps_den);
+    }
+    enc = AMF_EncodeNamedNumber(enc, end, &av_videocodecid, 7 /*AVC*/);
+    enc = AMF_EncodeNamedNumber(enc, end, &av_avcprofile, info.profile_idc);
+    enc = AMF_EncodeNamedNumber(enc, end, &av_avclevel, info.level_idc);
+    if (!enc || end - enc < 3) {
+        E("Buffer too small for onMetaData");
+        return -1;
+    }
+
+    *enc++ = 0;
+    *enc++ = 0;
+    *enc++ = AMF_OBJECT_END;
+    return enc - (char *) buf;
+}
+
 int RtmpHandler::make_video_body(byte *buf, uint32_t dat_len, bool key_frame)
 {
     uint32_t idx = 0;
@@ -268,6 +435,11 @@ int RtmpHandler::send_audio(int32_t timestamp,
         return -1;
     }
 
+    // The asc goes under it too, see send_avc()
+    TRACE_BEGIN("lock RtmpHandler");
+    AutoLock _l(m_mutex);
+    TRACE_END("lock RtmpHandler");
+
     // Need to send asc before audio data
     // If timestamp backwards greatly, take it as a new flv audio stream
     if (timestamp == 0 ||       // Usually first audio frame comes
@@ -322,13 +494,13 @@ int RtmpHandler::send_audio(int32_t timestamp,
 
     m_ainfo.lts = timestamp;
 
-    AutoLock _l(m_mutex);
-
     // 2 bytes for 0xAF 0x00/0x01 (normally is so)
-    byte *buf = (byte *) m_mem_pool.alloc(length-7+2);
-    int body_len = make_audio_body(dat+7, length-7, buf, length-7+2);
+    MediaBuffer *mb = media_buffer_alloc(length-7+2, RTMP_MAX_HEADER_SIZE);
+    if (!mb)
+        return -1;
+    int body_len = make_audio_body(dat+7, length-7, mb->data, length-7+2);
     if (!send_rtmp_pkt(RTMP_PACKET_TYPE_AUDIO, timestamp+m_ainfo.tm_offset,
-                       buf, body_len)) {
+                       mb, mb->data, body_len)) {
         E("Send audio data to rtmpserver failed");
         return -1;
     }
@@ -367,45 +539,161 @@ byte RtmpHandler::pkttyp2channel(byte typ)
         return RTMP_SYSTEM_CHANNEL;
 }
 
-bool RtmpHandler::packet_cb(void *opaque, int pkttype,
-                            uint32_t pts, const byte *buf, uint32_t pktsize)
+bool RtmpHandler::packet_cb(void *opaque, RtmpPacket *pkt)
 {
     RtmpHandler *hdlr = (RtmpHandler *) opaque;
 
-    if ((pkttype == RTMP_PACKET_TYPE_AUDIO ||
-         pkttype == RTMP_PACKET_TYPE_VIDEO) &&
-        hdlr->m_flvmuxer.is_opened()) {
-        if (hdlr->m_flvmuxer.write_tag(pkttype, pts, buf, pktsize) < 0) {
+    LatencyTracker *latency = hdlr->m_session->latency();
+    if (latency) {
+        latency->mark(pkt->latency_seq, STAGE_INTERLEAVED);
+    }
+
+    if (pkt->pkttype == RTMP_PACKET_TYPE_INFO) {
+        if (hdlr->m_flvmuxer.is_opened() &&
+            pkt->size > SET_DATA_FRAME_LENGTH &&
+            hdlr->m_flvmuxer.write_tag(pkt->pkttype, pkt->pts,
+                                       pkt->data + SET_DATA_FRAME_LENGTH,
+                                       pkt->size - SET_DATA_FRAME_LENGTH) < 0) {
+            E("Write script tag to flv file \"%s\" failed (cont)",
+              hdlr->m_flvmuxer.get_path());
+        }
+    } else if (pkt->pkttype == RTMP_PACKET_TYPE_AUDIO ||
+               pkt->pkttype == RTMP_PACKET_TYPE_VIDEO) {
+        if (hdlr->m_flvmuxer.is_opened() &&
+            hdlr->m_flvmuxer.write_tag(pkt->pkttype, pkt->pts, pkt->data, pkt->size) < 0) {
             E("Write tag to flv file \"%s\" failed (cont)",
               hdlr->m_flvmuxer.get_path());
         }
+
+        if (hdlr->m_dvr &&
+            hdlr->m_dvr->add_packet(pkt) < 0) {
+            E("Add packet to dvr ring failed (cont)");
+        }
+    }
+
+    if (!hdlr->m_rtmp) {
+        // Flv file only, no live url given
+        return true;
     }
 
+    // librtmp puts the message header right in front of m_body, and the
+    // header of every further chunk over the tail of the previous one.
+    // A message of one chunk is sent from its buffer in place then, only
+    // the headroom gets written; a longer one would trample the payload
+    // the dvr ring and others share, so goes out of a copy
     RTMPPacket rtmp_pkt;
     RTMPPacket_Reset(&rtmp_pkt);
-    RTMPPacket_Alloc(&rtmp_pkt, pktsize);
-    memcpy(rtmp_pkt.m_body, buf, pktsize);
-    rtmp_pkt.m_packetType = pkttype;
-    rtmp_pkt.m_nChannel = pkttyp2channel(pkttype);
+    bool in_place = pkt->buf &&
+        pkt->size <= hdlr->m_rtmp->m_outChunkSize &&
+        media_buffer_room_before(pkt->buf, pkt->data) >= RTMP_MAX_HEADER_SIZE;
+    if (in_place) {
+        rtmp_pkt.m_body = (char *) pkt->data;
+    } else {
+        if (!RTMPPacket_Alloc(&rtmp_pkt, pkt->size)) {
+            E("RTMPPacket_Alloc for %d bytes failed", pkt->size);
+            return false;
+        }
+        memcpy(rtmp_pkt.m_body, pkt->data, pkt->size);
+        metric_add(METRIC_RTMP_BODY_COPIES);
+    }
+    rtmp_pkt.m_packetType = pkt->pkttype;
+    rtmp_pkt.m_nChannel = pkttyp2channel(pkt->pkttype);
     rtmp_pkt.m_headerType = RTMP_PACKET_SIZE_LARGE;
-    rtmp_pkt.m_nTimeStamp = pts;
+    rtmp_pkt.m_nTimeStamp = pkt->pts;
     rtmp_pkt.m_hasAbsTimestamp = 0;
     rtmp_pkt.m_nInfoField2 = hdlr->m_rtmp->m_stream_id;
-    rtmp_pkt.m_nBodySize = pktsize;
+    rtmp_pkt.m_nBodySize = pkt->size;
+    uint64_t send_start_us = get_time_now_us();
+    TRACE_BEGIN("RTMP_SendPacket");
     bool retval = RTMP_SendPacket(hdlr->m_rtmp, &rtmp_pkt, FALSE);
-    RTMPPacket_Free(&rtmp_pkt);
+    TRACE_END("RTMP_SendPacket");
+    metric_observe_since(METRIC_RTMP_SEND_US, send_start_us);
+    if (!in_place) {
+        RTMPPacket_Free(&rtmp_pkt);
+    }
+
+    if (retval) {
+        metric_add(METRIC_RTMP_PACKETS_SENT);
+        metric_add(METRIC_RTMP_BYTES_SENT, pkt->size);
+        flight_record(FLIGHT_PACKET_SENT, pkt->pkttype, pkt->size);
+        hdlr->m_send_failed = false;
+    } else {
+        metric_add(METRIC_RTMP_SEND_FAILED);
+        flight_record(FLIGHT_SEND_FAILED, pkt->pkttype, pkt->size);
+        // The frames after refer to the one lost; once for a run of
+        // failures, they go on till the connection is back
+        if (pkt->pkttype == RTMP_PACKET_TYPE_VIDEO && !hdlr->m_send_failed) {
+            hdlr->m_session->request_keyframe();
+            hdlr->m_send_failed = true;
+        }
+    }
+
+    if (retval && latency) {
+        latency->mark(pkt->latency_seq, STAGE_SENT);
+    }
     return retval;
 }
 
 bool RtmpHandler::send_rtmp_pkt(int pkttype, uint32_t ts,
-                                const byte *buf, uint32_t pktsize)
+                                const byte *buf, uint32_t pktsize,
+                                uint32_t latency_seq)
 {
+    MediaBuffer *mb = media_buffer_alloc(pktsize, RTMP_MAX_HEADER_SIZE);
+    if (!mb)
+        return false;
+
+    memcpy(mb->data, buf, pktsize);
+    return send_rtmp_pkt(pkttype, ts, mb, mb->data, pktsize, latency_seq);
+}
+
+bool RtmpHandler::send_rtmp_pkt(int pkttype, uint32_t ts,
+                                MediaBuffer *mb, byte *body, uint32_t pktsize,
+                                uint32_t latency_seq)
+{
+    std::auto_ptr<RtmpPacket> pkt(
+            new RtmpPacket(pkttype, mb, body, pktsize, ts, ts));
+    pkt->latency_seq = latency_seq;
+
     if (pkttype == RTMP_PACKET_TYPE_AUDIO ||
-        pkttype == RTMP_PACKET_TYPE_VIDEO) {
-        std::auto_ptr<RtmpPacket> pkt(
-                new RtmpPacket(pkttype, (uint8_t *) buf, pktsize, ts, ts));
+        pkttype == RTMP_PACKET_TYPE_VIDEO ||
+        pkttype == RTMP_PACKET_TYPE_INFO) {
         return m_jitter->add_packet(pkt.get()) < 0 ? false : true;
     }
 
-    return packet_cb(this, pkttype, ts, buf, pktsize);
+    return packet_cb(this, pkt.get());
+}
+
+int RtmpHandler::enable_dvr(uint32_t max_bytes, uint32_t max_duration)
+{
+    if (!max_bytes && !max_duration) {
+        E("DVR ring needs a byte or duration budget");
+        return -1;
+    }
+
+    SAFE_DELETE(m_dvr);
+    m_dvr = new DVRRing(m_session, max_bytes, max_duration);
+
+    I("DVR ring enabled (max_bytes=%u, max_duration=%ums)",
+      max_bytes, max_duration);
+    return 0;
+}
+
+int RtmpHandler::export_clip(uint64_t start_ts, uint64_t end_ts, const std::string &path)
+{
+    if (!m_dvr) {
+        E("DVR ring not enabled");
+        return -1;
+    }
+
+    return m_dvr->export_clip(start_ts, end_ts, path);
+}
+
+int RtmpHandler::export_last(uint32_t duration, const std::string &path)
+{
+    if (!m_dvr) {
+        E("DVR ring not enabled");
+        return -1;
+    }
+
+    return m_dvr->export_last(duration, path);
 }
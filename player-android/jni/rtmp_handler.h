@@ -3,7 +3,9 @@
 
 #include <librtmp/rtmp.h>
 
+#include "common.h"
 #include "flv_muxer.h"
+#include "xmedia.h"
 #include "xutil.h"
 
 #ifdef __cplusplus
@@ -13,20 +15,36 @@ extern "C" {
 class VideoRawParser;
 class AudioRawParser;
 class JitterBuffer;
+class DVRRing;
+class FQRtmpSession;
+struct RtmpPacket;
 
 class RtmpHandler {
 public:
-    RtmpHandler(const std::string &flvpath);
+    RtmpHandler(FQRtmpSession *session, const std::string &flvpath);
     ~RtmpHandler();
 
     int connect(const std::string &liveurl);
     int disconnect();
 
+    // Annex-b input, re-split by VideoRawParser
     int send_video(int32_t timestamp, byte *dat, uint32_t length);
+    // Encoder output, already length-prefixed
+    int send_video(int32_t timestamp, const AVCFrame *frame);
     int send_audio(int32_t timestamp, byte *dat, uint32_t length);
 
     bool send_rtmp_pkt(int pkttype, uint32_t ts,
-                       const byte *buf, uint32_t pktsize);
+                       const byte *buf, uint32_t pktsize,
+                       uint32_t latency_seq = 0);
+    // Zero-copy: body (inside mb, with RTMP_MAX_HEADER_SIZE of room in
+    // front) is sent as it is, the reference to mb is taken over
+    bool send_rtmp_pkt(int pkttype, uint32_t ts,
+                       MediaBuffer *mb, byte *body, uint32_t pktsize,
+                       uint32_t latency_seq = 0);
+
+    int enable_dvr(uint32_t max_bytes, uint32_t max_duration);
+    int export_clip(uint64_t start_ts, uint64_t end_ts, const std::string &path);
+    int export_last(uint32_t duration, const std::string &path);
 
 private:
     struct DataInfo {
@@ -46,13 +64,28 @@ private:
                                  const byte *sps, uint32_t sps_len,
                                  const byte *pps, uint32_t pps_len);
     static int make_video_body(byte *buf, uint32_t dat_len, bool key_frame);
+    static int make_metadata_body(byte *buf, uint32_t len,
+                                  const xmedia::AVCVideoInfo &info);
+
+    int set_chunk_size(int size);
+
+    int update_video_info(int32_t timestamp,
+                          const byte *sps, uint32_t sps_len,
+                          const byte *pps, uint32_t pps_len);
+
+    int send_avc(int32_t timestamp, MediaBuffer *mb, byte *buf, uint32_t length,
+                 bool key_frame,
+                 const byte *sps, uint32_t sps_len,
+                 const byte *pps, uint32_t pps_len, bool sps_pps_changed,
+                 uint32_t latency_seq = 0);
 
     static byte pkttyp2channel(byte typ);
 
-    static bool packet_cb(void *opaque, int pkttype,
-                          uint32_t pts, const byte *buf, uint32_t pktsize);
+    static bool packet_cb(void *opaque, RtmpPacket *pkt);
 
 private:
+    FQRtmpSession *m_session;
+
     std::string m_url;
 
     RTMP *m_rtmp;
@@ -62,13 +95,18 @@ private:
 
     DataInfo m_vinfo;
     DataInfo m_ainfo;
+    // Asked the encoder for one since m_vinfo.need_cfg was set
+    bool m_keyframe_asked;
+    // A send failed, and no packet went out since (keyframe asked once)
+    bool m_send_failed;
 
-    xutil::MemHolder m_mem_pool;
     xutil::RecursiveMutex m_mutex;
 
     JitterBuffer *m_jitter;
 
     FLVMuxer m_flvmuxer;
+
+    DVRRing *m_dvr;
 };
 
 #ifdef __cplusplus
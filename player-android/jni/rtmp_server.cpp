@@ -0,0 +1,421 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <librtmp/rtmp.h>
+
+#include "rtmp_server.h"
+#include "trace.h"
+
+#define THREAD_NAME "rtmp_server"
+
+#define SERVER_CHUNK_SIZE       4096
+#define SERVER_WINDOW_SIZE      2500000
+#define SERVER_STREAM_ID        1
+#define ACCEPT_POLL_MS          100
+
+// "@setDataFrame" amf string heading the rtmp metadata, not kept in flv
+#define SET_DATA_FRAME_LENGTH   (1 + 2 + 13)
+
+using namespace xutil;
+
+static AVal aval(const char *str)
+{
+    AVal val = { const_cast<char *>(str), (int) strlen(str) };
+    return val;
+}
+
+static bool aval_is(const AVal &val, const char *str)
+{
+    return val.av_len == (int) strlen(str) &&
+        !memcmp(val.av_val, str, val.av_len);
+}
+
+static int send_message(RTMP *r, int channel, uint8_t type, uint32_t stream_id,
+                        char *body, char *end)
+{
+    RTMPPacket packet;
+
+    RTMPPacket_Reset(&packet);
+    packet.m_nChannel = channel;
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    packet.m_packetType = type;
+    packet.m_nTimeStamp = 0;
+    packet.m_nInfoField2 = stream_id;
+    packet.m_hasAbsTimestamp = 0;
+    packet.m_body = body;
+    packet.m_nBodySize = end - body;
+
+    if (!end || !RTMP_SendPacket(r, &packet, FALSE)) {
+        E("Send message of type %d failed", type);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_control(RTMP *r, uint8_t type, uint32_t val, int extra = -1)
+{
+    char pbuf[RTMP_MAX_HEADER_SIZE + 8];
+    char *body = pbuf + RTMP_MAX_HEADER_SIZE, *pend = pbuf + sizeof(pbuf);
+    char *enc = AMF_EncodeInt32(body, pend, val);
+
+    if (extra >= 0) {
+        *enc++ = extra;
+    }
+    return send_message(r, 0x02, type, 0, body, enc);
+}
+
+// _result or onStatus with an info object of level "status"
+static int send_status(RTMP *r, const char *method, double txn, uint32_t stream_id,
+                       const char *code, const char *description)
+{
+    char pbuf[RTMP_MAX_HEADER_SIZE + 512];
+    char *body = pbuf + RTMP_MAX_HEADER_SIZE, *pend = pbuf + sizeof(pbuf);
+    char *enc = body;
+    AVal val;
+
+    val = aval(method);
+    enc = AMF_EncodeString(enc, pend, &val);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+
+    if (!strcmp(code, "NetConnection.Connect.Success")) {
+        AVal name = aval("fmsVer");
+        val = aval("FMS/3,5,7,7009");
+        *enc++ = AMF_OBJECT;
+        enc = AMF_EncodeNamedString(enc, pend, &name, &val);
+        name = aval("capabilities");
+        enc = AMF_EncodeNamedNumber(enc, pend, &name, 31.0);
+        enc = AMF_EncodeInt24(enc, pend, AMF_OBJECT_END);
+    } else {
+        *enc++ = AMF_NULL;
+    }
+
+    AVal name = aval("level");
+    val = aval("status");
+    *enc++ = AMF_OBJECT;
+    enc = AMF_EncodeNamedString(enc, pend, &name, &val);
+    name = aval("code");
+    val = aval(code);
+    enc = AMF_EncodeNamedString(enc, pend, &name, &val);
+    name = aval("description");
+    val = aval(description);
+    enc = AMF_EncodeNamedString(enc, pend, &name, &val);
+    enc = AMF_EncodeInt24(enc, pend, AMF_OBJECT_END);
+
+    return send_message(r, 0x03, RTMP_PACKET_TYPE_INVOKE, stream_id, body, enc);
+}
+
+// _result of createStream, releaseStream ...
+static int send_result(RTMP *r, double txn, int stream_id = -1)
+{
+    char pbuf[RTMP_MAX_HEADER_SIZE + 64];
+    char *body = pbuf + RTMP_MAX_HEADER_SIZE, *pend = pbuf + sizeof(pbuf);
+    char *enc = body;
+    AVal val = aval("_result");
+
+    enc = AMF_EncodeString(enc, pend, &val);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+    *enc++ = AMF_NULL;
+    if (stream_id >= 0) {
+        enc = AMF_EncodeNumber(enc, pend, stream_id);
+    } else {
+        *enc++ = AMF_UNDEFINED;
+    }
+    return send_message(r, 0x03, RTMP_PACKET_TYPE_INVOKE, 0, body, enc);
+}
+
+RtmpServer::RtmpServer() :
+    m_msg_cb(NULL), m_msg_opaque(NULL),
+    m_listen_fd(-1), m_client_fd(-1), m_port(0),
+    m_thrd(NULL), m_quit(false), m_publishing(false)
+{
+}
+
+RtmpServer::~RtmpServer()
+{
+    stop();
+}
+
+void RtmpServer::set_message_callback(rtmp_server_message_cb cb, void *opaque)
+{
+    m_msg_cb = cb;
+    m_msg_opaque = opaque;
+}
+
+int RtmpServer::start(const std::string &addr, int port, const std::string &flvpath)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int on = 1;
+
+    if (m_thrd) {
+        E("Rtmp server already started");
+        return -1;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr.c_str(), &sin.sin_addr) != 1) {
+        E("Invalid address \"%s\"", STR(addr));
+        return -1;
+    }
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+        E("socket() failed: %s", ERRNOMSG);
+        return -1;
+    }
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(m_listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        listen(m_listen_fd, 4) < 0 ||
+        getsockname(m_listen_fd, (struct sockaddr *) &sin, &len) < 0) {
+        E("Listen on %s:%d failed: %s", STR(addr), port, ERRNOMSG);
+        SAFE_CLOSE(m_listen_fd);
+        return -1;
+    }
+    m_port = ntohs(sin.sin_port);
+
+    if (!flvpath.empty() &&
+        m_flvmuxer.set_file(flvpath) < 0) {
+        E("Open \"%s\" failed", STR(flvpath));
+        SAFE_CLOSE(m_listen_fd);
+        return -1;
+    }
+
+    m_quit = false;
+    m_thrd = CREATE_THREAD_ROUTINE(serve_routine, NULL, false);
+
+    I("Rtmp server listening on %s:%d", STR(addr), m_port);
+    return 0;
+}
+
+void RtmpServer::stop()
+{
+    if (!m_thrd)
+        return;
+
+    m_quit = true;
+    BEGIN
+    AutoLock l(m_mutex);
+    if (m_client_fd >= 0) {
+        // Wakes up the blocking read
+        shutdown(m_client_fd, SHUT_RDWR);
+    }
+    END
+    JOIN_DELETE_THREAD(m_thrd);
+    SAFE_CLOSE(m_listen_fd);
+}
+
+RtmpServerStats RtmpServer::stats() const
+{
+    AutoLock l(m_mutex);
+    return m_stats;
+}
+
+unsigned int RtmpServer::serve_routine(void *arg)
+{
+    struct pollfd pfd;
+    pfd.fd = m_listen_fd;
+    pfd.events = POLLIN;
+
+    TRACE_THREAD_NAME(THREAD_NAME);
+
+    while (!m_quit) {
+        int ret = poll(&pfd, 1, ACCEPT_POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            E("poll() failed: %s", ERRNOMSG);
+            break;
+        }
+        if (ret <= 0)
+            continue;
+
+        int fd = accept(m_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            W("accept() failed: %s (cont)", ERRNOMSG);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        BEGIN
+        AutoLock l(m_mutex);
+        m_client_fd = fd;
+        ++m_stats.connections;
+        END
+
+        serve(fd);
+        m_publishing = false;
+    }
+    return 0;
+}
+
+void RtmpServer::serve(int fd)
+{
+    RTMP *r = RTMP_Alloc();
+    RTMPPacket packet;
+
+    RTMP_Init(r);
+    r->m_sb.sb_socket = fd;
+    memset(&packet, 0, sizeof(packet));
+
+    if (m_quit || !RTMP_Serve(r)) {
+        E("Rtmp handshake failed");
+        goto out;
+    }
+
+    while (!m_quit && RTMP_IsConnected(r) &&
+           RTMP_ReadPacket(r, &packet)) {
+        if (!RTMPPacket_IsReady(&packet))
+            continue;
+
+        int ret = handle_packet(r, &packet);
+        RTMPPacket_Free(&packet);
+        if (ret < 0)
+            break;
+    }
+
+out:
+    RTMPPacket_Free(&packet);
+    BEGIN
+    AutoLock l(m_mutex);
+    m_client_fd = -1;
+    END
+    // Closes fd too
+    RTMP_Close(r);
+    RTMP_Free(r);
+    D("Rtmp publisher disconnected");
+}
+
+int RtmpServer::handle_packet(RTMP *r, RTMPPacket *packet)
+{
+    RtmpServerMessage msg;
+    const uint8_t *body = (const uint8_t *) packet->m_body;
+
+    msg.arrival_us = get_time_now_us();
+    msg.type = packet->m_packetType;
+    msg.timestamp = packet->m_nTimeStamp;
+    msg.size = packet->m_nBodySize;
+    msg.stream_id = packet->m_nInfoField2;
+
+    switch (packet->m_packetType) {
+    case RTMP_PACKET_TYPE_CHUNK_SIZE:
+        if (packet->m_nBodySize >= 4) {
+            r->m_inChunkSize = AMF_DecodeInt32(packet->m_body);
+            D("Publisher chunk size: %d", r->m_inChunkSize);
+        }
+        return 0;
+
+    case RTMP_PACKET_TYPE_INVOKE:
+        return handle_invoke(r, packet);
+
+    case RTMP_PACKET_TYPE_INFO:
+    case RTMP_PACKET_TYPE_AUDIO:
+    case RTMP_PACKET_TYPE_VIDEO:
+        break;
+
+    default:
+        // Acks, user control, bandwidth ..
+        return 0;
+    }
+
+    BEGIN
+    AutoLock l(m_mutex);
+    if (msg.type == RTMP_PACKET_TYPE_VIDEO) {
+        ++m_stats.video_messages;
+    } else if (msg.type == RTMP_PACKET_TYPE_AUDIO) {
+        ++m_stats.audio_messages;
+    }
+    m_stats.bytes += msg.size;
+    END
+
+    if (m_flvmuxer.is_opened()) {
+        const uint8_t *data = body;
+        uint32_t size = msg.size;
+
+        if (msg.type == RTMP_PACKET_TYPE_INFO &&
+            size > SET_DATA_FRAME_LENGTH && data[0] == AMF_STRING &&
+            !memcmp(data + 3, "@setDataFrame", 13)) {
+            data += SET_DATA_FRAME_LENGTH;
+            size -= SET_DATA_FRAME_LENGTH;
+        }
+        if (m_flvmuxer.write_tag(msg.type, msg.timestamp, data, size) < 0) {
+            W("Write flv tag failed (cont)");
+        }
+    }
+
+    if (m_msg_cb) {
+        m_msg_cb(m_msg_opaque, msg, body);
+    }
+    return 0;
+}
+
+int RtmpServer::handle_invoke(RTMP *r, RTMPPacket *packet)
+{
+    AMFObject obj;
+    AVal method;
+    double txn;
+    int ret = 0;
+
+    if (packet->m_nBodySize < 1 || packet->m_body[0] != AMF_STRING) {
+        W("Invalid invoke packet (ignored)");
+        return 0;
+    }
+    if (AMF_Decode(&obj, packet->m_body, packet->m_nBodySize, FALSE) < 0) {
+        E("Decode invoke packet failed");
+        return -1;
+    }
+
+    AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
+    txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
+    D("Invoke %.*s, txn=%.0f", method.av_len, method.av_val, txn);
+
+    if (aval_is(method, "connect")) {
+        if (send_control(r, RTMP_PACKET_TYPE_SERVER_BW, SERVER_WINDOW_SIZE) < 0 ||
+            send_control(r, RTMP_PACKET_TYPE_CLIENT_BW, SERVER_WINDOW_SIZE, 2 /* dynamic */) < 0 ||
+            send_control(r, RTMP_PACKET_TYPE_CHUNK_SIZE, SERVER_CHUNK_SIZE) < 0) {
+            ret = -1;
+            goto out;
+        }
+        r->m_outChunkSize = SERVER_CHUNK_SIZE;
+        ret = send_status(r, "_result", txn, 0,
+                          "NetConnection.Connect.Success", "Connection succeeded.");
+    } else if (aval_is(method, "createStream")) {
+        ret = send_result(r, txn, SERVER_STREAM_ID);
+    } else if (aval_is(method, "publish")) {
+        AVal name;
+        AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &name);
+        I("Publish of \"%.*s\" started", name.av_len, name.av_val);
+
+        BEGIN
+        AutoLock l(m_mutex);
+        ++m_stats.publishes;
+        END
+        m_publishing = true;
+
+        // StreamBegin then the status the publisher waits for
+        char pbuf[RTMP_MAX_HEADER_SIZE + 6];
+        char *body = pbuf + RTMP_MAX_HEADER_SIZE, *pend = pbuf + sizeof(pbuf);
+        char *enc = AMF_EncodeInt16(body, pend, 0);
+        enc = AMF_EncodeInt32(enc, pend, SERVER_STREAM_ID);
+        if (send_message(r, 0x02, RTMP_PACKET_TYPE_CONTROL, 0, body, enc) < 0) {
+            ret = -1;
+            goto out;
+        }
+        ret = send_status(r, "onStatus", 0, SERVER_STREAM_ID,
+                          "NetStream.Publish.Start", "Start publishing.");
+    } else if (aval_is(method, "FCUnpublish") ||
+               aval_is(method, "deleteStream")) {
+        m_publishing = false;
+    } else if (txn > 0) {
+        // releaseStream, FCPublish and the like
+        ret = send_result(r, txn);
+    }
+
+out:
+    AMF_Reset(&obj);
+    return ret;
+}
@@ -0,0 +1,85 @@
+#ifndef _RTMP_SERVER_H_
+#define _RTMP_SERVER_H_
+
+#include "flv_muxer.h"
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct RTMP;
+struct RTMPPacket;
+
+// One message taken in from the publisher
+struct RtmpServerMessage {
+    uint8_t type;           // RTMP_PACKET_TYPE_*
+    uint32_t timestamp;     // Of the stream, in ms
+    uint32_t size;
+    uint32_t stream_id;
+    uint64_t arrival_us;    // Wall clock when its last chunk was read
+};
+
+typedef void (*rtmp_server_message_cb)(void *opaque, const RtmpServerMessage &msg,
+                                       const uint8_t *body);
+
+struct RtmpServerStats {
+    uint32_t connections;
+    uint32_t publishes;
+    uint64_t video_messages;
+    uint64_t audio_messages;
+    uint64_t bytes;         // Of the message bodies
+
+    RtmpServerStats() :
+        connections(0), publishes(0), video_messages(0), audio_messages(0), bytes(0) { }
+};
+
+/* Just enough of an rtmp server to take a publish: handshake, connect,
+ * createStream, publish, chunk reassembly, Set Chunk Size and acks (the
+ * latter two by librtmp). Publishers are served one at a time, so a
+ * reconnecting one is simply accepted again. Meant as a local stand-in
+ * for tests and benchmarks, run in-process or by rtmp_serve. */
+class RtmpServer {
+public:
+    RtmpServer();
+    ~RtmpServer();
+
+    // Called on the server thread, before start()
+    void set_message_callback(rtmp_server_message_cb cb, void *opaque);
+
+    // port 0 to pick a free one, see port(); the media of every publish
+    // goes to flvpath if not empty
+    int start(const std::string &addr, int port, const std::string &flvpath = "");
+    void stop();
+
+    int port() const { return m_port; }
+    RtmpServerStats stats() const;
+
+    // Whether a publish is going on
+    bool publishing() const { return m_publishing; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RtmpServer);
+    DECL_THREAD_ROUTINE(RtmpServer, serve_routine);
+
+    void serve(int fd);
+    int handle_packet(RTMP *r, RTMPPacket *packet);
+    int handle_invoke(RTMP *r, RTMPPacket *packet);
+
+    rtmp_server_message_cb m_msg_cb;
+    void *m_msg_opaque;
+    int m_listen_fd;
+    int m_client_fd;
+    int m_port;
+    xutil::Thread *m_thrd;
+    volatile bool m_quit;
+    volatile bool m_publishing;
+    FLVMuxer m_flvmuxer;
+    RtmpServerStats m_stats;
+    mutable xutil::Mutex m_mutex;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _RTMP_SERVER_H_ */
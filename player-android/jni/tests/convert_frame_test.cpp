@@ -0,0 +1,59 @@
+#include <vector>
+#include <libyuv.h>
+
+#include "video_encoder.h"
+#include "test.h"
+
+using namespace libyuv;
+
+// The whole frame in one go, what the bands must add up to
+static void convert_whole(const uint8_t *src, uint8_t *dst, int width, int height,
+                          RotationMode mode)
+{
+    int src_uv_stride = (width + 1) & ~1;
+    int dst_uv_stride = (width + 1) / 2;
+    int y_size = width * height;
+    int dst_uv_size = dst_uv_stride * ((height + 1) / 2);
+
+    NV12ToI420Rotate(src, width, src + y_size, src_uv_stride,
+                     dst, width,
+                     dst + y_size + dst_uv_size, dst_uv_stride,
+                     dst + y_size, dst_uv_stride,
+                     width, height, mode);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[][2] = {
+        { 160, 64 }, { 160, 66 }, { 160, 96 }, { 176, 144 }, { 161, 250 },
+        { 320, 270 }, { 640, 480 }, { 160, 63 }, { 33, 65 },
+    };
+
+    for (size_t s = 0; s < NELEM(sizes); ++s) {
+        int width = sizes[s][0], height = sizes[s][1];
+        int src_size = width * height + ((width + 1) & ~1) * ((height + 1) / 2);
+        int dst_size = width * height + (width + 1) / 2 * ((height + 1) / 2) * 2;
+        std::vector<uint8_t> src(src_size), expected(dst_size), dst(dst_size);
+        unsigned int seed = s + 1;
+
+        for (int i = 0; i < src_size; ++i) {
+            src[i] = rand_r(&seed) & 0xFF;
+        }
+
+        for (int rotation = 0; rotation <= 270; rotation += 90) {
+            convert_whole(&src[0], &expected[0], width, height,
+                          rotation == 180 ? kRotate180 : kRotate0);
+
+            for (int bands = 1; bands <= 9; ++bands) {
+                memset(&dst[0], 0, dst_size);
+                convert_frame(&src[0], &dst[0], width, height, rotation, bands);
+                if (dst != expected) {
+                    fprintf(stderr, "%dx%d rotation %d in %d bands differs\n",
+                            width, height, rotation, bands);
+                    CHECK(dst == expected);
+                }
+            }
+        }
+    }
+    return TEST_RESULT();
+}
@@ -0,0 +1,125 @@
+#include <librtmp/rtmp.h>
+
+#include "dvr_ring.h"
+#include "fqrtmp_session.h"
+#include "test.h"
+
+using namespace xutil;
+
+// Flv tag bodies as RtmpHandler makes them, size bytes in all
+static void add(DVRRing *dvr, int pkttype, byte b0, byte b1, int size, uint64_t pts)
+{
+    std::vector<byte> body(size, 0);
+    body[0] = b0;
+    body[1] = b1;
+    RtmpPacket pkt(pkttype, &body[0], size, pts, pts);
+    CHECK_EQ(dvr->add_packet(&pkt), 0);
+}
+
+static void add_key(DVRRing *dvr, int size, uint64_t pts)
+{
+    add(dvr, RTMP_PACKET_TYPE_VIDEO, 0x17, 0x01, size, pts);
+}
+
+static void add_inter(DVRRing *dvr, int size, uint64_t pts)
+{
+    add(dvr, RTMP_PACKET_TYPE_VIDEO, 0x27, 0x01, size, pts);
+}
+
+static void add_avc_seq_hdr(DVRRing *dvr, uint64_t pts)
+{
+    add(dvr, RTMP_PACKET_TYPE_VIDEO, 0x17, 0x00, 5, pts);
+}
+
+static void add_aac(DVRRing *dvr, int size, uint64_t pts)
+{
+    add(dvr, RTMP_PACKET_TYPE_AUDIO, 0xAF, 0x01, size, pts);
+}
+
+// Whole GOPs go, oldest first
+static void test_gop_eviction(FQRtmpSession *session)
+{
+    DVRRing dvr(session, 2500, 0);
+
+    for (int gop = 0; gop < 2; ++gop) {
+        add_key(&dvr, 1000, gop * 300);
+        add_inter(&dvr, 100, gop * 300 + 100);
+        add_inter(&dvr, 100, gop * 300 + 200);
+    }
+    CHECK_EQ(dvr.get_bytes(), 2400);
+
+    add_key(&dvr, 1000, 600);
+    CHECK_EQ(dvr.get_bytes(), 2200);
+    CHECK_EQ(dvr.get_duration(), 300);
+}
+
+// A GOP over the byte budget keeps its key frame, is cut short, and the
+// ring takes up again at the next key frame
+static void test_gop_over_bytes(FQRtmpSession *session)
+{
+    DVRRing dvr(session, 1500, 0);
+
+    add_key(&dvr, 1000, 0);
+    for (int i = 1; i <= 5; ++i) {
+        add_inter(&dvr, 100, i * 40);
+    }
+    CHECK_EQ(dvr.get_bytes(), 1500);
+
+    add_inter(&dvr, 100, 240);
+    CHECK_EQ(dvr.get_bytes(), 1500);
+    add_aac(&dvr, 10, 250);
+    add_inter(&dvr, 100, 280);
+    CHECK_EQ(dvr.get_bytes(), 1500);
+
+    // Sequence headers are still taken
+    add_avc_seq_hdr(&dvr, 300);
+    CHECK_EQ(dvr.get_bytes(), 1505);
+
+    add_key(&dvr, 1000, 320);
+    CHECK_EQ(dvr.get_bytes(), 1000);
+    add_inter(&dvr, 100, 360);
+    CHECK_EQ(dvr.get_bytes(), 1100);
+    CHECK_EQ(dvr.get_duration(), 40);
+}
+
+// Ditto by duration
+static void test_gop_over_duration(FQRtmpSession *session)
+{
+    DVRRing dvr(session, 0, 1000);
+
+    add_key(&dvr, 1000, 0);
+    for (int i = 1; i <= 10; ++i) {
+        add_inter(&dvr, 100, i * 100);
+    }
+    CHECK_EQ(dvr.get_duration(), 1000);
+
+    add_inter(&dvr, 100, 1100);
+    CHECK_EQ(dvr.get_duration(), 1000);
+    CHECK_EQ(dvr.get_bytes(), 2000);
+}
+
+// A key frame over the budget on its own still stays
+static void test_key_frame_over_budget(FQRtmpSession *session)
+{
+    DVRRing dvr(session, 500, 0);
+
+    add_key(&dvr, 1000, 0);
+    CHECK_EQ(dvr.get_bytes(), 1000);
+    add_inter(&dvr, 100, 40);
+    CHECK_EQ(dvr.get_bytes(), 1000);
+    add_key(&dvr, 800, 80);
+    CHECK_EQ(dvr.get_bytes(), 800);
+}
+
+int main(int argc, char *argv[])
+{
+    FQRtmpSession session;
+
+    test_gop_eviction(&session);
+    test_gop_over_bytes(&session);
+    test_gop_over_duration(&session);
+    test_key_frame_over_budget(&session);
+
+    CHECK_EQ(session.mem_budget()->used(MEM_DVR), 0);
+    return TEST_RESULT();
+}
@@ -0,0 +1,84 @@
+#include "video_encoder.h"
+#include "test.h"
+
+#define FPS             15
+#define INTERVAL_US     (1000000 / FPS)
+
+// Frames of encode_us until the first step, -1 if none in max_frames;
+// the step is taken as VideoEncoder::adapt_effort() does
+static int frames_to_step(EffortCtrl &ctrl, uint32_t encode_us, int max_frames, int &step)
+{
+    for (int i = 1; i <= max_frames; ++i) {
+        step = ctrl.update(encode_us);
+        if (step) {
+            ctrl.level += step;
+            return i;
+        }
+    }
+    step = 0;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    EffortCtrl ctrl;
+    Rational fps;
+    int step, n;
+
+    fps.num = FPS;
+    fps.den = 1;
+    ctrl.init(fps);
+    int start_level = ctrl.level;
+    CHECK(start_level > 0);
+    CHECK_EQ(ctrl.interval_us, INTERVAL_US);
+
+    // In the band, never a step
+    CHECK_EQ(frames_to_step(ctrl, INTERVAL_US * 60 / 100, 1000, step), -1);
+
+    // Headroom: up a level once it lasted EFFORT_UP_SECS (3 s)
+    n = frames_to_step(ctrl, INTERVAL_US * 20 / 100, 1000, step);
+    CHECK_EQ(step, 1);
+    CHECK(n >= 3 * FPS && n <= 3 * FPS + FPS);
+    CHECK_EQ(ctrl.level, start_level + 1);
+
+    // Behind: down again after the average settled, the way back up
+    // takes twice as long then
+    n = frames_to_step(ctrl, INTERVAL_US * 2, 1000, step);
+    CHECK_EQ(step, -1);
+    CHECK(n <= 2 * FPS);
+    CHECK_EQ(ctrl.level, start_level);
+    n = frames_to_step(ctrl, INTERVAL_US * 20 / 100, 1000, step);
+    CHECK_EQ(step, 1);
+    CHECK(n >= 6 * FPS && n <= 6 * FPS + 2 * FPS);
+
+    // Doubled up to EFFORT_UP_MAX_SECS (30 s) at most
+    for (int i = 0; i < 6; ++i) {
+        frames_to_step(ctrl, INTERVAL_US * 2, 1000, step);
+        CHECK_EQ(step, -1);
+        frames_to_step(ctrl, INTERVAL_US * 20 / 100, 10000, step);
+        CHECK_EQ(step, 1);
+    }
+    frames_to_step(ctrl, INTERVAL_US * 2, 1000, step);
+    n = frames_to_step(ctrl, INTERVAL_US * 20 / 100, 10000, step);
+    CHECK_EQ(step, 1);
+    CHECK(n >= 30 * FPS && n <= 30 * FPS + 2 * FPS);
+
+    // Steadily behind: down to level 0 and no further
+    for (int i = 0; i < 20 && ctrl.level > 0; ++i) {
+        frames_to_step(ctrl, INTERVAL_US * 2, 1000, step);
+        CHECK_EQ(step, -1);
+    }
+    CHECK_EQ(ctrl.level, 0);
+    CHECK_EQ(frames_to_step(ctrl, INTERVAL_US * 2, 1000, step), -1);
+
+    // Steadily ahead: up to the top level and no further
+    int last_level = -1;
+    for (int i = 0; i < 20 && ctrl.level != last_level; ++i) {
+        last_level = ctrl.level;
+        frames_to_step(ctrl, INTERVAL_US * 10 / 100, 10000, step);
+    }
+    CHECK(ctrl.level > start_level);
+    CHECK_EQ(frames_to_step(ctrl, INTERVAL_US * 10 / 100, 10000, step), -1);
+
+    return TEST_RESULT();
+}
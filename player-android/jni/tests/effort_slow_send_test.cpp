@@ -0,0 +1,122 @@
+/* Adaptive effort in slice mode, publishing through NetImpairProxy at a
+ * rate well below the stream's: the sends fall behind, x264 doesn't, and
+ * the effort must not be stepped down for what the connection takes. */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <librtmp/rtmp.h>
+
+#include "fqrtmp_session.h"
+#include "rtmp_server.h"
+#include "net_impair.h"
+#include "metrics.h"
+#include "test.h"
+
+using namespace xutil;
+
+#define RUN_MS          6000
+#define FPS             15
+#define WIDTH           320
+#define HEIGHT          240
+// Well below what the encoder puts out, with little room to queue
+#define SCHEDULE        "rate=400k queue=16k"
+#define SNDBUF_BYTES    (32 * 1024)
+
+// Of the publisher's connection to port, found among the open fds: a
+// loopback socket takes megabytes before a send blocks, an uplink doesn't
+static bool shrink_send_buffer(int port, int bytes)
+{
+    for (int fd = 3; fd < 1024; ++fd) {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof(sin);
+        if (getpeername(fd, (struct sockaddr *) &sin, &len) < 0 ||
+            sin.sin_family != AF_INET || ntohs(sin.sin_port) != port)
+            continue;
+        return setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == 0;
+    }
+    return false;
+}
+
+static void on_message(void *opaque, const RtmpServerMessage &msg, const uint8_t *body)
+{
+    if (msg.type == RTMP_PACKET_TYPE_VIDEO) {
+        ++*(int *) opaque;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // The connection may be torn down with a send blocked on it
+    signal(SIGPIPE, SIG_IGN);
+    xlog_set_sinks(0);
+
+    int arrived = 0;
+    RtmpServer server;
+    server.set_message_callback(on_message, &arrived);
+    CHECK_EQ(server.start("127.0.0.1", 0, ""), 0);
+
+    std::vector<NetPhase> phases;
+    CHECK_EQ(net_schedule_parse(SCHEDULE, phases), 0);
+    NetImpairProxy proxy;
+    CHECK_EQ(proxy.start(0, "127.0.0.1", server.port(), phases), 0);
+
+    SessionConfig config;
+    CHECK_EQ(config.parse(sprintf_("--live rtmp://127.0.0.1:%d/live/test",
+                                   proxy.port()).c_str()), 0);
+    FQRtmpSession session;
+    VideoConfig vc;
+    vc.width = WIDTH;
+    vc.height = HEIGHT;
+    // Noise at what it takes, frames are large for the rate to choke on
+    vc.bitrate = 8000 * 1000;
+    vc.fps.num = vc.orig_fps.num = FPS;
+    vc.fps.den = vc.orig_fps.den = 1;
+    vc.slice_max_size = 1200;
+    vc.adaptive_effort = true;
+    CHECK_EQ(session.open_video_encoder(vc), 0);
+    int start_level = gmetrics.gauges[METRIC_VIDEO_EFFORT];
+    if (session.open(config) < 0) {
+        CHECK(!"open session");
+        return TEST_RESULT();
+    }
+    CHECK(shrink_send_buffer(proxy.port(), SNDBUF_BYTES));
+
+    std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2);
+    uint64_t start_us = get_time_now_us();
+    int video_frames = 0;
+    uint32_t seed = 1;
+    for ( ; ; ) {
+        uint64_t elapsed_us = get_time_now_us() - start_us;
+        if (elapsed_us >= RUN_MS * 1000)
+            break;
+        uint64_t video_ts = (uint64_t) video_frames * 1000000 / FPS;
+        if (video_ts > elapsed_us) {
+            usleep(video_ts - elapsed_us);
+        }
+
+        foreach(frame, it) {
+            seed = seed * 1103515245 + 12345;
+            *it = seed >> 24;
+        }
+        // Refused at the memory cap is fine, the sends are what's slow
+        session.send_video(&frame[0], frame.size(), 0, video_ts / 1000);
+        ++video_frames;
+    }
+
+    // Set at a step only, since the open reset the metrics
+    int level = gmetrics.counters[METRIC_VIDEO_EFFORT_STEPS] ?
+        gmetrics.gauges[METRIC_VIDEO_EFFORT] : start_level;
+    CHECK(level >= start_level);
+
+    session.close_video_encoder();
+    session.close();
+    proxy.stop();
+    server.stop();
+
+    fprintf(stderr, "%d frames fed, %d arrived, effort level %d -> %d\n",
+            video_frames, arrived, start_level, level);
+    // The sends were behind all along
+    CHECK(arrived < video_frames * 3 / 4);
+    return TEST_RESULT();
+}
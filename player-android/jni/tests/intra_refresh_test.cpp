@@ -0,0 +1,132 @@
+/* A session in intra refresh mode writing an flv, framewise and in slice
+ * mode: every sweep starts at a key frame with a sequence header right
+ * before it, for a viewer joining there to decode from. */
+
+#include "fqrtmp_session.h"
+#include "metrics.h"
+#include "xfile.h"
+#include "test.h"
+
+using namespace xutil;
+
+#define FRAMES          75      // 5 sweeps, the last held by the interleaver
+#define FPS             15
+#define WIDTH           160
+#define HEIGHT          120
+#define DRAIN_MS        5000
+
+static uint32_t be24(const uint8_t *p)
+{
+    return (p[0]<<16) | (p[1]<<8) | p[2];
+}
+
+static uint64_t video_inflight()
+{
+    return gmetrics.counters[METRIC_VIDEO_FRAMES_IN] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_ENCODED] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_DROPPED];
+}
+
+static void push(const std::string &flvpath, int slice_max_size)
+{
+    SessionConfig config;
+    CHECK_EQ(config.parse(sprintf_("--flvpath %s", STR(flvpath)).c_str()), 0);
+    FQRtmpSession session;
+    VideoConfig vc;
+    vc.width = WIDTH;
+    vc.height = HEIGHT;
+    vc.bitrate = 200 * 1000;
+    vc.fps.num = vc.orig_fps.num = FPS;
+    vc.fps.den = vc.orig_fps.den = 1;
+    vc.i_frame_interval = 1;
+    vc.intra_refresh = true;
+    vc.slice_max_size = slice_max_size;
+    CHECK_EQ(session.open_video_encoder(vc), 0);
+    if (session.open(config) < 0) {
+        CHECK(!"open session");
+        return;
+    }
+
+    std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2, 128);
+    for (int i = 0; i < FRAMES; ++i) {
+        // A block moving over gray, for x264 to have something to code
+        memset(&frame[0], 128, WIDTH * HEIGHT);
+        for (int y = 40; y < 80; ++y) {
+            memset(&frame[y * WIDTH + i % (WIDTH - 40)], 250, 40);
+        }
+        while (session.send_video(&frame[0], frame.size(), 0,
+                                  (int64_t) i * 1000 / FPS) == SEND_DROPPED) {
+            usleep(500);
+        }
+    }
+
+    uint64_t drain_start = get_time_now();
+    while (video_inflight() && get_time_now() - drain_start < DRAIN_MS) {
+        usleep(1000);
+    }
+    CHECK_EQ(video_inflight(), 0);
+
+    session.close_video_encoder();
+    session.close();
+}
+
+// Key frames, and those with a sequence header just before
+static void count_keys(const std::string &path, int &keys, int &keys_with_hdr)
+{
+    xfile::File file;
+    std::vector<uint8_t> flv;
+    if (file.open(path, "rb") && file.size() > 0) {
+        flv.resize(file.size());
+        if (!file.read_buffer(&flv[0], flv.size())) {
+            flv.clear();
+        }
+    }
+    const uint8_t *p = flv.empty() ? NULL : &flv[0];
+    size_t size = flv.size(), pos = 13;
+    bool after_hdr = false;
+
+    keys = keys_with_hdr = 0;
+    CHECK(size >= 13 && !memcmp(p, "FLV\x01", 4));
+    while (pos + 11 <= size) {
+        uint8_t type = p[pos] & 0x1F;
+        uint32_t data_size = be24(p + pos + 1);
+        if (pos + 11 + data_size + 4 > size)
+            break;
+
+        if (type == 9 && data_size >= 2) {
+            const uint8_t *body = p + pos + 11;
+            if (body[1] == 0x00) {          // AVC sequence header
+                after_hdr = true;
+            } else {
+                if (body[0]>>4 == 1) {      // Key frame
+                    ++keys;
+                    keys_with_hdr += after_hdr;
+                }
+                after_hdr = false;
+            }
+        }
+        pos += 11 + data_size + 4;
+    }
+    CHECK_EQ(pos, size);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int slice_max_sizes[] = { 0, 400 };
+    std::string flvpath = sprintf_("/tmp/intra_refresh_test.%d.flv", (int) getpid());
+
+    xlog_set_sinks(0);
+
+    for (unsigned i = 0; i < NELEM(slice_max_sizes); ++i) {
+        push(flvpath, slice_max_sizes[i]);
+
+        int keys, keys_with_hdr;
+        count_keys(flvpath, keys, keys_with_hdr);
+        fprintf(stderr, "slice_max_size %d: %d keys, %d with a sequence header\n",
+                slice_max_sizes[i], keys, keys_with_hdr);
+        CHECK(keys > 1);
+        CHECK_EQ(keys_with_hdr, keys);
+        unlink(STR(flvpath));
+    }
+    return TEST_RESULT();
+}
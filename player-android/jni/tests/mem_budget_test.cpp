@@ -0,0 +1,80 @@
+#include <vector>
+
+#include "mem_budget.h"
+#include "test.h"
+
+#define CAP     100000
+
+struct Calls {
+    std::vector<bool> pressure;
+    std::vector<int64_t> used;
+};
+
+static void on_pressure(void *opaque, bool pressure, int64_t used)
+{
+    Calls *calls = (Calls *) opaque;
+    calls->pressure.push_back(pressure);
+    calls->used.push_back(used);
+}
+
+int main(int argc, char *argv[])
+{
+    MemBudget budget;
+    Calls calls;
+
+    // No cap, accounting only
+    budget.add(MEM_JITTER, 1000000);
+    CHECK_EQ(budget.used(), 1000000);
+    CHECK(!budget.pressure());
+    CHECK(!budget.full());
+    budget.add(MEM_JITTER, -1000000);
+
+    budget.set_cap(CAP);
+    budget.set_pressure_callback(on_pressure, &calls);
+
+    // Up to the high watermark
+    budget.add(MEM_VIDEO_QUEUE, CAP * 79 / 100);
+    CHECK(!budget.pressure());
+    budget.add(MEM_DVR, CAP / 100);
+    CHECK(budget.pressure());
+    CHECK_EQ(calls.pressure.size(), 1);
+    CHECK(calls.pressure.size() == 1 && calls.pressure[0]);
+    CHECK_EQ(calls.used.back(), CAP * 80 / 100);
+
+    // Between the watermarks the state holds either way, no more calls
+    budget.add(MEM_VIDEO_QUEUE, -CAP * 15 / 100);
+    CHECK(budget.pressure());
+    budget.add(MEM_AUDIO_BUFFER, CAP * 10 / 100);
+    CHECK(budget.pressure());
+    CHECK_EQ(calls.pressure.size(), 1);
+
+    // At the cap, input is refused
+    CHECK(!budget.full());
+    budget.add(MEM_JITTER, CAP * 25 / 100);
+    CHECK(budget.full());
+    budget.add(MEM_JITTER, -CAP * 25 / 100);
+    CHECK(!budget.full());
+
+    // Down to the low watermark
+    budget.add(MEM_AUDIO_BUFFER, -CAP * 10 / 100);
+    budget.add(MEM_VIDEO_QUEUE, -CAP * 4 / 100);
+    CHECK(budget.pressure());
+    budget.add(MEM_VIDEO_QUEUE, -CAP * 1 / 100);
+    CHECK(!budget.pressure());
+    CHECK_EQ(calls.pressure.size(), 2);
+    CHECK(calls.pressure.size() == 2 && !calls.pressure[1]);
+    CHECK_EQ(calls.used.back(), CAP * 60 / 100);
+
+    // And climbing back between them doesn't start it again
+    budget.add(MEM_VIDEO_QUEUE, CAP * 19 / 100);
+    CHECK(!budget.pressure());
+    CHECK_EQ(calls.pressure.size(), 2);
+
+    CHECK_EQ(budget.used(MEM_VIDEO_QUEUE), CAP * 78 / 100);
+    CHECK_EQ(budget.used(MEM_DVR), CAP / 100);
+    CHECK_EQ(budget.used(MEM_AUDIO_BUFFER), 0);
+    CHECK_EQ(budget.used(MEM_JITTER), 0);
+    CHECK_EQ(budget.used(), CAP * 79 / 100);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,117 @@
+/* MEMORY_PRESSURE of a session: crossing a watermark on another thread
+ * (the interleaver's, under its lock) sends nothing there; the event
+ * comes from within the next send_video() instead, once per change of
+ * state, with a listener calling back into the session. */
+
+#include <pthread.h>
+#include <vector>
+
+#include "fqrtmp_session.h"
+#include "test.h"
+
+using namespace xutil;
+
+#define CAP             1000000
+#define WIDTH           160
+#define HEIGHT          120
+
+struct Events {
+    FQRtmpSession *session;
+    std::vector<int64_t> pressure;
+    int off_thread;
+};
+
+static pthread_t main_thread;
+
+static void on_event(void *opaque, libfqrtmp_event type, int64_t arg1, const char *arg2)
+{
+    Events *events = (Events *) opaque;
+
+    if (type != MEMORY_PRESSURE)
+        return;
+    events->pressure.push_back(arg1);
+    events->off_thread += !pthread_equal(pthread_self(), main_thread);
+    // As a java listener may
+    events->session->request_keyframe();
+}
+
+struct Adds {
+    MemBudget *budget;
+    std::vector<int64_t> bytes;
+};
+
+static void *add_routine(void *arg)
+{
+    Adds *adds = (Adds *) arg;
+
+    foreach(adds->bytes, it) {
+        adds->budget->add(MEM_JITTER, *it);
+    }
+    return NULL;
+}
+
+static void add_on_thread(MemBudget *budget, const int64_t *bytes, int n)
+{
+    Adds adds;
+    adds.budget = budget;
+    adds.bytes.assign(bytes, bytes + n);
+
+    pthread_t thrd;
+    CHECK_EQ(pthread_create(&thrd, NULL, add_routine, &adds), 0);
+    pthread_join(thrd, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    xlog_set_sinks(0);
+    main_thread = pthread_self();
+
+    FQRtmpSession session;
+    VideoConfig vc;
+    vc.width = WIDTH;
+    vc.height = HEIGHT;
+    CHECK_EQ(session.open_video_encoder(vc), 0);
+    SessionConfig config;
+    CHECK_EQ(config.parse(sprintf_("--memcap %d", CAP).c_str()), 0);
+    if (session.open(config) < 0) {
+        CHECK(!"open session");
+        return TEST_RESULT();
+    }
+
+    Events events;
+    events.session = &session;
+    events.off_thread = 0;
+    session.set_event_callback(on_event, &events);
+
+    std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2, 128);
+    MemBudget *budget = session.mem_budget();
+
+    // On, off the thread that crossed
+    static const int64_t on[] = { CAP * 9 / 10 };
+    add_on_thread(budget, on, NELEM(on));
+    CHECK(budget->pressure());
+    CHECK(events.pressure.empty());
+    CHECK_EQ(session.send_video(&frame[0], frame.size(), 0), SEND_SLOW_DOWN);
+    CHECK_EQ(events.pressure.size(), 1);
+    CHECK(events.pressure.size() == 1 && events.pressure[0] == 1);
+
+    // Off, on, off before the next send: only where it ends up
+    static const int64_t flaps[] = { -CAP * 9 / 10, CAP * 9 / 10, -CAP * 9 / 10 };
+    add_on_thread(budget, flaps, NELEM(flaps));
+    CHECK(!budget->pressure());
+    CHECK_EQ(events.pressure.size(), 1);
+    session.send_video(&frame[0], frame.size(), 0);
+    CHECK_EQ(events.pressure.size(), 2);
+    CHECK(events.pressure.size() == 2 && events.pressure[1] == 0);
+
+    // Off, on: no change to report
+    static const int64_t flap[] = { CAP * 9 / 10, -CAP * 9 / 10 };
+    add_on_thread(budget, flap, NELEM(flap));
+    session.send_video(&frame[0], frame.size(), 0);
+    CHECK_EQ(events.pressure.size(), 2);
+    CHECK_EQ(events.off_thread, 0);
+
+    session.close_video_encoder();
+    session.close();
+    return TEST_RESULT();
+}
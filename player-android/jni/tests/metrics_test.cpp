@@ -0,0 +1,43 @@
+#include "metrics.h"
+#include "test.h"
+
+static uint32_t percentile(MetricHistogram h, int pct)
+{
+    const MetricHistogramData &hist = gmetrics.histograms[h];
+    uint32_t buckets[METRIC_BUCKET_NUM];
+
+    for (int i = 0; i < METRIC_BUCKET_NUM; ++i) {
+        buckets[i] = hist.buckets[i];
+    }
+    return metric_percentile(buckets, hist.count, hist.max, pct);
+}
+
+int main(int argc, char *argv[])
+{
+    metrics_reset();
+    CHECK_EQ(percentile(METRIC_CONVERT_US, 50), 0);
+
+    // One value: every percentile is it, not its bucket's bound
+    metric_observe(METRIC_INTERLEAVE_WAIT_US, 51624);
+    CHECK_EQ(percentile(METRIC_INTERLEAVE_WAIT_US, 50), 51624);
+    CHECK_EQ(percentile(METRIC_INTERLEAVE_WAIT_US, 99), 51624);
+
+    // 1..100: 63 in [0, 64), 37 in [64, 128)
+    for (uint32_t us = 1; us <= 100; ++us) {
+        metric_observe(METRIC_CONVERT_US, us);
+    }
+    CHECK_EQ(percentile(METRIC_CONVERT_US, 50), 50);
+    uint32_t p90 = percentile(METRIC_CONVERT_US, 90);
+    CHECK(p90 >= 64 && p90 <= 100);
+    CHECK(percentile(METRIC_CONVERT_US, 99) >= p90);
+    CHECK_EQ(percentile(METRIC_CONVERT_US, 100), 100);
+
+    // Beyond the last bucket's start, up to the max
+    metric_observe(METRIC_RTMP_SEND_US, 5000000);
+    metric_observe(METRIC_RTMP_SEND_US, 3000000);
+    uint32_t p50 = percentile(METRIC_RTMP_SEND_US, 50);
+    CHECK(p50 >= 1u << (METRIC_BUCKET_NUM + METRIC_BUCKET_SHIFT - 2) && p50 <= 5000000);
+    CHECK_EQ(percentile(METRIC_RTMP_SEND_US, 99), 5000000);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,252 @@
+/* The publisher pipeline through NetImpairProxy into RtmpServer, all in
+ * process: the schedule of tools/net_impair.cpp, shortened, then a drop.
+ * Checks the capture to arrival latency of every phase, that the session
+ * keeps going without the connection, and the flv the server wrote. */
+
+#include <signal.h>
+#include <librtmp/rtmp.h>
+
+#include "fqrtmp_session.h"
+#include "rtmp_server.h"
+#include "net_impair.h"
+#include "latency_tracker.h"
+#include "metrics.h"
+#include "xfile.h"
+#include "test.h"
+
+using namespace xutil;
+
+#define SCHEDULE        "rate=1.5M dur=2s; rate=300k dur=2s rtt=200ms jitter=50ms; drop"
+#define PHASE_MS        2000
+// Left out of either phase, what was queued at a change
+#define GUARD_MS        500
+#define RUN_MS          5000
+#define FPS             15
+#define WIDTH           160
+#define HEIGHT          120
+
+// Arrival latency of each phase, in ms
+#define CLEAR_MAX_MS    500
+#define SLOW_MIN_MS     100     // Half the rtt
+#define SLOW_MAX_MS     1000
+
+struct Arrivals {
+    int length_size;
+    uint64_t last_arrival_us;
+    // Arrival and capture to arrival, in us
+    std::vector<std::pair<uint64_t, uint32_t> > latencies;
+
+    Arrivals() : length_size(4), last_arrival_us(0) { }
+};
+
+static void on_message(void *opaque, const RtmpServerMessage &msg, const uint8_t *body)
+{
+    Arrivals *arr = (Arrivals *) opaque;
+
+    arr->last_arrival_us = msg.arrival_us;
+    if (msg.type != RTMP_PACKET_TYPE_VIDEO)
+        return;
+
+    std::vector<LatencySEI> seis;
+    latency_sei_parse_video_tag(body, msg.size, arr->length_size, seis);
+    foreach(seis, it) {
+        arr->latencies.push_back(std::make_pair(msg.arrival_us,
+                    (uint32_t) (msg.arrival_us - it->capture_us)));
+    }
+}
+
+// Latencies (ms) of what arrived in [from_ms, to_ms] of the run
+static void phase_latency(const Arrivals &arr, uint64_t start_us,
+                          uint32_t from_ms, uint32_t to_ms,
+                          uint32_t &min_ms, uint32_t &max_ms, int &count)
+{
+    min_ms = ~0U, max_ms = 0, count = 0;
+    foreach(arr.latencies, it) {
+        uint64_t at_ms = (it->first - start_us) / 1000;
+        if (at_ms < from_ms || at_ms > to_ms)
+            continue;
+        min_ms = MIN(min_ms, it->second / 1000);
+        max_ms = MAX(max_ms, it->second / 1000);
+        ++count;
+    }
+}
+
+static uint32_t be24(const uint8_t *p)
+{
+    return (p[0]<<16) | (p[1]<<8) | p[2];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+    return (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+// Header, tag types, back pointers, timestamps in order, and the video
+// starting with its sequence header then a key frame
+static void check_flv(const std::string &path, int &tags)
+{
+    xfile::File file;
+    std::vector<uint8_t> flv;
+    if (file.open(path, "rb") && file.size() > 0) {
+        flv.resize(file.size());
+        if (!file.read_buffer(&flv[0], flv.size())) {
+            flv.clear();
+        }
+    }
+    const uint8_t *p = flv.empty() ? NULL : &flv[0];
+    size_t size = flv.size(), pos = 13;
+    uint32_t last_ts = 0;
+    int video_tags = 0;
+
+    tags = 0;
+    CHECK(size >= 13 && !memcmp(p, "FLV\x01", 4));
+    if (size < 13)
+        return;
+    CHECK_EQ(be32(p + 9), 0);
+
+    while (pos + 11 <= size) {
+        uint8_t type = p[pos] & 0x1F;
+        uint32_t data_size = be24(p + pos + 1);
+        uint32_t ts = be24(p + pos + 4) | (p[pos + 7]<<24);
+        if (pos + 11 + data_size + 4 > size)
+            break;
+
+        CHECK(type == 8 || type == 9 || type == 18);
+        CHECK(ts >= last_ts);
+        CHECK_EQ(be32(p + pos + 11 + data_size), 11 + data_size);
+        if (type == 9 && data_size >= 2) {
+            const uint8_t *body = p + pos + 11;
+            if (video_tags == 0) {
+                CHECK_EQ(body[1], 0x00);    // AVC sequence header
+            } else if (video_tags == 1) {
+                CHECK_EQ(body[0]>>4, 1);    // Key frame
+            }
+            ++video_tags;
+        }
+        last_ts = ts;
+        pos += 11 + data_size + 4;
+        ++tags;
+    }
+    CHECK_EQ(pos, size);
+    CHECK(video_tags > 0);
+}
+
+// The flv is closed once the server is gone
+static void run(const std::string &flvpath)
+{
+    Arrivals arr;
+    RtmpServer server;
+    server.set_message_callback(on_message, &arr);
+    CHECK_EQ(server.start("127.0.0.1", 0, flvpath), 0);
+
+    std::vector<NetPhase> phases;
+    CHECK_EQ(net_schedule_parse(SCHEDULE, phases), 0);
+    CHECK_EQ(phases.size(), 3);
+    NetImpairProxy proxy;
+    CHECK_EQ(proxy.start(0, "127.0.0.1", server.port(), phases), 0);
+
+    SessionConfig config;
+    CHECK_EQ(config.parse(sprintf_("--live rtmp://127.0.0.1:%d/live/test --latencysei 1",
+                                   proxy.port()).c_str()), 0);
+    FQRtmpSession session;
+    VideoConfig vc;
+    vc.width = WIDTH;
+    vc.height = HEIGHT;
+    vc.bitrate = 200 * 1000;
+    vc.fps.num = vc.orig_fps.num = FPS;
+    vc.fps.den = vc.orig_fps.den = 1;
+    AudioConfig ac;
+    CHECK_EQ(session.open_video_encoder(vc), 0);
+    CHECK_EQ(session.open_audio_encoder(ac), 0);
+    // The schedule starts with this connection
+    uint64_t start_us = get_time_now_us();
+    if (session.open(config) < 0) {
+        CHECK(!"open session");
+        return;
+    }
+
+    std::vector<uint8_t> frame(WIDTH * HEIGHT * 3 / 2, 128);
+    std::vector<uint8_t> pcm(ac.frame_length * ac.channels * 2);
+    uint64_t video_frames = 0, audio_frames = 0;
+    bool published_before_drop = false;
+    uint64_t worst_send_us = 0;
+
+    for ( ; ; ) {
+        uint64_t elapsed_us = get_time_now_us() - start_us;
+        if (elapsed_us >= RUN_MS * 1000)
+            break;
+        if (elapsed_us < 2 * PHASE_MS * 1000 - GUARD_MS * 1000 && server.publishing()) {
+            published_before_drop = true;
+        }
+
+        uint64_t video_ts = video_frames * 1000000 / FPS;
+        uint64_t audio_ts = audio_frames * ac.frame_length * 1000000 / ac.samplerate;
+        uint64_t next_us = MIN(video_ts, audio_ts);
+        if (next_us > elapsed_us) {
+            usleep(next_us - elapsed_us);
+        }
+
+        uint64_t send_start_us = get_time_now_us();
+        if (video_ts <= audio_ts) {
+            // A block moving over gray, for x264 to have something to code
+            memset(&frame[0], 128, WIDTH * HEIGHT);
+            for (int y = 40; y < 80; ++y) {
+                memset(&frame[y * WIDTH + video_frames % (WIDTH - 40)], 250, 40);
+            }
+            CHECK(session.send_video(&frame[0], frame.size(), 0, video_ts / 1000) >= 0);
+            ++video_frames;
+        } else {
+            CHECK(session.send_audio(&pcm[0], pcm.size()) >= 0);
+            ++audio_frames;
+        }
+        worst_send_us = MAX(worst_send_us, get_time_now_us() - send_start_us);
+    }
+
+    CHECK(published_before_drop);
+    // Gone with the drop, no reconnect: the session goes on sending into
+    // nothing without blocking, every send counted as failed
+    CHECK(!server.publishing());
+    CHECK(worst_send_us < 200 * 1000);
+    CHECK(gmetrics.counters[METRIC_RTMP_SEND_FAILED] > 0);
+    // One at the connect, one for the run of failures
+    CHECK(gmetrics.counters[METRIC_VIDEO_KEYFRAME_REQUESTS] <= 2);
+    CHECK(arr.last_arrival_us &&
+          arr.last_arrival_us - start_us < (2 * PHASE_MS + GUARD_MS) * 1000ULL);
+
+    session.close_video_encoder();
+    session.close_audio_encoder();
+    session.close();
+    proxy.stop();
+    server.stop();
+
+    uint32_t min_ms, max_ms;
+    int count;
+    phase_latency(arr, start_us, GUARD_MS, PHASE_MS, min_ms, max_ms, count);
+    fprintf(stderr, "rate=1.5M: %d frames, latency %u-%u ms\n", count, min_ms, max_ms);
+    CHECK(count > 0);
+    CHECK(max_ms < CLEAR_MAX_MS);
+
+    phase_latency(arr, start_us, PHASE_MS + GUARD_MS, 2 * PHASE_MS, min_ms, max_ms, count);
+    fprintf(stderr, "rate=300k rtt=200ms: %d frames, latency %u-%u ms\n", count, min_ms, max_ms);
+    CHECK(count > 0);
+    CHECK(min_ms >= SLOW_MIN_MS);
+    CHECK(max_ms < SLOW_MAX_MS);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string flvpath = sprintf_("/tmp/net_impair_test.%d.flv", (int) getpid());
+
+    // The publisher's socket is closed under it by the drop
+    signal(SIGPIPE, SIG_IGN);
+    xlog_set_sinks(0);
+
+    run(flvpath);
+
+    int tags;
+    check_flv(flvpath, tags);
+    CHECK(tags > 0);
+
+    unlink(STR(flvpath));
+    return TEST_RESULT();
+}
@@ -0,0 +1,86 @@
+#include <vector>
+
+#include "xring.h"
+#include "xutil.h"
+#include "test.h"
+
+using namespace xutil;
+
+// Byte i of the stream
+static uint8_t pattern(uint32_t i)
+{
+    return (uint8_t) (i * 7 + (i >> 8));
+}
+
+static void write_stream(RingBuffer &ring, uint32_t &written, uint32_t len)
+{
+    std::vector<uint8_t> buf(len);
+    for (uint32_t i = 0; i < len; ++i) {
+        buf[i] = pattern(written + i);
+    }
+    CHECK(ring.read_from_buffer(&buf[0], len));
+    written += len;
+}
+
+// The unread bytes are contiguous from consumed, whatever the wrap
+static bool check_stream(RingBuffer &ring, uint32_t read)
+{
+    const uint8_t *p = ring.get_pointer() + ring.consumed;
+    for (uint32_t i = 0; i < ring.published - ring.consumed; ++i) {
+        if (p[i] != pattern(read + i))
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    RingBuffer ring;
+    uint32_t written = 0, read = 0;
+
+    ring.initialize(100);
+    uint32_t size = ring.size;
+    CHECK(size >= 16*1024);
+    CHECK_EQ(size % sysconf(_SC_PAGESIZE), 0);
+
+    // The second mapping shows the first
+    ring.get_pointer()[10] = 0x5A;
+    CHECK_EQ(ring.get_pointer()[size + 10], 0x5A);
+
+    // Wrap around: written past the end, read through the mirror
+    write_stream(ring, written, size - 1000);
+    ring.ignore(size - 3000);
+    read += size - 3000;
+    write_stream(ring, written, 5000);
+    CHECK(ring.published > size);
+    CHECK_EQ(ring.size, size);
+    CHECK(check_stream(ring, read));
+
+    // Consumed past the end, back to the first mapping
+    ring.ignore(3500);
+    read += 3500;
+    CHECK(ring.consumed < size);
+    CHECK(ring.published < size);
+    CHECK(check_stream(ring, read));
+
+    // Filled up: grows by half at least, unread bytes kept in order
+    uint32_t unread = ring.published - ring.consumed;
+    write_stream(ring, written, size - unread + 1);
+    CHECK(ring.size >= size + size/2);
+    CHECK_EQ(ring.consumed, 0);
+    CHECK_EQ(ring.published, written - read);
+    CHECK(check_stream(ring, read));
+
+    // Wholly read, back to the start
+    ring.ignore_all();
+    CHECK_EQ(ring.consumed, 0);
+    CHECK_EQ(ring.published, 0);
+
+    ring.read_from_repeat(0xAB, 3);
+    ring.read_from_byte(0xCD);
+    CHECK_EQ(ring.published, 4);
+    CHECK_EQ(ring.get_pointer()[2], 0xAB);
+    CHECK_EQ(ring.get_pointer()[3], 0xCD);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,65 @@
+#include <vector>
+
+#include "video_encoder.h"
+#include "test.h"
+
+static x264_nal_t make_nal(int type, int first_mb, int last_mb)
+{
+    x264_nal_t nal;
+
+    memset(&nal, 0, sizeof(nal));
+    nal.i_type = type;
+    nal.i_first_mb = first_mb;
+    nal.i_last_mb = last_mb;
+    return nal;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<x264_nal_t> nals;
+
+    // As slice threads may hand them over, parameter sets in between
+    nals.push_back(make_nal(NAL_SLICE_IDR, 200, 299));
+    nals.push_back(make_nal(NAL_SPS, 0, 0));
+    nals.push_back(make_nal(NAL_SLICE_IDR, 0, 99));
+    nals.push_back(make_nal(NAL_PPS, 0, 0));
+    nals.push_back(make_nal(NAL_SLICE_IDR, 300, 329));
+    nals.push_back(make_nal(NAL_SEI, 0, 0));
+    nals.push_back(make_nal(NAL_SLICE_IDR, 100, 199));
+
+    sort_frame_nals(nals);
+
+    static const int types[] = {
+        NAL_SPS, NAL_PPS, NAL_SEI,
+        NAL_SLICE_IDR, NAL_SLICE_IDR, NAL_SLICE_IDR, NAL_SLICE_IDR
+    };
+    static const int first_mbs[] = { 0, 0, 0, 0, 100, 200, 300 };
+    CHECK_EQ(nals.size(), NELEM(types));
+    for (size_t i = 0; i < nals.size() && i < NELEM(types); ++i) {
+        CHECK_EQ(nals[i].i_type, types[i]);
+        CHECK_EQ(nals[i].i_first_mb, first_mbs[i]);
+    }
+
+    // Non-idr slices likewise; already in order, nothing moves
+    nals.clear();
+    nals.push_back(make_nal(NAL_SEI, 0, 0));
+    nals.push_back(make_nal(NAL_SLICE, 0, 49));
+    nals.push_back(make_nal(NAL_SLICE, 50, 79));
+    nals.push_back(make_nal(NAL_SLICE, 80, 99));
+    std::vector<x264_nal_t> sorted = nals;
+    sort_frame_nals(sorted);
+    for (size_t i = 0; i < nals.size(); ++i) {
+        CHECK_EQ(sorted[i].i_type, nals[i].i_type);
+        CHECK_EQ(sorted[i].i_first_mb, nals[i].i_first_mb);
+    }
+
+    // Reversed
+    std::vector<x264_nal_t> reversed(nals.rbegin(), nals.rend() - 1);
+    reversed.insert(reversed.begin(), nals[0]);
+    sort_frame_nals(reversed);
+    for (size_t i = 0; i < nals.size(); ++i) {
+        CHECK_EQ(reversed[i].i_first_mb, nals[i].i_first_mb);
+    }
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,31 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+
+/* Checks for the host tests ctest runs (see CMakeLists.txt): a failed one
+ * prints where and what and is counted, the test goes on; main() ends
+ * with return TEST_RESULT() */
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        ++test_failures; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long a_ = (long long) (a), b_ = (long long) (b); \
+    if (a_ != b_) { \
+        fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+                __FILE__, __LINE__, #a, #b, a_, b_); \
+        ++test_failures; \
+    } \
+} while (0)
+
+#define TEST_RESULT() \
+    (test_failures ? (fprintf(stderr, "%d check(s) failed\n", test_failures), 1) : 0)
+
+#endif /* end of _TEST_H_ */
@@ -0,0 +1,46 @@
+#include <string>
+
+#include "trace.h"
+#include "xfile.h"
+#include "test.h"
+
+using namespace xutil;
+
+static int count_events(const std::string &path, const char *phase)
+{
+    std::string json = xfile::File::read_content(path);
+    std::string needle = sprintf_("\"ph\":\"%s\"", phase);
+    int found = 0;
+
+    for (size_t pos = json.find(needle); pos != std::string::npos;
+         pos = json.find(needle, pos + 1)) {
+        ++found;
+    }
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string path = sprintf_("/tmp/trace_test.%d.json", (int) getpid());
+
+    CHECK_EQ(trace_start(), 0);
+    {
+        TraceScope scope("open across the restart");
+        trace_event("inner", 'B');
+        trace_event("inner", 'E');
+        CHECK_EQ(trace_stop(path), 0);
+        CHECK_EQ(count_events(path, "B"), 2);
+        CHECK_EQ(count_events(path, "E"), 1);
+
+        CHECK_EQ(trace_start(), 0);
+    }
+    // The scope's end belongs to the last trace, not to this one
+    trace_event("after", 'B');
+    trace_event("after", 'E');
+    CHECK_EQ(trace_stop(path), 0);
+    CHECK_EQ(count_events(path, "B"), 1);
+    CHECK_EQ(count_events(path, "E"), 1);
+
+    unlink(STR(path));
+    return TEST_RESULT();
+}
@@ -0,0 +1,42 @@
+#include <string>
+
+#include "xlog.h"
+#include "xfile.h"
+#include "test.h"
+
+using namespace xutil;
+
+// Written out by the logger thread alone, no xlog_flush()
+static bool wait_for(const std::string &path, const char *text)
+{
+    for (int i = 0; i < 200; ++i) {
+        if (xfile::File::read_content(path).find(text) != std::string::npos)
+            return true;
+        usleep(10*1000);
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string path = sprintf_("/tmp/xlog_test.%d.log", (int) getpid());
+
+    xlog_set_sinks(0);
+    CHECK_EQ(xlog_set_file(STR(path)), 0);
+
+    // Like an AVal, no NUL after the bytes
+    char *val = (char *) malloc(7);
+    memcpy(val, "connect", 7);
+    I("invoke <%.*s> <%.3s>", 7, val, val);
+    CHECK(wait_for(path, "invoke <connect> <con>"));
+
+    // Once idle, a new record wakes the logger thread again
+    usleep(50*1000);
+    I("after idle %d", 42);
+    CHECK(wait_for(path, "after idle 42"));
+
+    xlog_set_file(NULL);
+    free(val);
+    unlink(STR(path));
+    return TEST_RESULT();
+}
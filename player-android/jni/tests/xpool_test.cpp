@@ -0,0 +1,96 @@
+#include <pthread.h>
+
+#include "xpool.h"
+#include "xutil.h"
+#include "test.h"
+
+// Like xpool.cpp, blocks aren't kept under ASan
+#if defined(__SANITIZE_ADDRESS__)
+#define POOLED 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOLED 0
+#endif
+#endif
+#ifndef POOLED
+#define POOLED 1
+#endif
+
+// Class an alloc of size went to, XPOOL_CLASS_NUM for the large ones
+static int class_of(size_t size)
+{
+    XPoolStats before[XPOOL_CLASS_NUM + 1], after[XPOOL_CLASS_NUM + 1];
+    int cls = -1;
+
+    xpool_stats(before);
+    void *ptr = xpool_alloc(size);
+    xpool_stats(after);
+    for (int i = 0; i <= XPOOL_CLASS_NUM; ++i) {
+        if (after[i].allocs != before[i].allocs) {
+            CHECK_EQ(cls, -1);
+            cls = i;
+        }
+    }
+    memset(ptr, 0xA5, size);
+    xpool_free(ptr);
+    return cls;
+}
+
+static void *free_routine(void *arg)
+{
+    xpool_free(arg);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    XPoolStats stats[XPOOL_CLASS_NUM + 1];
+
+    xpool_stats(stats);
+    CHECK_EQ(stats[0].size, XPOOL_MIN_SIZE);
+    CHECK_EQ(stats[XPOOL_CLASS_NUM - 1].size, XPOOL_MAX_SIZE);
+    for (int i = 1; i < XPOOL_CLASS_NUM; ++i) {
+        // 64, 96, 128, 192, ...
+        CHECK_EQ(stats[i].size, i & 1 ? stats[i - 1].size * 3 / 2 : stats[i - 2].size * 2);
+    }
+
+    // The smallest class that holds the size
+    static const size_t sizes[] = {
+        1, 63, 64, 65, 95, 96, 97, 128, 129, 191, 192, 193, 1000, 4096, 4097,
+        3 * 1024 * 1024, 3 * 1024 * 1024 + 1, XPOOL_MAX_SIZE
+    };
+    for (size_t i = 0; i < NELEM(sizes); ++i) {
+        int cls = class_of(sizes[i]);
+        CHECK(cls >= 0 && cls < XPOOL_CLASS_NUM);
+        if (cls < 0 || cls >= XPOOL_CLASS_NUM)
+            continue;
+        CHECK(stats[cls].size >= sizes[i]);
+        CHECK(cls == 0 || stats[cls - 1].size < sizes[i]);
+    }
+    CHECK_EQ(class_of(XPOOL_MAX_SIZE + 1), XPOOL_CLASS_NUM);
+
+    // A freed block comes back to the next alloc of its class
+    int cls = class_of(1000);
+    void *ptr = xpool_alloc(1000);
+    xpool_free(ptr);
+    xpool_stats(stats);
+    uint64_t mallocs = stats[cls].mallocs;
+    void *again = xpool_alloc(1000);
+    xpool_stats(stats);
+    CHECK(!POOLED || again == ptr);
+    CHECK_EQ(stats[cls].mallocs, mallocs + (POOLED ? 0 : 1));
+
+    // Freed by a thread that then exits, picked up again from the depot
+    pthread_t tid;
+    pthread_create(&tid, NULL, free_routine, again);
+    pthread_join(tid, NULL);
+    xpool_stats(stats);
+    mallocs = stats[cls].mallocs;
+    ptr = xpool_alloc(1000);
+    xpool_stats(stats);
+    CHECK_EQ(stats[cls].mallocs, mallocs + (POOLED ? 0 : 1));
+    CHECK_EQ(stats[cls].in_use, 1);
+    xpool_free(ptr);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,375 @@
+#include <sys/resource.h>
+#include <sched.h>
+#include <fcntl.h>
+
+#include "thread_ctl.h"
+
+using namespace xutil;
+
+struct ThreadEntry {
+    char name[16];
+    pid_t tid;
+    bool alive;
+    // Kept from the last look, for when it's gone
+    int policy;
+    int nice;
+    uint64_t cpu_mask;
+    uint64_t start_ticks;   // utime + stime when sampling started
+    uint64_t ticks;
+    uint32_t samples;       // Taken while alive
+    uint32_t running;       // Of which it was on a cpu
+    uint32_t on_cpu[THREAD_CTL_MAX_CPUS];
+};
+
+class ThreadSampler {
+public:
+    ThreadSampler(uint32_t interval_ms);
+    ~ThreadSampler();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ThreadSampler);
+    DECL_THREAD_ROUTINE(ThreadSampler, sample_routine);
+    xutil::Thread *m_thrd;
+    uint32_t m_interval;
+    volatile bool m_quit;
+};
+
+static pthread_mutex_t ctl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadEntry entries[THREAD_CTL_MAX_THREADS];
+static int entry_num;
+// Never destroyed, threads may register while the process exits
+static std::vector<ThreadConfig> &configs = *new std::vector<ThreadConfig>;
+static ThreadSampler *sampler;
+static bool sampled;
+
+ThreadConfig::ThreadConfig() :
+    nice(THREAD_NICE_KEEP), fifo_priority(0), cpu_mask(0)
+{
+}
+
+static int parse_cpu_list(const char *list, uint64_t *mask)
+{
+    std::vector<std::string> ranges = split(list, ",");
+
+    *mask = 0;
+    foreach(ranges, it) {
+        int first, last;
+        int n = sscanf(it->c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            last = first;
+        } else if (n != 2) {
+            return -1;
+        }
+        if (first < 0 || last < first || last >= THREAD_CTL_MAX_CPUS)
+            return -1;
+        for (int cpu = first; cpu <= last; ++cpu) {
+            *mask |= 1ULL << cpu;
+        }
+    }
+    return *mask ? 0 : -1;
+}
+
+int ThreadConfig::parse(const char *spec)
+{
+    std::vector<std::string> fields = split(spec, ":");
+
+    if (fields.empty() || fields[0].empty()) {
+        E("No thread name in \"%s\"", spec);
+        return -1;
+    }
+    name = fields[0];
+
+    for (unsigned i = 1; i < fields.size(); ++i) {
+        const char *field = fields[i].c_str();
+        if (start_with(field, "nice=")) {
+            nice = atoi(field + 5);
+        } else if (start_with(field, "fifo=")) {
+            fifo_priority = atoi(field + 5);
+        } else if (start_with(field, "cpus=")) {
+            if (parse_cpu_list(field + 5, &cpu_mask) < 0) {
+                E("Invalid cpu list \"%s\" for thread %s", field + 5, STR(name));
+                return -1;
+            }
+        } else {
+            E("Unknown thread setting \"%s\" for thread %s", field, STR(name));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static std::string cpu_list(uint64_t mask)
+{
+    std::string list;
+
+    for (int cpu = 0; cpu < THREAD_CTL_MAX_CPUS; ++cpu) {
+        if (!(mask & (1ULL << cpu)))
+            continue;
+        int last = cpu;
+        while (last + 1 < THREAD_CTL_MAX_CPUS && (mask & (1ULL << (last + 1)))) {
+            ++last;
+        }
+        if (!list.empty()) {
+            list += ",";
+        }
+        list += last > cpu ? sprintf_("%d-%d", cpu, last) : sprintf_("%d", cpu);
+        cpu = last;
+    }
+    return list.empty() ? "-" : list;
+}
+
+// State, utime + stime and the cpu last run on, from the task's stat
+static int read_stat(pid_t tid, char *state, uint64_t *ticks, int *cpu)
+{
+    char path[64], buf[512];
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int) tid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    // The name in parentheses may hold anything, fields follow the last ')'
+    char *p = strrchr(buf, ')');
+    if (!p)
+        return -1;
+
+    char *saveptr = NULL;
+    uint64_t utime = 0, stime = 0;
+    int field = 3;
+    for (char *tok = strtok_r(p + 1, " ", &saveptr);
+         tok; tok = strtok_r(NULL, " ", &saveptr), ++field) {
+        if (field == 3) {
+            *state = tok[0];
+        } else if (field == 14) {
+            utime = strtoull(tok, NULL, 10);
+        } else if (field == 15) {
+            stime = strtoull(tok, NULL, 10);
+        } else if (field == 39) {
+            *cpu = atoi(tok);
+            break;
+        }
+    }
+    if (field != 39)
+        return -1;
+
+    *ticks = utime + stime;
+    return 0;
+}
+
+// Called with ctl_mutex held
+static void refresh_sched(ThreadEntry *entry)
+{
+    entry->policy = sched_getscheduler(entry->tid);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, entry->tid);
+    if (!errno) {
+        entry->nice = nice;
+    }
+    entry->cpu_mask = get_thread_affinity(entry->tid);
+}
+
+// Ditto
+static void apply_config(ThreadEntry *entry)
+{
+    foreach(configs, it) {
+        const ThreadConfig &config = *it;
+        if (config.name != entry->name)
+            continue;
+
+        if ((config.fifo_priority > 0 || config.nice != THREAD_NICE_KEEP) &&
+            set_thread_priority(entry->tid,
+                                config.nice != THREAD_NICE_KEEP ? config.nice : 0,
+                                config.fifo_priority) < 0) {
+            W("Scheduling of thread %s left as is (cont)", entry->name);
+        }
+        if (config.cpu_mask &&
+            set_thread_affinity(entry->tid, config.cpu_mask) < 0) {
+            W("Affinity of thread %s left as is (cont)", entry->name);
+        }
+        break;
+    }
+    refresh_sched(entry);
+}
+
+void thread_ctl_register(const char *name)
+{
+    set_thread_name(name);
+
+    pthread_mutex_lock(&ctl_mutex);
+    ThreadEntry *entry = NULL;
+    for (int i = 0; i < entry_num; ++i) {
+        // Same name, a thread of the encoder opened again
+        if (!strncmp(entries[i].name, name, sizeof(entries[i].name) - 1)) {
+            entry = &entries[i];
+            break;
+        }
+    }
+    if (!entry && entry_num < THREAD_CTL_MAX_THREADS) {
+        entry = &entries[entry_num++];
+    }
+    if (entry) {
+        memset(entry, 0, sizeof(*entry));
+        strncpy(entry->name, name, sizeof(entry->name) - 1);
+        entry->tid = gettid();
+        entry->alive = true;
+        char state;
+        int cpu;
+        read_stat(entry->tid, &state, &entry->start_ticks, &cpu);
+        entry->ticks = entry->start_ticks;
+        apply_config(entry);
+    } else {
+        W("Too many threads registered, %s left out", name);
+    }
+    pthread_mutex_unlock(&ctl_mutex);
+}
+
+void thread_ctl_unregister()
+{
+    pid_t tid = gettid();
+
+    pthread_mutex_lock(&ctl_mutex);
+    for (int i = 0; i < entry_num; ++i) {
+        ThreadEntry *entry = &entries[i];
+        if (entry->alive && entry->tid == tid) {
+            char state;
+            int cpu;
+            read_stat(tid, &state, &entry->ticks, &cpu);
+            refresh_sched(entry);
+            entry->alive = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctl_mutex);
+}
+
+void thread_ctl_configure(const std::vector<ThreadConfig> &configs_)
+{
+    pthread_mutex_lock(&ctl_mutex);
+    configs = configs_;
+    for (int i = 0; i < entry_num; ++i) {
+        if (entries[i].alive) {
+            apply_config(&entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&ctl_mutex);
+}
+
+/////////////////////////////////////////////////////////////
+
+ThreadSampler::ThreadSampler(uint32_t interval_ms) :
+    m_interval(interval_ms), m_quit(false)
+{
+    m_thrd = CREATE_THREAD_ROUTINE(sample_routine, NULL, false);
+}
+
+ThreadSampler::~ThreadSampler()
+{
+    m_quit = true;
+    JOIN_DELETE_THREAD(m_thrd);
+}
+
+unsigned int ThreadSampler::sample_routine(void *arg)
+{
+    set_thread_name("thread_sampler");
+
+    while (!m_quit) {
+        pthread_mutex_lock(&ctl_mutex);
+        for (int i = 0; i < entry_num; ++i) {
+            ThreadEntry *entry = &entries[i];
+            char state;
+            int cpu;
+
+            if (!entry->alive ||
+                read_stat(entry->tid, &state, &entry->ticks, &cpu) < 0)
+                continue;
+
+            ++entry->samples;
+            if (state == 'R' && cpu >= 0 && cpu < THREAD_CTL_MAX_CPUS) {
+                ++entry->running;
+                ++entry->on_cpu[cpu];
+            }
+        }
+        pthread_mutex_unlock(&ctl_mutex);
+
+        short_snap(m_interval, &m_quit, m_interval);
+    }
+    return 0;
+}
+
+int thread_ctl_sample_start(uint32_t interval_ms)
+{
+    if (sampler) {
+        E("Thread sampler already started");
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctl_mutex);
+    for (int i = 0; i < entry_num; ++i) {
+        ThreadEntry *entry = &entries[i];
+        char state;
+        int cpu;
+        entry->samples = entry->running = 0;
+        memset(entry->on_cpu, 0, sizeof(entry->on_cpu));
+        if (entry->alive) {
+            read_stat(entry->tid, &state, &entry->ticks, &cpu);
+        }
+        entry->start_ticks = entry->ticks;
+    }
+    sampled = true;
+    pthread_mutex_unlock(&ctl_mutex);
+
+    sampler = new ThreadSampler(MAX(interval_ms, 1u));
+    return 0;
+}
+
+void thread_ctl_sample_stop()
+{
+    SAFE_DELETE(sampler);
+}
+
+std::string thread_ctl_report()
+{
+    static const long ticks_per_sec = sysconf(_SC_CLK_TCK);
+    std::string text;
+
+    pthread_mutex_lock(&ctl_mutex);
+    if (!sampled) {
+        pthread_mutex_unlock(&ctl_mutex);
+        return text;
+    }
+
+    text += sprintf_("%-16s %6s %6s %4s %-10s %8s %6s  %s\n",
+                     "thread", "tid", "policy", "nice", "cpus", "cpu_ms", "run%",
+                     "residency");
+    for (int i = 0; i < entry_num; ++i) {
+        ThreadEntry *entry = &entries[i];
+        if (entry->alive) {
+            refresh_sched(entry);
+        }
+
+        const char *policy = entry->policy == SCHED_FIFO ? "fifo" :
+            entry->policy == SCHED_RR ? "rr" :
+            entry->policy == SCHED_OTHER ? "other" : "-";
+        std::string residency;
+        for (int cpu = 0; cpu < THREAD_CTL_MAX_CPUS; ++cpu) {
+            if (entry->on_cpu[cpu]) {
+                residency += sprintf_("%scpu%d %.0f%%", residency.empty() ? "" : " ",
+                                      cpu, entry->on_cpu[cpu] * 100.0 / entry->running);
+            }
+        }
+        text += sprintf_("%-16s %6d %6s %4d %-10s %8llu %6.1f  %s\n",
+                         entry->name, (int) entry->tid, policy, entry->nice,
+                         STR(cpu_list(entry->cpu_mask)),
+                         (long long unsigned) ((entry->ticks - entry->start_ticks) *
+                                               1000 / ticks_per_sec),
+                         entry->samples ? entry->running * 100.0 / entry->samples : 0,
+                         residency.empty() ? "-" : STR(residency));
+    }
+    pthread_mutex_unlock(&ctl_mutex);
+    return text;
+}
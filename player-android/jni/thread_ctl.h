@@ -0,0 +1,50 @@
+#ifndef _THREAD_CTL_H_
+#define _THREAD_CTL_H_
+
+#include <string>
+#include <vector>
+
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Name, scheduling and cpu placement of the pipeline threads, configured
+ * by thread name, and a sampler of where they actually run. A thread
+ * joins with thread_ctl_register() as it starts; configurations apply to
+ * the threads registered by then and to the ones joining later, so they
+ * may be set before or after the encoders are opened. Process wide. */
+
+#define THREAD_CTL_MAX_THREADS  16
+#define THREAD_CTL_MAX_CPUS     64
+#define THREAD_NICE_KEEP        0x7FFF
+
+struct ThreadConfig {
+    std::string name;
+    int nice;               // -20..19, THREAD_NICE_KEEP to leave it
+    int fifo_priority;      // SCHED_FIFO (if permitted) when > 0
+    uint64_t cpu_mask;      // Bit per cpu, 0 to leave it
+
+    ThreadConfig();
+    // "<name>[:nice=<n>][:fifo=<prio>][:cpus=<list>]", list like "4-7,0"
+    int parse(const char *spec);
+};
+
+// Names the calling thread and applies its configuration
+void thread_ctl_register(const char *name);
+// Before the calling thread returns, it stays in the report
+void thread_ctl_unregister();
+void thread_ctl_configure(const std::vector<ThreadConfig> &configs);
+
+// Where each registered thread is, every interval_ms
+int thread_ctl_sample_start(uint32_t interval_ms);
+void thread_ctl_sample_stop();
+// A line per thread: policy, nice, allowed cpus, cpu time, the share of
+// samples it was running and on which cpus; empty if never sampled
+std::string thread_ctl_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _THREAD_CTL_H_ */
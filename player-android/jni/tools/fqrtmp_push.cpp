@@ -0,0 +1,481 @@
+/* Pushes raw yuv (and pcm) files through the same pipeline as the app:
+ * x264/fdk-aac, the interleaver and the rtmp/flv output, e.g. to replay
+ * a session captured with DUMP_YUV on a server. Frames are paced in real
+ * time like the camera does, or fed as fast as the encoders take them
+ * (-x) to measure the throughput. Statistics of every stage are printed
+ * at exit.
+ * Usage: fqrtmp_push -i <file.yuv> -s <w>x<h> [options] -- <session options>
+ * where session options are the ones of nativeNew(), e.g.
+ *   fqrtmp_push -i cap.yuv -s 640x480 -a cap.pcm -- --live rtmp://host/app/name
+ *   fqrtmp_push -i cap.yuv -s 640x480 -p i420 -x -- --flvpath out.flv */
+
+#include <getopt.h>
+#include <signal.h>
+
+#include "fqrtmp_session.h"
+#include "metrics.h"
+#include "libyuv.h"
+#include "xfile.h"
+#include "xutil.h"
+
+using namespace xutil;
+using namespace libyuv;
+
+// Frames (or aac frames of pcm) waiting in the encoders in -x mode
+#define MAX_VIDEO_INFLIGHT      2
+#define MAX_AUDIO_INFLIGHT      4
+// Max time to wait for the encoders at the end
+#define DRAIN_TIMEOUT_MS        5000
+
+enum PixFmt { PIXFMT_NV21, PIXFMT_NV12, PIXFMT_I420 };
+
+struct PushOptions {
+    const char *video_path;
+    const char *audio_path;
+    int width, height;
+    PixFmt pixfmt;
+    Rational fps;
+    int rotation;
+    int video_bitrate;
+    const char *preset;
+    int slice_max_size;
+    bool intra_refresh;
+    bool adaptive_effort;
+    int keyframe_every; // Frames, 0 for none asked for
+    int samplerate;
+    int channels;
+    int audio_bitrate;
+    bool max_speed;
+    int loops;          // 0 for endless
+    bool quiet;
+
+    PushOptions() :
+        video_path(NULL), audio_path(NULL), width(-1), height(-1),
+        pixfmt(PIXFMT_NV21), rotation(0), video_bitrate(-1), preset(NULL),
+        slice_max_size(0), intra_refresh(false), adaptive_effort(false),
+        keyframe_every(0),
+        samplerate(44100), channels(2), audio_bitrate(-1),
+        max_speed(false), loops(1), quiet(false)
+    {
+        fps.num = 15;
+        fps.den = 1;
+    }
+};
+
+// Reads fixed sized chunks, rewinding at the end for as many loops
+struct RawReader {
+    xfile::File file;
+    std::vector<uint8_t> buf;
+    int loops;
+    int loop;
+
+    bool read()
+    {
+        for (;;) {
+            if (file.read_buffer(&buf[0], buf.size()))
+                return true;
+            if (loops && ++loop >= loops)
+                return false;
+            if (!file.seek_begin())
+                return false;
+        }
+    }
+};
+
+static volatile bool quit = false;
+
+static void on_signal(int sig)
+{
+    quit = true;
+}
+
+static void on_event(void *opaque, libfqrtmp_event type, int64_t arg1, const char *arg2)
+{
+    if (type == ENCOUNTERED_ERROR) {
+        fprintf(stderr, "Error %lld: %s\n", (long long) arg1, arg2);
+        quit = true;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -i <file.yuv> -s <w>x<h> [options] -- <session options>\n"
+            "  -i, --video <file>       raw video\n"
+            "  -s, --size <w>x<h>\n"
+            "  -p, --pixfmt <fmt>       nv21 (camera, default), nv12 or i420 (DUMP_YUV)\n"
+            "  -r, --fps <num>[/<den>]  of the input and the stream, default 15\n"
+            "  -R, --rotation <deg>     0 or 180\n"
+            "  -b, --vbitrate <bps>     default 450000\n"
+            "  -P, --preset <name>      x264 preset, default ultrafast\n"
+            "  -l, --slicesize <bytes>  slice mode, frames sent with their last slice\n"
+            "  -I, --intrarefresh       periodic intra refresh instead of idr frames\n"
+            "  -E, --adaptive           x264 effort stepped with the time it takes\n"
+            "  -K, --keyframes <n>      ask for a keyframe every n frames\n"
+            "  -a, --audio <file>       raw s16le pcm\n"
+            "  -S, --samplerate <hz>    default 44100\n"
+            "  -c, --channels <n>       default 2\n"
+            "  -B, --abitrate <bps>\n"
+            "  -n, --loop <n>           times to play the input, 0 for endless, default 1\n"
+            "  -x, --maxspeed           feed as fast as the encoders take it\n"
+            "  -q, --quiet              no pipeline log on stderr\n"
+            "Session options: --live <url>, --flvpath <path>, --latencysei <n>, ...\n",
+            prog);
+}
+
+static int parse_options(int argc, char *argv[], PushOptions &opts)
+{
+    struct option longopts[] = {
+        {"video",      required_argument, NULL, 'i'},
+        {"size",       required_argument, NULL, 's'},
+        {"pixfmt",     required_argument, NULL, 'p'},
+        {"fps",        required_argument, NULL, 'r'},
+        {"rotation",   required_argument, NULL, 'R'},
+        {"vbitrate",   required_argument, NULL, 'b'},
+        {"preset",     required_argument, NULL, 'P'},
+        {"slicesize",  required_argument, NULL, 'l'},
+        {"intrarefresh", no_argument,     NULL, 'I'},
+        {"adaptive",   no_argument,       NULL, 'E'},
+        {"keyframes",  required_argument, NULL, 'K'},
+        {"audio",      required_argument, NULL, 'a'},
+        {"samplerate", required_argument, NULL, 'S'},
+        {"channels",   required_argument, NULL, 'c'},
+        {"abitrate",   required_argument, NULL, 'B'},
+        {"loop",       required_argument, NULL, 'n'},
+        {"maxspeed",   no_argument,       NULL, 'x'},
+        {"quiet",      no_argument,       NULL, 'q'},
+        {"help",       no_argument,       NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+    int ch;
+
+    while ((ch = getopt_long(argc, argv,
+                             "i:s:p:r:R:b:P:l:IEK:a:S:c:B:n:xqh", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'i':
+            opts.video_path = optarg;
+            break;
+
+        case 's':
+            if (sscanf(optarg, "%dx%d", &opts.width, &opts.height) != 2) {
+                fprintf(stderr, "Invalid size \"%s\"\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'p':
+            if (!strcasecmp(optarg, "nv21")) {
+                opts.pixfmt = PIXFMT_NV21;
+            } else if (!strcasecmp(optarg, "nv12")) {
+                opts.pixfmt = PIXFMT_NV12;
+            } else if (!strcasecmp(optarg, "i420")) {
+                opts.pixfmt = PIXFMT_I420;
+            } else {
+                fprintf(stderr, "Unsupported pixfmt \"%s\"\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'r':
+            opts.fps.den = 1;
+            if (sscanf(optarg, "%d/%d", &opts.fps.num, &opts.fps.den) < 1 ||
+                opts.fps.num <= 0 || opts.fps.den <= 0) {
+                fprintf(stderr, "Invalid fps \"%s\"\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'R':
+            opts.rotation = atoi(optarg);
+            break;
+
+        case 'b':
+            opts.video_bitrate = atoi(optarg);
+            break;
+
+        case 'P':
+            opts.preset = optarg;
+            break;
+
+        case 'l':
+            opts.slice_max_size = atoi(optarg);
+            break;
+
+        case 'I':
+            opts.intra_refresh = true;
+            break;
+
+        case 'E':
+            opts.adaptive_effort = true;
+            break;
+
+        case 'K':
+            opts.keyframe_every = atoi(optarg);
+            break;
+
+        case 'a':
+            opts.audio_path = optarg;
+            break;
+
+        case 'S':
+            opts.samplerate = atoi(optarg);
+            break;
+
+        case 'c':
+            opts.channels = atoi(optarg);
+            break;
+
+        case 'B':
+            opts.audio_bitrate = atoi(optarg);
+            break;
+
+        case 'n':
+            opts.loops = atoi(optarg);
+            break;
+
+        case 'x':
+            opts.max_speed = true;
+            break;
+
+        case 'q':
+            opts.quiet = true;
+            break;
+
+        case 'h':
+        default:
+            return -1;
+        }
+    }
+
+    if (!opts.video_path && !opts.audio_path) {
+        fprintf(stderr, "Neither video nor audio input given\n");
+        return -1;
+    }
+    if (opts.video_path &&
+        (opts.width <= 0 || opts.height <= 0 || (opts.width|opts.height)&1)) {
+        fprintf(stderr, "Video size missing or odd\n");
+        return -1;
+    }
+    return 0;
+}
+
+// What VideoEncoder::feed() takes
+static void to_nv21(const PushOptions &opts, const uint8_t *src, uint8_t *dst)
+{
+    int y_size = opts.width * opts.height;
+
+    switch (opts.pixfmt) {
+    case PIXFMT_NV21:
+        memcpy(dst, src, y_size * 3 / 2);
+        break;
+
+    case PIXFMT_NV12:
+        memcpy(dst, src, y_size);
+        for (int i = y_size; i < y_size * 3 / 2; i += 2) {
+            dst[i] = src[i + 1];
+            dst[i + 1] = src[i];
+        }
+        break;
+
+    case PIXFMT_I420:
+        I420ToNV21(src, opts.width,
+                   src + y_size, opts.width / 2,
+                   src + y_size * 5 / 4, opts.width / 2,
+                   dst, opts.width,
+                   dst + y_size, opts.width,
+                   opts.width, opts.height);
+        break;
+    }
+}
+
+static uint64_t video_inflight()
+{
+    return gmetrics.counters[METRIC_VIDEO_FRAMES_IN] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_ENCODED] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_DROPPED];
+}
+
+int main(int argc, char *argv[])
+{
+    PushOptions opts;
+    if (parse_options(argc, argv, opts) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // What's left after "--" goes to the session, argv[0] of it is skipped
+    SessionConfig config;
+    if (config.parse(argc - optind + 1, argv + optind - 1) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.liveurl.empty() && config.flvpath.empty()) {
+        fprintf(stderr, "Neither --live nor --flvpath given\n");
+        return 1;
+    }
+
+    xlog_set_sinks(opts.quiet ? 0 : XLOG_SINK_STDERR);
+
+    RawReader video, audio;
+    std::vector<uint8_t> nv21;
+    if (opts.video_path) {
+        if (!video.file.open(opts.video_path, "rb")) {
+            fprintf(stderr, "Open \"%s\" failed: %s\n", opts.video_path, ERRNOMSG);
+            return 1;
+        }
+        video.buf.resize(opts.width * opts.height * 3 / 2);
+        video.loops = opts.loops;
+        video.loop = 0;
+        nv21.resize(video.buf.size());
+    }
+    if (opts.audio_path &&
+        !audio.file.open(opts.audio_path, "rb")) {
+        fprintf(stderr, "Open \"%s\" failed: %s\n", opts.audio_path, ERRNOMSG);
+        return 1;
+    }
+
+    FQRtmpSession session;
+    session.set_event_callback(on_event, NULL);
+
+    if (opts.video_path) {
+        VideoConfig vc;
+        vc.width = opts.width;
+        vc.height = opts.height;
+        // No frame dropping by the fps control, the input is the camera
+        vc.fps = vc.orig_fps = opts.fps;
+        if (opts.video_bitrate > 0) {
+            vc.bitrate = opts.video_bitrate;
+        }
+        if (opts.preset) {
+            vc.preset = opts.preset;
+        }
+        vc.slice_max_size = opts.slice_max_size;
+        vc.intra_refresh = opts.intra_refresh;
+        vc.adaptive_effort = opts.adaptive_effort;
+        if (session.open_video_encoder(vc) < 0) {
+            fprintf(stderr, "Open video encoder failed\n");
+            return 1;
+        }
+    }
+
+    AudioConfig ac;
+    if (opts.audio_path) {
+        ac.samplerate = opts.samplerate;
+        ac.channels = opts.channels;
+        ac.bitrate = opts.audio_bitrate;
+        if (session.open_audio_encoder(ac) < 0) {
+            fprintf(stderr, "Open audio encoder failed\n");
+            return 1;
+        }
+        // One aac frame of pcm per send
+        audio.buf.resize(ac.frame_length * ac.channels * 2);
+        audio.loops = opts.loops;
+        audio.loop = 0;
+    }
+
+    if (session.open(config) < 0) {
+        fprintf(stderr, "Open session failed\n");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    // librtmp writes with send(), a dropped connection must come back as
+    // an error, as with the android runtime
+    signal(SIGPIPE, SIG_IGN);
+
+    bool video_eof = !opts.video_path, audio_eof = !opts.audio_path;
+    uint64_t video_frames = 0, audio_frames = 0;
+    uint64_t start_us = get_time_now_us();
+
+    while (!quit && (!video_eof || !audio_eof)) {
+        // Both in us, whichever is due first goes next
+        uint64_t video_ts = video_frames * 1000000 * opts.fps.den / opts.fps.num;
+        uint64_t audio_ts = opts.audio_path ?
+            audio_frames * ac.frame_length * 1000000 / ac.samplerate : 0;
+        bool send_video = !video_eof && (audio_eof || video_ts <= audio_ts);
+        uint64_t ts = send_video ? video_ts : audio_ts;
+
+        if (!opts.max_speed) {
+            uint64_t now = get_time_now_us() - start_us;
+            if (ts > now) {
+                usleep(ts - now);
+            }
+        } else {
+            // Back-pressure, well below the memory cap so no frame is refused
+            while (!quit &&
+                   (send_video ?
+                    video_inflight() >= MAX_VIDEO_INFLIGHT :
+                    gmetrics.gauges[METRIC_AUDIO_QUEUE_BYTES] >=
+                    (int32_t) audio.buf.size() * MAX_AUDIO_INFLIGHT)) {
+                usleep(500);
+            }
+        }
+
+        if (send_video) {
+            if (!video.read()) {
+                video_eof = true;
+                continue;
+            }
+            to_nv21(opts, &video.buf[0], &nv21[0]);
+            // As a viewer joining would
+            if (opts.keyframe_every > 0 && video_frames &&
+                !(video_frames % opts.keyframe_every)) {
+                session.request_keyframe();
+            }
+            // Wall clock stamps are meaningless when not paced
+            while (session.send_video(&nv21[0], nv21.size(), opts.rotation,
+                                      opts.max_speed ? (int64_t) (video_ts / 1000) : -1) ==
+                   SEND_DROPPED && opts.max_speed && !quit) {
+                // At the memory cap, nothing is lost by waiting when not paced
+                usleep(500);
+            }
+            ++video_frames;
+        } else {
+            if (!audio.read()) {
+                audio_eof = true;
+                continue;
+            }
+            while (session.send_audio(&audio.buf[0], audio.buf.size()) ==
+                   SEND_DROPPED && opts.max_speed && !quit) {
+                usleep(500);
+            }
+            ++audio_frames;
+        }
+    }
+
+    // Let the encoders finish what's queued before tearing down
+    uint64_t drain_start = get_time_now();
+    while (!quit && get_time_now() - drain_start < DRAIN_TIMEOUT_MS &&
+           (video_inflight() ||
+            (opts.audio_path &&
+             gmetrics.gauges[METRIC_AUDIO_QUEUE_BYTES] >= (int32_t) audio.buf.size()))) {
+        usleep(1000);
+    }
+    uint64_t elapsed_us = get_time_now_us() - start_us;
+
+    session.close_video_encoder();
+    session.close_audio_encoder();
+    session.close();
+    xlog_flush();
+
+    double elapsed = elapsed_us / 1000000.0;
+    double media = MAX(video_frames * opts.fps.den / (double) opts.fps.num,
+                       opts.audio_path ?
+                       audio_frames * ac.frame_length / (double) ac.samplerate : 0);
+    uint64_t encoded = gmetrics.counters[METRIC_VIDEO_FRAMES_ENCODED];
+
+    printf("%s mode, %.2fs of media pushed in %.2fs (%.2fx realtime)\n",
+           opts.max_speed ? "max-speed" : "real-time", media, elapsed,
+           elapsed > 0 ? media / elapsed : 0);
+    printf("video: %llu frames in, %llu encoded, %.2f fps, %.1f kbps\n",
+           (long long unsigned) video_frames, (long long unsigned) encoded,
+           elapsed > 0 ? encoded / elapsed : 0,
+           media > 0 ? gmetrics.counters[METRIC_VIDEO_BYTES_ENCODED] * 8 / media / 1000 : 0);
+    printf("audio: %llu frames in, %llu encoded, %.1f kbps\n",
+           (long long unsigned) audio_frames,
+           (long long unsigned) gmetrics.counters[METRIC_AUDIO_FRAMES_ENCODED],
+           media > 0 ? gmetrics.counters[METRIC_AUDIO_BYTES_ENCODED] * 8 / media / 1000 : 0);
+    printf("%s", metrics_report().c_str());
+    return 0;
+}
@@ -0,0 +1,167 @@
+/* Streams bytes through IOBuffer and RingBuffer the way the pipeline does:
+ * writes of one size, reads (copied out, as AudioEncoder does) of another,
+ * with a standing backlog in between, e.g. pcm piling up behind a stalled
+ * encoder. Reports throughput and the bytes each buffer copied internally
+ * (compaction and growth), after checking both deliver the stream intact.
+ * Usage: iobuf_bench [-w <write>] [-r <read>] [-b <backlog>] [-n <MB>] */
+
+#include <time.h>
+
+#include "xring.h"
+#include "xutil.h"
+
+using namespace xutil;
+
+struct Scenario {
+    const char *name;
+    uint32_t write_size;
+    uint32_t read_size;
+    uint32_t backlog;
+};
+
+struct Result {
+    uint64_t elapsed_us;
+    uint64_t copied;
+    uint32_t checksum;
+};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Adler-32 like, order matters
+static void checksum_update(uint32_t &sum, const uint8_t *p, uint32_t len)
+{
+    uint32_t a = sum & 0xFFFF, b = sum >> 16;
+    for (uint32_t i = 0; i < len; ++i) {
+        a = (a + p[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    sum = (b << 16) | a;
+}
+
+// What the last write made the buffer move (at least the unread bytes),
+// on a new allocation or when compacted in place
+template <typename Buffer>
+static uint64_t write_copied(const Buffer &buf, const uint8_t *old_buffer,
+                             uint32_t old_consumed, uint32_t old_published)
+{
+    if ((buf.buffer != old_buffer && old_buffer) ||
+        buf.consumed != old_consumed)
+        return old_published - old_consumed;
+    return 0;
+}
+
+template <typename Buffer>
+static Result run(const Scenario &s, uint64_t total, bool verify)
+{
+    Buffer buf;
+    std::vector<uint8_t> src(s.write_size), dst(s.read_size);
+    Result res = { 0, 0, 1 };
+    uint64_t written = 0;
+    uint8_t seed = 0;
+
+    uint64_t start = now_us();
+    while (written < total) {
+        // Content changes with every write, so misordering shows
+        src[0] = seed++;
+        src[s.write_size - 1] = seed;
+
+        const uint8_t *old_buffer = buf.buffer;
+        uint32_t old_consumed = buf.consumed, old_published = buf.published;
+        buf.read_from_buffer(&src[0], s.write_size);
+        res.copied += write_copied(buf, old_buffer, old_consumed, old_published);
+        written += s.write_size;
+
+        while (GETAVAILABLEBYTESCOUNT(buf) >= s.backlog + s.read_size) {
+            memcpy(&dst[0], GETIBPOINTER(buf), s.read_size);
+            if (verify) {
+                checksum_update(res.checksum, &dst[0], s.read_size);
+            }
+            buf.ignore(s.read_size);
+        }
+    }
+    // The backlog too, so both checksums cover the whole stream
+    while (GETAVAILABLEBYTESCOUNT(buf)) {
+        uint32_t n = MIN(GETAVAILABLEBYTESCOUNT(buf), s.read_size);
+        memcpy(&dst[0], GETIBPOINTER(buf), n);
+        if (verify) {
+            checksum_update(res.checksum, &dst[0], n);
+        }
+        buf.ignore(n);
+    }
+    res.elapsed_us = MAX(now_us() - start, (uint64_t) 1);
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    Scenario custom = { "custom", 0, 0, 0 };
+    uint64_t total = 256ULL * 1024 * 1024;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "w:r:b:n:h")) != -1) {
+        switch (ch) {
+        case 'w':
+            custom.write_size = atoi(optarg);
+            break;
+
+        case 'r':
+            custom.read_size = atoi(optarg);
+            break;
+
+        case 'b':
+            custom.backlog = atoi(optarg);
+            break;
+
+        case 'n':
+            total = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-w <write>] [-r <read>] [-b <backlog>] "
+                    "[-n <MB>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Scenario defaults[] = {
+        // 20ms of 44.1k stereo from AudioRecord, 1024 sample aac frames
+        { "pcm",          3528, 4096, 0 },
+        { "pcm stalled",  3528, 4096, 512*1024 },
+        // Small writes, whole chunks out, as a socket send buffer
+        { "chunks",       137,  4096, 64*1024 },
+        { "large frames", 115200, 65536, 1024*1024 },
+    };
+    std::vector<Scenario> scenarios;
+    if (custom.write_size && custom.read_size) {
+        scenarios.push_back(custom);
+    } else {
+        scenarios.assign(defaults, defaults + NELEM(defaults));
+    }
+
+    printf("%-13s %-8s %10s %12s\n", "scenario", "buffer", "MB/s", "copied/byte");
+    foreach(scenarios, it) {
+        const Scenario &s = *it;
+
+        // Small and checked first, then timed
+        uint64_t check_total = MIN(total, (uint64_t) 8*1024*1024);
+        if (run<IOBuffer>(s, check_total, true).checksum !=
+            run<RingBuffer>(s, check_total, true).checksum) {
+            printf("%-13s MISMATCH between IOBuffer and RingBuffer\n", s.name);
+            return 1;
+        }
+
+        Result io = run<IOBuffer>(s, total, false);
+        Result ring = run<RingBuffer>(s, total, false);
+        printf("%-13s %-8s %10.1f %12.3f\n", s.name, "iobuf",
+               total / (double) io.elapsed_us, io.copied / (double) total);
+        printf("%-13s %-8s %10.1f %12.3f  x%.2f\n", s.name, "ring",
+               total / (double) ring.elapsed_us, ring.copied / (double) total,
+               io.elapsed_us / (double) ring.elapsed_us);
+    }
+    return 0;
+}
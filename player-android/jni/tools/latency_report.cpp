@@ -0,0 +1,180 @@
+/* Reads the latency sei (see LatencyTracker) back from an flv file, e.g.
+ * the one recorded with --flvpath or pulled from the rtmp server, and
+ * prints the latency distribution of every stage.
+ * Usage: latency_report <file.flv> */
+
+#include <algorithm>
+#include <map>
+
+#include "latency_tracker.h"
+#include "xmedia.h"
+#include "xutil.h"
+
+using namespace xutil;
+using namespace xmedia;
+
+#define FLV_HEADER_SIZE         9
+#define FLV_TAG_HEADER_SIZE     11
+#define FLV_PREV_TAG_SIZE       4
+#define FLV_TAG_TYPE_VIDEO      9
+
+static const char *stage_names[STAGE_NUM] = {
+    "capture", "convert", "encode", "interleave", "send"
+};
+
+struct Stats {
+    uint32_t seis;
+    uint32_t first_seq, last_seq;
+    uint32_t interval;
+    uint32_t missing;
+    // Report of every frame fully sent, by sequence
+    std::map<uint32_t, LatencySEI> reports;
+    // Capture clock minus flv timestamp, relative to the first frame
+    std::vector<int64_t> drift;
+    uint64_t first_capture_us;
+    uint32_t first_tag_ts;
+
+    Stats() :
+        seis(0), first_seq(0), last_seq(0), interval(0), missing(0),
+        first_capture_us(0), first_tag_ts(0) { }
+};
+
+static uint32_t get_be(const byte *p, int n)
+{
+    uint32_t val = 0;
+    while (n--) {
+        val = (val<<8) | *p++;
+    }
+    return val;
+}
+
+static void add_sei(Stats &st, const LatencySEI &sei, uint32_t tag_ts)
+{
+    if (!st.seis) {
+        st.first_seq = sei.seq;
+        st.first_capture_us = sei.capture_us;
+        st.first_tag_ts = tag_ts;
+    } else if (sei.seq > st.last_seq + sei.interval) {
+        st.missing += (sei.seq - st.last_seq) / sei.interval - 1;
+    }
+    ++st.seis;
+    st.last_seq = sei.seq;
+    st.interval = sei.interval;
+
+    st.drift.push_back(
+            (int64_t) (sei.capture_us - st.first_capture_us) / 1000 -
+            (int64_t) (tag_ts - st.first_tag_ts));
+
+    if (sei.report_seq &&
+        sei.report[STAGE_SENT - 1] != LATENCY_SEI_NO_REPORT) {
+        st.reports[sei.report_seq] = sei;
+    }
+}
+
+template <typename T>
+static void print_distribution(const char *name, std::vector<T> &vals, double scale)
+{
+    if (vals.empty()) {
+        printf("%-12s: no samples\n", name);
+        return;
+    }
+
+    std::sort(vals.begin(), vals.end());
+    double sum = 0;
+    foreach(vals, it) {
+        sum += *it;
+    }
+
+#define PCT(p) (vals[MIN((size_t) (vals.size() * (p) / 100), vals.size() - 1)] * scale)
+    printf("%-12s: n=%-6u min=%8.2f avg=%8.2f p50=%8.2f p90=%8.2f p99=%8.2f max=%8.2f\n",
+           name, (unsigned) vals.size(),
+           vals.front() * scale, sum / vals.size() * scale,
+           PCT(50), PCT(90), PCT(99), vals.back() * scale);
+#undef PCT
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file.flv>\n", argv[0]);
+        return 1;
+    }
+
+    IOBuffer iobuf;
+    iobuf.read_from_file(argv[1], "rb");
+    const byte *p = GETIBPOINTER(iobuf);
+    const byte *end = p + GETAVAILABLEBYTESCOUNT(iobuf);
+
+    if (end - p < FLV_HEADER_SIZE + FLV_PREV_TAG_SIZE ||
+        memcmp(p, "FLV", 3)) {
+        fprintf(stderr, "\"%s\" is not an flv file\n", argv[1]);
+        return 1;
+    }
+    p += get_be(p + 5, 4) + FLV_PREV_TAG_SIZE;
+
+    Stats st;
+    int length_size = 4;
+
+    while (end - p >= FLV_TAG_HEADER_SIZE) {
+        byte typ = p[0]&0x1F;
+        uint32_t data_size = get_be(p + 1, 3);
+        uint32_t tag_ts = get_be(p + 4, 3) | (p[7]<<24);
+
+        p += FLV_TAG_HEADER_SIZE;
+        if (data_size > (uint32_t) (end - p)) {
+            fprintf(stderr, "Truncated tag at the end (ignored)\n");
+            break;
+        }
+
+        if (typ == FLV_TAG_TYPE_VIDEO) {
+            std::vector<LatencySEI> seis;
+            latency_sei_parse_video_tag(p, data_size, length_size, seis);
+            foreach(seis, it) {
+                add_sei(st, *it, tag_ts);
+            }
+        }
+        p += data_size + FLV_PREV_TAG_SIZE;
+    }
+
+    if (!st.seis) {
+        fprintf(stderr, "No latency sei found, was the stream pushed with --latencysei?\n");
+        return 1;
+    }
+
+    printf("%u latency sei, seq %u..%u, sampled every %u frames, %u missing\n",
+           st.seis, st.first_seq, st.last_seq, st.interval, st.missing);
+    printf("%u frames with stage timings, in ms:\n", (unsigned) st.reports.size());
+
+    // Each stage's own cost, then the whole way from capture to socket
+    std::vector<uint32_t> stages[STAGE_NUM];
+    foreach(st.reports, it) {
+        const uint32_t *r = it->second.report;
+        uint32_t prev = 0;
+        bool complete = true;
+
+        for (int i = 0; i < STAGE_NUM - 1; ++i) {
+            if (r[i] == LATENCY_SEI_NO_REPORT || r[i] < prev) {
+                complete = false;
+                break;
+            }
+            prev = r[i];
+        }
+        if (!complete)
+            continue;
+
+        prev = 0;
+        for (int i = 0; i < STAGE_NUM - 1; ++i) {
+            stages[i + 1].push_back(r[i] - prev);
+            prev = r[i];
+        }
+        stages[STAGE_CAPTURE].push_back(r[STAGE_SENT - 1]);
+    }
+
+    for (int i = STAGE_CONVERTED; i < STAGE_NUM; ++i) {
+        print_distribution(stage_names[i], stages[i], 0.001);
+    }
+    print_distribution("total", stages[STAGE_CAPTURE], 0.001);
+    print_distribution("ts drift", st.drift, 1.0);
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* Runs NetImpairProxy on its own, in front of rtmp_serve or a real
+ * server, to push through a scripted bottleneck, e.g.
+ *   net_impair -p 19360 -t 127.0.0.1:1935 \
+ *       -s "rate=1.5M dur=30s; rate=300k dur=20s; drop"
+ *   fqrtmp_push ... -- --live rtmp://127.0.0.1:19360/live/test
+ * Usage: net_impair -p <port> -t <addr>:<port> -s <schedule> */
+
+#include <signal.h>
+
+#include "net_impair.h"
+#include "xutil.h"
+
+using namespace xutil;
+
+static volatile bool quit = false;
+
+static void on_signal(int sig)
+{
+    quit = true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string target_addr;
+    int port = 0, target_port = 0;
+    const char *schedule = "";
+    int ch;
+
+    while ((ch = getopt(argc, argv, "p:t:s:h")) != -1) {
+        switch (ch) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 't': {
+            std::vector<std::string> parts = split(optarg, ":");
+            if (parts.size() != 2) {
+                fprintf(stderr, "Target must be <addr>:<port>\n");
+                return 1;
+            }
+            target_addr = parts[0];
+            target_port = atoi(parts[1].c_str());
+            break;
+        }
+
+        case 's':
+            schedule = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s -p <port> -t <addr>:<port> -s <schedule>\n"
+                    "  schedule: phases separated by ';' of rate=<bps> dur=<time> "
+                    "rtt=<time> jitter=<time> queue=<bytes> stall drop\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (target_addr.empty()) {
+        fprintf(stderr, "No target given\n");
+        return 1;
+    }
+
+    xlog_set_sinks(XLOG_SINK_STDERR);
+
+    std::vector<NetPhase> phases;
+    if (net_schedule_parse(schedule, phases) < 0)
+        return 1;
+
+    NetImpairProxy proxy;
+    if (proxy.start(port, target_addr, target_port, phases) < 0)
+        return 1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    while (!quit) {
+        usleep(100000);
+    }
+    proxy.stop();
+    xlog_flush();
+    return 0;
+}
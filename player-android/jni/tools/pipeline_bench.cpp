@@ -0,0 +1,470 @@
+/* Drives the whole publisher pipeline as fast as it goes: NV21 frames and
+ * pcm through conversion, x264, the nal parser, avcc packaging, the
+ * interleaver, flv writing and rtmp to an in-process RtmpServer on
+ * loopback. For every resolution it prints the frame rate, the latency
+ * of every stage (taken from the latency sei the server receives), cpu
+ * time, allocations per frame and the peak rss.
+ * Usage: pipeline_bench [-n <frames>] [-r 480p,720p,1080p|<w>x<h>,...]
+ *                       [-P <preset>] [-l <slice bytes>] [-i <file.nv21> -s <w>x<h>]
+ *                       [-o <file.flv>] [-v] */
+
+#include <sys/resource.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <librtmp/rtmp.h>
+
+#include "fqrtmp_session.h"
+#include "rtmp_server.h"
+#include "latency_tracker.h"
+#include "metrics.h"
+#include "xfile.h"
+#include "xutil.h"
+
+using namespace xutil;
+
+#define BENCH_FPS               30
+#define SYNTHETIC_FRAMES        8
+#define MAX_VIDEO_INFLIGHT      2
+#define MAX_AUDIO_INFLIGHT      4
+#define DRAIN_TIMEOUT_MS        5000
+// Server quiet this long after the session is closed means all is in
+#define SINK_QUIET_MS           200
+
+// Count every allocation of the process by taking over malloc and
+// friends; glibc only, and not under the sanitizers that do the same
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define COUNT_ALLOCS
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static volatile uint64_t alloc_count = 0;
+
+extern "C" void *malloc(size_t size) throw()
+{
+    __sync_add_and_fetch(&alloc_count, 1);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) throw()
+{
+    __sync_add_and_fetch(&alloc_count, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) throw()
+{
+    __sync_add_and_fetch(&alloc_count, 1);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size) throw()
+{
+    __sync_add_and_fetch(&alloc_count, 1);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size) throw()
+{
+    __sync_add_and_fetch(&alloc_count, 1);
+    void *ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+#endif
+
+struct Resolution {
+    std::string name;
+    int width, height;
+    int bitrate;
+};
+
+struct BenchOptions {
+    int frames;
+    std::vector<Resolution> resolutions;
+    const char *preset;
+    int slice_max_size;
+    const char *input_path;
+    std::string flvpath;
+    bool verbose;
+
+    BenchOptions() :
+        frames(300), preset(NULL), slice_max_size(0), input_path(NULL), flvpath("/dev/null"), verbose(false) { }
+};
+
+// What the sink saw, filled on the server thread
+struct SinkStats {
+    int length_size;
+    uint64_t last_arrival_us;
+    // By the frame reported
+    std::map<uint32_t, LatencySEI> reports;
+    // Capture to arrival at the server, in us
+    std::vector<uint32_t> arrive;
+
+    SinkStats() : length_size(4), last_arrival_us(0) { }
+};
+
+static void on_message(void *opaque, const RtmpServerMessage &msg, const uint8_t *body)
+{
+    SinkStats *sink = (SinkStats *) opaque;
+
+    sink->last_arrival_us = msg.arrival_us;
+    if (msg.type != RTMP_PACKET_TYPE_VIDEO)
+        return;
+
+    std::vector<LatencySEI> seis;
+    latency_sei_parse_video_tag(body, msg.size, sink->length_size, seis);
+    foreach(seis, it) {
+        sink->arrive.push_back((uint32_t) (msg.arrival_us - it->capture_us));
+        if (it->report_seq &&
+            it->report[STAGE_SENT - 1] != LATENCY_SEI_NO_REPORT) {
+            sink->reports[it->report_seq] = *it;
+        }
+    }
+}
+
+static int parse_resolution(const std::string &str, Resolution &res)
+{
+    res.name = str;
+    if (str == "480p") {
+        res.width = 640, res.height = 480, res.bitrate = 800 * 1000;
+    } else if (str == "720p") {
+        res.width = 1280, res.height = 720, res.bitrate = 1500 * 1000;
+    } else if (str == "1080p") {
+        res.width = 1920, res.height = 1080, res.bitrate = 3000 * 1000;
+    } else if (sscanf(str.c_str(), "%dx%d", &res.width, &res.height) == 2 &&
+               res.width > 0 && res.height > 0 && !((res.width|res.height)&1)) {
+        // About the bits per pixel of the above
+        res.bitrate = (int) ((int64_t) res.width * res.height * 3000 / 2073600) * 1000;
+    } else {
+        fprintf(stderr, "Invalid resolution \"%s\"\n", str.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// Moving gradients with a noisy block, so that x264 has something to do
+static void make_synthetic(int width, int height, std::vector<std::vector<uint8_t> > &frames)
+{
+    int y_size = width * height;
+    unsigned int seed = 1;
+
+    frames.resize(SYNTHETIC_FRAMES);
+    for (int k = 0; k < SYNTHETIC_FRAMES; ++k) {
+        std::vector<uint8_t> &f = frames[k];
+        f.resize(y_size * 3 / 2);
+
+        for (int y = 0; y < height; ++y) {
+            uint8_t *row = &f[y * width];
+            for (int x = 0; x < width; ++x) {
+                row[x] = (x + y + k * 4) & 0xFF;
+            }
+        }
+        for (int y = height / 4; y < height / 2; ++y) {
+            uint8_t *row = &f[y * width];
+            for (int x = width / 4 + k * 2; x < width / 2 + k * 2; ++x) {
+                row[x] = rand_r(&seed) & 0xFF;
+            }
+        }
+        for (int i = y_size; i < y_size * 3 / 2; i += 2) {
+            f[i] = 128 + ((i / width + k) & 0x1F);
+            f[i + 1] = 128 - ((i % width) & 0x1F);
+        }
+    }
+}
+
+static int load_input(const char *path, const Resolution &res,
+                      std::vector<std::vector<uint8_t> > &frames)
+{
+    xfile::File file;
+    if (!file.open(path, "rb")) {
+        fprintf(stderr, "Open \"%s\" failed: %s\n", path, ERRNOMSG);
+        return -1;
+    }
+
+    std::vector<uint8_t> frame(res.width * res.height * 3 / 2);
+    while (file.read_buffer(&frame[0], frame.size())) {
+        frames.push_back(frame);
+    }
+    if (frames.empty()) {
+        fprintf(stderr, "No whole %dx%d frame in \"%s\"\n", res.width, res.height, path);
+        return -1;
+    }
+    return 0;
+}
+
+static void reset_peak_rss()
+{
+    // Linux >= 4.0, the peak stays process wide otherwise
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+static long peak_rss_kb()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = -1;
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                break;
+        }
+        fclose(fp);
+    }
+    if (kb < 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+static uint64_t cpu_time_us()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+        ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static uint64_t video_inflight()
+{
+    return gmetrics.counters[METRIC_VIDEO_FRAMES_IN] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_ENCODED] -
+        gmetrics.counters[METRIC_VIDEO_FRAMES_DROPPED];
+}
+
+static void print_stage(const char *name, std::vector<uint32_t> &vals)
+{
+    if (vals.empty()) {
+        printf("  %-12s %8s\n", name, "-");
+        return;
+    }
+
+    std::sort(vals.begin(), vals.end());
+#define PCT(p) (vals[MIN((size_t) (vals.size() * (p) / 100), vals.size() - 1)] / 1000.0)
+    printf("  %-12s %8.2f %8.2f %8.2f\n", name, PCT(50), PCT(99), vals.back() / 1000.0);
+#undef PCT
+}
+
+static int run(const BenchOptions &opts, const Resolution &res)
+{
+    std::vector<std::vector<uint8_t> > frames;
+    if (opts.input_path) {
+        if (load_input(opts.input_path, res, frames) < 0)
+            return -1;
+    } else {
+        make_synthetic(res.width, res.height, frames);
+    }
+
+    SinkStats sink;
+    RtmpServer server;
+    server.set_message_callback(on_message, &sink);
+    if (server.start("127.0.0.1", 0) < 0)
+        return -1;
+
+    SessionConfig config;
+    if (config.parse(sprintf_("--live rtmp://127.0.0.1:%d/live/bench --flvpath %s --latencysei 1",
+                              server.port(), STR(opts.flvpath)).c_str()) < 0)
+        return -1;
+
+    reset_peak_rss();
+
+    FQRtmpSession session;
+    VideoConfig vc;
+    vc.width = res.width;
+    vc.height = res.height;
+    vc.bitrate = res.bitrate;
+    vc.fps.num = vc.orig_fps.num = BENCH_FPS;
+    vc.fps.den = vc.orig_fps.den = 1;
+    if (opts.preset) {
+        vc.preset = opts.preset;
+    }
+    vc.slice_max_size = opts.slice_max_size;
+    AudioConfig ac;
+    if (session.open_video_encoder(vc) < 0 ||
+        session.open_audio_encoder(ac) < 0 ||
+        session.open(config) < 0) {
+        fprintf(stderr, "Open pipeline failed\n");
+        return -1;
+    }
+
+    std::vector<uint8_t> pcm(ac.frame_length * ac.channels * 2);
+    for (size_t i = 0; i + 1 < pcm.size(); i += 2) {
+        int16_t s = (int16_t) (8000 * sin(i * 0.01));
+        pcm[i] = s & 0xFF;
+        pcm[i + 1] = (s >> 8) & 0xFF;
+    }
+
+    uint64_t video_frames = 0, audio_frames = 0;
+#ifdef COUNT_ALLOCS
+    uint64_t allocs_start = alloc_count;
+#endif
+    uint64_t cpu_start = cpu_time_us();
+    uint64_t start_us = get_time_now_us();
+
+    while ((int) video_frames < opts.frames) {
+        uint64_t video_ts = video_frames * 1000000 / BENCH_FPS;
+        uint64_t audio_ts = audio_frames * ac.frame_length * 1000000 / ac.samplerate;
+
+        if (video_ts <= audio_ts) {
+            while (video_inflight() >= MAX_VIDEO_INFLIGHT) {
+                usleep(200);
+            }
+            std::vector<uint8_t> &f = frames[video_frames % frames.size()];
+            session.send_video(&f[0], f.size(), 0, video_ts / 1000);
+            ++video_frames;
+        } else {
+            while (gmetrics.gauges[METRIC_AUDIO_QUEUE_BYTES] >=
+                   (int32_t) pcm.size() * MAX_AUDIO_INFLIGHT) {
+                usleep(200);
+            }
+            session.send_audio(&pcm[0], pcm.size());
+            ++audio_frames;
+        }
+    }
+
+    uint64_t drain_start = get_time_now();
+    while (video_inflight() && get_time_now() - drain_start < DRAIN_TIMEOUT_MS) {
+        usleep(500);
+    }
+    uint64_t elapsed_us = get_time_now_us() - start_us;
+    uint64_t cpu_us = cpu_time_us() - cpu_start;
+#ifdef COUNT_ALLOCS
+    uint64_t allocs = alloc_count - allocs_start;
+#endif
+
+    session.close_video_encoder();
+    session.close_audio_encoder();
+    session.close();
+    // Let the sink take what's still on the way
+    while (get_time_now_us() - sink.last_arrival_us < SINK_QUIET_MS * 1000) {
+        usleep(10000);
+    }
+    server.stop();
+    long peak_kb = peak_rss_kb();
+
+    uint64_t encoded = gmetrics.counters[METRIC_VIDEO_FRAMES_ENCODED];
+    printf("%s %dx%d @%dkbps: %llu frames in %.2fs, %.1f fps, %.2f ms cpu/frame, ",
+           res.name.c_str(), res.width, res.height, res.bitrate / 1000,
+           (long long unsigned) encoded, elapsed_us / 1000000.0,
+           encoded * 1000000.0 / elapsed_us,
+           encoded ? cpu_us / 1000.0 / encoded : 0);
+#ifdef COUNT_ALLOCS
+    printf("%.1f allocs/frame, ", encoded ? (double) allocs / encoded : 0);
+#else
+    printf("allocs n/a, ");
+#endif
+    printf("peak rss %.1f MB\n", peak_kb / 1024.0);
+
+    // Each stage's own cost
+    std::vector<uint32_t> stages[STAGE_NUM - 1], total;
+    foreach(sink.reports, it) {
+        const uint32_t *r = it->second.report;
+        uint32_t prev = 0;
+
+        for (int i = 0; i < STAGE_NUM - 1; ++i) {
+            if (r[i] == LATENCY_SEI_NO_REPORT || r[i] < prev)
+                break;
+            stages[i].push_back(r[i] - prev);
+            prev = r[i];
+        }
+        total.push_back(r[STAGE_SENT - 1]);
+    }
+
+    static const char *stage_names[STAGE_NUM - 1] = {
+        "convert", "encode", "interleave", "send"
+    };
+    printf("  %-12s %8s %8s %8s  (ms, %u frames)\n", "stage", "p50", "p99", "max",
+           (unsigned) sink.reports.size());
+    for (int i = 0; i < STAGE_NUM - 1; ++i) {
+        print_stage(stage_names[i], stages[i]);
+    }
+    print_stage("capture-sent", total);
+    print_stage("capture-sink", sink.arrive);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    const char *resolutions = "480p,720p,1080p";
+    const char *size = NULL;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:r:P:l:i:s:o:vh")) != -1) {
+        switch (ch) {
+        case 'n':
+            opts.frames = atoi(optarg);
+            break;
+
+        case 'r':
+            resolutions = optarg;
+            break;
+
+        case 'P':
+            opts.preset = optarg;
+            break;
+
+        case 'l':
+            opts.slice_max_size = atoi(optarg);
+            break;
+
+        case 'i':
+            opts.input_path = optarg;
+            break;
+
+        case 's':
+            size = optarg;
+            break;
+
+        case 'o':
+            opts.flvpath = optarg;
+            break;
+
+        case 'v':
+            opts.verbose = true;
+            break;
+
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n <frames>] [-r 480p,720p,1080p|<w>x<h>,...] [-P <preset>]\n"
+                    "          [-l <slice bytes>] [-i <file.nv21> -s <w>x<h>] [-o <file.flv>] [-v]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    // A recorded input comes in one size only
+    std::vector<std::string> names = split(opts.input_path ? STR(size) : resolutions, ",");
+    foreach(names, it) {
+        Resolution res;
+        if (parse_resolution(*it, res) < 0)
+            return 1;
+        opts.resolutions.push_back(res);
+    }
+    if (opts.resolutions.empty() || opts.frames <= 0) {
+        fprintf(stderr, "Nothing to run\n");
+        return 1;
+    }
+
+    xlog_set_sinks(opts.verbose ? XLOG_SINK_STDERR : 0);
+
+    foreach(opts.resolutions, it) {
+        if (run(opts, *it) < 0)
+            return 1;
+    }
+    xlog_flush();
+    return 0;
+}
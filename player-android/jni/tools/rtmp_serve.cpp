@@ -0,0 +1,113 @@
+/* Runs RtmpServer on its own: takes a publish (e.g. of fqrtmp_push or the
+ * app) on loopback or the lan, optionally records it, and prints when
+ * every message arrived against its stream timestamp.
+ * Usage: rtmp_serve [-a <addr>] [-p <port>] [-o <file.flv>] [-v] */
+
+#include <getopt.h>
+#include <signal.h>
+#include <librtmp/rtmp.h>
+
+#include "rtmp_server.h"
+#include "xutil.h"
+
+using namespace xutil;
+
+struct Arrivals {
+    bool verbose;
+    uint64_t first_us;
+    uint32_t first_ts;
+    // Arrival behind the stream clock, in ms, relative to the first message
+    int64_t max_lag, min_lag;
+
+    Arrivals() :
+        verbose(false), first_us(0), first_ts(0), max_lag(0), min_lag(0) { }
+};
+
+static volatile bool quit = false;
+
+static void on_signal(int sig)
+{
+    quit = true;
+}
+
+static void on_message(void *opaque, const RtmpServerMessage &msg, const uint8_t *body)
+{
+    Arrivals *arr = (Arrivals *) opaque;
+
+    if (msg.type != RTMP_PACKET_TYPE_AUDIO &&
+        msg.type != RTMP_PACKET_TYPE_VIDEO)
+        return;
+
+    if (!arr->first_us) {
+        arr->first_us = msg.arrival_us;
+        arr->first_ts = msg.timestamp;
+    }
+    int64_t arrival = (int64_t) (msg.arrival_us - arr->first_us) / 1000;
+    int64_t lag = arrival - (int64_t) (msg.timestamp - arr->first_ts);
+    arr->max_lag = MAX(arr->max_lag, lag);
+    arr->min_lag = MIN(arr->min_lag, lag);
+
+    if (arr->verbose) {
+        printf("%8lld.%03u %s ts=%-8u size=%-7u lag=%lld\n",
+               (long long) arrival / 1000, (unsigned) (arrival % 1000),
+               msg.type == RTMP_PACKET_TYPE_VIDEO ? "video" : "audio",
+               msg.timestamp, msg.size, (long long) lag);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string addr("127.0.0.1"), flvpath;
+    int port = 1935;
+    Arrivals arr;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "a:p:o:vh")) != -1) {
+        switch (ch) {
+        case 'a':
+            addr = optarg;
+            break;
+
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 'o':
+            flvpath = optarg;
+            break;
+
+        case 'v':
+            arr.verbose = true;
+            break;
+
+        default:
+            fprintf(stderr, "Usage: %s [-a <addr>] [-p <port>] [-o <file.flv>] [-v]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    xlog_set_sinks(XLOG_SINK_STDERR);
+
+    RtmpServer server;
+    server.set_message_callback(on_message, &arr);
+    if (server.start(addr, port, flvpath) < 0)
+        return 1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    while (!quit) {
+        usleep(100000);
+    }
+    server.stop();
+    xlog_flush();
+
+    RtmpServerStats st = server.stats();
+    printf("%u connections, %u publishes, %llu video and %llu audio messages, %llu bytes\n",
+           st.connections, st.publishes,
+           (long long unsigned) st.video_messages, (long long unsigned) st.audio_messages,
+           (long long unsigned) st.bytes);
+    printf("arrival against stream clock: %lld..%lld ms\n",
+           (long long) arr.min_lag, (long long) arr.max_lag);
+    return 0;
+}
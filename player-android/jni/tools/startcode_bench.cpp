@@ -0,0 +1,157 @@
+/* Micro-benchmark of the startcode scanners over the key frames of an
+ * annex-b h264 file (e.g. the one dumped by DUMP_X264 in video_encoder.cpp).
+ * Usage: startcode_bench <file.h264> [iterations] */
+
+#include <time.h>
+#include <libyuv/cpu_id.h>
+
+#include "xmedia.h"
+#include "xutil.h"
+
+using namespace xutil;
+using namespace xmedia;
+
+typedef const byte *(*FindStartcodeFunc)(const byte *p, const byte *end);
+
+struct Scanner {
+    const char *name;
+    FindStartcodeFunc func;
+    bool usable;
+};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Byte by byte as VideoRawParser used to do, the reference of the speed-up
+static const byte *find_startcode_bytewise(const byte *p, const byte *end)
+{
+    for ( ; end - p >= 3; ++p) {
+        if (STARTCODE3(p))
+            return p;
+    }
+    return end;
+}
+
+static uint32_t count_startcodes(FindStartcodeFunc func,
+                                 const byte *p, const byte *end)
+{
+    uint32_t n = 0;
+
+    while ((p = func(p, end)) != end) {
+        ++n;
+        p += 3;
+    }
+    return n;
+}
+
+// Key frame is taken as everything from a sps up to the next non-idr slice or sps
+static void collect_key_frames(const byte *dat, const byte *end,
+                               std::vector<std::pair<const byte *, uint32_t> > &frames)
+{
+    const byte *frame_start = NULL;
+    const byte *p = find_startcode_c(dat, end);
+
+    while (p != end) {
+        byte nalu_typ = p + 3 < end ? p[3]&0x1F : 0;
+
+        if (frame_start && (nalu_typ == 7 || nalu_typ == 1)) {
+            frames.push_back(std::make_pair(frame_start, (uint32_t) (p - frame_start)));
+            frame_start = NULL;
+        }
+        if (nalu_typ == 7) {
+            frame_start = p;
+        }
+        p = find_startcode_c(p + 3, end);
+    }
+    if (frame_start) {
+        frames.push_back(std::make_pair(frame_start, (uint32_t) (end - frame_start)));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file.h264> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    IOBuffer iobuf;
+    iobuf.read_from_file(argv[1], "rb");
+    if (!GETAVAILABLEBYTESCOUNT(iobuf)) {
+        fprintf(stderr, "Read \"%s\" failed or empty file\n", argv[1]);
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+
+    const byte *dat = GETIBPOINTER(iobuf);
+    const byte *end = dat + GETAVAILABLEBYTESCOUNT(iobuf);
+    std::vector<std::pair<const byte *, uint32_t> > frames;
+    uint64_t total_bytes = 0;
+
+    collect_key_frames(dat, end, frames);
+    if (frames.empty()) {
+        fprintf(stderr, "No key frame found in \"%s\"\n", argv[1]);
+        return 1;
+    }
+    foreach(frames, it) {
+        total_bytes += it->second;
+    }
+    printf("%u key frames, %.1f KB on average, %d iterations\n",
+           (unsigned) frames.size(), total_bytes / 1024.0 / frames.size(), iterations);
+
+    Scanner scanners[] = {
+        { "byte", find_startcode_bytewise, true },
+        { "c",    find_startcode_c,    true },
+#if defined(__i386__) || defined(__x86_64__)
+        { "sse2", find_startcode_sse2, !!libyuv::TestCpuFlag(libyuv::kCpuHasSSE2) },
+        { "avx2", find_startcode_avx2, !!libyuv::TestCpuFlag(libyuv::kCpuHasAVX2) },
+#endif
+#if defined(HAVE_NEON) || defined(__aarch64__)
+        { "neon", find_startcode_neon, !!libyuv::TestCpuFlag(libyuv::kCpuHasNEON) },
+#endif
+        { "auto", find_startcode,      true },
+    };
+
+    uint64_t ref_us = 0;
+
+    for (unsigned i = 0; i < NELEM(scanners); ++i) {
+        const Scanner &s = scanners[i];
+        uint64_t nalus = 0, expected = 0;
+
+        if (!s.usable) {
+            printf("%-5s: not supported by this cpu\n", s.name);
+            continue;
+        }
+
+        uint64_t start = now_us();
+        for (int n = 0; n < iterations; ++n) {
+            foreach(frames, it) {
+                nalus += count_startcodes(s.func, it->first, it->first + it->second);
+            }
+        }
+        uint64_t elapsed = MAX(now_us() - start, (uint64_t) 1);
+
+        foreach(frames, it) {
+            expected += count_startcodes(find_startcode_c, it->first, it->first + it->second);
+        }
+        if (nalus != expected * iterations) {
+            printf("%-5s: MISMATCH, %llu nalus found (%llu expected)\n", s.name,
+                   (long long unsigned) nalus, (long long unsigned) (expected * iterations));
+            return 1;
+        }
+
+        if (!ref_us) {
+            ref_us = elapsed;
+        }
+        printf("%-5s: %8.1f MB/s, %6.2f us/frame, x%.2f\n", s.name,
+               total_bytes * iterations / (double) elapsed,
+               elapsed / (double) (frames.size() * iterations),
+               ref_us / (double) elapsed);
+    }
+
+    return 0;
+}
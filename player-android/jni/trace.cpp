@@ -0,0 +1,243 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "xfile.h"
+
+using namespace xutil;
+
+struct TraceEvent {
+    const char *name;
+    uint64_t ts;        // Monotonic, in us
+    char phase;
+};
+
+// Written by its own thread only, count is bumped after the event is in.
+// Emptied by the owner as it first writes in a new trace, what is there
+// belongs to the trace of generation only
+struct TraceBuffer {
+    pid_t tid;
+    char name[32];
+    volatile bool retired;      // Thread has exited
+    volatile uint32_t generation;
+    volatile uint32_t count;
+    uint32_t dropped;
+    uint32_t depth;             // Events begun and not ended yet
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+struct TraceThread {
+    char name[32];
+    TraceBuffer *buf;
+};
+
+volatile bool gtrace_on;
+// Bumped by every trace_start()
+static volatile uint32_t trace_generation;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static Mutex trace_mutex;
+static std::vector<TraceBuffer *> trace_buffers;
+
+static uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void trace_thread_exit(void *data)
+{
+    TraceThread *tt = (TraceThread *) data;
+
+    // Buffer stays for the dump, freed by the next trace_start()
+    if (tt->buf) {
+        tt->buf->retired = true;
+    }
+    SAFE_FREE(tt);
+}
+
+static void trace_init_key()
+{
+    pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+static TraceThread *get_trace_thread()
+{
+    pthread_once(&trace_once, trace_init_key);
+
+    TraceThread *tt = (TraceThread *) pthread_getspecific(trace_key);
+    if (!tt) {
+        tt = (TraceThread *) calloc(1, sizeof(TraceThread));
+        if (!tt)
+            return NULL;
+        prctl(PR_GET_NAME, tt->name, 0, 0, 0);
+        pthread_setspecific(trace_key, tt);
+    }
+    return tt;
+}
+
+static TraceBuffer *get_trace_buffer()
+{
+    TraceThread *tt = get_trace_thread();
+    if (!tt)
+        return NULL;
+
+    if (!tt->buf) {
+        // Once per thread, only when tracing is on
+        TraceBuffer *buf = (TraceBuffer *) malloc(sizeof(TraceBuffer));
+        if (!buf)
+            return NULL;
+        buf->tid = syscall(__NR_gettid);
+        snprintf(buf->name, sizeof(buf->name), "%s", tt->name);
+        buf->retired = false;
+        buf->generation = trace_generation;
+        buf->count = 0;
+        buf->dropped = 0;
+        buf->depth = 0;
+
+        AutoLock _l(trace_mutex);
+        trace_buffers.push_back(buf);
+        tt->buf = buf;
+    }
+    return tt->buf;
+}
+
+void trace_event(const char *name, char phase)
+{
+    TraceBuffer *buf = get_trace_buffer();
+    if (!buf)
+        return;
+
+    uint32_t generation = trace_generation;
+    if (buf->generation != generation) {
+        // A new trace, trace_stop() takes none of it until it's empty
+        buf->count = 0;
+        buf->dropped = 0;
+        buf->depth = 0;
+        __sync_synchronize();
+        buf->generation = generation;
+    }
+
+    // The end of what was begun before this trace started
+    if (phase == 'E') {
+        if (!buf->depth)
+            return;
+        --buf->depth;
+    } else if (phase == 'B') {
+        ++buf->depth;
+    }
+
+    uint32_t n = buf->count;
+    if (n == TRACE_BUFFER_EVENTS) {
+        ++buf->dropped;
+        return;
+    }
+
+    TraceEvent &ev = buf->events[n];
+    ev.name = name;
+    ev.ts = trace_now();
+    ev.phase = phase;
+    __sync_synchronize();
+    buf->count = n + 1;
+}
+
+void trace_thread_name(const char *name)
+{
+    TraceThread *tt = get_trace_thread();
+    if (!tt)
+        return;
+
+    snprintf(tt->name, sizeof(tt->name), "%s", name);
+    if (tt->buf) {
+        AutoLock _l(trace_mutex);
+        snprintf(tt->buf->name, sizeof(tt->buf->name), "%s", tt->name);
+    }
+}
+
+int trace_start()
+{
+    AutoLock _l(trace_mutex);
+
+    if (gtrace_on) {
+        E("Tracing already started");
+        return -1;
+    }
+
+    std::vector<TraceBuffer *>::iterator it = trace_buffers.begin();
+    while (it != trace_buffers.end()) {
+        if ((*it)->retired) {
+            free(*it);
+            it = trace_buffers.erase(it);
+        } else {
+            // Its owner may still be ending a scope, it empties it itself
+            ++it;
+        }
+    }
+
+    __sync_add_and_fetch(&trace_generation, 1);
+    gtrace_on = true;
+    I("Tracing started");
+    return 0;
+}
+
+int trace_stop(const std::string &path)
+{
+    gtrace_on = false;
+
+    AutoLock _l(trace_mutex);
+
+    xfile::File f;
+    if (!f.open(path, "w")) {
+        E("Open trace file \"%s\" failed", STR(path));
+        return -1;
+    }
+
+    pid_t pid = getpid();
+    char line[256];
+    uint32_t total = 0, dropped = 0;
+    bool first = true;
+    int len;
+
+    f.write_string("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    foreach(trace_buffers, it) {
+        const TraceBuffer *buf = *it;
+
+        // Not written since this trace started, what it holds is older
+        if (buf->generation != trace_generation)
+            continue;
+        __sync_synchronize();
+        uint32_t n = buf->count;
+        if (!n)
+            continue;
+
+        len = snprintf(line, sizeof(line),
+                       "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{\"name\":\"%s\"}}",
+                       first ? "" : ",\n", pid, buf->tid, buf->name);
+        f.write_buffer((const uint8_t *) line, len);
+        first = false;
+
+        for (uint32_t i = 0; i < n; ++i) {
+            const TraceEvent &ev = buf->events[i];
+            len = snprintf(line, sizeof(line),
+                           ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d}",
+                           ev.name, ev.phase, (long long unsigned) ev.ts, pid, buf->tid);
+            f.write_buffer((const uint8_t *) line, len);
+        }
+        total += n;
+        dropped += buf->dropped;
+    }
+
+    f.write_string("\n]}\n");
+    f.close();
+
+    I("Tracing stopped, %u events written to \"%s\" (%u dropped)",
+      total, STR(path), dropped);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>
+
+#include "config.h"
+#include "xutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Chrome trace-event recorder (load the output in chrome://tracing).
+ * Every thread appends begin/end events to a buffer of its own, no lock
+ * is taken on the way; names must be string literals (only the pointer
+ * is kept). An end whose begin was before the trace started is left out.
+ * ENABLE_TRACE in config.h compiles the trace points out. */
+
+#define TRACE_BUFFER_EVENTS     (32*1024) // Per thread, later events dropped
+
+extern volatile bool gtrace_on;
+
+void trace_event(const char *name, char phase);
+// Label the calling thread in the trace
+void trace_thread_name(const char *name);
+
+int trace_start();
+// Stop recording and write what's been recorded as json
+int trace_stop(const std::string &path);
+
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : m_name(NULL) {
+        if (gtrace_on) {
+            m_name = name;
+            trace_event(name, 'B');
+        }
+    }
+    ~TraceScope() {
+        // Closed even if tracing stopped meanwhile, keep it balanced
+        if (m_name)
+            trace_event(m_name, 'E');
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TraceScope);
+    const char *m_name;
+};
+
+#if defined(ENABLE_TRACE) && (ENABLE_TRACE != 0)
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(_trace_, __LINE__)(name)
+#define TRACE_BEGIN(name) do { if (gtrace_on) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name)   do { if (gtrace_on) trace_event(name, 'E'); } while (0)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_THREAD_NAME(name)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _TRACE_H_ */
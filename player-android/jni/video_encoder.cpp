@@ -1,9 +1,17 @@
 #include <memory>
+#include <algorithm>
 #include <libyuv.h>
 
 #include "video_encoder.h"
 #include "rtmp_handler.h"
+#include "latency_tracker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "thread_ctl.h"
+#include "fqrtmp_session.h"
 #include "xqueue.h"
+#include "xexecutor.h"
 
 //#define XDEBUG
 
@@ -14,10 +22,145 @@ using namespace xutil;
 using namespace libyuv;
 
 #define THREAD_NAME "video_encoder"
-extern JNIEnv *jni_get_env(const char *name);
+#define SLICE_THREAD_NAME "video_sender"
+
+// Fewer rows than this per band aren't worth a task
+#define CONVERT_BAND_MIN_ROWS   32
+#define CONVERT_MAX_BANDS       8
+
+// Keyframes asked for by request_keyframe() are this far apart at least
+#define KEYFRAME_MIN_INTERVAL_MS    1000
+
+// Average encode time, in percent of the frame interval, above which the
+// effort steps down and below which it may step up
+#define EFFORT_BEHIND_PCT       80
+#define EFFORT_HEADROOM_PCT     40
+// Seconds of headroom before a step up, doubled each time a level turns
+// out too much (up to the max) so the encoder doesn't seesaw
+#define EFFORT_UP_SECS          3
+#define EFFORT_UP_MAX_SECS      30
+
+// Ordered by cost, roughly x264's presets from superfast to slow within
+// what x264_encoder_reconfig() takes; nothing here touches the sps.
+// subme stays above 0 as x264 can't come back from it
+struct EffortLevel {
+    int subme;
+    int me_method;
+    int me_range;
+    unsigned inter;
+    unsigned intra;
+};
+
+static const EffortLevel effort_levels[] = {
+    { 1, X264_ME_DIA, 16, 0, 0 },
+    { 3, X264_ME_DIA, 16, 0, 0 },
+    // What init() sets by hand, where the adaptive encoder starts
+    { 5, X264_ME_DIA, 16, 0, 0 },
+    { 5, X264_ME_HEX, 16, X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16,
+      X264_ANALYSE_I4x4 },
+    { 6, X264_ME_HEX, 16, X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16,
+      X264_ANALYSE_I4x4 },
+    { 7, X264_ME_HEX, 16, X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 |
+      X264_ANALYSE_PSUB8x8, X264_ANALYSE_I4x4 },
+    { 8, X264_ME_UMH, 16, X264_ANALYSE_I4x4 | X264_ANALYSE_PSUB16x16 |
+      X264_ANALYSE_PSUB8x8, X264_ANALYSE_I4x4 },
+};
+
+#define EFFORT_LEVEL_NUM        ((int) NELEM(effort_levels))
+#define EFFORT_START_LEVEL      2
+
+static void apply_effort(x264_param_t *params, int level)
+{
+    const EffortLevel &effort = effort_levels[level];
+
+    params->analyse.i_subpel_refine = effort.subme;
+    params->analyse.i_me_method = effort.me_method;
+    params->analyse.i_me_range = effort.me_range;
+    params->analyse.inter = effort.inter;
+    params->analyse.intra = effort.intra;
+}
+
+// Rows [row, row+rows) of the nv12/nv21 frame, into the i420 buffer
+struct ConvertBand {
+    const uint8_t *src;
+    uint8_t *dst;
+    int width;
+    int height;
+    int rotation;
+    int row;
+    int rows;
+};
+
+static void convert_band(void *arg)
+{
+    const ConvertBand *band = (const ConvertBand *) arg;
+    int width = band->width, height = band->height;
+    int src_uv_stride = (width + 1) & ~1;
+    int dst_uv_stride = (width + 1) / 2;
+    int dst_y_size = width * height;
+    int dst_uv_size = dst_uv_stride * ((height + 1) / 2);
+    // Turned by 180, the band lands mirrored at the other end
+    int dst_row = band->rotation == 180 ?
+        height - band->row - band->rows : band->row;
+    uint8_t *dst_v = band->dst + dst_y_size + dst_row / 2 * dst_uv_stride;
+
+    NV12ToI420Rotate(band->src + band->row * width, width,
+                     band->src + dst_y_size + band->row / 2 * src_uv_stride,
+                     src_uv_stride,
+                     band->dst + dst_row * width, width,
+                     dst_v + dst_uv_size, dst_uv_stride,
+                     dst_v, dst_uv_stride,
+                     width, band->rows,
+                     band->rotation == 180 ? kRotate180 : kRotate0);
+}
+
+void convert_frame(const uint8_t *src, uint8_t *dst, int width, int height,
+                   int rotation, int max_bands)
+{
+    // Rows are independent in both orientations: bands of even rows (whole
+    // chroma rows), one per executor worker plus this thread, which helps
+    Executor *executor = pipeline_executor();
+    int bands = MIN(MIN(max_bands, CONVERT_MAX_BANDS),
+                    height / CONVERT_BAND_MIN_ROWS);
+    if (height & 1) {
+        bands = 1;  // Bands mirrored by 180 would start on odd rows
+    }
+    bands = MAX(bands, 1);
+    int band_rows = (height / bands + 1) & ~1;
+    ConvertBand band[CONVERT_MAX_BANDS];
+    TaskGroup group;
+    for (int i = 0, row = 0; i < bands; ++i, row += band_rows) {
+        band[i].src = src;
+        band[i].dst = dst;
+        band[i].width = width;
+        band[i].height = height;
+        band[i].rotation = rotation == 180 ? 180 : 0;
+        band[i].row = row;
+        band[i].rows = i == bands - 1 ? height - row : band_rows;
+        if (bands == 1) {
+            convert_band(&band[i]);
+        } else {
+            executor->submit(convert_band, &band[i], &group);
+        }
+    }
+    executor->wait(&group);
+}
+
+VideoConfig::VideoConfig() :
+    preset("ultrafast"), tune("zerolatency"), profile("baseline"),
+    level_idc(-1), input_csp(17 /* ImageFormat.NV21 */), bitrate(450 * 1000),
+    width(-1), height(-1),
+    i_frame_interval(3), repeat_headers(true), b_frames(0), deblocking_filter(true),
+    slice_max_size(0), intra_refresh(false), adaptive_effort(false)
+{
+    fps.num = 15;
+    fps.den = 1;
+    orig_fps.num = 30;
+    orig_fps.den = 1;
+}
 
-VideoEncoder::VideoEncoder() :
-    m_enc(NULL), m_start_pts(0), m_frame_num(0), m_thrd(NULL), m_quit(false), m_file_yuv(NULL), m_file_x264(NULL)
+VideoEncoder::VideoEncoder(FQRtmpSession *session) :
+    m_session(session), m_slice_max_size(0), m_intra_refresh(false), m_adaptive_effort(false), m_keyframe_requested(false), m_last_keyframe_us(0), m_frame_mbs(0), m_enc(NULL), m_sps_pps_changed(false), m_start_pts(0), m_frame_num(0), m_thrd(NULL), m_slice_thrd(NULL), m_quit(false), m_file_yuv(NULL), m_file_x264(NULL)
 {
     memset(&m_params, 0, sizeof(m_params));
 
@@ -36,17 +179,24 @@ VideoEncoder::VideoEncoder() :
 VideoEncoder::~VideoEncoder()
 {
     Packet *pkt = NULL;
-    int i;
 
     D("Average fps is: %.2f", m_fps_calc.get_fps());
 
     m_quit = true;
     m_queue.cancel_wait();
     JOIN_DELETE_THREAD(m_thrd);
-    for (i = 0; i < m_queue.size(); ++i) {
+    // Nothing left to send once the encode thread is gone
+    {
+        AutoLock _l(m_slices.mutex);
+        m_slices.quit = true;
+        m_slices.cond.broadcast();
+    }
+    JOIN_DELETE_THREAD(m_slice_thrd);
+    // Popping shrinks the queue, so not counted by i
+    while (m_queue.size() > 0) {
         if (m_queue.pop(pkt) < 0)
             break;
-        SAFE_DELETE(pkt);
+        release_frame(pkt);
     }
     x264_encoder_close(m_enc);
     m_enc = NULL;
@@ -80,8 +230,6 @@ int VideoEncoder::FPSCtrl::init(int tgt_fps, int orig_fps)
 
 static void X264_log(void *p, int level, const char *fmt, va_list args)
 {
-    char buf[4096];
-
     static const int level_map[] = {
         ANDROID_LOG_ERROR,
         ANDROID_LOG_WARN,
@@ -92,11 +240,56 @@ static void X264_log(void *p, int level, const char *fmt, va_list args)
     if (level < 0 || level > X264_LOG_DEBUG)
         return;
 
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    __android_log_write(level_map[level], LOG_TAG, buf);
+    if (level_map[level] < XLOG_MIN_LEVEL)
+        return;
+
+    xlog_vprint("x264", -1, level_map[level], LOG_TAG, true, fmt, args);
+}
+
+void EffortCtrl::init(const Rational &fps)
+{
+    level = EFFORT_START_LEVEL;
+    interval_us = (uint32_t) (1000000LL * fps.den / fps.num);
+    avg_us = 0;
+    frames = 0;
+    // About a second for the average to be of the current level
+    settle_frames = MAX(fps.num / fps.den, 8);
+    up_frames = fps.num / fps.den * EFFORT_UP_SECS;
+    headroom_frames = 0;
+}
+
+int EffortCtrl::update(uint32_t encode_us)
+{
+    // 1/8 of the new one, the rest history; the first one to start with
+    avg_us = avg_us ? avg_us - avg_us / 8 + encode_us / 8 : encode_us;
+
+    if (++frames < settle_frames)
+        return 0;
+
+    if (avg_us > interval_us * EFFORT_BEHIND_PCT / 100) {
+        headroom_frames = 0;
+        if (level == 0)
+            return 0;
+        // Behind, and the level above isn't to be tried again that soon
+        up_frames = MIN(up_frames * 2,
+                        (int) (1000000 / interval_us * EFFORT_UP_MAX_SECS));
+        frames = 0;
+        return -1;
+    }
+
+    if (avg_us < interval_us * EFFORT_HEADROOM_PCT / 100) {
+        if (++headroom_frames >= up_frames && level < EFFORT_LEVEL_NUM - 1) {
+            headroom_frames = 0;
+            frames = 0;
+            return 1;
+        }
+    } else {
+        headroom_frames = 0;
+    }
+    return 0;
 }
 
-int VideoEncoder::init(jobject video_config)
+int VideoEncoder::init(const VideoConfig &video_config)
 {
     if (load_config(video_config) < 0) {
         E("Video encoder load_config failed");
@@ -147,6 +340,12 @@ int VideoEncoder::init(jobject video_config)
     m_params.analyse.b_fast_pskip = 1;
     m_params.analyse.b_dct_decimate = 1;
 
+    if (m_adaptive_effort) {
+        apply_effort(&m_params, EFFORT_START_LEVEL);
+        m_effort.init(m_fps);
+        metric_set(METRIC_VIDEO_EFFORT, m_effort.level);
+    }
+
     m_params.b_repeat_headers = m_repeat_headers ? 1 : 0;
 
     if (!m_profile.empty()) {
@@ -164,9 +363,36 @@ int VideoEncoder::init(jobject video_config)
 
     m_params.i_keyint_max = m_fps.num / m_fps.den * m_i_frame_interval;
 
-    m_params.i_threads = cpu_num();
+    if (m_intra_refresh) {
+        // A column of intra blocks sweeps the picture once per interval
+        // instead of an idr, the first frame of a sweep is flagged key
+        // and carries a recovery point. A vbv of one frame keeps every
+        // frame about the same size
+        m_params.b_intra_refresh = 1;
+        m_params.i_frame_reference = 1;
+        if (m_bitrate > 0) {
+            m_params.rc.i_vbv_buffer_size =
+                MAX(m_params.rc.i_vbv_max_bitrate * m_fps.den / m_fps.num, 1);
+        }
+    }
 
-    m_params.b_annexb = 1;
+    // Leaves the cores the conversion workers and aac need
+    m_params.i_threads = pipeline_encoder_threads();
+
+    // Length-prefixed nalus, ready for flv/rtmp without re-parsing
+    m_params.b_annexb = 0;
+
+    if (m_slice_max_size > 0) {
+        // Nothing held back, a frame comes out of the very encode call it
+        // goes in with, the slices seen are of the frame just fed
+        m_params.i_bframe = 0;
+        m_params.rc.i_lookahead = 0;
+        m_params.i_sync_lookahead = 0;
+        m_params.b_sliced_threads = 1;
+        m_params.i_slice_max_size = m_slice_max_size;
+        m_params.nalu_process = slice_ready;
+        m_frame_mbs = ((m_width + 15) / 16) * ((m_height + 15) / 16);
+    }
 
     m_enc = x264_encoder_open(&m_params);
     if (!m_enc) {
@@ -176,6 +402,26 @@ int VideoEncoder::init(jobject video_config)
 
     x264_encoder_parameters(m_enc, &m_params);
 
+    if (m_params.nalu_process) {
+        // x264_encoder_headers() would call back with no frame to take the
+        // opaque of, the parameter sets come from a twin without it
+        x264_param_t params = m_params;
+        params.nalu_process = NULL;
+        x264_t *twin = x264_encoder_open(&params);
+        if (!twin) {
+            E("x264_encoder_open for the parameter sets failed");
+            return -1;
+        }
+        int ret = fetch_headers(twin);
+        x264_encoder_close(twin);
+        if (ret < 0)
+            return -1;
+
+        m_slice_thrd = CREATE_THREAD_ROUTINE(slice_send_routine, NULL, false);
+    } else if (fetch_headers(m_enc) < 0) {
+        return -1;
+    }
+
     if (m_fps_ctrl.init(m_fps.num/m_fps.den,
                         m_orig_fps.num/m_orig_fps.den) < 0)
         return -1;
@@ -183,42 +429,37 @@ int VideoEncoder::init(jobject video_config)
     return 0;
 }
 
-int VideoEncoder::feed(uint8_t *buffer, int len, int rotation)
+int VideoEncoder::feed(uint8_t *buffer, int len, int rotation, int64_t pts)
 {
     int dst_i420_y_size = m_width * m_height;
     int dst_i420_uv_size = ((m_width + 1) / 2) * ((m_height + 1) / 2);
     int dst_i420_size = dst_i420_y_size + dst_i420_uv_size * 2;
+    uint64_t capture_us = get_time_now_us();
 
-    align_buffer_64(dst_i420_c, dst_i420_size);
-
-    switch (rotation) {
-    default:
-    case 0:
-        NV12ToI420Rotate(buffer, m_width,
-                         buffer + m_width * m_height, (m_width + 1) & ~1,
-                         dst_i420_c, m_width,
-                         dst_i420_c + dst_i420_y_size + dst_i420_uv_size, (m_width + 1) / 2,
-                         dst_i420_c + dst_i420_y_size, (m_width + 1) / 2,
-                         m_width, m_height, kRotate0);
-        break;
-    case 180:
-        NV12ToI420Rotate(buffer, m_width,
-                         buffer + m_width * m_height, (m_width + 1) & ~1,
-                         dst_i420_c, m_width,
-                         dst_i420_c + dst_i420_y_size + dst_i420_uv_size, (m_width + 1) / 2,
-                         dst_i420_c + dst_i420_y_size, (m_width + 1) / 2,
-                         m_width, m_height, kRotate180);
-        break;
-    }
+    // Converted straight into the buffer the queued packet views
+    MediaBuffer *frame_buf = media_buffer_alloc(dst_i420_size);
+    if (!frame_buf)
+        return -1;
+    uint8_t *dst_i420_c = frame_buf->data;
 
+    TRACE_BEGIN("NV12ToI420Rotate");
+    convert_frame(buffer, dst_i420_c, m_width, m_height, rotation,
+                  pipeline_executor()->threads() + 1);
+    TRACE_END("NV12ToI420Rotate");
+
+    uint64_t converted_us = get_time_now_us();
+    metric_observe(METRIC_CONVERT_US, (uint32_t) (converted_us - capture_us));
     uint64_t now = get_time_now();
 
-    if (!m_start_pts) {
-        m_start_pts = now;
+    bool stamped = pts >= 0;
+    if (!stamped) {
+        if (!m_start_pts) {
+            m_start_pts = now;
+        }
+        pts = now - m_start_pts;
     }
-
-    uint64_t pts = now - m_start_pts;
-    if (!m_fps_ctrl.first_timestamp) {
+    // Frames stamped by the caller are paced by it, nothing to drop
+    if (!stamped && !m_fps_ctrl.first_timestamp) {
         uint64_t stamp_differ = now - m_fps_ctrl.start_timestamp;
         m_fps_ctrl.start_timestamp = now;
         m_fps_ctrl.avg_timestamp_per_frame =
@@ -234,7 +475,9 @@ int VideoEncoder::feed(uint8_t *buffer, int len, int rotation)
                 if (m_fps_ctrl.last_frame < m_fps_ctrl.get_frame-1) {
                     ++m_fps_ctrl.last_frame;
                     ++m_fps_ctrl.dropped_frames;
-                    free_aligned_buffer_64(dst_i420_c);
+                    metric_add(METRIC_VIDEO_FRAMES_DROPPED);
+                    flight_record(FLIGHT_VIDEO_DROPPED, m_fps_ctrl.dropped_frames);
+                    media_buffer_unref(&frame_buf);
                     return 0;
                 }
             }
@@ -263,9 +506,18 @@ int VideoEncoder::feed(uint8_t *buffer, int len, int rotation)
     m_fps_ctrl.last_frame = m_fps_ctrl.get_frame;
     ++m_fps_ctrl.n;
 
-    Packet *pkt = new Packet(dst_i420_c, dst_i420_size, pts, pts);
-    free_aligned_buffer_64(dst_i420_c);
-    return m_queue.push(pkt);
+    Packet *pkt = new Packet(frame_buf, dst_i420_c, dst_i420_size, pts, pts);
+
+    LatencyTracker *latency = m_session->latency();
+    if (latency) {
+        pkt->latency_seq = latency->begin_frame(capture_us);
+        latency->mark(pkt->latency_seq, STAGE_CONVERTED, converted_us);
+    }
+    m_session->mem_budget()->add(MEM_VIDEO_QUEUE, pkt->size);
+    int ret = m_queue.push(pkt);
+    metric_set(METRIC_VIDEO_QUEUE_DEPTH, m_queue.size());
+    flight_record(FLIGHT_VIDEO_FED, dst_i420_size, m_queue.size());
+    return ret;
 }
 
 unsigned int VideoEncoder::encode_routine(void *arg)
@@ -276,17 +528,32 @@ unsigned int VideoEncoder::encode_routine(void *arg)
     int num_of_nals;
     int frame_size;
 
+    TRACE_THREAD_NAME(THREAD_NAME);
+    thread_ctl_register(THREAD_NAME);
     D("x264 encode_routine started ..");
 
+    // One for the whole run, so its nalu list keeps its capacity
+    std::auto_ptr<AVCFrame> pkt_out(new AVCFrame);
+
     while (!m_quit) {
-        std::auto_ptr<Packet> pkt_out(new Packet);
         int ret;
 
-        if (m_queue.pop(pkt) < 0)
+        media_buffer_unref(&pkt_out->buf);
+        pkt_out->data = NULL;
+        pkt_out->size = 0;
+
+        TRACE_BEGIN("wait frame");
+        ret = m_queue.pop(pkt);
+        TRACE_END("wait frame");
+        if (ret < 0)
             break;
 
-        if (m_quit)
+        if (m_quit) {
+            release_frame(pkt);
             break;
+        }
+
+        metric_set(METRIC_VIDEO_QUEUE_DEPTH, m_queue.size());
 
         if (m_file_yuv) {
             m_file_yuv->write_buffer(pkt->data, pkt->size);
@@ -303,14 +570,70 @@ unsigned int VideoEncoder::encode_routine(void *arg)
         m_pic.img.i_stride[1] = (m_params.i_width + 1) / 2;
         m_pic.img.i_stride[2] = (m_params.i_width + 1) / 2;
         m_pic.i_pts = m_frame_num++;
+        // Comes back in pic_out of the very frame; in slice mode it's what
+        // slice_ready gets, the frame is pkt then
+        m_pic.opaque = m_slice_max_size > 0 ?
+            (void *) this : (void *) (intptr_t) pkt->latency_seq;
+
+        // A request coming in right after is taken by this frame too
+        if (m_keyframe_requested &&
+            get_time_now_us() - m_last_keyframe_us >=
+                KEYFRAME_MIN_INTERVAL_MS * 1000ULL) {
+            m_keyframe_requested = false;
+            if (m_intra_refresh) {
+                x264_encoder_intra_refresh(m_enc);
+            } else {
+                m_pic.i_type = X264_TYPE_IDR;
+            }
+            metric_add(METRIC_VIDEO_KEYFRAMES_FORCED);
+            flight_record(FLIGHT_KEYFRAME_FORCED, m_frame_num, 0);
+        }
+
+        if (pkt->latency_seq && m_session->latency() &&
+            attach_latency_sei(pkt->latency_seq) < 0) {
+            W("Attach latency sei to frame #%u failed (cont)", pkt->latency_seq);
+        }
 
+        uint64_t encode_start_us = get_time_now_us();
+        // Time in x264 only, waiting on the send (slice mode) isn't for the
+        // effort to make up
+        uint32_t x264_us = 0;
+        if (m_slice_max_size > 0) {
+            AutoLock _l(m_slices.mutex);
+            m_slices.mbs = 0;
+            m_slices.failed = false;
+            m_slices.complete = false;
+            m_slices.sent = false;
+            m_slices.frame = pkt_out.get();
+            m_slices.src = pkt;
+            m_slices.encode_start_us = encode_start_us;
+        }
         do {
+            uint64_t call_start_us = get_time_now_us();
+            TRACE_BEGIN("x264_encoder_encode");
             frame_size = x264_encoder_encode(m_enc, &nals, &num_of_nals, &m_pic, &pic_out);
+            TRACE_END("x264_encoder_encode");
+            x264_us += (uint32_t) (get_time_now_us() - call_start_us);
             if (frame_size < 0) {
                 E("x264_encoder_encode failed");
                 goto cleanup;
             }
+            // Here rather than when sent, the sender is another thread in
+            // slice mode and the requests are served on this one
+            if (frame_size > 0 && pic_out.b_keyframe) {
+                m_last_keyframe_us = get_time_now_us();
+            }
+
+            // x264 took the sei (and frees it), don't hand it in twice
+            memset(&m_pic.extra_sei, 0, sizeof(m_pic.extra_sei));
+            m_pic.opaque = NULL;
             
+            // The nals went to slice_ready instead
+            if (m_slice_max_size > 0) {
+                ret = frame_size > 0;
+                continue;
+            }
+
             ret = encode_nals(pkt_out.get(), nals, num_of_nals);
             if (ret < 0) {
                E("encode_nals failed");
@@ -318,28 +641,268 @@ unsigned int VideoEncoder::encode_routine(void *arg)
             }
         } while (!m_quit && !ret && x264_encoder_delayed_frames(m_enc));
 
-        pkt_out->pts = pkt->pts;
-        pkt_out->dts = pkt->dts;
-
-        if (m_file_x264) {
-            m_file_x264->write_buffer(pkt_out->data, pkt_out->size);
+        if (m_adaptive_effort) {
+            adapt_effort(x264_us);
         }
 
-        if (gfq.rtmp_hdlr) {
-            gfq.rtmp_hdlr->send_video(pkt_out->pts, pkt_out->data, pkt_out->size);
+        if (m_slice_max_size > 0) {
+            uint64_t returned_us = get_time_now_us();
+            bool complete;
+            {
+                // No slice comes in any more, the frame may still be on
+                // its way out
+                AutoLock _l(m_slices.mutex);
+                complete = m_slices.complete;
+                while (complete && !m_slices.sent) {
+                    m_slices.cond.wait();
+                }
+            }
+            if (complete) {
+                metric_observe(METRIC_SLICE_LEAD_US,
+                               m_slices.sent_us < returned_us ?
+                               returned_us - m_slices.sent_us : 0);
+            } else {
+                // The slices didn't add up to the frame, what there is goes
+                send_slices();
+            }
+            goto cleanup;
         }
 
-        m_fps_calc.check();
+        if (!pkt_out->size)
+            goto cleanup;
+
+        send_frame(pkt_out.get(), pkt, pic_out.b_keyframe,
+                   (uint32_t) (intptr_t) pic_out.opaque, encode_start_us);
 
 cleanup:
-        SAFE_DELETE(pkt);
+        release_frame(pkt);
     }
 
+    thread_ctl_unregister();
     D("x264 encode_routine ended");
     return 0;
 }
 
-int VideoEncoder::encode_nals(Packet *pkt, const x264_nal_t *nals, int nnal)
+void VideoEncoder::send_frame(AVCFrame *frame, const Packet *src, bool key_frame,
+                              uint32_t latency_seq, uint64_t encode_start_us)
+{
+    metric_observe_since(METRIC_VIDEO_ENCODE_US, encode_start_us);
+    metric_add(METRIC_VIDEO_FRAMES_ENCODED);
+    metric_add(METRIC_VIDEO_BYTES_ENCODED, frame->size);
+
+    frame->pts = src->pts;
+    frame->dts = src->dts;
+    flight_record(FLIGHT_VIDEO_ENCODED, frame->size, frame->pts);
+    frame->key_frame = key_frame;
+    frame->sps = &m_sps[0];
+    frame->sps_length = m_sps.size();
+    frame->pps = &m_pps[0];
+    frame->pps_length = m_pps.size();
+    // x264 repeats the sps/pps before every sweep, a sequence header goes
+    // with it for whoever starts there
+    frame->sps_pps_changed = m_sps_pps_changed || (key_frame && m_intra_refresh);
+    m_sps_pps_changed = false;
+
+    frame->latency_seq = latency_seq;
+    if (m_session->latency()) {
+        m_session->latency()->mark(frame->latency_seq, STAGE_ENCODED);
+    }
+
+    if (m_file_x264) {
+        dump_annexb(frame);
+    }
+
+    if (RtmpHandler *rtmp_hdlr = m_session->rtmp_handler()) {
+        rtmp_hdlr->send_video(frame->pts, frame);
+    }
+
+    m_fps_calc.check();
+}
+
+void VideoEncoder::slice_ready(x264_t *h, x264_nal_t *nal, void *opaque)
+{
+    VideoEncoder *enc = (VideoEncoder *) opaque;
+    SliceAssembly &sa = enc->m_slices;
+
+    // What x264 asks for to escape and length-prefix the nal
+    uint8_t *buf = (uint8_t *) xpool_alloc(nal->i_payload * 3 / 2 + 5 + 64);
+    if (buf) {
+        x264_nal_encode(h, buf, nal);
+        metric_add(METRIC_VIDEO_SLICES);
+    }
+
+    AutoLock _l(sa.mutex);
+    if (!buf) {
+        E("xpool_alloc for nal of %d bytes failed: %s",
+          nal->i_payload, ERRNOMSG);
+        sa.failed = true;
+    } else {
+        sa.nals.push_back(*nal);
+    }
+    if ((nal->i_type == NAL_SLICE || nal->i_type == NAL_SLICE_IDR) &&
+        !sa.complete) {
+        sa.mbs += nal->i_last_mb - nal->i_first_mb + 1;
+        // The last slice in, the frame goes now rather than when x264 is
+        // done with it; slices out of another thread are all in by then
+        if (sa.mbs >= enc->m_frame_mbs) {
+            sa.complete = true;
+            sa.cond.broadcast();
+        }
+    }
+}
+
+static bool nal_before(const x264_nal_t &a, const x264_nal_t &b)
+{
+    bool a_slice = a.i_type == NAL_SLICE || a.i_type == NAL_SLICE_IDR;
+    bool b_slice = b.i_type == NAL_SLICE || b.i_type == NAL_SLICE_IDR;
+
+    if (a_slice != b_slice)
+        return b_slice;
+    return a_slice && a.i_first_mb < b.i_first_mb;
+}
+
+void sort_frame_nals(std::vector<x264_nal_t> &nals)
+{
+    std::stable_sort(nals.begin(), nals.end(), nal_before);
+}
+
+void VideoEncoder::send_slices()
+{
+    SliceAssembly &sa = m_slices;
+    bool key_frame = false;
+    int ret = 0;
+
+    {
+        AutoLock _l(sa.mutex);
+        if (sa.failed) {
+            E("Frame with a slice missing dropped");
+        } else if (!sa.nals.empty()) {
+            sort_frame_nals(sa.nals);
+            ret = encode_nals(sa.frame, &sa.nals[0], sa.nals.size());
+            if (ret < 0) {
+                E("encode_nals failed");
+            }
+        }
+        foreach(sa.nals, it) {
+            // Past the length prefix x264_nal_encode() put in front
+            key_frame |= it->i_type == NAL_SLICE_IDR ||
+                (it->i_type == NAL_SEI &&
+                 xmedia::h264_sei_has_recovery_point(it->p_payload + 4,
+                                                     it->i_payload - 4));
+            xpool_free(it->p_payload);
+        }
+        sa.nals.clear();
+    }
+
+    if (ret > 0) {
+        send_frame(sa.frame, sa.src, key_frame, sa.src->latency_seq,
+                   sa.encode_start_us);
+    }
+}
+
+unsigned int VideoEncoder::slice_send_routine(void *arg)
+{
+    SliceAssembly &sa = m_slices;
+
+    TRACE_THREAD_NAME(SLICE_THREAD_NAME);
+    thread_ctl_register(SLICE_THREAD_NAME);
+    D("x264 slice_send_routine started ..");
+
+    for ( ; ; ) {
+        {
+            AutoLock _l(sa.mutex);
+            while (!sa.quit && (!sa.complete || sa.sent)) {
+                sa.cond.wait();
+            }
+            if (sa.quit)
+                break;
+        }
+
+        send_slices();
+
+        AutoLock _l(sa.mutex);
+        sa.sent = true;
+        sa.sent_us = get_time_now_us();
+        sa.cond.broadcast();
+    }
+
+    thread_ctl_unregister();
+    D("x264 slice_send_routine ended");
+    return 0;
+}
+
+void VideoEncoder::adapt_effort(uint32_t encode_us)
+{
+    int step = m_effort.update(encode_us);
+    if (!step)
+        return;
+
+    x264_param_t params;
+    x264_encoder_parameters(m_enc, &params);
+    apply_effort(&params, m_effort.level + step);
+    // Taken at the next frame, on this thread as x264 wants it
+    if (x264_encoder_reconfig(m_enc, &params) < 0) {
+        W("x264_encoder_reconfig to effort level %d failed (cont)",
+          m_effort.level + step);
+        return;
+    }
+
+    I("Effort level %d -> %d, average encode time %uus of %uus",
+      m_effort.level, m_effort.level + step,
+      m_effort.avg_us, m_effort.interval_us);
+    m_effort.level += step;
+    metric_set(METRIC_VIDEO_EFFORT, m_effort.level);
+    metric_add(METRIC_VIDEO_EFFORT_STEPS);
+}
+
+int VideoEncoder::fetch_headers(x264_t *enc)
+{
+    x264_nal_t *nals;
+    int nnal;
+
+    if (x264_encoder_headers(enc, &nals, &nnal) < 0) {
+        E("x264_encoder_headers failed");
+        return -1;
+    }
+
+    for (int i = 0; i < nnal; ++i) {
+        // Strip the 4-byte length prefix
+        const byte *dat = nals[i].p_payload + 4;
+        uint32_t length = nals[i].i_payload - 4;
+
+        if (nals[i].i_type == NAL_SPS) {
+            m_sps.assign(dat, dat + length);
+        } else if (nals[i].i_type == NAL_PPS) {
+            m_pps.assign(dat, dat + length);
+        }
+    }
+
+    if (m_sps.size() < 4 || m_pps.empty()) {
+        E("No sps or pps got from x264");
+        return -1;
+    }
+
+    // Make sure what goes out is what was asked for
+    xmedia::SPS sps;
+    xmedia::PPS pps;
+    xmedia::AVCVideoInfo info;
+    if (xmedia::h264_parse_sps(&m_sps[0], m_sps.size(), &sps) < 0 ||
+        xmedia::h264_parse_pps(&m_pps[0], m_pps.size(), &pps) < 0 ||
+        xmedia::h264_video_info(sps, &pps, info) < 0) {
+        E("Decode sps/pps from x264 failed");
+        return -1;
+    }
+    if (info.width != m_width || info.height != m_height) {
+        E("x264 output size %dx%d mismatches the configured %dx%d",
+          info.width, info.height, m_width, m_height);
+        return -1;
+    }
+
+    m_sps_pps_changed = true;
+    return 0;
+}
+
+int VideoEncoder::encode_nals(AVCFrame *frame, const x264_nal_t *nals, int nnal)
 {
     int i, size = 0;
     uint8_t *p;
@@ -350,156 +913,125 @@ int VideoEncoder::encode_nals(Packet *pkt, const x264_nal_t *nals, int nnal)
     for (i = 0; i < nnal; ++i)
         size += nals[i].i_payload;
 
-    pkt->data = (uint8_t *) realloc(pkt->data, size);
-    if (!pkt->data) {
-        E("realloc for out-pkt failed: %s", ERRNOMSG);
+    // Headroom for RtmpHandler to put the tag header in front in place
+    MediaBuffer *buf = media_buffer_alloc(size, MEDIA_BUFFER_HEADROOM);
+    if (!buf)
         return -1;
-    }
+    media_buffer_unref(&frame->buf);
+    frame->buf = buf;
+    frame->data = buf->data;
 
-    p = pkt->data;
-    pkt->size = size;
+    p = frame->data;
+    frame->size = size;
+    frame->nalus.resize(nnal);
 
     for (i = 0; i < nnal; ++i) {
         memcpy(p, nals[i].p_payload, nals[i].i_payload);
+
+        NaluInfo &ni = frame->nalus[i];
+        ni.offset = p + 4 - frame->data;
+        ni.length = nals[i].i_payload - 4;
+        ni.type = nals[i].i_type;
         p += nals[i].i_payload;
     }
 
     return 1;
 }
 
-volatile bool VideoEncoder::quit() const
+// user_data_unregistered sei carrying the capture time of this frame
+// and the stage timings of an earlier one, see LatencyTracker
+int VideoEncoder::attach_latency_sei(uint32_t seq)
 {
-    return m_quit;
-}
+    // Both are released by x264 through sei_free after use
+    x264_sei_payload_t *payload =
+        (x264_sei_payload_t *) xpool_alloc(sizeof(x264_sei_payload_t));
+    byte *buf = (byte *) xpool_alloc(LATENCY_SEI_PAYLOAD_SIZE);
+    if (!payload || !buf) {
+        E("xpool_alloc for latency sei failed: %s", ERRNOMSG);
+        xpool_free(payload);
+        xpool_free(buf);
+        return -1;
+    }
 
-int VideoEncoder::load_config(jobject video_config)
-{
-    JNIEnv *env = jni_get_env(THREAD_NAME);
-    jvalue jval;
-
-#define CALL_METHOD(obj, name, signature) do { \
-    jboolean has_exception = JNI_FALSE; \
-    jval = jnu_call_method_by_name(&has_exception, obj, name, signature); \
-    if (has_exception) { \
-        E("Exception with %s()", name); \
-        return -1; \
-    } \
-} while (0)
-
-#define INIT_STRING_MEMBER(member, jstr) do { \
-    const char *str = env->GetStringUTFChars((jstring) jstr, NULL); \
-    member = str ? str : ""; \
-    env->ReleaseStringUTFChars((jstring) jstr, str); \
-} while (0)
-
-    CALL_METHOD(video_config, "getPreset", "()Ljava/lang/String;");
-    INIT_STRING_MEMBER(m_preset, jval.l);
-
-    CALL_METHOD(video_config, "getTune", "()Ljava/lang/String;");
-    INIT_STRING_MEMBER(m_tune, jval.l);
-
-    CALL_METHOD(video_config, "getProfile", "()Ljava/lang/String;");
-    INIT_STRING_MEMBER(m_profile, jval.l);
-
-    CALL_METHOD(video_config, "getLevelIDC", "()I");
-    m_level_idc = jval.i;
-
-    CALL_METHOD(video_config, "getInputCSP", "()I");
-    m_input_csp = jval.i;
-
-    CALL_METHOD(video_config, "getBitrate", "()I");
-    m_bitrate = jval.i;
-
-    CALL_METHOD(video_config, "getWidth", "()I");
-    m_width = jval.i;
-
-    CALL_METHOD(video_config, "getHeight", "()I");
-    m_height = jval.i;
-
-#define INIT_RATIONAL_MEMBER(rational, obj) do { \
-    jboolean has_exception = JNI_FALSE; \
-    jvalue tmpval = jnu_get_field_by_name(&has_exception, obj, "num", "I"); \
-    if (has_exception) { \
-        E("Exception with Rational"); \
-        return -1; \
-    } \
-    rational.num = tmpval.i; \
-    tmpval = jnu_get_field_by_name(&has_exception, obj, "den", "I"); \
-    if (has_exception) { \
-        E("Exception with Rational"); \
-        return -1; \
-    } \
-    rational.den = tmpval.i; \
-} while (0)
-
-    CALL_METHOD(video_config, "getFPS", "()Lcom/dxyh/libfqrtmp/LibFQRtmp$Rational;");
-    INIT_RATIONAL_MEMBER(m_fps, jval.l);
-
-    CALL_METHOD(video_config, "getOrigFPS", "()Lcom/dxyh/libfqrtmp/LibFQRtmp$Rational;");
-    INIT_RATIONAL_MEMBER(m_orig_fps, jval.l);
-
-    CALL_METHOD(video_config, "getIFrameInterval", "()I");
-    m_i_frame_interval = jval.i;
-
-    CALL_METHOD(video_config, "getRepeatHeaders", "()Z");
-    m_repeat_headers = jval.z;
-
-    CALL_METHOD(video_config, "getBFrames", "()I");
-    m_b_frames = jval.i;
-
-    CALL_METHOD(video_config, "getDeblockingFilter", "()Z");
-    m_deblocking_filter = jval.z;
+    LatencySEI sei;
+    m_session->latency()->make_sei(seq, sei);
 
-    dump_config();
-    return 0;
+    payload->payload_size = latency_sei_write(sei, buf, LATENCY_SEI_PAYLOAD_SIZE);
+    payload->payload_type = 5; // user_data_unregistered
+    payload->payload = buf;
 
-#undef CALL_METHOD
-#undef INIT_STRING_MEMBER
-#undef INIT_RATIONAL_MEMBER
+    m_pic.extra_sei.num_payloads = 1;
+    m_pic.extra_sei.payloads = payload;
+    m_pic.extra_sei.sei_free = xpool_free;
+    return 0;
 }
 
-void VideoEncoder::dump_config() const
+// Keep the dump playable by raw h264 tools
+void VideoEncoder::dump_annexb(const AVCFrame *frame)
 {
-    D("preset=%s, tune=%s, profile=%s, level_idc=%d, input_csp=%d, bitrate=%d, width=%d, height=%d, fps={%d/%d}, i_frame_interval=%d, repeat_headers=%s, b_frames=%d, deblocking_filter=%s",
-      STR(m_preset), STR(m_tune), STR(m_profile), m_level_idc, m_input_csp, m_bitrate, m_width, m_height, m_fps.num, m_fps.den, m_i_frame_interval, m_repeat_headers ? "true" : "false", m_b_frames, m_deblocking_filter ? "true" : "false");
+    static const byte startcode[] = { 0x00, 0x00, 0x00, 0x01 };
+
+    foreach(frame->nalus, it) {
+        m_file_x264->write_buffer(startcode, sizeof(startcode));
+        m_file_x264->write_buffer(frame->data + it->offset, it->length);
+    }
 }
 
-jint openVideoEncoder(JNIEnv *env, jobject thiz, jobject video_config)
+void VideoEncoder::release_frame(Packet *&pkt)
 {
-    gfq.video_enc = new VideoEncoder;
-
-    if (gfq.video_enc->init(video_config) < 0) {
-        closeVideoEncoder(env, thiz);
-        return -1;
+    if (pkt) {
+        m_session->mem_budget()->add(MEM_VIDEO_QUEUE, -pkt->size);
+        SAFE_DELETE(pkt);
     }
-
-    return 0;
 }
 
-jint closeVideoEncoder(JNIEnv *env, jobject thiz)
+void VideoEncoder::request_keyframe()
 {
-    SAFE_DELETE(gfq.video_enc);
-    return 0;
+    metric_add(METRIC_VIDEO_KEYFRAME_REQUESTS);
+    m_keyframe_requested = true;
 }
 
-jint sendRawVideo(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len, int rotation)
+volatile bool VideoEncoder::quit() const
 {
-    int ret = 0;
-
-    if (gfq.video_enc && !gfq.video_enc->quit()) {
-        uint8_t *buffer;
-        jboolean is_copy;
+    return m_quit;
+}
 
-        buffer = (uint8_t *) env->GetByteArrayElements(byte_arr, &is_copy);
-        if (!buffer) {
-            E("Get video buffer failed");
-            return -1;
-        }
+int VideoEncoder::load_config(const VideoConfig &video_config)
+{
+    if (video_config.width <= 0 || video_config.height <= 0 ||
+        video_config.fps.num <= 0 || video_config.fps.den <= 0 ||
+        video_config.orig_fps.num <= 0 || video_config.orig_fps.den <= 0) {
+        E("Invalid video size %dx%d or fps {%d/%d}, {%d/%d}",
+          video_config.width, video_config.height,
+          video_config.fps.num, video_config.fps.den,
+          video_config.orig_fps.num, video_config.orig_fps.den);
+        return -1;
+    }
 
-        ret = gfq.video_enc->feed(buffer, len, rotation);
+    m_preset = video_config.preset;
+    m_tune = video_config.tune;
+    m_profile = video_config.profile;
+    m_level_idc = video_config.level_idc;
+    m_input_csp = video_config.input_csp;
+    m_bitrate = video_config.bitrate;
+    m_width = video_config.width;
+    m_height = video_config.height;
+    m_fps = video_config.fps;
+    m_orig_fps = video_config.orig_fps;
+    m_i_frame_interval = video_config.i_frame_interval;
+    m_repeat_headers = video_config.repeat_headers;
+    m_b_frames = video_config.b_frames;
+    m_deblocking_filter = video_config.deblocking_filter;
+    m_slice_max_size = video_config.slice_max_size;
+    m_intra_refresh = video_config.intra_refresh;
+    m_adaptive_effort = video_config.adaptive_effort;
 
-        env->ReleaseByteArrayElements(byte_arr, (jbyte *) buffer, 0);
-    }
+    dump_config();
+    return 0;
+}
 
-    return ret;
+void VideoEncoder::dump_config() const
+{
+    D("preset=%s, tune=%s, profile=%s, level_idc=%d, input_csp=%d, bitrate=%d, width=%d, height=%d, fps={%d/%d}, i_frame_interval=%d, repeat_headers=%s, b_frames=%d, deblocking_filter=%s, slice_max_size=%d, intra_refresh=%s, adaptive_effort=%s",
+      STR(m_preset), STR(m_tune), STR(m_profile), m_level_idc, m_input_csp, m_bitrate, m_width, m_height, m_fps.num, m_fps.den, m_i_frame_interval, m_repeat_headers ? "true" : "false", m_b_frames, m_deblocking_filter ? "true" : "false", m_slice_max_size, m_intra_refresh ? "true" : "false", m_adaptive_effort ? "true" : "false");
 }
@@ -1,7 +1,6 @@
 #ifndef _VIDEO_ENCODER_H_
 #define _VIDEO_ENCODER_H_
 
-#include <jni.h>
 #include <stdint.h>
 #include <x264.h>
 
@@ -15,20 +14,98 @@
 extern "C" {
 #endif
 
+class FQRtmpSession;
+
+// Mirrors LibFQRtmp.VideoConfig
+struct VideoConfig {
+    std::string preset;
+    std::string tune;
+    std::string profile;
+    int level_idc;
+    int input_csp;
+    int bitrate;
+    int width;
+    int height;
+    Rational fps;
+    Rational orig_fps;      // Of the camera, frames beyond fps are dropped
+    int i_frame_interval;   // In seconds
+    bool repeat_headers;
+    int b_frames;
+    bool deblocking_filter;
+    // > 0 for slice mode: slices of at most this many bytes, taken from
+    // x264 as each is done and the frame sent with its last one
+    int slice_max_size;
+    // Periodic intra refresh in place of idr frames every i_frame_interval
+    bool intra_refresh;
+    // Analysis effort stepped up and down with the cpu time x264 is
+    // getting, the preset's only at the start
+    bool adaptive_effort;
+
+    VideoConfig();
+};
+
+// An nv12/nv21 frame into i420, turned by 180 if rotation is 180 (as is
+// otherwise); split in up to max_bands bands of rows run on the pipeline
+// executor
+void convert_frame(const uint8_t *src, uint8_t *dst, int width, int height,
+                   int rotation, int max_bands);
+
+// The nals x264 put out for a frame, slice mode, into decoding order:
+// parameter sets and sei as they came, then the slices by position
+// (slice threads finish in any order)
+void sort_frame_nals(std::vector<x264_nal_t> &nals);
+
+// Where in effort_levels (see the .cpp) an encoder is, moved a step
+// when the average encode time stays out of the band around the frame
+// interval long enough
+struct EffortCtrl {
+    int level;
+    uint32_t interval_us;
+    uint32_t avg_us;        // Moving average of the encode time
+    int frames;             // Since the last step
+    int settle_frames;      // Before the average says anything again
+    int up_frames;          // With headroom needed for a step up
+    int headroom_frames;    // In a row so far
+
+    void init(const Rational &fps);
+    // -1, 0 or 1: the step to take after a frame of encode_us, level is
+    // left to the caller to move
+    int update(uint32_t encode_us);
+};
+
 class VideoEncoder {
 public:
-    VideoEncoder();
+    VideoEncoder(FQRtmpSession *session);
     ~VideoEncoder();
 
-    int init(jobject video_config);
-    int feed(uint8_t *buffer, int len, int rotation);
+    int init(const VideoConfig &video_config);
+    // pts in ms, stamped with the wall clock (and frames beyond fps
+    // dropped) when -1
+    int feed(uint8_t *buffer, int len, int rotation, int64_t pts = -1);
+    // Any thread: the next frame fed to x264 is made an idr (a new sweep
+    // in intra refresh mode). Requests within KEYFRAME_MIN_INTERVAL_MS of
+    // the last keyframe wait for it, those pending meanwhile make one
+    void request_keyframe();
     volatile bool quit() const;
 
 private:
-    int load_config(jobject video_config);
+    int load_config(const VideoConfig &video_config);
     void dump_config() const;
 
-    int encode_nals(Packet *pkt, const x264_nal_t *nals, int nnal);
+    int fetch_headers(x264_t *enc);
+    int attach_latency_sei(uint32_t seq);
+    int encode_nals(AVCFrame *frame, const x264_nal_t *nals, int nnal);
+    void send_frame(AVCFrame *frame, const Packet *src, bool key_frame,
+                    uint32_t latency_seq, uint64_t encode_start_us);
+    // x264's nalu_process, on its slice threads, opaque is the encoder
+    static void slice_ready(x264_t *h, x264_nal_t *nal, void *opaque);
+    // The nals of the current frame into its AVCFrame and off to rtmp
+    void send_slices();
+    // After each frame, encode_us is what x264 took on it
+    void adapt_effort(uint32_t encode_us);
+    void dump_annexb(const AVCFrame *frame);
+    // Off the queue, out of the session's memory budget
+    void release_frame(Packet *&pkt);
 
     struct FPSCtrl {
         int64_t a, b;
@@ -48,7 +125,28 @@ private:
         int init(int tgt_fps, int orig_fps = 30);
     };
 
+    // Slice mode, the frame x264 is at
+    struct SliceAssembly {
+        xutil::Mutex mutex;
+        xutil::Condition cond;          // On complete, sent and quit
+        std::vector<x264_nal_t> nals;   // Payloads escaped, xpool'ed
+        int mbs;                        // Covered by the slices in
+        bool failed;
+        bool complete;                  // All in, the sender takes it
+        bool sent;
+        uint64_t sent_us;
+        AVCFrame *frame;
+        const Packet *src;
+        uint64_t encode_start_us;
+        bool quit;
+
+        SliceAssembly() :
+            cond(mutex), mbs(0), failed(false), complete(false), sent(false),
+            sent_us(0), frame(NULL), src(NULL), encode_start_us(0), quit(false) { }
+    };
+
 private:
+    FQRtmpSession *m_session;
     std::string m_preset;
     std::string m_tune;
     std::string m_profile;
@@ -63,13 +161,28 @@ private:
     bool m_repeat_headers;
     int m_b_frames;
     bool m_deblocking_filter;
+    int m_slice_max_size;
+    bool m_intra_refresh;
+    bool m_adaptive_effort;
+    EffortCtrl m_effort;
+    volatile bool m_keyframe_requested;
+    uint64_t m_last_keyframe_us;        // Encode thread only
+    int m_frame_mbs;
+    SliceAssembly m_slices;
     x264_param_t m_params;
     x264_t *m_enc;
     x264_picture_t m_pic;
+    std::vector<byte> m_sps;
+    std::vector<byte> m_pps;
+    bool m_sps_pps_changed;
     uint64_t m_start_pts;
     int m_frame_num;
     DECL_THREAD_ROUTINE(VideoEncoder, encode_routine);
     xutil::Thread *m_thrd;
+    // Slice mode, sends a frame once slice_ready has all of it, so x264's
+    // slice threads don't wait on the connection
+    DECL_THREAD_ROUTINE(VideoEncoder, slice_send_routine);
+    xutil::Thread *m_slice_thrd;
     Queue<Packet *> m_queue;
     volatile bool m_quit;
     xfile::File *m_file_yuv;
@@ -78,10 +191,6 @@ private:
     FPSCtrl m_fps_ctrl;
 };
 
-jint openVideoEncoder(JNIEnv *env, jobject, jobject);
-jint closeVideoEncoder(JNIEnv *env, jobject);
-jint sendRawVideo(JNIEnv *env, jobject thiz, jbyteArray byte_arr, jint len, int rotation);
-
 #ifdef __cplusplus
 }
 #endif
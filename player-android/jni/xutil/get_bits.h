@@ -5,6 +5,17 @@
 #include <assert.h>
 #include "xutil.h"
 
+// The cached reader keeps up to 64 bits in a register and loads 32 more
+// only when it runs short, instead of an unaligned load per read.
+// Build with -DCACHED_BITSTREAM_READER=0 to get the plain one back
+#ifndef CACHED_BITSTREAM_READER
+#define CACHED_BITSTREAM_READER 1
+#endif
+
+#if CACHED_BITSTREAM_READER && defined(BITSTREAM_READER_LE)
+#error "Cached bitstream reader is big-endian only"
+#endif
+
 #define OPEN_READER_NOSIZE(name, gb)            \
     unsigned int name ## _index = (gb)->index;  \
     unsigned int __attribute__((unused)) name ## _cache = 0
@@ -113,6 +124,11 @@ struct GetBitContext {
     int index;
     int size_in_bits;
     int size_in_bits_plus8;
+#if CACHED_BITSTREAM_READER
+    const uint8_t *ptr;     // Next byte to go into the cache
+    uint64_t cache;         // Left aligned
+    unsigned bits_left;     // Valid bits in cache
+#endif
 };
 
 static inline int init_get_bits(GetBitContext *s, const uint8_t *buffer,
@@ -134,10 +150,164 @@ static inline int init_get_bits(GetBitContext *s, const uint8_t *buffer,
     s->size_in_bits_plus8 = bit_size + 8;
     s->buffer_end         = buffer + buffer_size;
     s->index              = 0;
+#if CACHED_BITSTREAM_READER
+    s->ptr                = buffer;
+    s->cache              = 0;
+    s->bits_left          = 0;
+#endif
     
     return ret;
 }
 
+static inline int get_bits_count(const GetBitContext *s)
+{
+    return s->index;
+}
+
+static int av_log2(unsigned v) { int r = 0; while (v >>= 1) r++; return r; }
+
+#if CACHED_BITSTREAM_READER
+
+// Append 32 bits to the cache, zeros past the end of the buffer
+static inline void refill_32(GetBitContext *s)
+{
+    uint64_t val;
+
+    if (s->buffer_end - s->ptr >= 4) {
+        uint32_t tmp;
+        memcpy(&tmp, s->ptr, 4);
+        val = ntohl(tmp);
+        s->ptr += 4;
+    } else {
+        val = 0;
+        for (int i = 0; i < 4; ++i) {
+            val <<= 8;
+            if (s->ptr < s->buffer_end)
+                val |= *s->ptr++;
+        }
+    }
+
+    s->cache |= val << (32 - s->bits_left);
+    s->bits_left += 32;
+}
+
+static inline unsigned int show_bits32_cached(GetBitContext *s)
+{
+    if (s->bits_left < 32)
+        refill_32(s);
+    return s->cache >> 32;
+}
+
+// n must not exceed bits_left
+static inline void skip_cached(GetBitContext *s, unsigned n)
+{
+    s->cache <<= n;
+    s->bits_left -= n;
+    s->index += n;
+}
+
+static inline void skip_bits(GetBitContext *s, int n)
+{
+    while (n > 32) {
+        show_bits32_cached(s);
+        skip_cached(s, 32);
+        n -= 32;
+    }
+    if ((unsigned) n > s->bits_left)
+        refill_32(s);
+    skip_cached(s, n);
+}
+
+static inline void skip_bits1(GetBitContext *s)
+{
+    skip_bits(s, 1);
+}
+
+static inline unsigned int get_bits1(GetBitContext *s)
+{
+    if (!s->bits_left)
+        refill_32(s);
+
+    unsigned int result = s->cache >> 63;
+    skip_cached(s, 1);
+    return result;
+}
+
+/**
+ * Read 1-32 bits.
+ */
+static inline unsigned int get_bits(GetBitContext *s, int n)
+{
+    assert(n>0 && n<=32);
+    if ((unsigned) n > s->bits_left)
+        refill_32(s);
+
+    unsigned int result = s->cache >> (64 - n);
+    skip_cached(s, n);
+    return result;
+}
+
+static inline unsigned int get_bits_long(GetBitContext *s, int n)
+{
+    return get_bits(s, n);
+}
+
+static inline int get_ue_golomb_31(GetBitContext *gb)
+{
+    unsigned int buf = show_bits32_cached(gb) >> (32 - 9);
+
+    skip_cached(gb, ff_golomb_vlc_len[buf]);
+    return ff_ue_golomb_vlc_code[buf];
+}
+
+static inline int get_ue_golomb(GetBitContext *gb)
+{
+    unsigned int buf = show_bits32_cached(gb);
+
+    if (buf >= (1 << 27)) {
+        buf >>= 32 - 9;
+        skip_cached(gb, ff_golomb_vlc_len[buf]);
+
+        return ff_ue_golomb_vlc_code[buf];
+    } else {
+        int log = 2 * av_log2(buf) - 31;
+        skip_cached(gb, 32 - log);
+        buf >>= log;
+        buf--;
+
+        return buf;
+    }
+}
+
+static inline int get_se_golomb(GetBitContext *gb)
+{
+    unsigned int buf = show_bits32_cached(gb);
+
+    if (buf >= (1 << 27)) {
+        buf >>= 32 - 9;
+        skip_cached(gb, ff_golomb_vlc_len[buf]);
+
+        return ff_se_golomb_vlc_code[buf];
+    } else {
+        int log = av_log2(buf);
+        skip_cached(gb, 31 - log);
+        buf = show_bits32_cached(gb);
+
+        buf >>= log;
+
+        skip_cached(gb, 32 - log);
+
+        if (buf & 1)
+            buf = -(buf >> 1);
+        else
+            buf = (buf >> 1);
+
+        return buf;
+    }
+}
+
+#else
+
 static inline void skip_bits(GetBitContext *s, int n)
 {
     OPEN_READER(re, s);
@@ -184,6 +354,15 @@ static inline unsigned int get_bits(GetBitContext *s, int n)
     return tmp;
 }
 
+static inline unsigned int get_bits_long(GetBitContext *s, int n)
+{
+    if (n <= 25)
+        return get_bits(s, n);
+
+    unsigned int ret = get_bits(s, 16) << (n - 16);
+    return ret | get_bits(s, n - 16);
+}
+
 static inline int get_ue_golomb_31(GetBitContext *gb) 
 {
     unsigned int buf;
@@ -199,8 +378,6 @@ static inline int get_ue_golomb_31(GetBitContext *gb)
     return ff_ue_golomb_vlc_code[buf];
 }
 
-static int av_log2(unsigned v) { int r = 0; while (v >>= 1) r++; return r; }
-
 static inline int get_ue_golomb(GetBitContext *gb)
 {           
     unsigned int buf;
@@ -260,6 +437,8 @@ static inline int get_se_golomb(GetBitContext *gb)
     }
 }
 
+#endif
+
 }
 
 #endif /* end of _GET_BITS_H_ */
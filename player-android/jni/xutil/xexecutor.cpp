@@ -0,0 +1,198 @@
+#include "xexecutor.h"
+
+namespace xutil {
+
+Executor::Executor(int threads, const char *name,
+                   ThreadStartHook on_start, ThreadExitHook on_exit) :
+    m_name(name), m_on_start(on_start), m_on_exit(on_exit),
+    m_queued(0), m_sleeping(0), m_quit(false), m_next(0),
+    m_executed(0), m_stolen(0)
+{
+    pthread_key_create(&m_self_key, NULL);
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_work_cond, NULL);
+    pthread_cond_init(&m_done_cond, NULL);
+
+    for (int i = 0; i < threads; ++i) {
+        Worker *worker = new Worker;
+        worker->index = i;
+        pthread_mutex_init(&worker->mutex, NULL);
+        worker->thrd = NULL;
+        m_workers.push_back(worker);
+    }
+    // Every deque is there before the first worker looks for one to steal from
+    foreach(m_workers, it) {
+        (*it)->thrd = CREATE_THREAD_ROUTINE(worker_routine, *it, false);
+    }
+}
+
+Executor::~Executor()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_quit = true;
+    pthread_cond_broadcast(&m_work_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    // All joined before any deque goes, the others may still look into it
+    foreach(m_workers, it) {
+        JOIN_DELETE_THREAD((*it)->thrd);
+    }
+    foreach(m_workers, it) {
+        pthread_mutex_destroy(&(*it)->mutex);
+        delete *it;
+    }
+
+    pthread_cond_destroy(&m_done_cond);
+    pthread_cond_destroy(&m_work_cond);
+    pthread_mutex_destroy(&m_mutex);
+    pthread_key_delete(m_self_key);
+}
+
+void Executor::submit(TaskFunc func, void *arg, TaskGroup *group)
+{
+    Task task = { func, arg, group };
+
+    if (group) {
+        __sync_add_and_fetch(&group->m_pending, 1);
+    }
+
+    if (m_workers.empty()) {
+        run(task);
+        return;
+    }
+
+    // A worker splitting its task keeps the pieces, they are stolen if
+    // others are idle
+    Worker *worker = (Worker *) pthread_getspecific(m_self_key);
+    if (!worker) {
+        worker = m_workers[__sync_fetch_and_add(&m_next, 1) % m_workers.size()];
+    }
+    pthread_mutex_lock(&worker->mutex);
+    worker->tasks.push_back(task);
+    pthread_mutex_unlock(&worker->mutex);
+
+    __sync_add_and_fetch(&m_queued, 1);
+    pthread_mutex_lock(&m_mutex);
+    if (m_sleeping) {
+        pthread_cond_signal(&m_work_cond);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void Executor::wait(TaskGroup *group)
+{
+    Worker *worker = (Worker *) pthread_getspecific(m_self_key);
+    int self = worker ? worker->index : -1;
+
+    while (!group->done()) {
+        Task task;
+        if (take(self, &task)) {
+            run(task);
+            continue;
+        }
+
+        // Nothing left to help with, the rest is running on the workers
+        pthread_mutex_lock(&m_mutex);
+        if (!group->done()) {
+            pthread_cond_wait(&m_done_cond, &m_mutex);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+}
+
+bool Executor::take(int self, Task *task)
+{
+    int num = (int) m_workers.size();
+
+    if (self >= 0) {
+        Worker *worker = m_workers[self];
+        pthread_mutex_lock(&worker->mutex);
+        bool found = !worker->tasks.empty();
+        if (found) {
+            *task = worker->tasks.back();
+            worker->tasks.pop_back();
+        }
+        pthread_mutex_unlock(&worker->mutex);
+        if (found) {
+            __sync_sub_and_fetch(&m_queued, 1);
+            return true;
+        }
+    }
+
+    int start = self >= 0 ? self + 1 : (int) (m_next % num);
+    for (int i = 0; i < num; ++i) {
+        Worker *victim = m_workers[(start + i) % num];
+        if (victim->index == self)
+            continue;
+
+        pthread_mutex_lock(&victim->mutex);
+        bool found = !victim->tasks.empty();
+        if (found) {
+            *task = victim->tasks.front();
+            victim->tasks.pop_front();
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if (found) {
+            __sync_sub_and_fetch(&m_queued, 1);
+            if (self >= 0) {
+                __sync_add_and_fetch(&m_stolen, 1);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::run(const Task &task)
+{
+    task.func(task.arg);
+    __sync_add_and_fetch(&m_executed, 1);
+
+    if (task.group &&
+        !__sync_sub_and_fetch(&task.group->m_pending, 1)) {
+        pthread_mutex_lock(&m_mutex);
+        pthread_cond_broadcast(&m_done_cond);
+        pthread_mutex_unlock(&m_mutex);
+    }
+}
+
+unsigned int Executor::worker_routine(void *arg)
+{
+    Worker *worker = (Worker *) arg;
+    std::string name = sprintf_("%s%d", STR(m_name), worker->index);
+
+    set_thread_name(STR(name));
+    if (m_on_start) {
+        m_on_start(STR(name));
+    }
+    pthread_setspecific(m_self_key, worker);
+
+    for ( ; ; ) {
+        Task task;
+        if (take(worker->index, &task)) {
+            run(task);
+            continue;
+        }
+
+        // Checked under the lock submit() signals with, no wakeup is missed;
+        // what is queued is run before quitting
+        pthread_mutex_lock(&m_mutex);
+        if (__sync_fetch_and_add(&m_queued, 0) <= 0) {
+            if (m_quit) {
+                pthread_mutex_unlock(&m_mutex);
+                break;
+            }
+            ++m_sleeping;
+            pthread_cond_wait(&m_work_cond, &m_mutex);
+            --m_sleeping;
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    if (m_on_exit) {
+        m_on_exit();
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,103 @@
+#ifndef _XEXECUTOR_H_
+#define _XEXECUTOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "xutil.h"
+
+namespace xutil {
+
+typedef void (*TaskFunc)(void *arg);
+typedef void (*ThreadStartHook)(const char *name);
+typedef void (*ThreadExitHook)();
+
+// Tasks waited on together, see Executor::wait()
+class TaskGroup {
+public:
+    TaskGroup() : m_pending(0) { }
+
+    // A barrier too: what the tasks wrote is visible once this is true
+    bool done() const {
+        return __sync_fetch_and_add(const_cast<volatile int *>(&m_pending), 0) == 0;
+    }
+
+private:
+    friend class Executor;
+    TaskGroup(const TaskGroup &);
+    void operator=(const TaskGroup &);
+
+    volatile int m_pending;
+};
+
+/* Fixed set of worker threads, each with its own deque of tasks. A worker
+ * runs the newest task of its own deque first (what it just split off is
+ * still in cache) and, once that is empty, steals the oldest of another's,
+ * so the work spreads without one shared queue to contend on. Tasks from
+ * outside are dealt out round-robin. A thread waiting for a group runs
+ * queued tasks in the meantime rather than sleep, so a stage that splits
+ * its own work keeps its core busy. With no workers, submit() runs the
+ * task there and then. Tasks must not block on anything but other tasks. */
+class Executor {
+public:
+    // on_start/on_exit are run on each worker as it starts and ends
+    Executor(int threads, const char *name = "executor",
+             ThreadStartHook on_start = NULL, ThreadExitHook on_exit = NULL);
+    // Runs what is still queued, then joins the workers
+    ~Executor();
+
+    int threads() const { return (int) m_workers.size(); }
+
+    void submit(TaskFunc func, void *arg, TaskGroup *group = NULL);
+    // Until every task submitted with group has run
+    void wait(TaskGroup *group);
+
+    uint64_t executed() const { return m_executed; }
+    // Of which were taken from another worker's deque
+    uint64_t stolen() const { return m_stolen; }
+
+private:
+    struct Task {
+        TaskFunc func;
+        void *arg;
+        TaskGroup *group;
+    };
+
+    struct Worker {
+        Executor *executor;
+        int index;
+        pthread_mutex_t mutex;
+        std::deque<Task> tasks;
+        xutil::Thread *thrd;
+    };
+
+    DISALLOW_COPY_AND_ASSIGN(Executor);
+    DECL_THREAD_ROUTINE(Executor, worker_routine);
+
+    // The calling worker's own deque first (self < 0 from outside)
+    bool take(int self, Task *task);
+    void run(const Task &task);
+
+    std::vector<Worker *> m_workers;
+    std::string m_name;
+    ThreadStartHook m_on_start;
+    ThreadExitHook m_on_exit;
+    pthread_key_t m_self_key;
+    // Sleeping and waking, workers for tasks and waiters for their groups
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_work_cond;
+    pthread_cond_t m_done_cond;
+    volatile int m_queued;
+    int m_sleeping;
+    volatile bool m_quit;
+    volatile uint32_t m_next;
+    volatile uint64_t m_executed;
+    volatile uint64_t m_stolen;
+};
+
+}
+
+#endif /* end of _XEXECUTOR_H_ */
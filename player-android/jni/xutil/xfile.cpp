@@ -78,7 +78,7 @@ off_t File::cursor() const
 bool File::seek_ahead(off_t cnt) const
 {
     if (cnt < 0) {
-        E("Invalid offset %d passed", cnt);
+        E("Invalid offset %ld passed", (long) cnt);
         return false;
     }
 
@@ -102,7 +102,7 @@ bool File::seek_ahead(off_t cnt) const
 bool File::seek_behind(off_t cnt) const
 {
     if (cnt < 0) {
-        E("Invalid offset %d passed", cnt);
+        E("Invalid offset %ld passed", (long) cnt);
         return false;
     }
 
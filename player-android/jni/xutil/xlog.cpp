@@ -0,0 +1,632 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <vector>
+
+#include "xlog.h"
+
+#define XLOG_RING_SIZE      (64*1024)   // Per thread, power of 2
+#define XLOG_RECORD_MAX     1024        // Long strings get truncated
+#define XLOG_FMT_MAX        512         // For the copied ones
+#define XLOG_LINE_MAX       4096
+
+// Both the caller and the logger thread walk the format the same way
+enum ArgType {
+    ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR
+};
+
+struct FmtSpec {
+    const char *start;  // At '%'
+    const char *end;    // Past the conversion char
+    bool star_width;
+    bool star_prec;
+    int prec;           // -1 if not given, taken from the args if star_prec
+    ArgType type;
+};
+
+struct LogHeader {
+    uint16_t size;      // Of the whole record
+    uint8_t prio;
+    uint8_t copy_fmt;   // fmt (NUL-terminated) follows the header
+    int32_t line;
+    const char *file;
+    const char *tag;
+    const char *fmt;
+    uint64_t ts;        // Wall clock in us
+};
+
+// Single producer (its thread), single consumer (the logger thread)
+struct LogRing {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    uint32_t dropped_reported;
+    volatile bool retired;
+    pid_t tid;
+    uint8_t buf[XLOG_RING_SIZE];
+};
+
+static pthread_once_t xlog_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xlog_key;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Never destroyed, the detached logger thread outlives static destructors
+static std::vector<LogRing *> &rings = *new std::vector<LogRing *>;
+// Copy of rings taken by drain(), kept to be reused drain after drain
+static std::vector<LogRing *> &snapshot = *new std::vector<LogRing *>;
+#ifdef __ANDROID__
+static volatile int sinks = XLOG_SINK_LOGCAT;
+#else
+static volatile int sinks = XLOG_SINK_STDERR;
+#endif
+static FILE *sink_file;
+static volatile XLogHook hook;
+
+// Returns NULL at the end of fmt, literal text is left to the caller
+static const char *next_spec(const char *p, FmtSpec &spec)
+{
+    for ( ; *p; ++p) {
+        if (*p != '%')
+            continue;
+        if (p[1] == '%') {
+            ++p;
+            continue;
+        }
+
+        spec.start = p++;
+        spec.star_width = spec.star_prec = false;
+        spec.prec = -1;
+
+        while (*p && strchr("-+ #0'", *p)) ++p;
+        if (*p == '*') {
+            spec.star_width = true;
+            ++p;
+        }
+        while (*p >= '0' && *p <= '9') ++p;
+        if (*p == '.') {
+            ++p;
+            spec.prec = 0;
+            if (*p == '*') {
+                spec.star_prec = true;
+                ++p;
+            }
+            for ( ; *p >= '0' && *p <= '9'; ++p) {
+                spec.prec = spec.prec*10 + *p - '0';
+            }
+        }
+
+        int longs = 0;
+        char size = 0;
+        for ( ; *p && strchr("hlLqjzt", *p); ++p) {
+            if (*p == 'l') ++longs;
+            else if (*p != 'h') size = *p;
+        }
+        if (!*p) {
+            // Dangling '%', print it as it is
+            spec.type = ARG_NONE;
+            spec.end = p;
+            return p;
+        }
+
+        switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            if (longs >= 2 || size == 'q' || size == 'j' || size == 'L') spec.type = ARG_LLONG;
+            else if (longs == 1) spec.type = ARG_LONG;
+            else if (size == 'z') spec.type = ARG_SIZE;
+            else if (size == 't') spec.type = ARG_PTRDIFF;
+            else spec.type = ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec.type = size == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 's':
+            spec.type = longs ? ARG_PTR : ARG_STR;
+            break;
+        case 'p': case 'n':
+            spec.type = ARG_PTR;
+            break;
+        default:
+            spec.type = ARG_NONE;
+            break;
+        }
+        spec.end = ++p;
+        return p;
+    }
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////
+// Caller side
+
+static void ring_retire(void *data)
+{
+    // Freed by the logger thread once drained
+    ((LogRing *) data)->retired = true;
+}
+
+static void *logger_routine(void *arg);
+
+// Set by a writer whose ring was empty, the logger thread sleeps on it
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static bool wake_pending;
+
+static void xlog_init()
+{
+    pthread_key_create(&xlog_key, ring_retire);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid, &attr, logger_routine, NULL);
+    pthread_attr_destroy(&attr);
+
+    atexit(xlog_flush);
+}
+
+static LogRing *get_ring()
+{
+    pthread_once(&xlog_once, xlog_init);
+
+    LogRing *ring = (LogRing *) pthread_getspecific(xlog_key);
+    if (!ring) {
+        // Once per thread
+        ring = (LogRing *) malloc(sizeof(LogRing));
+        if (!ring)
+            return NULL;
+        ring->head = ring->tail = 0;
+        ring->dropped = ring->dropped_reported = 0;
+        ring->retired = false;
+        ring->tid = syscall(__NR_gettid);
+
+        pthread_mutex_lock(&rings_mutex);
+        rings.push_back(ring);
+        pthread_mutex_unlock(&rings_mutex);
+        pthread_setspecific(xlog_key, ring);
+    }
+    return ring;
+}
+
+template <typename T>
+static inline bool put_arg(uint8_t *&p, const uint8_t *end, T val)
+{
+    if (end - p < (int) sizeof(T))
+        return false;
+    memcpy(p, &val, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+static bool put_args(uint8_t *&p, const uint8_t *end, const char *fmt, va_list args)
+{
+    FmtSpec spec;
+
+    while ((fmt = next_spec(fmt, spec))) {
+        if (spec.star_width && !put_arg(p, end, va_arg(args, int)))
+            return false;
+        if (spec.star_prec) {
+            spec.prec = va_arg(args, int);
+            if (!put_arg(p, end, spec.prec))
+                return false;
+        }
+
+        bool ok = true;
+        switch (spec.type) {
+        case ARG_NONE:    break;
+        case ARG_INT:     ok = put_arg(p, end, va_arg(args, int)); break;
+        case ARG_LONG:    ok = put_arg(p, end, va_arg(args, long)); break;
+        case ARG_LLONG:   ok = put_arg(p, end, va_arg(args, long long)); break;
+        case ARG_SIZE:    ok = put_arg(p, end, va_arg(args, size_t)); break;
+        case ARG_PTRDIFF: ok = put_arg(p, end, va_arg(args, ptrdiff_t)); break;
+        case ARG_DOUBLE:  ok = put_arg(p, end, va_arg(args, double)); break;
+        case ARG_LDOUBLE: ok = put_arg(p, end, va_arg(args, long double)); break;
+        case ARG_PTR:     ok = put_arg(p, end, va_arg(args, void *)); break;
+        case ARG_STR: {
+            const char *str = va_arg(args, const char *);
+            if (!str) str = "(null)";
+            size_t avail = end - p;
+            if (avail < sizeof(uint16_t) + 1)
+                return false;
+            avail -= sizeof(uint16_t) + 1;
+            // "%.*s" is how AVals (not NUL-terminated) are logged, never
+            // read past the precision
+            if (spec.prec >= 0 && (size_t) spec.prec < avail) {
+                avail = spec.prec;
+            }
+            uint16_t len = strnlen(str, avail);
+            put_arg(p, end, (uint16_t) (len + 1));
+            memcpy(p, str, len);
+            p[len] = '\0';
+            p += len + 1;
+            break;
+        }
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static void ring_write(LogRing *ring, const uint8_t *rec, uint32_t size)
+{
+    uint32_t head = ring->head;
+
+    if (XLOG_RING_SIZE - (head - ring->tail) < size) {
+        ++ring->dropped;
+        return;
+    }
+
+    uint32_t off = head & (XLOG_RING_SIZE - 1);
+    uint32_t first = XLOG_RING_SIZE - off;
+    if (first >= size) {
+        memcpy(ring->buf + off, rec, size);
+    } else {
+        memcpy(ring->buf + off, rec, first);
+        memcpy(ring->buf, rec + first, size - first);
+    }
+
+    __sync_synchronize();
+    ring->head = head + size;
+
+    // Seen empty, the logger thread may have gone to sleep
+    __sync_synchronize();
+    if (ring->tail == head) {
+        pthread_mutex_lock(&wake_mutex);
+        wake_pending = true;
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_mutex);
+    }
+}
+
+static void log_record(const char *file, int line, int prio, const char *tag,
+                       bool copy_fmt, const char *fmt, va_list args)
+{
+    XLogHook h = hook;
+    if (h && prio >= ANDROID_LOG_WARN) {
+        h(prio, file, line, copy_fmt ? NULL : fmt);
+    }
+
+    LogRing *ring = get_ring();
+    if (!ring)
+        return;
+
+    uint8_t rec[XLOG_RECORD_MAX];
+    uint8_t *p = rec + sizeof(LogHeader);
+    const uint8_t *end = rec + sizeof(rec);
+    LogHeader hdr;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    hdr.prio = prio;
+    hdr.copy_fmt = copy_fmt;
+    hdr.line = line;
+    hdr.file = file;
+    hdr.tag = tag;
+    hdr.fmt = copy_fmt ? NULL : fmt;
+    hdr.ts = tv.tv_sec * 1000000ULL + tv.tv_usec;
+
+    if (copy_fmt) {
+        // Args are taken by the copy, so a truncated fmt stays consistent
+        size_t len = strnlen(fmt, XLOG_FMT_MAX - 1);
+        memcpy(p, fmt, len);
+        p[len] = '\0';
+        fmt = (const char *) p;
+        p += len + 1;
+    }
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    bool ok = put_args(p, end, fmt, args_copy);
+    va_end(args_copy);
+    if (!ok) {
+        ++ring->dropped;
+        return;
+    }
+
+    hdr.size = p - rec;
+    memcpy(rec, &hdr, sizeof(hdr));
+    ring_write(ring, rec, hdr.size);
+}
+
+void xlog_print(const char *file, int line, int prio, const char *tag,
+                const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    log_record(file, line, prio, tag, false, fmt, args);
+    va_end(args);
+}
+
+void xlog_vprint(const char *file, int line, int prio, const char *tag,
+                 bool copy_fmt, const char *fmt, va_list args)
+{
+    log_record(file, line, prio, tag, copy_fmt, fmt, args);
+}
+
+/////////////////////////////////////////////////////////////
+// Logger thread side
+
+template <typename T>
+static inline T get_arg(const uint8_t *&p)
+{
+    T val;
+    memcpy(&val, p, sizeof(T));
+    p += sizeof(T);
+    return val;
+}
+
+// Format one conversion with its own spec, '*' values passed along
+template <typename T>
+static int format_one(char *buf, size_t len, const char *spec,
+                      const FmtSpec &fs, int width, int prec, T val)
+{
+    if (fs.star_width && fs.star_prec)
+        return snprintf(buf, len, spec, width, prec, val);
+    else if (fs.star_width || fs.star_prec)
+        return snprintf(buf, len, spec, fs.star_width ? width : prec, val);
+    return snprintf(buf, len, spec, val);
+}
+
+static void format_record(const LogHeader &hdr, const uint8_t *args,
+                          char *out, size_t out_len)
+{
+    const char *fmt = hdr.copy_fmt ? (const char *) args : hdr.fmt;
+    const char *file = strrchr(hdr.file, '/');
+    const uint8_t *p = args;
+    size_t n = 0;
+    FmtSpec fs;
+
+    if (hdr.copy_fmt) {
+        p += strlen(fmt) + 1;
+    }
+
+    if (hdr.line >= 0) {
+        n = snprintf(out, out_len, "[%s:%04d] ", file ? file + 1 : hdr.file, hdr.line);
+    } else {
+        n = snprintf(out, out_len, "[%s] ", hdr.file);
+    }
+
+    const char *lit = fmt;
+    while (n < out_len - 1 && (lit = fmt, fmt = next_spec(fmt, fs))) {
+        // Literal text before the spec, "%%" collapsed
+        for (const char *q = lit; q < fs.start && n < out_len - 1; ++q) {
+            out[n++] = *q;
+            if (q[0] == '%' && q[1] == '%') ++q;
+        }
+
+        char spec[32];
+        size_t spec_len = fs.end - fs.start;
+        if (spec_len >= sizeof(spec)) spec_len = sizeof(spec) - 1;
+        memcpy(spec, fs.start, spec_len);
+        spec[spec_len] = '\0';
+
+        int width = fs.star_width ? get_arg<int>(p) : 0;
+        int prec = fs.star_prec ? get_arg<int>(p) : 0;
+        char *dst = out + n;
+        size_t left = out_len - n;
+        int ret = 0;
+
+        switch (fs.type) {
+        case ARG_NONE:
+            ret = snprintf(dst, left, "%s", spec);
+            break;
+        case ARG_INT:     ret = format_one(dst, left, spec, fs, width, prec, get_arg<int>(p)); break;
+        case ARG_LONG:    ret = format_one(dst, left, spec, fs, width, prec, get_arg<long>(p)); break;
+        case ARG_LLONG:   ret = format_one(dst, left, spec, fs, width, prec, get_arg<long long>(p)); break;
+        case ARG_SIZE:    ret = format_one(dst, left, spec, fs, width, prec, get_arg<size_t>(p)); break;
+        case ARG_PTRDIFF: ret = format_one(dst, left, spec, fs, width, prec, get_arg<ptrdiff_t>(p)); break;
+        case ARG_DOUBLE:  ret = format_one(dst, left, spec, fs, width, prec, get_arg<double>(p)); break;
+        case ARG_LDOUBLE: ret = format_one(dst, left, spec, fs, width, prec, get_arg<long double>(p)); break;
+        case ARG_PTR:
+            if (spec[spec_len - 1] == 'n') {
+                get_arg<void *>(p);
+                break;
+            }
+            ret = format_one(dst, left, spec, fs, width, prec, get_arg<void *>(p));
+            break;
+        case ARG_STR: {
+            uint16_t len = get_arg<uint16_t>(p);
+            ret = format_one(dst, left, spec, fs, width, prec, (const char *) p);
+            p += len;
+            break;
+        }
+        }
+        if (ret > 0) {
+            n += (size_t) ret < left ? (size_t) ret : left - 1;
+        }
+    }
+    for (const char *q = lit; *q && n < out_len - 1; ++q) {
+        out[n++] = *q;
+        if (q[0] == '%' && q[1] == '%') ++q;
+    }
+    out[n] = '\0';
+}
+
+static void ring_peek(const LogRing *ring, uint32_t pos, uint8_t *dst, uint32_t size)
+{
+    uint32_t off = pos & (XLOG_RING_SIZE - 1);
+    uint32_t first = XLOG_RING_SIZE - off;
+    if (first >= size) {
+        memcpy(dst, ring->buf + off, size);
+    } else {
+        memcpy(dst, ring->buf + off, first);
+        memcpy(dst + first, ring->buf, size - first);
+    }
+}
+
+static void write_sinks(int prio, const char *tag, uint64_t ts, pid_t tid, const char *msg)
+{
+    static const char prio_chars[] = "??VDIWEF";
+    int s = sinks;
+
+#ifdef __ANDROID__
+    if (s & XLOG_SINK_LOGCAT) {
+        __android_log_write(prio, tag, msg);
+    }
+#endif
+
+    if (s & (XLOG_SINK_STDERR | XLOG_SINK_FILE)) {
+        time_t sec = ts / 1000000;
+        struct tm tm;
+        char stamp[32];
+
+        localtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%m-%d %H:%M:%S", &tm);
+
+        char c = prio >= 0 && prio < (int) sizeof(prio_chars) - 1 ? prio_chars[prio] : '?';
+        // x264 and librtmp end theirs with a newline
+        int len = strlen(msg);
+        if (len > 0 && msg[len - 1] == '\n') {
+            --len;
+        }
+        if (s & XLOG_SINK_STDERR) {
+            fprintf(stderr, "%s.%03u %5d %c %s: %.*s\n", stamp,
+                    (unsigned) (ts / 1000 % 1000), tid, c, tag, len, msg);
+        }
+        if ((s & XLOG_SINK_FILE) && sink_file) {
+            fprintf(sink_file, "%s.%03u %5d %c %s: %.*s\n", stamp,
+                    (unsigned) (ts / 1000 % 1000), tid, c, tag, len, msg);
+        }
+    }
+}
+
+// Write out what's in the rings, oldest first across threads
+static void drain()
+{
+    static uint8_t rec[XLOG_RECORD_MAX];
+    static char line[XLOG_LINE_MAX];
+
+    pthread_mutex_lock(&rings_mutex);
+    snapshot.assign(rings.begin(), rings.end());
+    pthread_mutex_unlock(&rings_mutex);
+
+    for ( ; ; ) {
+        LogRing *oldest = NULL;
+        LogHeader hdr, oldest_hdr;
+
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            LogRing *ring = snapshot[i];
+            if (ring->tail == ring->head)
+                continue;
+            __sync_synchronize();
+            ring_peek(ring, ring->tail, (uint8_t *) &hdr, sizeof(hdr));
+            if (!oldest || hdr.ts < oldest_hdr.ts) {
+                oldest = ring;
+                oldest_hdr = hdr;
+            }
+        }
+        if (!oldest)
+            break;
+
+        ring_peek(oldest, oldest->tail, rec, oldest_hdr.size);
+        format_record(oldest_hdr, rec + sizeof(LogHeader), line, sizeof(line));
+        __sync_synchronize();
+        oldest->tail += oldest_hdr.size;
+        // Pairs with the check of ring_write(), a record put in meanwhile
+        // is either seen here or woken up for
+        __sync_synchronize();
+
+        write_sinks(oldest_hdr.prio, oldest_hdr.tag, oldest_hdr.ts, oldest->tid, line);
+    }
+
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        LogRing *ring = snapshot[i];
+        uint32_t dropped = ring->dropped;
+        if (dropped != ring->dropped_reported) {
+            snprintf(line, sizeof(line), "[xlog] %u records of thread %d dropped",
+                     dropped - ring->dropped_reported, ring->tid);
+            ring->dropped_reported = dropped;
+
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            write_sinks(ANDROID_LOG_WARN, LOG_TAG,
+                        tv.tv_sec * 1000000ULL + tv.tv_usec, ring->tid, line);
+        }
+    }
+
+    if (sink_file) {
+        fflush(sink_file);
+    }
+
+    // Rings of exited threads are done with once drained
+    pthread_mutex_lock(&rings_mutex);
+    for (std::vector<LogRing *>::iterator it = rings.begin(); it != rings.end(); ) {
+        if ((*it)->retired && (*it)->tail == (*it)->head) {
+            free(*it);
+            it = rings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void *logger_routine(void *arg)
+{
+    for ( ; ; ) {
+        pthread_mutex_lock(&wake_mutex);
+        while (!wake_pending) {
+            pthread_cond_wait(&wake_cond, &wake_mutex);
+        }
+        wake_pending = false;
+        pthread_mutex_unlock(&wake_mutex);
+
+        pthread_mutex_lock(&drain_mutex);
+        drain();
+        pthread_mutex_unlock(&drain_mutex);
+    }
+    return NULL;
+}
+
+void xlog_flush()
+{
+    pthread_once(&xlog_once, xlog_init);
+
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+void xlog_set_hook(XLogHook h)
+{
+    hook = h;
+}
+
+void xlog_set_sinks(int s)
+{
+    sinks = s;
+}
+
+int xlog_set_file(const char *path)
+{
+    FILE *fp = NULL;
+
+    if (path) {
+        fp = fopen(path, "a");
+        if (!fp)
+            return -1;
+    }
+
+    pthread_mutex_lock(&drain_mutex);
+    if (sink_file) {
+        fclose(sink_file);
+    }
+    sink_file = fp;
+    pthread_mutex_unlock(&drain_mutex);
+
+    if (fp) {
+        sinks |= XLOG_SINK_FILE;
+    } else {
+        sinks &= ~XLOG_SINK_FILE;
+    }
+    return 0;
+}
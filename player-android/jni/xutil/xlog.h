@@ -1,40 +1,79 @@
 #ifndef _XLOG_H_
 #define _XLOG_H_
 
-#include <libgen.h>
+#include <stdarg.h>
+
+#ifdef __ANDROID__
 #include <android/log.h>
+#else
+// Same values as <android/log.h>, so levels mean the same everywhere
+typedef enum android_LogPriority {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT,
+} android_LogPriority;
+#endif
 
 #ifndef LOG_TAG
 #define LOG_TAG "FQRtmp"
 #endif
 
-#define V(fmt, ...) libfqrtmp_log_print(basename(__FILE__), __LINE__, ANDROID_LOG_VERBOSE, LOG_TAG, fmt, ##__VA_ARGS__)
-#define D(fmt, ...) libfqrtmp_log_print(basename(__FILE__), __LINE__, ANDROID_LOG_DEBUG, LOG_TAG, fmt, ##__VA_ARGS__)
-#define I(fmt, ...) libfqrtmp_log_print(basename(__FILE__), __LINE__, ANDROID_LOG_INFO, LOG_TAG, fmt, ##__VA_ARGS__)
-#define W(fmt, ...) libfqrtmp_log_print(basename(__FILE__), __LINE__, ANDROID_LOG_WARN, LOG_TAG, fmt, ##__VA_ARGS__)
-#define E(fmt, ...) libfqrtmp_log_print(basename(__FILE__), __LINE__, ANDROID_LOG_ERROR, LOG_TAG, fmt, ##__VA_ARGS__)
+// Lower levels are compiled out (arguments are not evaluated)
+#ifndef XLOG_MIN_LEVEL
+#define XLOG_MIN_LEVEL ANDROID_LOG_DEBUG
+#endif
+
+#define XLOG_(prio, fmt, ...) do { \
+    if ((prio) >= XLOG_MIN_LEVEL) \
+        xlog_print(__FILE__, __LINE__, (prio), LOG_TAG, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define V(fmt, ...) XLOG_(ANDROID_LOG_VERBOSE, fmt, ##__VA_ARGS__)
+#define D(fmt, ...) XLOG_(ANDROID_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define I(fmt, ...) XLOG_(ANDROID_LOG_INFO, fmt, ##__VA_ARGS__)
+#define W(fmt, ...) XLOG_(ANDROID_LOG_WARN, fmt, ##__VA_ARGS__)
+#define E(fmt, ...) XLOG_(ANDROID_LOG_ERROR, fmt, ##__VA_ARGS__)
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static inline int libfqrtmp_log_print(const char *file, const int line,
-                                      const android_LogPriority prio, const char *tag,
-                                      const char *fmt, ...)
-{
-    char buf[4096];
-    int ret;
+/* Asynchronous logger: the caller only copies the format pointer and the
+ * binary arguments (strings by value) into a ring of its own thread, a
+ * background thread formats and writes them out. Never blocks, records
+ * are dropped (and counted) when the ring is full. file, tag and fmt
+ * must be string literals unless copy_fmt is set. */
 
-    ret = snprintf(buf, 4096, "[%s:%04d] ", file, line);
+enum {
+    XLOG_SINK_LOGCAT    = 1,
+    XLOG_SINK_STDERR    = 2,
+    XLOG_SINK_FILE      = 4,
+};
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf + ret, 4096 - ret, fmt, args);
-    va_end(args);
+void xlog_print(const char *file, int line, int prio, const char *tag,
+                const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+// For foreign callbacks (librtmp, x264), whose fmt may not be a literal
+void xlog_vprint(const char *file, int line, int prio, const char *tag,
+                 bool copy_fmt, const char *fmt, va_list args);
 
-    __android_log_write(prio, tag, buf);
-    return 0;
-}
+// Logcat on android, stderr elsewhere by default
+void xlog_set_sinks(int sinks);
+// Also write to path (appended), NULL to stop
+int xlog_set_file(const char *path);
+
+// Write out everything logged so far
+void xlog_flush();
+
+// Called synchronously for warnings and errors, on the logging thread;
+// fmt is NULL when it is not a literal
+typedef void (*XLogHook)(int prio, const char *file, int line, const char *fmt);
+void xlog_set_hook(XLogHook hook);
 
 #ifdef __cplusplus
 }
@@ -1,9 +1,62 @@
+#include <libyuv/cpu_id.h>
+
 #include "xmedia.h"
 
 using namespace xutil;
 
 namespace xmedia {
 
+typedef const byte *(*FindStartcodeFunc)(const byte *p, const byte *end);
+
+static FindStartcodeFunc select_find_startcode()
+{
+#if defined(HAVE_NEON) || defined(__aarch64__)
+    if (libyuv::TestCpuFlag(libyuv::kCpuHasNEON))
+        return find_startcode_neon;
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+    if (libyuv::TestCpuFlag(libyuv::kCpuHasAVX2))
+        return find_startcode_avx2;
+    if (libyuv::TestCpuFlag(libyuv::kCpuHasSSE2))
+        return find_startcode_sse2;
+#endif
+    return find_startcode_c;
+}
+
+const byte *find_startcode(const byte *p, const byte *end)
+{
+    static const FindStartcodeFunc func = select_find_startcode();
+    return func(p, end);
+}
+
+// Checks a word at a time, only bytes around a zero byte are looked at
+const byte *find_startcode_c(const byte *p, const byte *end)
+{
+    if (end - p < 3)
+        return end;
+
+    const byte *last = end - 2; // Last possible startcode position + 1
+
+    while (p + 4 <= last) {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        // Non-zero iff one of the 4 bytes is zero
+        if (((x - 0x01010101) & ~x & 0x80808080)) {
+            for (int i = 0; i < 4; ++i) {
+                if (!p[i] && !p[i+1] && p[i+2] == 1)
+                    return p + i;
+            }
+        }
+        p += 4;
+    }
+
+    for ( ; p < last; ++p) {
+        if (STARTCODE3(p))
+            return p;
+    }
+    return end;
+}
+
 void print_avc_dcr(const AVCDecorderConfigurationRecord &avc_dcr)
 {
     printf("---AVCDecorderConfigurationRecord---\n");
@@ -263,9 +316,88 @@ static int image_check_size(unsigned int w, unsigned int h)
 }
 
 #define MAX_SPS_COUNT               32
+#define MAX_PPS_COUNT               256
+#define MAX_PARAM_SET_SIZE          4096
+#define MAX_SEI_HEAD_SIZE           256
+#define EXTENDED_SAR                255
 #define H264_MAX_PICTURE_COUNT      36
 #define MAX_LOG2_MAX_FRAME_NUM      (12 + 4)
 #define MIN_LOG2_MAX_FRAME_NUM      4
+static const int pixel_aspect[17][2] = {
+    {   0,  1 },
+    {   1,  1 },
+    {  12, 11 },
+    {  10, 11 },
+    {  16, 11 },
+    {  40, 33 },
+    {  24, 11 },
+    {  20, 11 },
+    {  32, 11 },
+    {  80, 33 },
+    {  18, 11 },
+    {  15, 11 },
+    {  64, 33 },
+    { 160, 99 },
+    {   4,  3 },
+    {   3,  2 },
+    {   2,  1 },
+};
+
+static int decode_vui_parameters(GetBitContext *gb, SPS *sps)
+{
+    int aspect_ratio_info_present_flag = get_bits1(gb);
+
+    if (aspect_ratio_info_present_flag) {
+        unsigned int aspect_ratio_idc = get_bits(gb, 8);
+        if (aspect_ratio_idc == EXTENDED_SAR) {
+            sps->sar_num = get_bits(gb, 16);
+            sps->sar_den = get_bits(gb, 16);
+        } else if (aspect_ratio_idc < NELEM(pixel_aspect)) {
+            sps->sar_num = pixel_aspect[aspect_ratio_idc][0];
+            sps->sar_den = pixel_aspect[aspect_ratio_idc][1];
+        } else {
+            E("VUI: illegal aspect ratio %u", aspect_ratio_idc);
+            return -1;
+        }
+    } else {
+        sps->sar_num = 0;
+        sps->sar_den = 1;
+    }
+
+    if (get_bits1(gb))          // overscan_info_present_flag
+        skip_bits1(gb);         // overscan_appropriate_flag
+
+    if (get_bits1(gb)) {        // video_signal_type_present_flag
+        skip_bits(gb, 3);       // video_format
+        skip_bits1(gb);         // video_full_range_flag
+        if (get_bits1(gb)) {    // colour_description_present_flag
+            skip_bits(gb, 8);   // colour_primaries
+            skip_bits(gb, 8);   // transfer_characteristics
+            sps->colorspace = get_bits(gb, 8);
+        }
+    }
+
+    if (get_bits1(gb)) {        // chroma_loc_info_present_flag
+        get_ue_golomb(gb);      // chroma_sample_location_type_top_field
+        get_ue_golomb(gb);      // chroma_sample_location_type_bottom_field
+    }
+
+    sps->timing_info_present_flag = get_bits1(gb);
+    if (sps->timing_info_present_flag) {
+        sps->num_units_in_tick = get_bits_long(gb, 32);
+        sps->time_scale        = get_bits_long(gb, 32);
+        if (!sps->num_units_in_tick || !sps->time_scale) {
+            W("VUI: time_scale/num_units_in_tick invalid or unsupported (%u/%u), ignored",
+              sps->time_scale, sps->num_units_in_tick);
+            sps->timing_info_present_flag = 0;
+        }
+        sps->fixed_frame_rate_flag = get_bits1(gb);
+    }
+
+    // Hrd and bitstream restriction are of no interest
+    return 0;
+}
+
 int h264_decode_sps(GetBitContext *gb, SPS *sps)
 {
     int profile_idc, level_idc, constraint_set_flags = 0;
@@ -288,9 +420,10 @@ int h264_decode_sps(GetBitContext *gb, SPS *sps)
         return -1;
     }
 
-    sps->sps_id         = sps_id;
-    sps->profile_idc    = profile_idc;
-    sps->level_idc      = level_idc;
+    sps->sps_id                 = sps_id;
+    sps->profile_idc            = profile_idc;
+    sps->constraint_set_flags   = constraint_set_flags;
+    sps->level_idc              = level_idc;
 
     memset(sps->scaling_matrix4, 16, sizeof(sps->scaling_matrix4));
     memset(sps->scaling_matrix8, 16, sizeof(sps->scaling_matrix8));
@@ -394,6 +527,60 @@ int h264_decode_sps(GetBitContext *gb, SPS *sps)
     }
 
     sps->frame_mbs_only_flag = get_bits1(gb);
+    if (!sps->frame_mbs_only_flag)
+        sps->mb_aff = get_bits1(gb);
+    else
+        sps->mb_aff = 0;
+
+    sps->direct_8x8_inference_flag = get_bits1(gb);
+
+    sps->crop = get_bits1(gb);
+    if (sps->crop) {
+        unsigned int crop_left   = get_ue_golomb(gb);
+        unsigned int crop_right  = get_ue_golomb(gb);
+        unsigned int crop_top    = get_ue_golomb(gb);
+        unsigned int crop_bottom = get_ue_golomb(gb);
+        int width  = 16 * sps->mb_width;
+        int height = 16 * sps->mb_height * (2 - sps->frame_mbs_only_flag);
+
+        // Crop offsets are in chroma sample units
+        int vsub   = (sps->chroma_format_idc == 1) ? 1 : 0;
+        int hsub   = (sps->chroma_format_idc == 1 ||
+                      sps->chroma_format_idc == 2) ? 1 : 0;
+        int step_x = 1 << hsub;
+        int step_y = (2 - sps->frame_mbs_only_flag) << vsub;
+
+        if (crop_left  > (unsigned) INT_MAX / 4 / step_x ||
+            crop_right > (unsigned) INT_MAX / 4 / step_x ||
+            crop_top   > (unsigned) INT_MAX / 4 / step_y ||
+            crop_bottom> (unsigned) INT_MAX / 4 / step_y ||
+            (crop_left + crop_right) * step_x >= (unsigned) width ||
+            (crop_top + crop_bottom) * step_y >= (unsigned) height) {
+            E("SPS: crop values invalid %u %u %u %u / %d %d",
+                    crop_left, crop_right, crop_top, crop_bottom, width, height);
+            goto fail;
+        }
+
+        sps->crop_left   = crop_left   * step_x;
+        sps->crop_right  = crop_right  * step_x;
+        sps->crop_top    = crop_top    * step_y;
+        sps->crop_bottom = crop_bottom * step_y;
+    } else {
+        sps->crop_left   =
+        sps->crop_right  =
+        sps->crop_top    =
+        sps->crop_bottom = 0;
+    }
+
+    sps->vui_parameters_present_flag = get_bits1(gb);
+    if (sps->vui_parameters_present_flag) {
+        if (decode_vui_parameters(gb, sps) < 0)
+            goto fail;
+    } else {
+        sps->sar_num = 0;
+        sps->sar_den = 1;
+        sps->timing_info_present_flag = 0;
+    }
 
     // Already parsed what we need, return
     return 0;
@@ -402,6 +589,186 @@ fail:
     return -1;
 }
 
+int h264_decode_pps(GetBitContext *gb, int bit_length, PPS *pps)
+{
+    pps->pps_id = get_ue_golomb(gb);
+    if (pps->pps_id >= MAX_PPS_COUNT) {
+        E("pps_id %u out of range", pps->pps_id);
+        return -1;
+    }
+
+    pps->sps_id = get_ue_golomb_31(gb);
+    if (pps->sps_id >= MAX_SPS_COUNT) {
+        E("PPS: sps_id %u out of range", pps->sps_id);
+        return -1;
+    }
+
+    pps->cabac = get_bits1(gb);
+    skip_bits1(gb);                 // bottom_field_pic_order_in_frame_present_flag
+    if (get_ue_golomb(gb) > 0) {    // num_slice_groups_minus1
+        E("PPS: FMO is not supported");
+        return -1;
+    }
+    get_ue_golomb(gb);              // num_ref_idx_l0_default_active_minus1
+    get_ue_golomb(gb);              // num_ref_idx_l1_default_active_minus1
+    skip_bits1(gb);                 // weighted_pred_flag
+    skip_bits(gb, 2);               // weighted_bipred_idc
+    get_se_golomb(gb);              // pic_init_qp_minus26
+    get_se_golomb(gb);              // pic_init_qs_minus26
+    get_se_golomb(gb);              // chroma_qp_index_offset
+    skip_bits1(gb);                 // deblocking_filter_control_present_flag
+    skip_bits1(gb);                 // constrained_intra_pred_flag
+    skip_bits1(gb);                 // redundant_pic_cnt_present_flag
+
+    // more_rbsp_data(): high profile extension follows
+    pps->transform_8x8_mode = 0;
+    if (get_bits_count(gb) < bit_length)
+        pps->transform_8x8_mode = get_bits1(gb);
+
+    return 0;
+}
+
+uint32_t h264_nal_to_rbsp(const byte *src, uint32_t len, byte *dst)
+{
+    uint32_t i, n = 0, zeros = 0;
+
+    for (i = 0; i < len; ++i) {
+        if (zeros >= 2 && src[i] == 0x03) {
+            // emulation_prevention_three_byte
+            zeros = 0;
+            continue;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] ? 0 : zeros + 1;
+    }
+    return n;
+}
+
+// Bits before the rbsp_stop_one_bit
+static int rbsp_bit_length(const byte *rbsp, uint32_t len)
+{
+    while (len > 0 && !rbsp[len - 1])
+        --len;
+    if (!len)
+        return 0;
+    return len * 8 - __builtin_ctz(rbsp[len - 1]) - 1;
+}
+
+// Unescape a parameter set into a zero padded buffer for the bit reader
+static int load_param_set(const byte *nalu, uint32_t len, int nalu_typ,
+                          byte *rbsp, uint32_t &rbsp_len)
+{
+    if (len < 2 || (nalu[0]&0x1F) != nalu_typ) {
+        E("Not a nalu of type %d", nalu_typ);
+        return -1;
+    }
+    if (len > MAX_PARAM_SET_SIZE) {
+        E("Parameter set too large (%u bytes)", len);
+        return -1;
+    }
+
+    rbsp_len = h264_nal_to_rbsp(nalu + 1, len - 1, rbsp);
+    memset(rbsp + rbsp_len, 0, 8);
+    return 0;
+}
+
+int h264_parse_sps(const byte *nalu, uint32_t len, SPS *sps)
+{
+    byte rbsp[MAX_PARAM_SET_SIZE + 8];
+    uint32_t rbsp_len;
+    GetBitContext gb;
+
+    if (load_param_set(nalu, len, 7, rbsp, rbsp_len) < 0)
+        return -1;
+
+    memset(sps, 0, sizeof(*sps));
+    init_get_bits(&gb, rbsp, rbsp_len * 8);
+    return h264_decode_sps(&gb, sps);
+}
+
+int h264_parse_pps(const byte *nalu, uint32_t len, PPS *pps)
+{
+    byte rbsp[MAX_PARAM_SET_SIZE + 8];
+    uint32_t rbsp_len;
+    GetBitContext gb;
+
+    if (load_param_set(nalu, len, 8, rbsp, rbsp_len) < 0)
+        return -1;
+
+    memset(pps, 0, sizeof(*pps));
+    init_get_bits(&gb, rbsp, rbsp_len * 8);
+    return h264_decode_pps(&gb, rbsp_bit_length(rbsp, rbsp_len), pps);
+}
+
+bool h264_sei_has_recovery_point(const byte *nalu, uint32_t len)
+{
+    byte rbsp[MAX_SEI_HEAD_SIZE];
+
+    if (len < 2 || (nalu[0]&0x1F) != 6 /*SEI*/)
+        return false;
+
+    uint32_t rbsp_len = h264_nal_to_rbsp(nalu + 1, MIN(len - 1, (uint32_t) sizeof(rbsp)), rbsp);
+    const byte *p = rbsp, *end = rbsp + rbsp_len;
+    // sei_message()s up to the rbsp_trailing_bits
+    while (p < end && *p != 0x80) {
+        uint32_t type = 0, size = 0;
+        while (p < end && *p == 0xFF) {
+            type += *p++;
+        }
+        if (p == end)
+            break;
+        type += *p++;
+        while (p < end && *p == 0xFF) {
+            size += *p++;
+        }
+        if (p == end)
+            break;
+        size += *p++;
+
+        if (type == 6 /*recovery_point*/)
+            return true;
+        if (size >= (uint32_t) (end - p))
+            break;
+        p += size;
+    }
+    return false;
+}
+
+int h264_video_info(const SPS &sps, const PPS *pps, AVCVideoInfo &info)
+{
+    info.coded_width  = 16 * sps.mb_width;
+    info.coded_height = 16 * sps.mb_height * (2 - sps.frame_mbs_only_flag);
+    info.crop_left    = sps.crop_left;
+    info.crop_right   = sps.crop_right;
+    info.crop_top     = sps.crop_top;
+    info.crop_bottom  = sps.crop_bottom;
+    info.width        = info.coded_width - sps.crop_left - sps.crop_right;
+    info.height       = info.coded_height - sps.crop_top - sps.crop_bottom;
+
+    if (sps.timing_info_present_flag) {
+        // Two ticks a frame (field based timing)
+        info.fps_num = sps.time_scale;
+        info.fps_den = sps.num_units_in_tick * 2;
+    } else {
+        info.fps_num = 0;
+        info.fps_den = 1;
+    }
+
+    info.profile_idc = sps.profile_idc;
+    info.level_idc   = sps.level_idc;
+    info.cabac       = pps ? !!pps->cabac : false;
+    return 0;
+}
+
+void print_video_info(const AVCVideoInfo &info)
+{
+    I("h264 profile_idc=%d, level_idc=%d, cabac=%d, %dx%d (coded %dx%d, crop l%u r%u t%u b%u), fps=%d/%d",
+      info.profile_idc, info.level_idc, info.cabac,
+      info.width, info.height, info.coded_width, info.coded_height,
+      info.crop_left, info.crop_right, info.crop_top, info.crop_bottom,
+      info.fps_num, info.fps_den);
+}
+
 void BitrateCalc::check(uint32_t bits, uint32_t interval)
 {
     m_bits += bits;
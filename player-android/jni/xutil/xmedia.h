@@ -17,6 +17,19 @@ namespace xmedia {
 
 const static byte nalu_startcode[] = {0, 0, 0, 1};
 
+// Return the first 0x000001 in [p, end), or end if there is none.
+// The best implementation for the running cpu is picked at first call
+const byte *find_startcode(const byte *p, const byte *end);
+
+const byte *find_startcode_c(const byte *p, const byte *end);
+#if defined(__i386__) || defined(__x86_64__)
+const byte *find_startcode_sse2(const byte *p, const byte *end);
+const byte *find_startcode_avx2(const byte *p, const byte *end);
+#endif
+#if defined(HAVE_NEON) || defined(__aarch64__)
+const byte *find_startcode_neon(const byte *p, const byte *end);
+#endif
+
 struct AVCDecorderConfigurationRecord {
     byte version;
     byte profile;
@@ -57,6 +70,7 @@ const char *samplerate_idx_to_str(int rate_idx);
 struct SPS {
     unsigned int sps_id;
     int profile_idc;
+    int constraint_set_flags;
     int level_idc;
     int chroma_format_idc;
     int residual_color_transform_flag;
@@ -80,14 +94,57 @@ struct SPS {
     short offset_for_ref_frame[256];
     int ref_frame_count;
     int gaps_in_frame_num_allowed_flag;
+    int mb_aff;
+    int direct_8x8_inference_flag;
+    int crop;               // frame_cropping_flag
+    unsigned int crop_left; // In pixels
+    unsigned int crop_right;
+    unsigned int crop_top;
+    unsigned int crop_bottom;
+    int vui_parameters_present_flag;
+    int sar_num, sar_den;
+    int timing_info_present_flag;
+    uint32_t num_units_in_tick;
+    uint32_t time_scale;
+    int fixed_frame_rate_flag;
 };
 
 struct PPS {
+    unsigned int pps_id;
+    unsigned int sps_id;
+    int cabac;
     int transform_8x8_mode;
-    int OTHER_NOT_SUPPORTED;
 };
 
 int h264_decode_sps(xutil::GetBitContext *gb, SPS *sps);
+int h264_decode_pps(xutil::GetBitContext *gb, int bit_length, PPS *pps);
+
+// Strip the emulation prevention bytes, returns the rbsp length
+uint32_t h264_nal_to_rbsp(const byte *src, uint32_t len, byte *dst);
+// Nalu given without startcode or length prefix, header byte included
+int h264_parse_sps(const byte *nalu, uint32_t len, SPS *sps);
+int h264_parse_pps(const byte *nalu, uint32_t len, PPS *pps);
+// Whether an sei nalu carries a recovery point, as the first frame of a
+// periodic intra refresh does; only the messages in its first 256
+// bytes are looked at
+bool h264_sei_has_recovery_point(const byte *nalu, uint32_t len);
+
+// What a stream looks like according to its sps
+struct AVCVideoInfo {
+    int width;              // Cropped, as displayed
+    int height;
+    int coded_width;        // Whole macroblocks
+    int coded_height;
+    unsigned int crop_left, crop_right, crop_top, crop_bottom;
+    int fps_num;            // 0 if vui carries no timing info
+    int fps_den;
+    int profile_idc;
+    int level_idc;
+    bool cabac;
+};
+
+int h264_video_info(const SPS &sps, const PPS *pps, AVCVideoInfo &info);
+void print_video_info(const AVCVideoInfo &info);
 
 class BitrateCalc {
 public:
@@ -0,0 +1,104 @@
+#include "xmedia.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#if defined(__AVX2__) || defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#include <immintrin.h>
+#define HAVE_AVX2_INTRIN
+#endif
+#endif
+
+#if defined(HAVE_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Vectorized startcode scanners, all of them look for a "0x00 0x00" pair:
+ * compare the block at p and the one at p+1 against zero and AND them,
+ * a startcode can only start at a position set in the result. Thanks to
+ * emulation prevention such pairs hardly appear inside a nalu, so nearly
+ * every block is skipped as a whole. The tail goes to the scalar one. */
+
+namespace xmedia {
+
+#if defined(__i386__) || defined(__x86_64__)
+const byte *find_startcode_sse2(const byte *p, const byte *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // 16 bytes plus 2 bytes look-ahead for the last position of a block
+    while (end - p >= 16 + 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + 1));
+        unsigned mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (p[i+2] == 1)
+                return p + i;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+
+    return find_startcode_c(p, end);
+}
+
+#ifdef HAVE_AVX2_INTRIN
+__attribute__((target("avx2")))
+const byte *find_startcode_avx2(const byte *p, const byte *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (end - p >= 32 + 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p + 1));
+        unsigned mask = _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)));
+
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (p[i+2] == 1)
+                return p + i;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+
+    return find_startcode_sse2(p, end);
+}
+#else
+const byte *find_startcode_avx2(const byte *p, const byte *end)
+{
+    // Toolchain too old for avx2 intrinsics
+    return find_startcode_sse2(p, end);
+}
+#endif
+#endif
+
+#if defined(HAVE_NEON) || defined(__aarch64__)
+const byte *find_startcode_neon(const byte *p, const byte *end)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+
+    while (end - p >= 16 + 2) {
+        uint8x16_t a = vld1q_u8(p);
+        uint8x16_t b = vld1q_u8(p + 1);
+        uint8x16_t pairs = vandq_u8(vceqq_u8(a, zero), vceqq_u8(b, zero));
+        uint64x2_t pairs64 = vreinterpretq_u64_u8(pairs);
+
+        if (vgetq_lane_u64(pairs64, 0) | vgetq_lane_u64(pairs64, 1)) {
+            for (int i = 0; i < 16; ++i) {
+                if (!p[i] && !p[i+1] && p[i+2] == 1)
+                    return p + i;
+            }
+        }
+        p += 16;
+    }
+
+    return find_startcode_c(p, end);
+}
+#endif
+
+}
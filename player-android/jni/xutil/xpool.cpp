@@ -0,0 +1,314 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xpool.h"
+
+#define XPOOL_CACHE_BYTES       (512*1024)      // Per class, per thread
+#define XPOOL_CACHE_BLOCKS      64              // Likewise, for the small classes
+#define XPOOL_DEPOT_BYTES       (4*1024*1024)   // Per class
+#define XPOOL_LARGE             XPOOL_CLASS_NUM
+#define XPOOL_MAGIC             0x78706f6cu
+
+// gcc defines the former, clang tells by the latter
+#if defined(__SANITIZE_ADDRESS__)
+#define XPOOL_PASSTHROUGH       1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define XPOOL_PASSTHROUGH       1
+#endif
+#endif
+
+// In front of every block, keeps the payload 16-byte aligned
+struct BlockHeader {
+    uint32_t cls;
+    uint32_t magic;
+    uint64_t pad;
+};
+
+// Overlays the payload of a cached block
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+struct FreeList {
+    FreeBlock *head;
+    uint32_t count;
+};
+
+struct ThreadCache {
+    FreeList lists[XPOOL_CLASS_NUM];
+};
+
+struct Depot {
+    pthread_mutex_t mutex;
+    FreeList list;
+};
+
+struct ClassCounters {
+    volatile uint64_t allocs;
+    volatile uint64_t mallocs;
+    volatile uint64_t releases;
+    volatile int64_t in_use;
+};
+
+#ifndef XPOOL_PASSTHROUGH
+static pthread_once_t xpool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xpool_key;
+static Depot depots[XPOOL_CLASS_NUM];
+#endif
+static ClassCounters counters[XPOOL_CLASS_NUM + 1];
+
+static inline uint32_t class_size(int cls)
+{
+    return (cls & 1 ? 96u : 64u) << (cls >> 1);
+}
+
+// 64<<k is class 2k, 96<<k class 2k+1
+static inline int size_class(size_t size)
+{
+    if (size <= XPOOL_MIN_SIZE)
+        return 0;
+    if (size > XPOOL_MAX_SIZE)
+        return XPOOL_LARGE;
+
+    // 2^(bits-1) < size <= 2^bits
+    int bits = 32 - __builtin_clz((uint32_t) (size - 1));
+    if (size <= (size_t) 3 << (bits - 2))
+        return 2*(bits - 7) + 1;
+    return 2*(bits - 6);
+}
+
+static inline uint32_t cache_cap(int cls)
+{
+    uint32_t cap = XPOOL_CACHE_BYTES / class_size(cls);
+    if (cap > XPOOL_CACHE_BLOCKS)
+        return XPOOL_CACHE_BLOCKS;
+    return cap < 2 ? 2 : cap;
+}
+
+static inline uint32_t depot_cap(int cls)
+{
+    uint32_t cap = XPOOL_DEPOT_BYTES / class_size(cls);
+    return cap < 2 ? 2 : cap;
+}
+
+#ifndef XPOOL_PASSTHROUGH
+static void release_block(int cls, FreeBlock *blk)
+{
+    free((BlockHeader *) blk - 1);
+    __sync_add_and_fetch(&counters[cls].releases, 1);
+}
+
+// Up to n blocks of list to the depot, the ones it has no room for to malloc
+static void depot_put(int cls, FreeList *list, uint32_t n)
+{
+    Depot *depot = &depots[cls];
+    FreeBlock *overflow = NULL;
+    uint32_t cap = depot_cap(cls);
+
+    pthread_mutex_lock(&depot->mutex);
+    while (n-- && list->head) {
+        FreeBlock *blk = list->head;
+        list->head = blk->next;
+        --list->count;
+        if (depot->list.count < cap) {
+            blk->next = depot->list.head;
+            depot->list.head = blk;
+            ++depot->list.count;
+        } else {
+            blk->next = overflow;
+            overflow = blk;
+        }
+    }
+    pthread_mutex_unlock(&depot->mutex);
+
+    while (overflow) {
+        FreeBlock *blk = overflow;
+        overflow = blk->next;
+        release_block(cls, blk);
+    }
+}
+
+// Up to n blocks from the depot into list
+static void depot_get(int cls, FreeList *list, uint32_t n)
+{
+    Depot *depot = &depots[cls];
+
+    pthread_mutex_lock(&depot->mutex);
+    while (n-- && depot->list.head) {
+        FreeBlock *blk = depot->list.head;
+        depot->list.head = blk->next;
+        --depot->list.count;
+        blk->next = list->head;
+        list->head = blk;
+        ++list->count;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+static void cache_retire(void *data)
+{
+    ThreadCache *cache = (ThreadCache *) data;
+
+    for (int cls = 0; cls < XPOOL_CLASS_NUM; ++cls) {
+        depot_put(cls, &cache->lists[cls], cache->lists[cls].count);
+    }
+    free(cache);
+}
+
+static void xpool_init()
+{
+    pthread_key_create(&xpool_key, cache_retire);
+
+    for (int cls = 0; cls < XPOOL_CLASS_NUM; ++cls) {
+        pthread_mutex_init(&depots[cls].mutex, NULL);
+    }
+}
+
+static ThreadCache *get_cache()
+{
+    pthread_once(&xpool_once, xpool_init);
+
+    ThreadCache *cache = (ThreadCache *) pthread_getspecific(xpool_key);
+    if (!cache) {
+        // Once per thread
+        cache = (ThreadCache *) calloc(1, sizeof(ThreadCache));
+        if (!cache)
+            return NULL;
+        pthread_setspecific(xpool_key, cache);
+    }
+    return cache;
+}
+#endif
+
+static void *new_block(int cls, size_t size)
+{
+    BlockHeader *hdr = (BlockHeader *) malloc(
+            sizeof(BlockHeader) + (cls == XPOOL_LARGE ? size : class_size(cls)));
+    if (!hdr)
+        return NULL;
+
+    hdr->cls = cls;
+    hdr->magic = XPOOL_MAGIC;
+    __sync_add_and_fetch(&counters[cls].mallocs, 1);
+    return hdr + 1;
+}
+
+void *xpool_alloc(size_t size)
+{
+    int cls = size_class(size);
+    void *ptr = NULL;
+
+#ifndef XPOOL_PASSTHROUGH
+    if (cls != XPOOL_LARGE) {
+        ThreadCache *cache = get_cache();
+        if (cache) {
+            FreeList *list = &cache->lists[cls];
+            if (!list->head) {
+                depot_get(cls, list, (cache_cap(cls) + 1) / 2);
+            }
+            if (list->head) {
+                FreeBlock *blk = list->head;
+                list->head = blk->next;
+                --list->count;
+                ptr = blk;
+            }
+        }
+    }
+#endif
+
+    if (!ptr) {
+        ptr = new_block(cls, size);
+        if (!ptr)
+            return NULL;
+    }
+
+    __sync_add_and_fetch(&counters[cls].allocs, 1);
+    __sync_add_and_fetch(&counters[cls].in_use, 1);
+    return ptr;
+}
+
+void xpool_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    BlockHeader *hdr = (BlockHeader *) ptr - 1;
+    int cls = hdr->cls;
+    if (hdr->magic != XPOOL_MAGIC || cls > XPOOL_LARGE) {
+        fprintf(stderr, "xpool_free: %p was not allocated by xpool\n", ptr);
+        abort();
+    }
+
+    __sync_sub_and_fetch(&counters[cls].in_use, 1);
+
+#ifndef XPOOL_PASSTHROUGH
+    if (cls != XPOOL_LARGE) {
+        ThreadCache *cache = get_cache();
+        if (cache) {
+            FreeList *list = &cache->lists[cls];
+            FreeBlock *blk = (FreeBlock *) ptr;
+            blk->next = list->head;
+            list->head = blk;
+            if (++list->count > cache_cap(cls)) {
+                // Half goes, so a thread freeing steadily locks now and then
+                depot_put(cls, list, list->count / 2);
+            }
+            return;
+        }
+    }
+#endif
+
+    free(hdr);
+    __sync_add_and_fetch(&counters[cls].releases, 1);
+}
+
+void xpool_stats(XPoolStats stats[XPOOL_CLASS_NUM + 1])
+{
+    for (int cls = 0; cls <= XPOOL_LARGE; ++cls) {
+        XPoolStats &st = stats[cls];
+        st.size = cls == XPOOL_LARGE ? 0 : class_size(cls);
+        st.allocs = counters[cls].allocs;
+        st.mallocs = counters[cls].mallocs;
+        st.releases = counters[cls].releases;
+        st.in_use = counters[cls].in_use;
+        // Every block malloc'ed is in use, cached or released
+        st.cached = cls == XPOOL_LARGE ? 0 :
+            (int64_t) (st.mallocs - st.releases) - st.in_use;
+    }
+}
+
+std::string xpool_report()
+{
+    XPoolStats stats[XPOOL_CLASS_NUM + 1];
+    std::string text;
+    char line[128];
+
+    xpool_stats(stats);
+    snprintf(line, sizeof(line), "%-10s %10s %10s %10s %8s %8s\n",
+             "pool", "allocs", "mallocs", "releases", "in_use", "cached");
+    text += line;
+    for (int cls = 0; cls <= XPOOL_LARGE; ++cls) {
+        const XPoolStats &st = stats[cls];
+        if (!st.allocs)
+            continue;
+
+        char name[16];
+        if (cls == XPOOL_LARGE) {
+            snprintf(name, sizeof(name), "large");
+        } else if (st.size >= 1024) {
+            snprintf(name, sizeof(name), "%uK", st.size / 1024);
+        } else {
+            snprintf(name, sizeof(name), "%u", st.size);
+        }
+        snprintf(line, sizeof(line), "%-10s %10llu %10llu %10llu %8lld %8lld\n",
+                 name, (long long unsigned) st.allocs,
+                 (long long unsigned) st.mallocs,
+                 (long long unsigned) st.releases,
+                 (long long) st.in_use, (long long) st.cached);
+        text += line;
+    }
+    return text;
+}
@@ -0,0 +1,46 @@
+#ifndef _XPOOL_H_
+#define _XPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size-class pool for the short-lived objects of the media path: packets,
+ * list nodes, encoded and raw frames. Classes go from 64 bytes up in steps
+ * of 1.5x and 2x (64, 96, 128, 192, ...). A freed block stays with the
+ * thread that freed it and goes back to a shared depot in batches once
+ * that thread holds too many, where the allocating threads pick it up
+ * again; so malloc is only called until the pipeline has seen its peak.
+ * Requests over XPOOL_MAX_SIZE go to malloc every time.
+ * Built with ASan every block comes from malloc, for it to see misuse. */
+
+#define XPOOL_MIN_SIZE          64
+#define XPOOL_MAX_SIZE          (4*1024*1024)   // A 1080p i420 frame is 3M
+#define XPOOL_CLASS_NUM         33
+
+void *xpool_alloc(size_t size);
+// ptr from xpool_alloc() only, NULL is fine
+void xpool_free(void *ptr);
+
+struct XPoolStats {
+    uint32_t size;          // Of the blocks, 0 for the ones over XPOOL_MAX_SIZE
+    uint64_t allocs;
+    uint64_t mallocs;       // Allocs no cached block was there for
+    uint64_t releases;      // Frees past the caches, given back to malloc
+    int64_t in_use;
+    int64_t cached;         // Held by the thread caches and the depot
+};
+
+// One entry per class, then one for the large blocks
+void xpool_stats(XPoolStats stats[XPOOL_CLASS_NUM + 1]);
+// Classes that have seen use, as a text table
+std::string xpool_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* end of _XPOOL_H_ */
@@ -0,0 +1,170 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xring.h"
+#include "xutil.h"
+
+#define RING_MIN_SIZE   (16*1024)
+
+// Kernel values, older bionic headers lack the latter
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE  1
+#endif
+#ifndef MREMAP_FIXED
+#define MREMAP_FIXED    2
+#endif
+
+namespace xutil {
+
+static uint32_t round_to_pages(uint32_t size)
+{
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// size bytes of shared pages, mapped again right behind themselves.
+// mremap() with old_size 0 duplicates a shared mapping, which needs no
+// memfd (missing from older kernels and bionic). Called by its syscall,
+// bionic declares mremap() without the new_address argument
+static uint8_t *map_mirrored(uint32_t size)
+{
+    uint8_t *addr = (uint8_t *) mmap(NULL, 2*size, PROT_NONE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    if (mmap(addr, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED ||
+        (uint8_t *) syscall(__NR_mremap, addr, 0, size,
+                            MREMAP_MAYMOVE | MREMAP_FIXED, addr + size) != addr + size) {
+        munmap(addr, 2*size);
+        return NULL;
+    }
+    return addr;
+}
+
+RingBuffer::RingBuffer() :
+    buffer(NULL),
+    size(0),
+    published(0),
+    consumed(0)
+{
+}
+
+RingBuffer::~RingBuffer()
+{
+    cleanup();
+}
+
+void RingBuffer::initialize(uint32_t expected)
+{
+    if (buffer || size || published || consumed) {
+        E("Invalid RingBuffer state(%p,%u,%u,%u)",
+          buffer, size, published, consumed);
+        return;
+    }
+
+    ensure_size(expected);
+}
+
+bool RingBuffer::ensure_size(uint32_t expected)
+{
+    uint32_t avail = published - consumed;
+    if (avail + expected <= size)
+        return true;
+
+    // Grows by half at least, the only time data is copied
+    uint32_t new_size = avail + expected;
+    if (new_size < size + size/2)
+        new_size = size + size/2;
+    if (new_size < RING_MIN_SIZE)
+        new_size = RING_MIN_SIZE;
+    new_size = round_to_pages(new_size);
+
+    uint8_t *new_buffer = map_mirrored(new_size);
+    if (!new_buffer) {
+        E("Map ring buffer of %u bytes failed: %s", new_size, ERRNOMSG);
+        return false;
+    }
+    if (buffer) {
+        memcpy(new_buffer, buffer + consumed, avail);
+        munmap(buffer, 2*size);
+    }
+    buffer = new_buffer;
+    size = new_size;
+    consumed = 0;
+    published = avail;
+    return true;
+}
+
+bool RingBuffer::read_from_buffer(const uint8_t *buffer_, const uint32_t size_)
+{
+    if (!ensure_size(size_))
+        return false;
+    // Past size it lands in the mirror, i.e. at the start
+    memcpy(buffer + published, buffer_, size_);
+    published += size_;
+    return true;
+}
+
+void RingBuffer::read_from_byte(uint8_t byte)
+{
+    if (!ensure_size(1))
+        return;
+    buffer[published++] = byte;
+}
+
+void RingBuffer::read_from_repeat(uint8_t byte, uint32_t size_)
+{
+    if (!ensure_size(size_))
+        return;
+    memset(buffer + published, byte, size_);
+    published += size_;
+}
+
+uint8_t *RingBuffer::get_pointer()
+{
+    return buffer;
+}
+
+bool RingBuffer::ignore(uint32_t size_)
+{
+    consumed += size_;
+    if (consumed >= size) {
+        // Same bytes, seen through the first mapping
+        consumed -= size;
+        published -= size;
+    }
+    recycle();
+    return true;
+}
+
+bool RingBuffer::ignore_all()
+{
+    consumed = published;
+    recycle();
+    return true;
+}
+
+void RingBuffer::recycle()
+{
+    if (consumed != published)
+        return;
+    consumed = 0;
+    published = 0;
+}
+
+void RingBuffer::cleanup()
+{
+    if (buffer) {
+        munmap(buffer, 2*size);
+        buffer = NULL;
+    }
+    size = 0;
+    published = 0;
+    consumed = 0;
+}
+
+}
@@ -0,0 +1,47 @@
+#ifndef _XRING_H_
+#define _XRING_H_
+
+#include <stdint.h>
+
+namespace xutil {
+
+/* Byte pipe with the read and ignore API of IOBuffer (and the fields
+ * GETAVAILABLEBYTESCOUNT/GETIBPOINTER use), for streams that are written
+ * and consumed continuously. The pages are mapped twice in a row, so the
+ * unread bytes are contiguous even where they wrap around the end: no
+ * compaction copy ever, the data is only copied again when the ring has
+ * to grow. Linux/Android only. */
+class RingBuffer {
+public:
+    uint8_t *buffer;
+    uint32_t size;          // Of one mapping, multiple of the page size
+    uint32_t published;     // Up to 2*size, beyond size is the mirror
+    uint32_t consumed;      // Below size
+
+public:
+    RingBuffer();
+    ~RingBuffer();
+
+    void initialize(uint32_t expected);
+    // Room for expected bytes more than are unread
+    bool ensure_size(uint32_t expected);
+    bool read_from_buffer(const uint8_t *buffer_, const uint32_t size_);
+    void read_from_byte(uint8_t byte);
+    void read_from_repeat(uint8_t byte, uint32_t size_);
+    uint8_t *get_pointer();
+    bool ignore(uint32_t size_);
+    bool ignore_all();
+    void recycle();
+
+private:
+    void cleanup();
+
+private:
+    // Not copyable, the mapping is owned
+    RingBuffer(const RingBuffer &);
+    void operator=(const RingBuffer &);
+};
+
+}
+
+#endif /* end of _XRING_H_ */
@@ -17,6 +17,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/file.h>
+#include <sys/resource.h>
 #include <sched.h>
 #endif
 
@@ -216,6 +217,13 @@ uint64_t get_time_now()
     return tv.tv_sec * 1000LL + tv.tv_usec / 1000LL;
 }
 
+uint64_t get_time_now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 char *strcasechr(const char *s, int c)
 {
     const char *p = strchr(s, toupper(c));
@@ -733,6 +741,84 @@ int cpu_num()
 #endif
 }
 
+#ifndef _WIN32
+int set_thread_name(const char *name)
+{
+    char buf[16];
+
+    strncpy(buf, name, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    int ret = pthread_setname_np(pthread_self(), buf);
+    if (ret != 0) {
+        E("pthread_setname_np \"%s\" failed: %s", name, strerror_(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int set_thread_priority(pid_t tid, int nice, int fifo_priority)
+{
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    if (fifo_priority > 0) {
+        param.sched_priority = fifo_priority;
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) < 0) {
+            E("SCHED_FIFO %d for thread %d failed: %s",
+              fifo_priority, (int) tid, ERRNOMSG);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (sched_getscheduler(tid) != SCHED_OTHER &&
+        sched_setscheduler(tid, SCHED_OTHER, &param) < 0) {
+        E("SCHED_OTHER for thread %d failed: %s", (int) tid, ERRNOMSG);
+        return -1;
+    }
+    // Per thread on linux, tid taken as a process id
+    if (setpriority(PRIO_PROCESS, tid, nice) < 0) {
+        E("Nice %d for thread %d failed: %s", nice, (int) tid, ERRNOMSG);
+        return -1;
+    }
+    return 0;
+}
+
+int set_thread_affinity(pid_t tid, uint64_t cpu_mask)
+{
+    cpu_set_t set;
+
+    memset(&set, 0, sizeof(set));
+    for (unsigned int bit = 0; bit < 64 && bit < 8 * sizeof(set); ++bit) {
+        if (cpu_mask & (1ULL << bit)) {
+            ((uint8_t *) &set)[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+        E("Affinity 0x%llx for thread %d failed: %s",
+          (long long unsigned) cpu_mask, (int) tid, ERRNOMSG);
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t get_thread_affinity(pid_t tid)
+{
+    cpu_set_t set;
+    uint64_t cpu_mask = 0;
+
+    memset(&set, 0, sizeof(set));
+    if (sched_getaffinity(tid, sizeof(set), &set) < 0)
+        return 0;
+    for (unsigned int bit = 0; bit < 64 && bit < 8 * sizeof(set); ++bit) {
+        if ((((uint8_t *) &set)[bit / 8] >> (bit % 8)) & 1) {
+            cpu_mask |= 1ULL << bit;
+        }
+    }
+    return cpu_mask;
+}
+#endif
+
 /////////////////////////////////////////////////////////////
 
 void frac_init(Frac *f, int64_t val, int64_t num, int64_t den)
@@ -1057,7 +1143,7 @@ bool IOBuffer::ensure_size(uint32_t expected)
 
 bool IOBuffer::move_data()
 {
-    if (published - consumed <= consumed) {
+    if (consumed && published - consumed <= consumed) {
         memcpy(buffer, buffer + consumed, published - consumed);
         published = published - consumed;
         consumed = 0;
@@ -120,6 +120,7 @@ ssize_t writen(int fd, const void *buf, size_t n);
 char *skip_blank(char *p);
 
 uint64_t get_time_now();
+uint64_t get_time_now_us();
 
 char *strcasechr(const char *s, int c);
 bool end_with(const std::string &str, const std::string &sub);
@@ -178,6 +179,16 @@ void rmdir_(const std::string &path);
 
 int cpu_num();
 
+#ifndef _WIN32
+// Of the calling thread, the kernel keeps 15 characters
+int set_thread_name(const char *name);
+// SCHED_FIFO at fifo_priority when > 0 (if permitted), else SCHED_OTHER at nice
+int set_thread_priority(pid_t tid, int nice, int fifo_priority = 0);
+// Bit i for cpu i, the first 64 cpus only
+int set_thread_affinity(pid_t tid, uint64_t cpu_mask);
+uint64_t get_thread_affinity(pid_t tid);
+#endif
+
 /////////////////////////////////////////////////////////////
 
 struct Frac {
@@ -189,6 +200,23 @@ void frac_add(Frac *f, int64_t incr);
 
 /////////////////////////////////////////////////////////////
 
+// Read-only view of a contiguous array, valid until its owner changes it
+template <typename T>
+struct Span {
+    const T *data;
+    uint32_t size;
+
+    Span() : data(NULL), size(0) { }
+    Span(const T *data_, uint32_t size_) : data(data_), size(size_) { }
+
+    const T &operator[](uint32_t idx) const { return data[idx]; }
+    const T *begin() const { return data; }
+    const T *end() const { return data + size; }
+    bool empty() const { return !size; }
+};
+
+/////////////////////////////////////////////////////////////
+
 class Condition;
 
 class Mutex {
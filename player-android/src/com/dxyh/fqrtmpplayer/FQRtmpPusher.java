@@ -86,6 +86,7 @@ public class FQRtmpPusher implements IFQRtmp, SurfaceHolder.Callback,
     private int mNumberOfCameras;
     
     private boolean mServerConnected = false;
+    private boolean mSkipNextFrame = false;
     private boolean mStartPreviewFail = false;
     
     private boolean mPreviewing;
@@ -178,6 +179,8 @@ public class FQRtmpPusher implements IFQRtmp, SurfaceHolder.Callback,
 	    	public void run() {
 	    		mServerConnected = false;
 	    		String param = "-L " + url + (TextUtils.isEmpty(mFlvPath) ? "" : " -f " + mFlvPath);
+	    		// As Process.THREAD_PRIORITY_AUDIO and THREAD_PRIORITY_URGENT_DISPLAY
+	    		param += " --thread audio_encoder:nice=-16 --thread video_encoder:nice=-8";
 	    		mLibFQRtmp.start(param);
 	    	}
 	    };
@@ -232,6 +235,9 @@ public class FQRtmpPusher implements IFQRtmp, SurfaceHolder.Callback,
 			UiTools.toast(mActivity, "Connect to server failed", UiTools.SHORT_TOAST);
 			mHandler.sendEmptyMessage(ERROR_OCCURRED);
 			break;
+		case Event.MEMORY_PRESSURE:
+			Log.w(TAG, "Memory pressure " + (event.arg1 != 0 ? "on" : "off") + ", " + event.arg2);
+			break;
 		default:
 			break;
 		}
@@ -786,7 +792,13 @@ public class FQRtmpPusher implements IFQRtmp, SurfaceHolder.Callback,
         }
         
         if (mServerConnected && mLibFQRtmp != null) {
-            mLibFQRtmp.sendRawVideo(data, data.length, rotation);
+            if (mSkipNextFrame) {
+                mSkipNextFrame = false;
+            } else if (mLibFQRtmp.sendRawVideo(data, data.length, rotation) ==
+                       LibFQRtmp.SEND_SLOW_DOWN) {
+                // Half the frames until the native buffers drain
+                mSkipNextFrame = true;
+            }
         }
 
         camera.addCallbackBuffer(data);
@@ -4,6 +4,8 @@ public class Event {
     public static final int OPENING = 0;
     public static final int CONNECTED = 1;
     public static final int ENCOUNTERED_ERROR = 2;
+    public static final int CLIP_EXPORTED = 3;
+    public static final int MEMORY_PRESSURE = 4;
     
     public final int type;
     public final long arg1;
@@ -39,6 +39,9 @@ public class LibFQRtmp {
     	private final boolean mRepeatHeaders = true;
     	private final int mBFrames = 0;
     	private final boolean mDeblockingFilter = true;
+    	private int mSliceMaxSize = 0; // Bytes, > 0 for slice mode
+    	private boolean mIntraRefresh = false; // In place of periodic IDR frames
+    	private boolean mAdaptiveEffort = false; // x264 analysis follows the cpu it gets
     	
     	public int getCamcorderProfileId() {
     		return mCamcorderProfileId;
@@ -118,6 +121,27 @@ public class LibFQRtmp {
     		return mDeblockingFilter;
     	}
     	
+    	public void setSliceMaxSize(int size) {
+    		mSliceMaxSize = size;
+    	}
+    	public int getSliceMaxSize() {
+    		return mSliceMaxSize;
+    	}
+    	
+    	public void setIntraRefresh(boolean intraRefresh) {
+    		mIntraRefresh = intraRefresh;
+    	}
+    	public boolean getIntraRefresh() {
+    		return mIntraRefresh;
+    	}
+    	
+    	public void setAdaptiveEffort(boolean adaptiveEffort) {
+    		mAdaptiveEffort = adaptiveEffort;
+    	}
+    	public boolean getAdaptiveEffort() {
+    		return mAdaptiveEffort;
+    	}
+    	
     	public void setBitrate(int bitrate) {
     		mBitrate = bitrate;
     	}
@@ -248,6 +272,16 @@ public class LibFQRtmp {
     private native void nativeNew(String cmdline);
     private native void nativeRelease();
     
+    /* What sendRawAudio() and sendRawVideo() return besides -1. Native
+     * buffers are bounded by "--memcap <bytes>" (96M by default, 0 for no
+     * cap): past 80% of it frames are still taken but SEND_SLOW_DOWN asks
+     * for fewer until Event.MEMORY_PRESSURE turns off again, at the cap
+     * they are refused with SEND_DROPPED. The event comes from within the
+     * next call of either */
+    public static final int SEND_OK = 0;
+    public static final int SEND_SLOW_DOWN = 1;
+    public static final int SEND_DROPPED = 2;
+    
     public native int sendRawAudio(byte[] data, int length);
     public native int sendRawVideo(byte[] data, int length, int rotation);
     
@@ -257,6 +291,28 @@ public class LibFQRtmp {
     public native int openVideoEncoder(VideoConfig videoConfig);
     public native int closeVideoEncoder();
     
+    /* Makes the next frame encoded an IDR (a new refresh sweep with
+     * VideoConfig.setIntraRefresh()), e.g. for a viewer just joined.
+     * Requests within a second of the last keyframe wait for that second
+     * to pass and are served by a single one. -1 with no video encoder */
+    public native int requestKeyframe();
+    
+    /* DVR ring (enabled by "--dvrtime <sec>" and/or "--dvrsize <bytes>"),
+     * clips are written in background, Event.CLIP_EXPORTED is sent when done */
+    public native int exportClip(long startMs, long endMs, String path);
+    public native int exportLastClip(int durationMs, String path);
+    
+    /* Json snapshot of the native pipeline metrics (counters, queue depths,
+     * per-stage latency histograms in us), counted since start(). Periodic
+     * dump to a file is enabled by "--metricsdump <path>" */
+    public native String getMetrics();
+    
+    /* Chrome trace-event recording (view in chrome://tracing) of the native
+     * threads, stopTrace() writes the json. "--trace <path>" traces the
+     * whole session from start() to stop() */
+    public native int startTrace();
+    public native int stopTrace(String path);
+    
     private static OnNativeCrashListener sOnNativeCrashListener;
     
     public static interface OnNativeCrashListener {